@@ -47,7 +47,9 @@ void BM_MacroExpandRecursive(benchmark::State& state) {
   for (auto _ : state) {
     (void)_;
 
-    (void)CppMacroExpander(&cpp_parser).Expand(tokens, SpaceHandling::kSkip);
+    ArrayTokenList expanded =
+        CppMacroExpander(&cpp_parser).Expand(tokens, SpaceHandling::kSkip);
+    cpp_parser.token_list_pool()->Release(std::move(expanded));
   }
 
   state.SetItemsProcessed(state.iterations());
@@ -0,0 +1,95 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures queues of closures shared by many producer threads and one
+// consumer thread, like PRIORITY_IMMEDIATE closures of WorkerThread.
+// Compares a deque guarded by a Lock with MpscQueue.
+// Thread 0 is the consumer, and other threads are producers.
+
+#include <stdint.h>
+
+#include <deque>
+
+#include "absl/base/thread_annotations.h"
+#include "autolock_timer.h"
+#include "benchmark/benchmark.h"
+#include "lockhelper.h"
+#include "mpsc_queue.h"
+
+namespace devtools_goma {
+
+namespace {
+
+// Same size as WorkerThread::ClosureData.
+struct Item {
+  const char* location = nullptr;
+  void* closure = nullptr;
+  int queuelen = 0;
+  int tick = 0;
+  int64_t timestamp = 0;
+};
+
+// A deque guarded by one Lock, as WorkerThread's pendings_.
+class LockedQueue {
+ public:
+  void Push(Item item) {
+    AUTOLOCK(lock, &mu_);
+    q_.push_back(item);
+  }
+
+  bool Pop(Item* item) {
+    AUTOLOCK(lock, &mu_);
+    if (q_.empty()) {
+      return false;
+    }
+    *item = q_.front();
+    q_.pop_front();
+    return true;
+  }
+
+ private:
+  Lock mu_;
+  std::deque<Item> q_ GUARDED_BY(mu_);
+};
+
+template <typename Queue>
+void RunProducerConsumer(benchmark::State& state, Queue* q) {
+  int64_t popped = 0;
+  for (auto _ : state) {
+    (void)_;
+    if (state.thread_index == 0 && state.threads > 1) {
+      Item item;
+      popped += q->Pop(&item);
+    } else {
+      q->Push(Item());
+    }
+  }
+  if (state.thread_index == 0) {
+    // Drains remaining items, so the next run starts from an empty queue.
+    // Other threads have finished pushing before the iteration ends.
+    Item item;
+    while (q->Pop(&item)) {
+    }
+    state.counters["popped"] = popped;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+}  // anonymous namespace
+
+}  // namespace devtools_goma
+
+void BM_LockedQueue(benchmark::State& state) {
+  static auto* q = new devtools_goma::LockedQueue;
+  devtools_goma::RunProducerConsumer(state, q);
+}
+BENCHMARK(BM_LockedQueue)->ThreadRange(1, 64)->UseRealTime();
+
+void BM_MpscQueue(benchmark::State& state) {
+  static auto* q = new devtools_goma::MpscQueue<devtools_goma::Item>;
+  devtools_goma::RunProducerConsumer(state, q);
+}
+BENCHMARK(BM_MpscQueue)->ThreadRange(1, 64)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,99 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures lock contention of a hash map shared by many threads, like
+// FileHashCache and GlobalFileStatCache accessed from worker threads.
+// Compares a map guarded by one ReadWriteLock with ShardedHashMap.
+
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/str_cat.h"
+#include "autolock_timer.h"
+#include "benchmark/benchmark.h"
+#include "lockhelper.h"
+#include "sharded_hash_map.h"
+
+namespace devtools_goma {
+
+namespace {
+
+constexpr int kNumKeys = 10000;
+// 1 in kWriteRatio operations is write.
+constexpr int kWriteRatio = 10;
+
+const std::vector<std::string>& Keys() {
+  static const std::vector<std::string>* keys = [] {
+    auto* keys = new std::vector<std::string>;
+    for (int i = 0; i < kNumKeys; ++i) {
+      keys->push_back(absl::StrCat("/home/goma/src/third_party/include/file",
+                                   i, ".h"));
+    }
+    return keys;
+  }();
+  return *keys;
+}
+
+// A map guarded by one ReadWriteLock, as the caches used to be.
+class SingleLockMap {
+ public:
+  bool Find(const std::string& key, int* value) const {
+    AUTO_SHARED_LOCK(lock, &mu_);
+    auto it = map_.find(key);
+    if (it == map_.end()) {
+      return false;
+    }
+    *value = it->second;
+    return true;
+  }
+
+  void InsertOrAssign(const std::string& key, int value) {
+    AUTO_EXCLUSIVE_LOCK(lock, &mu_);
+    map_[key] = value;
+  }
+
+ private:
+  mutable ReadWriteLock mu_;
+  absl::flat_hash_map<std::string, int> map_ GUARDED_BY(mu_);
+};
+
+template <typename Map>
+void RunReadMostly(benchmark::State& state, Map* map) {
+  const std::vector<std::string>& keys = Keys();
+  // Each thread starts from a different key.
+  size_t i = state.thread_index * (kNumKeys / state.threads);
+  int hit = 0;
+  for (auto _ : state) {
+    (void)_;
+    const std::string& key = keys[i % keys.size()];
+    if (i % kWriteRatio == 0) {
+      map->InsertOrAssign(key, static_cast<int>(i));
+    } else {
+      int value = 0;
+      hit += map->Find(key, &value);
+    }
+    ++i;
+  }
+  benchmark::DoNotOptimize(hit);
+  state.SetItemsProcessed(state.iterations());
+}
+
+}  // anonymous namespace
+
+}  // namespace devtools_goma
+
+void BM_SingleLockMap(benchmark::State& state) {
+  static devtools_goma::SingleLockMap* map = new devtools_goma::SingleLockMap;
+  devtools_goma::RunReadMostly(state, map);
+}
+BENCHMARK(BM_SingleLockMap)->ThreadRange(1, 64)->UseRealTime();
+
+void BM_ShardedHashMap(benchmark::State& state) {
+  static auto* map = new devtools_goma::ShardedHashMap<std::string, int>;
+  devtools_goma::RunReadMostly(state, map);
+}
+BENCHMARK(BM_ShardedHashMap)->ThreadRange(1, 64)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,101 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures latency of short closures queued to WorkerThreadManager while
+// some workers are occupied by long closures, with and without work
+// stealing.  Reports p50 and p99 latency from RunClosure() to the start of
+// the closure.
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "benchmark/benchmark.h"
+#include "callback.h"
+#include "worker_thread.h"
+#include "worker_thread_manager.h"
+
+namespace devtools_goma {
+
+namespace {
+
+constexpr int kNumThreads = 4;
+constexpr int kNumClosures = 1000;
+// 1 in kLongClosureRatio closures is long.
+constexpr int kLongClosureRatio = 50;
+constexpr absl::Duration kLongClosureDuration = absl::Milliseconds(2);
+
+struct ClosureRecord {
+  absl::Time queued;
+  absl::Duration latency;
+};
+
+struct LoadState {
+  std::vector<ClosureRecord> records;
+  std::atomic<int> num_done{0};
+};
+
+void RunTask(LoadState* state, int i, absl::Duration duration) {
+  ClosureRecord* record = &state->records[i];
+  const absl::Time start = absl::Now();
+  record->latency = start - record->queued;
+  // Busy loop, as compile tasks use CPU rather than sleep.
+  while (absl::Now() - start < duration) {
+  }
+  state->num_done.fetch_add(1, std::memory_order_release);
+}
+
+void BM_SkewedLoad(benchmark::State& state) {
+  const bool work_stealing = state.range(0) != 0;
+  WorkerThreadManager wm;
+  if (work_stealing) {
+    wm.EnableWorkStealing();
+  }
+  wm.Start(kNumThreads);
+
+  std::vector<absl::Duration> latencies;
+  for (auto _ : state) {
+    LoadState load;
+    load.records.resize(kNumClosures);
+    for (int i = 0; i < kNumClosures; ++i) {
+      const absl::Duration duration = (i % kLongClosureRatio == 0)
+                                          ? kLongClosureDuration
+                                          : absl::ZeroDuration();
+      load.records[i].queued = absl::Now();
+      wm.RunClosure(FROM_HERE, NewCallback(RunTask, &load, i, duration),
+                    WorkerThread::PRIORITY_LOW);
+    }
+    while (load.num_done.load(std::memory_order_acquire) < kNumClosures) {
+      absl::SleepFor(absl::Microseconds(100));
+    }
+    for (int i = 0; i < kNumClosures; ++i) {
+      if (i % kLongClosureRatio != 0) {
+        latencies.push_back(load.records[i].latency);
+      }
+    }
+  }
+  wm.Finish();
+
+  std::sort(latencies.begin(), latencies.end());
+  if (!latencies.empty()) {
+    state.counters["p50_us"] = absl::ToDoubleMicroseconds(
+        latencies[latencies.size() / 2]);
+    state.counters["p99_us"] = absl::ToDoubleMicroseconds(
+        latencies[latencies.size() * 99 / 100]);
+  }
+}
+BENCHMARK(BM_SkewedLoad)
+    ->ArgName("work_stealing")
+    ->Arg(0)
+    ->Arg(1)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+}  // namespace devtools_goma
+
+BENCHMARK_MAIN();
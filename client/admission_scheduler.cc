@@ -0,0 +1,159 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "admission_scheduler.h"
+
+#include <algorithm>
+#include <sstream>
+
+#include "autolock_timer.h"
+#include "callback.h"
+#include "glog/logging.h"
+
+namespace devtools_goma {
+
+constexpr int AdmissionScheduler::kNumPhases;
+constexpr int64_t AdmissionScheduler::kLinkPriority;
+constexpr size_t AdmissionScheduler::kMaxDurations;
+
+// static
+const char* AdmissionScheduler::PhaseName(Phase phase) {
+  switch (phase) {
+    case Phase::kIncludeProcessor:
+      return "include_processor";
+    case Phase::kFileRequest:
+      return "file_request";
+    case Phase::kCallExec:
+      return "call_exec";
+    case Phase::kFileResponse:
+      return "file_response";
+  }
+  return "unknown";
+}
+
+AdmissionScheduler::AdmissionScheduler() = default;
+
+AdmissionScheduler::~AdmissionScheduler() {
+  AUTOLOCK(lock, &mu_);
+  for (auto& state : phases_) {
+    LOG_IF(WARNING, !state.waiters.empty())
+        << "tasks are still waiting for admission: " << state.waiters.size();
+    while (!state.waiters.empty()) {
+      delete state.waiters.top().closure;
+      state.waiters.pop();
+    }
+  }
+}
+
+void AdmissionScheduler::SetMaxInFlightTasks(Phase phase, int max_tasks) {
+  std::vector<OneshotClosure*> closures;
+  {
+    AUTOLOCK(lock, &mu_);
+    PhaseState* state = &phases_[static_cast<int>(phase)];
+    state->max_in_flight = max_tasks;
+    PopAdmittableWaiters(state, &closures);
+  }
+  LOG(INFO) << "admission: " << PhaseName(phase)
+            << " max_in_flight=" << max_tasks;
+  for (auto* closure : closures) {
+    closure->Run();
+  }
+}
+
+void AdmissionScheduler::Admit(Phase phase,
+                               int64_t priority,
+                               OneshotClosure* closure) {
+  DCHECK(closure != nullptr);
+  {
+    AUTOLOCK(lock, &mu_);
+    PhaseState* state = &phases_[static_cast<int>(phase)];
+    // Don't overtake waiting tasks, which may have higher priority.
+    if (!HasRoom(*state) || !state->waiters.empty()) {
+      state->waiters.push(Waiter{priority, next_seq_++, closure});
+      ++state->num_waited;
+      state->max_waiting = std::max(state->max_waiting,
+                                    static_cast<int>(state->waiters.size()));
+      return;
+    }
+    ++state->in_flight;
+    ++state->num_admitted;
+  }
+  closure->Run();
+}
+
+void AdmissionScheduler::Release(Phase phase) {
+  std::vector<OneshotClosure*> closures;
+  {
+    AUTOLOCK(lock, &mu_);
+    PhaseState* state = &phases_[static_cast<int>(phase)];
+    DCHECK_GT(state->in_flight, 0) << PhaseName(phase);
+    --state->in_flight;
+    PopAdmittableWaiters(state, &closures);
+  }
+  for (auto* closure : closures) {
+    closure->Run();
+  }
+}
+
+// static
+void AdmissionScheduler::PopAdmittableWaiters(
+    PhaseState* state, std::vector<OneshotClosure*>* closures) {
+  while (!state->waiters.empty() && HasRoom(*state)) {
+    closures->push_back(state->waiters.top().closure);
+    state->waiters.pop();
+    ++state->in_flight;
+    ++state->num_admitted;
+  }
+}
+
+void AdmissionScheduler::RecordDuration(const std::string& key,
+                                        absl::Duration duration) {
+  if (key.empty()) {
+    return;
+  }
+  AUTOLOCK(lock, &durations_mu_);
+  durations_.emplace_back(key, duration);
+  while (durations_.size() > kMaxDurations) {
+    durations_.pop_front();
+  }
+}
+
+absl::Duration AdmissionScheduler::EstimatedDuration(
+    const std::string& key) const {
+  AUTOLOCK(lock, &durations_mu_);
+  auto it = durations_.find(key);
+  if (it == durations_.end()) {
+    return absl::ZeroDuration();
+  }
+  return it->second;
+}
+
+int AdmissionScheduler::num_in_flight_tasks(Phase phase) const {
+  AUTOLOCK(lock, &mu_);
+  return phases_[static_cast<int>(phase)].in_flight;
+}
+
+int AdmissionScheduler::num_waiting_tasks(Phase phase) const {
+  AUTOLOCK(lock, &mu_);
+  return phases_[static_cast<int>(phase)].waiters.size();
+}
+
+std::string AdmissionScheduler::DebugString() const {
+  std::ostringstream ss;
+  AUTOLOCK(lock, &mu_);
+  for (int i = 0; i < kNumPhases; ++i) {
+    const PhaseState& state = phases_[i];
+    ss << " " << PhaseName(static_cast<Phase>(i)) << ":"
+       << " in_flight=" << state.in_flight
+       << " max_in_flight=" << state.max_in_flight
+       << " waiting=" << state.waiters.size()
+       << " max_waiting=" << state.max_waiting
+       << " admitted=" << state.num_admitted
+       << " waited=" << state.num_waited
+       << std::endl;
+  }
+  return ss.str();
+}
+
+}  // namespace devtools_goma
@@ -0,0 +1,134 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DEVTOOLS_GOMA_CLIENT_ADMISSION_SCHEDULER_H_
+#define DEVTOOLS_GOMA_CLIENT_ADMISSION_SCHEDULER_H_
+
+#include <cstdint>
+#include <limits>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "absl/time/time.h"
+#include "linked_unordered_map.h"
+#include "lockhelper.h"
+
+namespace devtools_goma {
+
+class OneshotClosure;
+
+// AdmissionScheduler bounds the number of in-flight tasks in each phase of
+// remote compile, so that a burst of requests doesn't saturate every phase
+// at once.
+//
+// Waiting tasks are admitted in order of priority, which is a hint of the
+// critical path (e.g. link steps, or tasks that took long time last time),
+// then in FIFO order.
+//
+// A task must hold at most one phase at a time, i.e. it must Release() the
+// previous phase before Admit() the next phase. Otherwise tasks could
+// deadlock.
+class AdmissionScheduler {
+ public:
+  enum class Phase {
+    kIncludeProcessor,
+    kFileRequest,  // upload input files.
+    kCallExec,
+    kFileResponse,  // download output files.
+  };
+  static constexpr int kNumPhases = 4;
+
+  // Priority of link steps, which are typically on the critical path.
+  static constexpr int64_t kLinkPriority = std::numeric_limits<int64_t>::max();
+
+  // The max number of keys for RecordDuration().
+  static constexpr size_t kMaxDurations = 65536;
+
+  static const char* PhaseName(Phase phase);
+
+  AdmissionScheduler();
+  ~AdmissionScheduler();
+
+  AdmissionScheduler(const AdmissionScheduler&) = delete;
+  AdmissionScheduler& operator=(const AdmissionScheduler&) = delete;
+
+  // Sets the max number of in-flight tasks in |phase|.
+  // 0 or negative means unlimited, which is the default.
+  void SetMaxInFlightTasks(Phase phase, int max_tasks) LOCKS_EXCLUDED(mu_);
+
+  // Runs |closure| when a task with |priority| is admitted to |phase|.
+  // If |phase| has room, |closure| runs before Admit() returns. Otherwise,
+  // it runs on a thread calling Release() later. So |closure| should be
+  // cheap, e.g. posting a closure to the task's thread.
+  void Admit(Phase phase, int64_t priority, OneshotClosure* closure)
+      LOCKS_EXCLUDED(mu_);
+
+  // Releases a slot of |phase| acquired by Admit(), and admits waiting tasks.
+  void Release(Phase phase) LOCKS_EXCLUDED(mu_);
+
+  // Records |duration| of a task identified by |key| (e.g. output filename),
+  // which is used as the priority hint for the next task with the same key.
+  void RecordDuration(const std::string& key, absl::Duration duration)
+      LOCKS_EXCLUDED(durations_mu_);
+  // Returns estimated duration of a task identified by |key|.
+  // Returns absl::ZeroDuration() if unknown.
+  absl::Duration EstimatedDuration(const std::string& key) const
+      LOCKS_EXCLUDED(durations_mu_);
+
+  int num_in_flight_tasks(Phase phase) const LOCKS_EXCLUDED(mu_);
+  int num_waiting_tasks(Phase phase) const LOCKS_EXCLUDED(mu_);
+
+  std::string DebugString() const LOCKS_EXCLUDED(mu_);
+
+ private:
+  struct Waiter {
+    int64_t priority;
+    int64_t seq;
+    OneshotClosure* closure;
+  };
+
+  struct WaiterLess {
+    // std::priority_queue pops the largest one first, so a waiter with
+    // larger priority, or smaller seq for the same priority, is larger.
+    bool operator()(const Waiter& lhs, const Waiter& rhs) const {
+      if (lhs.priority != rhs.priority) {
+        return lhs.priority < rhs.priority;
+      }
+      return lhs.seq > rhs.seq;
+    }
+  };
+
+  struct PhaseState {
+    int max_in_flight = 0;
+    int in_flight = 0;
+    std::priority_queue<Waiter, std::vector<Waiter>, WaiterLess> waiters;
+    // The number of tasks admitted, and ones that needed to wait.
+    int64_t num_admitted = 0;
+    int64_t num_waited = 0;
+    int max_waiting = 0;
+  };
+
+  static bool HasRoom(const PhaseState& state) {
+    return state.max_in_flight <= 0 || state.in_flight < state.max_in_flight;
+  }
+
+  // Pops waiters of |state| while it has room, and appends their closures
+  // to |closures|.
+  static void PopAdmittableWaiters(PhaseState* state,
+                                   std::vector<OneshotClosure*>* closures);
+
+  mutable Lock mu_;
+  PhaseState phases_[kNumPhases] GUARDED_BY(mu_);
+  int64_t next_seq_ GUARDED_BY(mu_) = 0;
+
+  mutable Lock durations_mu_;
+  // key to the last duration. Older one is first.
+  LinkedUnorderedMap<std::string, absl::Duration> durations_
+      GUARDED_BY(durations_mu_);
+};
+
+}  // namespace devtools_goma
+
+#endif  // DEVTOOLS_GOMA_CLIENT_ADMISSION_SCHEDULER_H_
@@ -0,0 +1,116 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "admission_scheduler.h"
+
+#include <string>
+#include <vector>
+
+#include "callback.h"
+#include "gtest/gtest.h"
+
+namespace devtools_goma {
+
+namespace {
+
+using Phase = AdmissionScheduler::Phase;
+
+void AppendName(std::vector<std::string>* admitted, std::string name) {
+  admitted->push_back(std::move(name));
+}
+
+}  // anonymous namespace
+
+TEST(AdmissionSchedulerTest, Unlimited) {
+  AdmissionScheduler scheduler;
+  std::vector<std::string> admitted;
+  for (int i = 0; i < 100; ++i) {
+    scheduler.Admit(Phase::kCallExec, 0,
+                    NewCallback(&AppendName, &admitted, std::to_string(i)));
+  }
+  EXPECT_EQ(100U, admitted.size());
+  EXPECT_EQ(100, scheduler.num_in_flight_tasks(Phase::kCallExec));
+  EXPECT_EQ(0, scheduler.num_waiting_tasks(Phase::kCallExec));
+  EXPECT_EQ(0, scheduler.num_in_flight_tasks(Phase::kFileRequest));
+}
+
+TEST(AdmissionSchedulerTest, Priority) {
+  AdmissionScheduler scheduler;
+  scheduler.SetMaxInFlightTasks(Phase::kFileRequest, 2);
+
+  std::vector<std::string> admitted;
+  scheduler.Admit(Phase::kFileRequest, 0,
+                  NewCallback(&AppendName, &admitted, std::string("a")));
+  scheduler.Admit(Phase::kFileRequest, 0,
+                  NewCallback(&AppendName, &admitted, std::string("b")));
+  // No room.
+  scheduler.Admit(Phase::kFileRequest, 10,
+                  NewCallback(&AppendName, &admitted, std::string("c")));
+  scheduler.Admit(Phase::kFileRequest, 100,
+                  NewCallback(&AppendName, &admitted, std::string("d")));
+  scheduler.Admit(Phase::kFileRequest, AdmissionScheduler::kLinkPriority,
+                  NewCallback(&AppendName, &admitted, std::string("link")));
+  scheduler.Admit(Phase::kFileRequest, 10,
+                  NewCallback(&AppendName, &admitted, std::string("e")));
+  EXPECT_EQ((std::vector<std::string>{"a", "b"}), admitted);
+  EXPECT_EQ(2, scheduler.num_in_flight_tasks(Phase::kFileRequest));
+  EXPECT_EQ(4, scheduler.num_waiting_tasks(Phase::kFileRequest));
+
+  // Other phases are not limited.
+  scheduler.Admit(Phase::kCallExec, 0,
+                  NewCallback(&AppendName, &admitted, std::string("exec")));
+  EXPECT_EQ("exec", admitted.back());
+  admitted.clear();
+
+  scheduler.Release(Phase::kFileRequest);
+  EXPECT_EQ((std::vector<std::string>{"link"}), admitted);
+  scheduler.Release(Phase::kFileRequest);
+  scheduler.Release(Phase::kFileRequest);
+  // Same priority is FIFO.
+  scheduler.Release(Phase::kFileRequest);
+  EXPECT_EQ((std::vector<std::string>{"link", "d", "c", "e"}), admitted);
+  EXPECT_EQ(2, scheduler.num_in_flight_tasks(Phase::kFileRequest));
+  EXPECT_EQ(0, scheduler.num_waiting_tasks(Phase::kFileRequest));
+
+  scheduler.Release(Phase::kFileRequest);
+  scheduler.Release(Phase::kFileRequest);
+  EXPECT_EQ(0, scheduler.num_in_flight_tasks(Phase::kFileRequest));
+}
+
+TEST(AdmissionSchedulerTest, IncreaseMaxInFlightTasks) {
+  AdmissionScheduler scheduler;
+  scheduler.SetMaxInFlightTasks(Phase::kIncludeProcessor, 1);
+
+  std::vector<std::string> admitted;
+  for (int i = 0; i < 4; ++i) {
+    scheduler.Admit(Phase::kIncludeProcessor, 0,
+                    NewCallback(&AppendName, &admitted, std::to_string(i)));
+  }
+  EXPECT_EQ(1U, admitted.size());
+
+  scheduler.SetMaxInFlightTasks(Phase::kIncludeProcessor, 3);
+  EXPECT_EQ((std::vector<std::string>{"0", "1", "2"}), admitted);
+
+  scheduler.SetMaxInFlightTasks(Phase::kIncludeProcessor, 0);
+  EXPECT_EQ((std::vector<std::string>{"0", "1", "2", "3"}), admitted);
+  EXPECT_EQ(4, scheduler.num_in_flight_tasks(Phase::kIncludeProcessor));
+}
+
+TEST(AdmissionSchedulerTest, EstimatedDuration) {
+  AdmissionScheduler scheduler;
+  EXPECT_EQ(absl::ZeroDuration(), scheduler.EstimatedDuration("foo.o"));
+
+  scheduler.RecordDuration("foo.o", absl::Seconds(3));
+  scheduler.RecordDuration("bar.o", absl::Seconds(1));
+  scheduler.RecordDuration("", absl::Seconds(1));
+  EXPECT_EQ(absl::Seconds(3), scheduler.EstimatedDuration("foo.o"));
+  EXPECT_EQ(absl::Seconds(1), scheduler.EstimatedDuration("bar.o"));
+  EXPECT_EQ(absl::ZeroDuration(), scheduler.EstimatedDuration(""));
+
+  // The recent one is used.
+  scheduler.RecordDuration("foo.o", absl::Seconds(5));
+  EXPECT_EQ(absl::Seconds(5), scheduler.EstimatedDuration("foo.o"));
+}
+
+}  // namespace devtools_goma
@@ -34,8 +34,10 @@ class FileServiceBlobUploader : public BlobClient::Uploader {
 
   bool Store() const override;
 
- private:
+ protected:
   std::unique_ptr<FileServiceHttpClient> file_service_;
+
+ private:
   std::unique_ptr<FileBlob> blob_;
   bool need_blob_ = false;
 };
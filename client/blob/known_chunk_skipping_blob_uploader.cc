@@ -0,0 +1,44 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "blob/known_chunk_skipping_blob_uploader.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "file_hash_cache.h"
+#include "glog/logging.h"
+#include "goma_file_http.h"
+
+namespace devtools_goma {
+
+KnownChunkSkippingBlobUploader::KnownChunkSkippingBlobUploader(
+    std::string filename,
+    std::unique_ptr<FileServiceHttpClient> file_service,
+    FileHashCache* file_hash_cache)
+    : FileServiceBlobUploader(std::move(filename), std::move(file_service)),
+      file_hash_cache_(file_hash_cache) {
+  CHECK(file_hash_cache_ != nullptr);
+  file_service_->set_known_chunk_checker(this);
+}
+
+bool KnownChunkSkippingBlobUploader::IsKnownChunk(const std::string& hash_key,
+                                                  int64_t chunk_size) {
+  if (!file_hash_cache_->IsKnownCacheKey(hash_key)) {
+    return false;
+  }
+  ++num_skipped_chunks_;
+  skipped_chunk_bytes_ += chunk_size;
+  return true;
+}
+
+void KnownChunkSkippingBlobUploader::OnChunkStored(const std::string& hash_key,
+                                                   int64_t chunk_size) {
+  ++num_stored_chunks_;
+  stored_chunk_bytes_ += chunk_size;
+  file_hash_cache_->AddKnownCacheKey(hash_key);
+}
+
+}  // namespace devtools_goma
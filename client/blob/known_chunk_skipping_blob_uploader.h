@@ -0,0 +1,55 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DEVTOOLS_GOMA_CLIENT_BLOB_KNOWN_CHUNK_SKIPPING_BLOB_UPLOADER_H_
+#define DEVTOOLS_GOMA_CLIENT_BLOB_KNOWN_CHUNK_SKIPPING_BLOB_UPLOADER_H_
+
+#include <memory>
+#include <string>
+
+#include "blob/file_service_blob_uploader.h"
+#include "lib/goma_file.h"
+
+namespace devtools_goma {
+
+class FileHashCache;
+
+// KnownChunkSkippingBlobUploader is a FileServiceBlobUploader that stores
+// only chunks of a large file whose hash keys are not known in
+// FileHashCache. Hash keys of stored chunks are added to FileHashCache,
+// so a large file modified in place, e.g. a member of .a or .rlib
+// rewritten with the same size, doesn't need to be sent in full again.
+// Note that a FILE_CHUNK hash key covers its offset, so chunks after
+// an insertion or a deletion are stored again.
+class KnownChunkSkippingBlobUploader
+    : public FileServiceBlobUploader,
+      private FileServiceClient::KnownChunkChecker {
+ public:
+  // It doesn't take ownership of |file_hash_cache|.
+  KnownChunkSkippingBlobUploader(
+      std::string filename,
+      std::unique_ptr<FileServiceHttpClient> file_service,
+      FileHashCache* file_hash_cache);
+  ~KnownChunkSkippingBlobUploader() override = default;
+
+  int num_stored_chunks() const { return num_stored_chunks_; }
+  int64_t stored_chunk_bytes() const { return stored_chunk_bytes_; }
+  int num_skipped_chunks() const { return num_skipped_chunks_; }
+  int64_t skipped_chunk_bytes() const { return skipped_chunk_bytes_; }
+
+ private:
+  bool IsKnownChunk(const std::string& hash_key, int64_t chunk_size) override;
+  void OnChunkStored(const std::string& hash_key, int64_t chunk_size) override;
+
+  FileHashCache* file_hash_cache_;
+
+  int num_stored_chunks_ = 0;
+  int64_t stored_chunk_bytes_ = 0;
+  int num_skipped_chunks_ = 0;
+  int64_t skipped_chunk_bytes_ = 0;
+};
+
+}  // namespace devtools_goma
+
+#endif  // DEVTOOLS_GOMA_CLIENT_BLOB_KNOWN_CHUNK_SKIPPING_BLOB_UPLOADER_H_
@@ -0,0 +1,101 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "blob/local_output_cache_blob_downloader.h"
+
+#include <utility>
+
+#include "file_data_output.h"
+#include "glog/logging.h"
+#include "goma_data_util.h"
+#include "local_output_cache.h"
+#include "simple_timer.h"
+
+MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
+#include "prototmp/goma_data.pb.h"
+MSVC_POP_WARNING()
+
+namespace devtools_goma {
+
+LocalOutputCacheBlobDownloader::LocalOutputCacheBlobDownloader(
+    LocalOutputCache* cache,
+    std::shared_ptr<const LocalOutputCacheEntryReader> entry)
+    : cache_(cache), entry_(std::move(entry)) {}
+
+bool LocalOutputCacheBlobDownloader::Download(const ExecResult_Output& output,
+                                              OutputFileInfo* info) {
+  const LocalOutputCacheEntryReader::File* file =
+      entry_->FindFile(output.filename());
+  if (file == nullptr) {
+    LOG(ERROR) << "no output in local output cache entry: "
+               << output.filename();
+    return false;
+  }
+  if (output.blob().file_size() != static_cast<std::int64_t>(file->size)) {
+    LOG(ERROR) << "output size mismatch: " << output.filename()
+               << " want=" << output.blob().file_size()
+               << " got=" << file->size;
+    return false;
+  }
+
+  SimpleTimer timer(SimpleTimer::START);
+  LocalOutputCacheCommitMode method = LocalOutputCacheCommitMode::kCopy;
+  bool success = false;
+  if (file->has_blob && !info->tmp_filename.empty() &&
+      entry_->MaterializeBlob(*file, info->tmp_filename, info->mode,
+                              cache_->commit_mode(), &method)) {
+    success = true;
+  } else {
+    method = LocalOutputCacheCommitMode::kCopy;
+    success = WriteContent(*file, info);
+  }
+  cache_->RecordCommit(success, method, timer.GetDuration());
+  if (!success) {
+    return false;
+  }
+
+  if (!file->hash_key.empty()) {
+    info->hash_key = std::string(file->hash_key);
+  } else {
+    // Entries in the legacy format do not have hash key.
+    FileBlob blob;
+    blob.set_blob_type(FileBlob::FILE);
+    blob.set_file_size(file->content.size());
+    blob.set_content(std::string(file->content));
+    info->hash_key = ComputeFileBlobHashKey(blob);
+  }
+  return true;
+}
+
+bool LocalOutputCacheBlobDownloader::WriteContent(
+    const LocalOutputCacheEntryReader::File& file,
+    OutputFileInfo* info) {
+  absl::string_view content = file.content;
+  std::string blob_content;
+  if (file.has_blob) {
+    if (!entry_->ReadContent(file, &blob_content)) {
+      LOG(ERROR) << "failed to read blob: " << file.filename;
+      return false;
+    }
+    content = blob_content;
+  }
+
+  auto file_data_output = info->NewFileDataOutput();
+  if (!file_data_output->IsValid()) {
+    LOG(ERROR) << "invalid output: " << file_data_output->ToString();
+    return false;
+  }
+  if (!file_data_output->WriteAt(0, content)) {
+    LOG(ERROR) << "failed to write: " << file_data_output->ToString();
+    file_data_output->Close();
+    return false;
+  }
+  if (!file_data_output->Close()) {
+    LOG(ERROR) << "failed to close: " << file_data_output->ToString();
+    return false;
+  }
+  return true;
+}
+
+}  // namespace devtools_goma
@@ -0,0 +1,52 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DEVTOOLS_GOMA_CLIENT_BLOB_LOCAL_OUTPUT_CACHE_BLOB_DOWNLOADER_H_
+#define DEVTOOLS_GOMA_CLIENT_BLOB_LOCAL_OUTPUT_CACHE_BLOB_DOWNLOADER_H_
+
+#include <memory>
+
+#include "goma_blob.h"
+#include "local_output_cache_entry.h"
+
+namespace devtools_goma {
+
+class LocalOutputCache;
+
+// LocalOutputCacheBlobDownloader writes output content from a
+// LocalOutputCache entry, instead of FileBlob in ExecResp.
+// Since the entry is mmapped, content is written to the output without
+// being copied into ExecResp.
+// If content is stored in a blob file, and the output is written to a file,
+// the blob is hard linked or cloned according to the cache's commit mode.
+class LocalOutputCacheBlobDownloader : public BlobClient::Downloader {
+ public:
+  LocalOutputCacheBlobDownloader(
+      LocalOutputCache* cache,
+      std::shared_ptr<const LocalOutputCacheEntryReader> entry);
+  ~LocalOutputCacheBlobDownloader() override = default;
+
+  // Writes content of |output.filename()| in the entry to |info|.
+  // |info->hash_key| is also set if the entry has it.
+  bool Download(const ExecResult_Output& output, OutputFileInfo* info) override;
+
+  int num_rpc() const override { return 0; }
+
+  const HttpClient::Status& http_status() const override {
+    return http_status_;
+  }
+
+ private:
+  bool WriteContent(const LocalOutputCacheEntryReader::File& file,
+                    OutputFileInfo* info);
+
+  LocalOutputCache* cache_;
+  const std::shared_ptr<const LocalOutputCacheEntryReader> entry_;
+  // No http is used, so this is always initial status.
+  const HttpClient::Status http_status_;
+};
+
+}  // namespace devtools_goma
+
+#endif  // DEVTOOLS_GOMA_CLIENT_BLOB_LOCAL_OUTPUT_CACHE_BLOB_DOWNLOADER_H_
@@ -9,14 +9,41 @@
 #include <utility>
 
 #include "file_helper.h"
+#include "absl/strings/match.h"
+#include "absl/strings/string_view.h"
 #include "glog/logging.h"
 #include "goma_hash.h"
 #include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
 #include "google/protobuf/message.h"
 
 namespace devtools_goma {
 
+namespace {
+
+// Cache file with embedded checksum starts with
+// kEmbeddedChecksumPrefix + <sha256 of the rest in hex> + "\n".
+constexpr absl::string_view kEmbeddedChecksumPrefix = "goma-sha256:";
+constexpr size_t kSha256HexSize = 64;
+
+void SetTotalBytesLimit(const std::string& filename,
+                        int total_bytes_limit,
+                        int warning_threshold,
+                        google::protobuf::io::CodedInputStream* input) {
+  if (total_bytes_limit >= 0 && warning_threshold >= 0) {
+    input->SetTotalBytesLimit(total_bytes_limit, warning_threshold);
+  } else if (total_bytes_limit >= 0 || warning_threshold >= 0) {
+    LOG(ERROR) << "only one of total_bytes_limit or warning_threshold"
+               << " is set. Set both."
+               << " filename=" << filename
+               << " total_bytes_limit=" << total_bytes_limit
+               << " warning_threshold=" << warning_threshold;
+  }
+}
+
+}  // anonymous namespace
+
 CacheFile::CacheFile(std::string filename) : filename_(std::move(filename)) {}
 
 CacheFile::~CacheFile() {}
@@ -61,14 +88,7 @@ bool CacheFile::LoadWithMaxLimit(google::protobuf::Message* msg,
   // However, FileInputStream takes fd and we need to support Windows.
   google::protobuf::io::IstreamInputStream iis(&f);
   google::protobuf::io::CodedInputStream input(&iis);
-  if (total_bytes_limit >= 0 && warning_threshold >= 0) {
-    input.SetTotalBytesLimit(total_bytes_limit, warning_threshold);
-  } else if (total_bytes_limit >= 0 || warning_threshold >= 0) {
-    LOG(ERROR) << "only one of total_bytes_limit or warning_threshold"
-               << " is set. Set both."
-               << " total_bytes_limit=" << total_bytes_limit
-               << " warning_threshold=" << warning_threshold;
-  }
+  SetTotalBytesLimit(filename_, total_bytes_limit, warning_threshold, &input);
 
   if (!msg->ParseFromCodedStream(&input)) {
     LOG(ERROR) << "failed to parse " << filename_;
@@ -106,4 +126,61 @@ bool CacheFile::Save(const google::protobuf::Message& msg) const {
   return true;
 }
 
+bool CacheFile::LoadWithEmbeddedChecksum(google::protobuf::Message* msg,
+                                         int total_bytes_limit,
+                                         int warning_threshold) const {
+  std::string buf;
+  if (!ReadFileToString(filename_, &buf)) {
+    LOG(INFO) << "failed to read " << filename_;
+    return false;
+  }
+  absl::string_view data(buf);
+  if (!absl::ConsumePrefix(&data, kEmbeddedChecksumPrefix) ||
+      data.size() < kSha256HexSize + 1 || data[kSha256HexSize] != '\n') {
+    LOG(ERROR) << "no embedded sha256 in " << filename_;
+    return false;
+  }
+  const absl::string_view sha256_expected = data.substr(0, kSha256HexSize);
+  data.remove_prefix(kSha256HexSize + 1);
+  std::string sha256_actual;
+  ComputeDataHashKey(data, &sha256_actual);
+  if (sha256_actual != sha256_expected) {
+    LOG(ERROR) << "sha256 digest of " << filename_ << ": " << sha256_actual
+               << " but expected: " << sha256_expected;
+    return false;
+  }
+  LOG(INFO) << filename_ << " integrity OK.";
+
+  google::protobuf::io::ArrayInputStream ais(data.data(), data.size());
+  google::protobuf::io::CodedInputStream input(&ais);
+  SetTotalBytesLimit(filename_, total_bytes_limit, warning_threshold, &input);
+  if (!msg->ParseFromCodedStream(&input)) {
+    LOG(ERROR) << "failed to parse " << filename_;
+    return false;
+  }
+  return true;
+}
+
+bool CacheFile::SaveWithEmbeddedChecksum(
+    const google::protobuf::Message& msg) const {
+  std::string msg_buf;
+  msg.SerializeToString(&msg_buf);
+  std::string sha256_str;
+  ComputeDataHashKey(msg_buf, &sha256_str);
+  DCHECK_EQ(kSha256HexSize, sha256_str.size());
+
+  std::string buf;
+  buf.reserve(kEmbeddedChecksumPrefix.size() + sha256_str.size() + 1 +
+              msg_buf.size());
+  buf.append(kEmbeddedChecksumPrefix.data(), kEmbeddedChecksumPrefix.size());
+  buf.append(sha256_str);
+  buf.push_back('\n');
+  buf.append(msg_buf);
+  if (!WriteStringToFile(buf, filename_)) {
+    LOG(ERROR) << "failed to write " << filename_;
+    return false;
+  }
+  return true;
+}
+
 }  // namespace devtools_goma
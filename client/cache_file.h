@@ -34,6 +34,14 @@ class CacheFile {
                         int warning_threshold) const;
   bool Save(const google::protobuf::Message& data) const;
 
+  // Same as LoadWithMaxLimit and Save, but sha256 sum is embedded at the
+  // head of the cache file instead of *.sha256 file, so that the cache file
+  // can be replaced atomically by rename.
+  bool LoadWithEmbeddedChecksum(google::protobuf::Message* data,
+                                int total_bytes_limit,
+                                int warning_threshold) const;
+  bool SaveWithEmbeddedChecksum(const google::protobuf::Message& data) const;
+
   const std::string& filename() const { return filename_; }
   bool Enabled() const { return !filename_.empty(); }
 
@@ -146,6 +146,7 @@ CompileService::CompileService(WorkerThreadManager* wm, int compiler_info_pool)
       compiler_info_pool_(wm_->StartPool(compiler_info_pool, "compiler_info")),
       file_hash_cache_(new FileHashCache),
       include_processor_pool_(WorkerThreadManager::kFreePool),
+      admission_scheduler_(new AdmissionScheduler),
       histogram_(new CompilerProxyHistogram),
       new_file_threshold_duration_(absl::Minutes(1)),
       enable_gch_hack_(true),
@@ -196,6 +197,21 @@ void CompileService::SetCompilerProxyIdPrefix(const std::string& prefix) {
   LOG(INFO) << "compiler_proxy_id_prefix:" << compiler_proxy_id_prefix_;
 }
 
+void CompileService::SetFileHashCacheFile(
+    const std::string& cache_filename,
+    absl::optional<absl::Duration> alive_duration) {
+  LOG(INFO) << "FileHashCache persistence is enabled. cache_filename="
+            << cache_filename;
+  file_hash_cache_->SetCacheFile(cache_filename, alive_duration);
+  wm_->RunClosure(FROM_HERE,
+                  NewCallback(this, &CompileService::LoadFileHashCache),
+                  WorkerThread::PRIORITY_LOW);
+}
+
+void CompileService::LoadFileHashCache() {
+  file_hash_cache_->Load();
+}
+
 void CompileService::SetSubProcessOptionSetter(
     std::unique_ptr<SubProcessOptionSetter> option_setter) {
   subprocess_option_setter_ = std::move(option_setter);
@@ -220,8 +236,13 @@ void CompileService::SetMultiFileStore(
 }
 
 void CompileService::SetFileServiceHttpClient(
-    std::unique_ptr<FileServiceHttpClient> file_service) {
-  blob_client_ = absl::make_unique<FileBlobClient>(std::move(file_service));
+    std::unique_ptr<FileServiceHttpClient> file_service,
+    bool skip_known_chunks) {
+  auto blob_client = absl::make_unique<FileBlobClient>(std::move(file_service));
+  if (skip_known_chunks) {
+    blob_client->EnableKnownChunkSkipping(file_hash_cache_.get());
+  }
+  blob_client_ = std::move(blob_client);
 }
 
 BlobClient* CompileService::blob_client() const {
@@ -338,6 +359,8 @@ void CompileService::ExecDone(WorkerThread::ThreadId thread_id,
 void CompileService::CompileTaskDone(CompileTask* task) {
   task->SetFrozenTimestamp(absl::Now());
   histogram_->UpdateCompileStat(task->stats());
+  admission_scheduler_->RecordDuration(task->admission_key(),
+                                       task->stats().handler_time);
   rbe_stats_mgr_.Accumulate(task);
   if (log_service_client_.get())
     log_service_client_->SaveExecLog(task->stats());
@@ -516,6 +539,7 @@ void CompileService::Wait() {
     log_service_client_->Wait();
   log_service_client_.reset();
   histogram_.reset();
+  file_hash_cache_->Save();
   file_hash_cache_.reset();
   if (multi_file_store_.get())
     multi_file_store_->Wait();
@@ -797,10 +821,17 @@ void CompileService::DumpStats(std::ostringstream* ss) {
     const IncludeCacheStats& ic_stats = gstats.includecache_stats();
     (*ss) << "includecache:" << std::endl;
     (*ss) << "  entries=" << ic_stats.total_entries()
+          << " resident_bytes=" << ic_stats.resident_bytes()
           << " hit=" << ic_stats.hit()
           << " missed=" << ic_stats.missed()
           << " updated=" << ic_stats.updated()
           << " evicted=" << ic_stats.evicted() << std::endl;
+    if (ic_stats.preparsed_hit() > 0 || ic_stats.preparsed_missed() > 0) {
+      (*ss) << "  preparsed_hit=" << ic_stats.preparsed_hit()
+            << " preparsed_missed=" << ic_stats.preparsed_missed()
+            << " preparsed_stored=" << ic_stats.preparsed_stored()
+            << std::endl;
+    }
   }
   if (gstats.has_depscache_stats()) {
     const DepsCacheStats& dc_stats = gstats.depscache_stats();
@@ -818,6 +849,19 @@ void CompileService::DumpStats(std::ostringstream* ss) {
           << " updated=" << dc_stats.updated()
           << " missed=" << dc_stats.missed()
           << std::endl;
+    if (dc_stats.journal_records() > 0) {
+      (*ss) << "  journal_records=" << dc_stats.journal_records()
+            << " journal_bytes=" << dc_stats.journal_bytes()
+            << " journal_compactions=" << dc_stats.journal_compactions()
+            << std::endl;
+    }
+    if (dc_stats.validation_count() > 0) {
+      (*ss) << "  validation_count=" << dc_stats.validation_count()
+            << " parallel=" << dc_stats.parallel_validation_count()
+            << " time=" << dc_stats.validation_time_ms() << "ms"
+            << " max=" << dc_stats.max_validation_time_ms() << "ms"
+            << std::endl;
+    }
   }
   if (gstats.has_local_output_cache_stats()) {
     const LocalOutputCacheStats& loc_stats = gstats.local_output_cache_stats();
@@ -831,10 +875,15 @@ void CompileService::DumpStats(std::ostringstream* ss) {
           << " lookup_success_time_ms=" << loc_stats.lookup_success_time_ms()
           << " lookup_miss=" << loc_stats.lookup_miss()
           << " lookup_failure=" << loc_stats.lookup_failure()
+          << " pre_key_lookup_success=" << loc_stats.pre_key_lookup_success()
+          << " pre_key_lookup_miss=" << loc_stats.pre_key_lookup_miss()
           << std::endl
           << " commit_success=" << loc_stats.commit_success()
           << " commit_success_time_ms=" << loc_stats.commit_success_time_ms()
           << " commit_failure=" << loc_stats.commit_failure()
+          << " commit_hardlink=" << loc_stats.commit_hardlink()
+          << " commit_reflink=" << loc_stats.commit_reflink()
+          << " commit_copy=" << loc_stats.commit_copy()
           << std::endl
           << " gc_count=" << loc_stats.gc_count()
           << " gc_total_time_ms=" << loc_stats.gc_total_time_ms()
@@ -854,6 +903,8 @@ void CompileService::DumpStats(std::ostringstream* ss) {
     }
   }
 
+  (*ss) << "admission:" << std::endl
+        << admission_scheduler_->DebugString();
   (*ss) << "http_rpc:"
         << " query=" << gstats.http_rpc_stats().query()
         << " retry=" << gstats.http_rpc_stats().retry()
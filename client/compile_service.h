@@ -17,6 +17,7 @@
 #include "absl/container/flat_hash_set.h"
 #include "absl/time/time.h"
 #include "absl/types/optional.h"
+#include "admission_scheduler.h"
 #include "atomic_stats_counter.h"
 #include "basictypes.h"
 #include "compiler_info.h"
@@ -135,16 +136,27 @@ class CompileService {
     return multi_file_store_.get();
   }
 
+  // If |skip_known_chunks| is true, chunks of large files known in
+  // file_hash_cache() are not stored again.
   void SetFileServiceHttpClient(
-      std::unique_ptr<FileServiceHttpClient> file_service);
+      std::unique_ptr<FileServiceHttpClient> file_service,
+      bool skip_known_chunks);
   BlobClient* blob_client() const;
 
   FileHashCache* file_hash_cache() const { return file_hash_cache_.get(); }
+  // Enables FileHashCache persistence in |cache_filename|, and starts
+  // loading it in a worker thread. The cache is saved in Wait().
+  void SetFileHashCacheFile(const std::string& cache_filename,
+                            absl::optional<absl::Duration> alive_duration);
   CompilerProxyHistogram* histogram() const { return histogram_.get(); }
 
   void StartIncludeProcessorWorkers(int num_threads);
   int include_processor_pool() const { return include_processor_pool_; }
 
+  AdmissionScheduler* admission_scheduler() const {
+    return admission_scheduler_.get();
+  }
+
   void SetLogServiceClient(
       std::unique_ptr<LogServiceClient> log_service_client);
   LogServiceClient* log_service() const { return log_service_client_.get(); }
@@ -414,6 +426,8 @@ class CompileService {
 
   void ClearTasksUnlocked();
 
+  void LoadFileHashCache();
+
   const CompileTask* FindTaskByIdUnlocked(int task_id, bool include_active);
 
   void DumpCommonStatsUnlocked(GomaStats* stats) SHARED_LOCKS_REQUIRED(buf_mu_)
@@ -482,6 +496,8 @@ class CompileService {
 
   int include_processor_pool_;
 
+  std::unique_ptr<AdmissionScheduler> admission_scheduler_;
+
   std::unique_ptr<LogServiceClient> log_service_client_;
 
   std::unique_ptr<CompilerProxyHistogram> histogram_;
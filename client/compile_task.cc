@@ -31,6 +31,7 @@
 #include "absl/strings/str_split.h"
 #include "absl/time/clock.h"
 #include "autolock_timer.h"
+#include "blob/local_output_cache_blob_downloader.h"
 #include "callback.h"
 #include "clang_tidy_flags.h"
 #include "compile_service.h"
@@ -80,6 +81,7 @@
 #include "task/local_output_file_task.h"
 #include "task/output_file_task.h"
 #include "time_util.h"
+#include "trace_recorder.h"
 #include "util.h"
 #include "vc_flags.h"
 #include "worker_thread.h"
@@ -380,8 +382,16 @@ void CompileTask::Start() {
   DCHECK(!BelongsToCurrentThread());
   thread_id_ = GetCurrentThreadId();
 
+  if (GlobalFileStatCache::Instance() != nullptr) {
+    // Files changed before this task started (e.g. by the preceding build
+    // steps) must not be seen with cached FileStats.
+    GlobalFileStatCache::Instance()->ProcessFileChanges();
+  }
   input_file_stat_cache_ = absl::make_unique<FileStatCache>();
-  output_file_stat_cache_ = absl::make_unique<FileStatCache>();
+  // Output files are updated by this task, which GlobalFileStatCache would
+  // not notice yet.
+  output_file_stat_cache_ =
+      absl::make_unique<FileStatCache>(/*use_global_cache=*/false);
 
   rpc_->NotifyWhenClosed(NewCallback(this, &CompileTask::GomaccClosed));
 
@@ -662,6 +672,10 @@ void CompileTask::ProcessSetup() {
 void CompileTask::TryProcessFileRequest() {
   file_request_timer_.Start();
   if (flags_->is_linking()) {
+    // Don't hold a kFileRequest slot while waiting for the preceding link
+    // tasks. Link tasks are admitted first, so waiting link tasks could
+    // take all slots while only the front one makes progress.
+    LeavePhase();
     AUTOLOCK(lock, &global_mu_);
     DCHECK(link_file_req_tasks_ != nullptr);
     link_file_req_tasks_->push_back(this);
@@ -670,8 +684,17 @@ void CompileTask::TryProcessFileRequest() {
               << link_file_req_tasks_->size();
       return;
     }
+  } else if (admitted_phase_ == AdmissionScheduler::Phase::kFileRequest) {
+    // Retry in FILE_REQ.
+    ProcessFileRequest();
+    return;
   }
-  ProcessFileRequest();
+  AdmitFileRequest();
+}
+
+void CompileTask::AdmitFileRequest() {
+  RunInPhase(AdmissionScheduler::Phase::kFileRequest,
+             NewCallback(this, &CompileTask::ProcessFileRequest));
 }
 
 void CompileTask::ProcessFileRequest() {
@@ -698,9 +721,16 @@ void CompileTask::ProcessFileRequest() {
     ProcessFinished("canceled before file req");
     return;
   }
+  if (state_ == SETUP && LookupLocalOutputCacheByPreKey()) {
+    ProcessPendingFileRequest();
+    LeavePhase();
+    ProcessFileResponse();
+    return;
+  }
   state_ = FILE_REQ;
   if (ShouldStopGoma()) {
     ProcessPendingFileRequest();
+    LeavePhase();
     state_ = LOCAL_RUN;
     stats_->set_local_run_reason("slow goma, local run started in FILE_REQ");
     return;
@@ -900,6 +930,7 @@ void CompileTask::ProcessFileRequestDone() {
   const absl::Duration include_fileload_time =
       include_timer_.GetDuration() - stats_->include_preprocess_time;
   stats_->include_fileload_time = include_fileload_time;
+  TraceRecorder::RecordSpan("IncludeFileload", trace_id_, fileload_run_time);
 
   VLOG(1) << trace_id_
           << " input files processing preprocess "
@@ -920,6 +951,7 @@ void CompileTask::ProcessFileRequestDone() {
     if (IsSubprocRunning()) {
       VLOG(1) << trace_id_ << " file request failed,"
               << " but subprocess running";
+      LeavePhase();
       state_ = LOCAL_RUN;
       stats_->set_local_run_reason("fail goma, local run started in FILE_REQ");
       return;
@@ -970,20 +1002,105 @@ void CompileTask::ProcessFileRequestDone() {
   // in end of ProcessFileRequest?
   if (LocalOutputCache::IsEnabled()) {
     local_output_cache_key_ = LocalOutputCache::MakeCacheKey(*req_);
-    if (LocalOutputCache::instance()->Lookup(local_output_cache_key_,
-                                             resp_.get(),
-                                             trace_id_)) {
+    if (LocalOutputCache::instance()->LookupEntry(local_output_cache_key_,
+                                                  resp_.get(),
+                                                  &local_output_cache_entry_,
+                                                  trace_id_)) {
       LOG(INFO) << trace_id_ << " lookup succeeded";
+      if (!local_output_cache_pre_key_.empty()) {
+        LocalOutputCache::instance()->AddPreCacheKey(
+            local_output_cache_pre_key_, local_output_cache_key_);
+      }
       stats_->set_cache_hit(true);
       stats_->set_cache_source(ExecLog::LOCAL_OUTPUT_CACHE);
       ReleaseMemoryForExecReqInput(req_.get());
       state_ = LOCAL_OUTPUT;
+      LeavePhase();
       ProcessFileResponse();
       return;
     }
   }
 
-  ProcessCallExec();
+  RunInPhase(AdmissionScheduler::Phase::kCallExec,
+             NewCallback(this, &CompileTask::ProcessCallExec));
+}
+
+bool CompileTask::LookupLocalOutputCacheByPreKey() {
+  CHECK(BelongsToCurrentThread());
+  CHECK_EQ(SETUP, state_);
+  if (!LocalOutputCache::IsEnabled()) {
+    return false;
+  }
+
+  // Here, |required_files_| is known, but the files are not hashed yet.
+  // Use their FileStat instead of the content hash, so that we can skip
+  // hashing and uploading input files on cache hit.
+  std::vector<std::pair<std::string, FileStat>> inputs;
+  inputs.reserve(required_files_.size());
+  for (const auto& filename : required_files_) {
+    std::string abs_filename =
+        file::JoinPathRespectAbsolute(flags_->cwd(), filename);
+    FileStat file_stat = input_file_stat_cache_->Get(abs_filename);
+    inputs.emplace_back(std::move(abs_filename), std::move(file_stat));
+  }
+  local_output_cache_pre_key_ =
+      LocalOutputCache::MakePreCacheKey(*req_, std::move(inputs));
+  if (local_output_cache_pre_key_.empty()) {
+    return false;
+  }
+  if (!LocalOutputCache::instance()->LookupEntryByPreKey(
+          local_output_cache_pre_key_, &local_output_cache_key_, resp_.get(),
+          &local_output_cache_entry_, trace_id_)) {
+    return false;
+  }
+
+  LOG(INFO) << trace_id_ << " lookup by pre cache key succeeded";
+  stats_->set_cache_hit(true);
+  stats_->set_cache_source(ExecLog::LOCAL_OUTPUT_CACHE);
+  state_ = LOCAL_OUTPUT;
+  return true;
+}
+
+void CompileTask::RunInPhase(AdmissionScheduler::Phase phase,
+                             OneshotClosure* closure) {
+  CHECK(BelongsToCurrentThread());
+  // Holding a phase while waiting for another phase could cause deadlock.
+  LeavePhase();
+  admitted_phase_ = phase;
+  service_->admission_scheduler()->Admit(
+      phase, AdmissionPriority(),
+      NewCallback(this, &CompileTask::RunInTaskThread, closure));
+}
+
+void CompileTask::RunInTaskThread(OneshotClosure* closure) {
+  service_->wm()->RunClosureInThread(
+      FROM_HERE, thread_id_, closure, WorkerThread::PRIORITY_LOW);
+}
+
+void CompileTask::LeavePhase() {
+  if (!admitted_phase_.has_value()) {
+    return;
+  }
+  service_->admission_scheduler()->Release(*admitted_phase_);
+  admitted_phase_.reset();
+}
+
+int64_t CompileTask::AdmissionPriority() {
+  if (admission_priority_.has_value()) {
+    return *admission_priority_;
+  }
+  if (flags_->is_linking()) {
+    admission_priority_ = AdmissionScheduler::kLinkPriority;
+    return *admission_priority_;
+  }
+  // Tasks that took longer last time are likely on the critical path.
+  if (!flags_->output_files().empty()) {
+    admission_key_ = file::JoinPathRespectAbsolute(
+        flags_->cwd(), flags_->output_files()[0]);
+  }
+  admission_priority_ = absl::ToInt64Milliseconds(
+      service_->admission_scheduler()->EstimatedDuration(admission_key_));
+  return *admission_priority_;
 }
 
 void CompileTask::ProcessPendingFileRequest() {
@@ -1004,7 +1121,7 @@ void CompileTask::ProcessPendingFileRequest() {
     service_->wm()->RunClosureInThread(
         FROM_HERE,
         pending_task->thread_id_,
-        NewCallback(pending_task, &CompileTask::ProcessFileRequest),
+        NewCallback(pending_task, &CompileTask::AdmitFileRequest),
         WorkerThread::PRIORITY_LOW);
   }
 }
@@ -1025,6 +1142,7 @@ void CompileTask::ProcessCallExec() {
         req_->input_size() > 0) << trace_id_ << " call exec";
   state_ = CALL_EXEC;
   if (ShouldStopGoma()) {
+    LeavePhase();
     state_ = LOCAL_RUN;
     stats_->set_local_run_reason("slow goma, local run started in CALL_EXEC");
     return;
@@ -1086,6 +1204,7 @@ void CompileTask::ProcessCallExecDone() {
   const absl::Duration rpc_call_timer_duration = rpc_call_timer_.GetDuration();
   stats_->add_rpc_call_time(DurationToIntMs(rpc_call_timer_duration));
   stats_->total_rpc_call_time += rpc_call_timer_duration;
+  TraceRecorder::RecordSpan("RPC", trace_id_, rpc_call_timer_duration);
 
   stats_->AddStatsFromHttpStatus(*http_rpc_status_);
   stats_->AddStatsFromExecResp(*resp_);
@@ -1133,6 +1252,7 @@ void CompileTask::ProcessCallExecDone() {
       // If rpc was failed while receiving response, goma should retry Exec call
       // because the reponse will be replied from cache with high probability.
       LOG(WARNING) << trace_id_ << " goma failed, but subprocess running.";
+      LeavePhase();
       state_ = LOCAL_RUN;
       stats_->set_local_run_reason("fail goma, local run started in CALL_EXEC");
       return;
@@ -1248,7 +1368,8 @@ void CompileTask::ProcessCallExecDone() {
     // Check command spec when not missing input response.
     CheckCommandSpec();
   }
-  ProcessFileResponse();
+  RunInPhase(AdmissionScheduler::Phase::kFileResponse,
+             NewCallback(this, &CompileTask::ProcessFileResponse));
 }
 
 void CompileTask::ProcessFileResponse() {
@@ -1265,6 +1386,7 @@ void CompileTask::ProcessFileResponse() {
   }
   state_ = FILE_RESP;
   if (ShouldStopGoma()) {
+    LeavePhase();
     state_ = LOCAL_RUN;
     stats_->set_local_run_reason("slow goma, local run started in FILE_RESP");
     return;
@@ -1376,8 +1498,18 @@ void CompileTask::ProcessFileResponse() {
     auto* output_info = &output_file_infos_[i];
     output_info->filename = filename;
     bool try_acquire_output_buffer = want_in_memory_output;
-    if (IsValidFileBlob(resp_->result().output(i).blob())) {
-      output_info->size = resp_->result().output(i).blob().file_size();
+    const FileBlob& blob = resp_->result().output(i).blob();
+    // LocalOutputCache hit has no content in blob. It is written from
+    // |local_output_cache_entry_|.
+    if (IsValidFileBlob(blob) ||
+        (local_output_cache_entry_ != nullptr && blob.has_file_size())) {
+      output_info->size = blob.file_size();
+      // Blob files in LocalOutputCache can be linked to the output file
+      // without writing content, so don't hold it in memory.
+      if (local_output_cache_entry_ != nullptr &&
+          local_output_cache_entry_->has_blob()) {
+        try_acquire_output_buffer = false;
+      }
     } else {
       LOG(ERROR) << trace_id_ << " output is invalid:"
                  << filename;
@@ -1412,10 +1544,17 @@ void CompileTask::ProcessFileResponse() {
               << " filename=" << filename
               << " mode=" << std::oct << output_info->mode;
     }
+    std::unique_ptr<BlobClient::Downloader> blob_downloader;
+    if (local_output_cache_entry_ != nullptr) {
+      blob_downloader = absl::make_unique<LocalOutputCacheBlobDownloader>(
+          LocalOutputCache::instance(), local_output_cache_entry_);
+    } else {
+      blob_downloader =
+          service_->blob_client()->NewDownloader(requester_info_, trace_id_);
+    }
     std::unique_ptr<OutputFileTask> output_file_task(new OutputFileTask(
-        service_->wm(),
-        service_->blob_client()->NewDownloader(requester_info_, trace_id_),
-        this, i, resp_->result().output(i), output_info));
+        service_->wm(), std::move(blob_downloader), this, i,
+        resp_->result().output(i), output_info));
 
     OutputFileTask* output_file_task_pointer = output_file_task.get();
     closures.push_back(
@@ -1442,10 +1581,14 @@ void CompileTask::ProcessFileResponseDone() {
   VLOG(1) << trace_id_ << " file resp done";
   CHECK(BelongsToCurrentThread());
   CHECK_EQ(FILE_RESP, state_);
+  // All outputs have been written, so the mapping is no longer needed.
+  local_output_cache_entry_.reset();
+  LeavePhase();
 
   const absl::Duration file_response_time = file_response_timer_.GetDuration();
   stats_->file_response_time += file_response_time;
   stats_->set_file_response_time(DurationToIntMs(file_response_time));
+  TraceRecorder::RecordSpan("FileResponse", trace_id_, file_response_time);
 
   if (abort_) {
     ProcessFinished("aborted in file resp");
@@ -1571,6 +1714,7 @@ void CompileTask::ProcessFinished(const std::string& msg) {
   CHECK_LT(state_, FINISHED);
   DCHECK(!finished_);
   finished_ = true;
+  LeavePhase();
   if (state_ == INIT) {
     // failed to find local compiler path.
     // it also happens if user uses old gomacc.
@@ -1724,6 +1868,9 @@ void CompileTask::ProcessReply() {
                                                       resp_.get(),
                                                       trace_id_)) {
           LOG(ERROR) << trace_id_ << " failed to save localoutputcache";
+        } else if (!local_output_cache_pre_key_.empty()) {
+          LocalOutputCache::instance()->AddPreCacheKey(
+              local_output_cache_pre_key_, local_output_cache_key_);
         }
       }
     }
@@ -1877,6 +2024,13 @@ void CompileTask::RewriteCoffTimestamp(const std::string& filename) {
   if (ext != "obj")
     return;
 
+  // The output might be hard linked to a blob in LocalOutputCache.
+  if (!UnshareHardLinkedFile(filename)) {
+    LOG(ERROR) << trace_id_ << " failed to unshare file for coff rewrite: "
+               << filename;
+    return;
+  }
+
   ScopedFd fd(ScopedFd::OpenForRewrite(filename));
   if (!fd.valid()) {
     LOG(ERROR) << trace_id_ << " failed to open file for coff rewrite: "
@@ -2178,6 +2332,7 @@ void CompileTask::ReplyResponse(const std::string& msg) {
 
   stats_->handler_time = handler_timer_.GetDuration();
   stats_->set_handler_time(DurationToIntMs(stats_->handler_time));
+  TraceRecorder::RecordSpan("CompileTask", trace_id_, stats_->handler_time);
   gomacc_pid_ = SubProcessState::kInvalidPid;
 
   if (stats_->handler_time > absl::Minutes(5)) {
@@ -2295,6 +2450,7 @@ void CompileTask::Done() {
   // LOCAL_FINISHED: fallback by should_fallback_.
   // abort_: idle fallback.
   replied_ = true;
+  LeavePhase();
   if (!abort_)
     CHECK_GE(state_, FINISHED);
   CHECK(rpc_ == nullptr) << trace_id_
@@ -2684,6 +2840,7 @@ void CompileTask::FillCompilerInfoDone(
   const absl::Duration compiler_info_time = compiler_info_timer_.GetDuration();
   stats_->set_compiler_info_process_time(DurationToIntMs(compiler_info_time));
   stats_->compiler_info_process_time = compiler_info_time;
+  TraceRecorder::RecordSpan("CompilerInfo", trace_id_, compiler_info_time);
   std::ostringstream ss;
   ss << " cache_hit=" << param->cache_hit
      << " updated=" << param->updated
@@ -2827,6 +2984,8 @@ void CompileTask::UpdateRequiredFilesDone(bool ok) {
   const absl::Duration include_preprocess_time = include_timer_.GetDuration();
   stats_->set_include_preprocess_time(DurationToIntMs(include_preprocess_time));
   stats_->include_preprocess_time = include_preprocess_time;
+  TraceRecorder::RecordSpan("IncludePreprocess", trace_id_,
+                            include_preprocess_time);
   stats_->set_depscache_used(depscache_used_);
 
   LOG_IF(WARNING, stats_->include_processor_run_time > absl::Seconds(1))
@@ -3323,6 +3482,13 @@ void CompileTask::StartIncludeProcessor() {
     }
   }
 
+  RunInPhase(AdmissionScheduler::Phase::kIncludeProcessor,
+             NewCallback(this, &CompileTask::PostIncludeProcessor));
+}
+
+void CompileTask::PostIncludeProcessor() {
+  VLOG(1) << trace_id_ << " PostIncludeProcessor";
+  CHECK_EQ(SETUP, state_);
   auto request_param = absl::make_unique<IncludeProcessorRequestParam>();
 
   input_file_stat_cache_->ReleaseOwner();
@@ -3380,6 +3546,8 @@ void CompileTask::RunIncludeProcessor(
   stats_->set_include_processor_run_time(
       DurationToIntMs(include_processor_run_time));
   stats_->include_processor_run_time = include_processor_run_time;
+  TraceRecorder::RecordSpan("IncludeProcessor", trace_id_,
+                            include_processor_run_time);
 
   auto response_param = absl::make_unique<IncludeProcessorResponseParam>();
   response_param->result = std::move(result);
@@ -3401,6 +3569,7 @@ void CompileTask::RunIncludeProcessorDone(
 
   input_file_stat_cache_ = std::move(response_param->file_stat_cache);
   input_file_stat_cache_->AcquireOwner();
+  LeavePhase();
   if (response_param->canceled) {
     UpdateRequiredFilesDone(false);
     return;
@@ -3500,6 +3669,8 @@ void CompileTask::InputFileTaskFinished(InputFileTask* input_file_task) {
   DCHECK(!hash_key.empty()) << filename;
   stats_->add_input_file_time(
       DurationToIntMs(input_file_task->timer().GetDuration()));
+  TraceRecorder::RecordSpan("InputFile", trace_id_,
+                            input_file_task->timer().GetDuration());
   stats_->add_input_file_size(file_size);
   if (!input_file_task->UpdateInputInTask(this)) {
     LOG(ERROR) << trace_id_ << " bad input data "
@@ -3949,6 +4120,7 @@ void CompileTask::OutputFileTaskFinished(
     return;
   }
   absl::Duration output_file_time = output_file_task->timer().GetDuration();
+  TraceRecorder::RecordSpan("OutputFile", trace_id_, output_file_time);
   LOG_IF(WARNING, output_file_time > absl::Minutes(1))
       << trace_id_ << " SLOW output file:"
       << " filename=" << filename
@@ -4100,6 +4272,8 @@ void CompileTask::LocalOutputFileTaskFinished(
   stats_->add_local_output_file_time(
       DurationToIntMs(local_output_file_task_duration));
   stats_->total_local_output_file_time += local_output_file_task_duration;
+  TraceRecorder::RecordSpan("LocalOutputFile", trace_id_,
+                            local_output_file_task_duration);
 
   const FileStat& file_stat = local_output_file_task->file_stat();
   stats_->add_local_output_file_size(file_stat.size);
@@ -4342,6 +4516,7 @@ void CompileTask::FinishSubProcess() {
 
     stats_->set_local_run_time(subproc->terminated().run_ms());
     stats_->local_run_time = absl::Milliseconds(subproc->terminated().run_ms());
+    TraceRecorder::RecordSpan("LocalRun", trace_id_, stats_->local_run_time);
 
     stats_->set_local_mem_kb(subproc->terminated().mem_kb());
     VLOG(1) << trace_id_ << " subproc finished"
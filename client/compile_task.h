@@ -18,6 +18,8 @@
 #include "absl/base/thread_annotations.h"
 #include "absl/container/flat_hash_set.h"
 #include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "admission_scheduler.h"
 #include "basictypes.h"
 #include "compiler_info.h"
 #include "compiler_specific.h"
@@ -49,6 +51,7 @@ class CompileService;
 class CompilerFlags;
 class CompilerProxyHistogram;
 class InputFileTask;
+class LocalOutputCacheEntryReader;
 class LocalOutputFileTask;
 class OutputFileTask;
 class RpcController;
@@ -115,6 +118,10 @@ class CompileTask {
 
   const CompileStats& stats() const { return *stats_; }
   CompileStats* mutable_stats() { return stats_.get(); }
+
+  // Key to estimate the duration of this task for AdmissionScheduler.
+  // Empty if not known yet.
+  const std::string& admission_key() const { return admission_key_; }
   // Dump a command spec fixed from |command_spec_|.
   CommandSpec DumpCommandSpec() const;
 
@@ -152,6 +159,7 @@ class CompileTask {
   FRIEND_TEST(CompileTaskTest, SetCompilerResourcesSendCompilerBinary);
   FRIEND_TEST(CompileTaskTest, ModifyRequestCWDAndPWD);
   FRIEND_TEST(CompileTaskTest, IsRelocatableCompilerFlags);
+  FRIEND_TEST(CompileTaskTest, QueuedLinkTasksDontHoldFileRequestSlots);
 
   enum ErrDest {
     // To log: write in log file, and show on status page.
@@ -210,12 +218,26 @@ class CompileTask {
   void ProcessSetup();
 
   // Processes file request. (runs InputFileTasks).
+  // Link tasks run file request one by one, and wait for the preceding link
+  // tasks before admission to kFileRequest phase.
   // state_: SETUP -> FILE_REQ
   void TryProcessFileRequest();
+  void AdmitFileRequest();
   void ProcessFileRequest();
   void ProcessFileRequestDone();
+  // Returns true if LocalOutputCache is found by pre cache key, and
+  // |resp_| is filled from the cache. Then input files need not be sent.
+  bool LookupLocalOutputCacheByPreKey();
   void ProcessPendingFileRequest();
 
+  // Leaves the current phase, and runs |closure| on the task's thread
+  // when AdmissionScheduler admits this task to |phase|.
+  void RunInPhase(AdmissionScheduler::Phase phase, OneshotClosure* closure);
+  void RunInTaskThread(OneshotClosure* closure);
+  // Releases the phase admitted by AdmissionScheduler if any.
+  void LeavePhase();
+  int64_t AdmissionPriority();
+
   // state_: FILE_REQ -> CALL_EXEC (call Exec service).
   void ProcessCallExec();
   void ProcessCallExecDone();
@@ -294,6 +316,7 @@ class CompileTask {
   void SetupRequestDone(bool ok);
 
   void StartIncludeProcessor();
+  void PostIncludeProcessor();
   void RunIncludeProcessor(
       std::unique_ptr<IncludeProcessorRequestParam> request_param);
   void RunIncludeProcessorDone(
@@ -497,10 +520,21 @@ class CompileTask {
   // DepsCache
   DepsCache::Identifier deps_identifier_;
 
+  // AdmissionScheduler
+  absl::optional<AdmissionScheduler::Phase> admitted_phase_;
+  absl::optional<int64_t> admission_priority_;
+  std::string admission_key_;
+
   // Even if lookup failed, we'd like to keep key after calculation so that
   // we can put cache later and at that time we don't need to recalculate
   // the key.
   std::string local_output_cache_key_;
+  // Key made from FileStat of required files. It is looked up before
+  // processing input files, and mapped to |local_output_cache_key_| later.
+  std::string local_output_cache_pre_key_;
+  // Set when LocalOutputCache lookup succeeded. Output files are written
+  // from this entry directly.
+  std::shared_ptr<const LocalOutputCacheEntryReader> local_output_cache_entry_;
 
   mutable Lock refcnt_mu_;
   int refcnt_ GUARDED_BY(refcnt_mu_) = 0;
@@ -6,11 +6,14 @@
 #include <memory>
 #include <set>
 #include <string>
+#include <vector>
 
 #include <json/json.h>
 
 #include "absl/memory/memory.h"
 #include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "autolock_timer.h"
 #include "callback.h"
 #include "compile_service.h"
 #include "compile_stats.h"
@@ -30,6 +33,8 @@ namespace {
 
 constexpr int kCompileTaskId = 1234;
 
+void DoNothing() {}
+
 std::unique_ptr<ExecReq> CreateExecReqForTest() {
   auto req = absl::make_unique<ExecReq>();
   req->add_arg("clang");
@@ -747,4 +752,51 @@ TEST_F(CompileTaskTest, IsRelocatableCompilerFlags) {
   EXPECT_FALSE(CompileTask::IsRelocatableCompilerFlags(*flags));
 }
 
+TEST_F(CompileTaskTest, QueuedLinkTasksDontHoldFileRequestSlots) {
+  AdmissionScheduler* scheduler = compile_service()->admission_scheduler();
+  scheduler->SetMaxInFlightTasks(AdmissionScheduler::Phase::kFileRequest, 1);
+  // Occupy the only slot, so that tasks in this test wait for admission
+  // instead of running file request.
+  OneshotClosure* noop = NewCallback(&DoNothing);
+  scheduler->Admit(AdmissionScheduler::Phase::kFileRequest, 0, noop);
+  ASSERT_EQ(1, scheduler->num_in_flight_tasks(
+                   AdmissionScheduler::Phase::kFileRequest));
+
+  auto new_task = [this](int id, std::vector<std::string> args) {
+    CompileTask* task = new CompileTask(compile_service().get(), id);
+    task->flags_ = CompilerFlagsParser::MustNew(args, "/tmp");
+    return task;
+  };
+  std::vector<CompileTask*> link_tasks;
+  for (int i = 0; i < 3; ++i) {
+    link_tasks.push_back(new_task(
+        kCompileTaskId + 1 + i,
+        {"clang", "foo.o", "-o", absl::StrCat("foo", i)}));
+    ASSERT_TRUE(link_tasks.back()->flags_->is_linking());
+    link_tasks.back()->TryProcessFileRequest();
+  }
+  CompileTask* compile =
+      new_task(kCompileTaskId + 4, {"clang", "-c", "bar.cc", "-o", "bar.o"});
+  ASSERT_FALSE(compile->flags_->is_linking());
+  compile->TryProcessFileRequest();
+
+  // Only the front link task waits for a slot with the compile task.
+  // Others wait for the preceding link tasks without taking slots.
+  EXPECT_EQ(2, scheduler->num_waiting_tasks(
+                   AdmissionScheduler::Phase::kFileRequest));
+  EXPECT_EQ(1, scheduler->num_in_flight_tasks(
+                   AdmissionScheduler::Phase::kFileRequest));
+  {
+    AUTOLOCK(lock, &CompileTask::global_mu_);
+    EXPECT_EQ(3U, CompileTask::link_file_req_tasks_->size());
+    EXPECT_EQ(link_tasks[0], CompileTask::link_file_req_tasks_->front());
+    CompileTask::link_file_req_tasks_->clear();
+  }
+
+  for (CompileTask* task : link_tasks) {
+    task->Deref();
+  }
+  compile->Deref();
+}
+
 }  // namespace devtools_goma
@@ -42,6 +42,8 @@
 #include "cxx/include_processor/include_cache.h"
 #include "cxx/include_processor/include_file_finder.h"
 #include "deps_cache.h"
+#include "descriptor_poller.h"
+#include "file_stat_cache.h"
 #include "glog/logging.h"
 #include "goma_init.h"
 #include "ioutil.h"
@@ -57,10 +59,15 @@
 #include "subprocess_controller_client.h"
 #include "subprocess_option_setter.h"
 #include "subprocess_task.h"
+#include "trace_recorder.h"
 #include "trustedipsmanager.h"
 #include "util.h"
 #include "watchdog.h"
 
+#ifdef __linux__
+#include "file_watcher_inotify.h"
+#endif
+
 #ifndef _WIN32
 using devtools_goma::Daemonize;
 #endif
@@ -160,19 +167,35 @@ void InitTrustedIps(TrustedIpsManager* trustedipsmanager) {
   }
 }
 
-void DepsCacheInit() {
+void DepsCacheInit(WorkerThreadManager* wm) {
   std::string cache_filename;
   if (!FLAGS_DEPS_CACHE_FILE.empty()) {
     cache_filename = file::JoinPathRespectAbsolute(GetCacheDirectory(),
                                                    FLAGS_DEPS_CACHE_FILE);
   }
-
-  DepsCache::Init(
-      cache_filename,
+  const absl::optional<absl::Duration> identifier_alive_duration =
       FLAGS_DEPS_CACHE_IDENTIFIER_ALIVE_DURATION >= 0 ?
           absl::optional<absl::Duration>(
               absl::Seconds(FLAGS_DEPS_CACHE_IDENTIFIER_ALIVE_DURATION)) :
-          absl::nullopt,
+          absl::nullopt;
+
+  if (FLAGS_DEPS_CACHE_JOURNAL) {
+    DepsCache::JournalOptions journal_options;
+    journal_options.wm = wm;
+    journal_options.flush_interval =
+        absl::Seconds(FLAGS_DEPS_CACHE_JOURNAL_FLUSH_INTERVAL_SEC);
+    journal_options.compaction_threshold_bytes =
+        static_cast<size_t>(FLAGS_DEPS_CACHE_JOURNAL_COMPACTION_THRESHOLD_IN_MB)
+        * 1024 * 1024;
+    DepsCache::Init(cache_filename, identifier_alive_duration,
+                    FLAGS_DEPS_CACHE_TABLE_THRESHOLD,
+                    FLAGS_DEPS_CACHE_MAX_PROTO_SIZE_IN_MB, journal_options);
+    return;
+  }
+
+  DepsCache::Init(
+      cache_filename,
+      identifier_alive_duration,
       FLAGS_DEPS_CACHE_TABLE_THRESHOLD,
       FLAGS_DEPS_CACHE_MAX_PROTO_SIZE_IN_MB);
 }
@@ -196,7 +219,23 @@ int main(int argc, char* argv[], const char* envp[]) {
   }
 #endif
 
-  if (FLAGS_ENABLE_GLOBAL_FILE_STAT_CACHE) {
+  if (FLAGS_COMPILER_PROXY_TRACE_BUFFER_SIZE > 0) {
+    devtools_goma::TraceRecorder::Init(FLAGS_COMPILER_PROXY_TRACE_BUFFER_SIZE);
+  }
+
+  if (FLAGS_ENABLE_FILE_WATCHER) {
+#ifdef __linux__
+    std::unique_ptr<devtools_goma::FileWatcher> file_watcher =
+        devtools_goma::MaybeNewInotifyFileWatcher();
+    if (file_watcher) {
+      devtools_goma::GlobalFileStatCache::Init(std::move(file_watcher));
+    }
+#else
+    LOG(WARNING) << "file watcher is not supported on this platform";
+#endif
+  }
+  if (FLAGS_ENABLE_GLOBAL_FILE_STAT_CACHE &&
+      devtools_goma::GlobalFileStatCache::Instance() == nullptr) {
     devtools_goma::GlobalFileStatCache::Init();
   }
 
@@ -309,7 +348,12 @@ int main(int argc, char* argv[], const char* envp[]) {
   LOG(INFO) << "max_num_sockets=" << max_num_sockets
             << " max_nfile=" << max_nfile;
 
+  devtools_goma::DescriptorPoller::EnableIoUring(
+      FLAGS_COMPILER_PROXY_USE_IO_URING);
   devtools_goma::WorkerThreadManager wm;
+  if (FLAGS_COMPILER_PROXY_WORK_STEALING) {
+    wm.EnableWorkStealing();
+  }
   wm.Start(FLAGS_COMPILER_PROXY_THREADS);
 
   devtools_goma::SubProcessControllerClient::Initialize(&wm, tmpdir);
@@ -319,15 +363,24 @@ int main(int argc, char* argv[], const char* envp[]) {
 
   devtools_goma::IncludeFileFinder::Init(FLAGS_ENABLE_GCH_HACK);
 
-  devtools_goma::IncludeCache::Init(FLAGS_MAX_INCLUDE_CACHE_ENTRIES,
-                                    !FLAGS_DEPS_CACHE_FILE.empty());
+  std::string preparsed_directive_cache_dir;
+  if (!FLAGS_PREPARSED_DIRECTIVE_CACHE_DIR.empty()) {
+    preparsed_directive_cache_dir = file::JoinPathRespectAbsolute(
+        devtools_goma::GetCacheDirectory(),
+        FLAGS_PREPARSED_DIRECTIVE_CACHE_DIR);
+  }
+  devtools_goma::IncludeCache::Init(FLAGS_MAX_INCLUDE_CACHE_SIZE_IN_MB,
+                                    !FLAGS_DEPS_CACHE_FILE.empty(),
+                                    preparsed_directive_cache_dir,
+                                    FLAGS_PREPARSED_DIRECTIVE_CACHE_MAX_IN_MB,
+                                    &wm);
   devtools_goma::modulemap::Cache::Init(FLAGS_MAX_MODULEMAP_CACHE_ENTRIES);
   devtools_goma::ListDirCache::Init(FLAGS_MAX_LIST_DIR_CACHE_ENTRY_NUM);
 
   std::unique_ptr<devtools_goma::WorkerThreadRunner> init_deps_cache(
       new devtools_goma::WorkerThreadRunner(
           &wm, FROM_HERE,
-          devtools_goma::NewCallback(devtools_goma::DepsCacheInit)));
+          devtools_goma::NewCallback(devtools_goma::DepsCacheInit, &wm)));
   std::unique_ptr<devtools_goma::WorkerThreadRunner> init_compiler_info_cache(
       new devtools_goma::WorkerThreadRunner(
           &wm, FROM_HERE,
@@ -371,15 +424,36 @@ int main(int argc, char* argv[], const char* envp[]) {
                          &server, FLAGS_WATCHDOG_TIMER);
   }
 
+  devtools_goma::LocalOutputCacheCommitMode local_output_cache_commit_mode;
+  if (!devtools_goma::ParseLocalOutputCacheCommitMode(
+          FLAGS_LOCAL_OUTPUT_CACHE_COMMIT_MODE,
+          &local_output_cache_commit_mode)) {
+    LOG(ERROR) << "unknown GOMA_LOCAL_OUTPUT_CACHE_COMMIT_MODE="
+               << FLAGS_LOCAL_OUTPUT_CACHE_COMMIT_MODE << ". use copy.";
+    local_output_cache_commit_mode =
+        devtools_goma::LocalOutputCacheCommitMode::kCopy;
+  }
   devtools_goma::LocalOutputCache::Init(
       FLAGS_LOCAL_OUTPUT_CACHE_DIR,
       &wm,
       FLAGS_LOCAL_OUTPUT_CACHE_MAX_CACHE_AMOUNT_IN_MB,
       FLAGS_LOCAL_OUTPUT_CACHE_THRESHOLD_CACHE_AMOUNT_IN_MB,
       FLAGS_LOCAL_OUTPUT_CACHE_MAX_ITEMS,
-      FLAGS_LOCAL_OUTPUT_CACHE_THRESHOLD_ITEMS);
+      FLAGS_LOCAL_OUTPUT_CACHE_THRESHOLD_ITEMS,
+      local_output_cache_commit_mode);
 
   init_deps_cache.reset();
+  if (devtools_goma::DepsCache::IsEnabled() &&
+      FLAGS_DEPS_CACHE_VALIDATION_THREADS > 0) {
+    // WorkerThreadManager::StartPool can't be called on a worker thread,
+    // so the pool is started here instead of DepsCacheInit.
+    devtools_goma::DepsCache::instance()->EnableParallelValidation(
+        &wm,
+        wm.StartPool(FLAGS_DEPS_CACHE_VALIDATION_THREADS,
+                     "deps_cache_validation"),
+        FLAGS_DEPS_CACHE_VALIDATION_THREADS,
+        FLAGS_DEPS_CACHE_PARALLEL_VALIDATION_MIN_DEPS);
+  }
   init_compiler_info_cache.reset();
   // Show memory just before server loop to understand how much memory is
   // used for initialization.
@@ -419,7 +493,7 @@ int main(int argc, char* argv[], const char* envp[]) {
   handler.reset();
   wm.Finish();
 
-  if (FLAGS_ENABLE_GLOBAL_FILE_STAT_CACHE) {
+  if (devtools_goma::GlobalFileStatCache::Instance() != nullptr) {
     devtools_goma::GlobalFileStatCache::Quit();
   }
 
@@ -429,5 +503,9 @@ int main(int argc, char* argv[], const char* envp[]) {
   }
 #endif
 
+  if (devtools_goma::TraceRecorder::Instance() != nullptr) {
+    devtools_goma::TraceRecorder::Quit();
+  }
+
   return 0;
 }
@@ -6,12 +6,12 @@
 #ifndef DEVTOOLS_GOMA_CLIENT_COMPILER_PROXY_HISTOGRAM_H_
 #define DEVTOOLS_GOMA_CLIENT_COMPILER_PROXY_HISTOGRAM_H_
 
+#include <memory>
 #include <sstream>
 #include <vector>
 
 #include "basictypes.h"
-#include "histogram.h"
-#include "lockhelper.h"
+#include "sharded_histogram.h"
 #include "threadpool_http_server.h"
 
 namespace devtools_goma {
@@ -19,6 +19,8 @@ namespace devtools_goma {
 class CompileStats;
 class GomaHistograms;
 
+// CompilerProxyHistogram is thread-safe.  Update*Stat() can be called
+// concurrently from worker threads without a lock.
 class CompilerProxyHistogram {
  public:
   enum HistogramItems {
@@ -101,8 +103,7 @@ class CompilerProxyHistogram {
   void Reset();
 
  private:
-  mutable Lock mu_;
-  std::vector<Histogram> histogram_;
+  std::vector<std::unique_ptr<ShardedHistogram>> histogram_;
 
   DISALLOW_COPY_AND_ASSIGN(CompilerProxyHistogram);
 };
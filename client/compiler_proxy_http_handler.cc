@@ -12,6 +12,7 @@
 #include "absl/strings/str_split.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "admission_scheduler.h"
 #include "chart.bundle.min.h"
 #include "compiler_proxy_contentionz_script.h"
 #include "compiler_proxy_histogram.h"
@@ -50,6 +51,7 @@
 #include "rand_util.h"
 #include "rpc_controller.h"
 #include "subprocess_controller_client.h"
+#include "trace_recorder.h"
 #include "util.h"
 
 #if HAVE_HEAP_PROFILER
@@ -250,8 +252,10 @@ CompilerProxyHttpHandler::CompilerProxyHttpHandler(std::string myname,
       absl::Milliseconds(FLAGS_MULTI_STORE_PENDING_MS);
   service_.SetMultiFileStore(absl::make_unique<MultiFileStore>(
       service_.http_rpc(), "/s", multi_store_options, wm));
-  service_.SetFileServiceHttpClient(absl::make_unique<FileServiceHttpClient>(
-      service_.http_rpc(), "/s", "/l", service_.multi_file_store()));
+  service_.SetFileServiceHttpClient(
+      absl::make_unique<FileServiceHttpClient>(
+          service_.http_rpc(), "/s", "/l", service_.multi_file_store()),
+      FLAGS_SKIP_KNOWN_CHUNKS);
   if (FLAGS_PROVIDE_INFO)
     service_.SetLogServiceClient(absl::make_unique<LogServiceClient>(
         service_.http_rpc(), "/sl", FLAGS_NUM_LOG_IN_SAVE_LOG,
@@ -259,6 +263,17 @@ CompilerProxyHttpHandler::CompilerProxyHttpHandler(std::string myname,
   ArFileReader::Register();
   JarFileReader::Register();
   service_.StartIncludeProcessorWorkers(FLAGS_INCLUDE_PROCESSOR_THREADS);
+  service_.admission_scheduler()->SetMaxInFlightTasks(
+      AdmissionScheduler::Phase::kIncludeProcessor,
+      FLAGS_MAX_ACTIVE_INCLUDE_PROCESSOR_TASKS);
+  service_.admission_scheduler()->SetMaxInFlightTasks(
+      AdmissionScheduler::Phase::kFileRequest,
+      FLAGS_MAX_ACTIVE_FILE_REQUEST_TASKS);
+  service_.admission_scheduler()->SetMaxInFlightTasks(
+      AdmissionScheduler::Phase::kCallExec, FLAGS_MAX_ACTIVE_CALL_EXEC_TASKS);
+  service_.admission_scheduler()->SetMaxInFlightTasks(
+      AdmissionScheduler::Phase::kFileResponse,
+      FLAGS_MAX_ACTIVE_FILE_RESPONSE_TASKS);
   service_.SetNeedToSendContent(FLAGS_COMPILER_PROXY_STORE_FILE);
   service_.SetNewFileThresholdDuration(
       absl::Seconds(FLAGS_COMPILER_PROXY_NEW_FILE_THRESHOLD));
@@ -292,6 +307,15 @@ CompilerProxyHttpHandler::CompilerProxyHttpHandler(std::string myname,
   service_.SetShouldFailForUnsupportedCompilerFlag(
       FLAGS_FAIL_FOR_UNSUPPORTED_COMPILER_FLAGS);
   service_.SetTmpDir(tmpdir_);
+  if (!FLAGS_FILE_HASH_CACHE_FILE.empty()) {
+    service_.SetFileHashCacheFile(
+        file::JoinPathRespectAbsolute(GetCacheDirectory(),
+                                      FLAGS_FILE_HASH_CACHE_FILE),
+        FLAGS_FILE_HASH_CACHE_ALIVE_DURATION >= 0
+            ? absl::optional<absl::Duration>(
+                  absl::Seconds(FLAGS_FILE_HASH_CACHE_ALIVE_DURATION))
+            : absl::nullopt);
+  }
   if (FLAGS_ALLOWED_NETWORK_ERROR_DURATION >= 0) {
     service_.SetAllowedNetworkErrorDuration(
         absl::Seconds(FLAGS_ALLOWED_NETWORK_ERROR_DURATION));
@@ -415,6 +439,8 @@ CompilerProxyHttpHandler::CompilerProxyHttpHandler(std::string myname,
       std::make_pair("/logz", &CompilerProxyHttpHandler::HandleLogRequest));
   http_handlers_.insert(std::make_pair(
       "/errorz", &CompilerProxyHttpHandler::HandleErrorStatusRequest));
+  http_handlers_.insert(
+      std::make_pair("/tracez", &CompilerProxyHttpHandler::HandleTraceRequest));
 #if HAVE_COUNTERZ
   http_handlers_.insert(std::make_pair(
       "/counterz", &CompilerProxyHttpHandler::HandleCounterRequest));
@@ -1289,6 +1315,36 @@ int CompilerProxyHttpHandler::HandleErrorStatusRequest(const HttpServerRequest&,
   return 200;
 }
 
+int CompilerProxyHttpHandler::HandleTraceRequest(
+    const HttpServerRequest& request,
+    std::string* response) {
+  TraceRecorder* recorder = TraceRecorder::Instance();
+  if (recorder == nullptr) {
+    std::ostringstream ss;
+    OutputOkHeader("text/plain", &ss);
+    ss << "tracing is disabled. "
+       << "Set GOMA_COMPILER_PROXY_TRACE_BUFFER_SIZE to enable it."
+       << std::endl;
+    *response = ss.str();
+    return 200;
+  }
+
+  // Open the response in chrome://tracing or https://ui.perfetto.dev/
+  Json::Value json;
+  recorder->DumpToJson(&json);
+  const std::string& query = request.query();
+  if (strstr(query.c_str(), "clear") != nullptr) {
+    recorder->Clear();
+  }
+
+  std::ostringstream ss;
+  OutputOkHeader("application/json", &ss);
+  Json::FastWriter writer;
+  ss << writer.write(json);
+  *response = ss.str();
+  return 200;
+}
+
 #ifdef HAVE_COUNTERZ
 int CompilerProxyHttpHandler::HandleCounterRequest(const HttpServerRequest&,
                                                    std::string* response) {
@@ -162,6 +162,9 @@ class CompilerProxyHttpHandler : public ThreadpoolHttpServer::HttpHandler,
 
   int HandleErrorStatusRequest(const HttpServerRequest&, std::string* response);
 
+  int HandleTraceRequest(const HttpServerRequest& request,
+                         std::string* response);
+
 #ifdef HAVE_COUNTERZ
   int HandleCounterRequest(const HttpServerRequest&, std::string* response);
 #endif
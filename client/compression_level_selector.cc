@@ -0,0 +1,122 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "compression_level_selector.h"
+
+#include <algorithm>
+
+#include "autolock_timer.h"
+#include "glog/logging.h"
+#include "prototmp/goma_stats.pb.h"
+
+namespace devtools_goma {
+
+namespace {
+
+struct DefaultEstimate {
+  int level;
+  double ratio;
+  double speed;
+};
+
+// Rough ratio and speed for ExecReq, used until actual results are recorded.
+// Levels not listed here are not used except |max_level|.
+const DefaultEstimate kDefaultEstimates[] = {
+    {1, 0.35, 100e6},
+    {3, 0.30, 60e6},
+    {6, 0.27, 25e6},
+    {9, 0.26, 10e6},
+    {19, 0.22, 2e6},
+};
+
+// Requests smaller than this are not compressed.
+const size_t kMinCompressSize = 256;
+
+// Compression results of smaller requests are not recorded, since
+// the duration is dominated by fixed overhead.
+const size_t kMinRecordSize = 4096;
+
+// Weight of a new result in the estimate.
+const double kRecordWeight = 0.2;
+
+}  // anonymous namespace
+
+CompressionLevelSelector::CompressionLevelSelector(int max_level)
+    : max_level_(max_level) {
+  CHECK_GT(max_level_, 0);
+  for (const auto& e : kDefaultEstimates) {
+    if (e.level > max_level_) {
+      break;
+    }
+    estimates_.push_back(LevelEstimate{e.level, e.ratio, e.speed});
+  }
+  if (estimates_.empty() || estimates_.back().level != max_level_) {
+    // Use the estimate of the nearest lower level.
+    LevelEstimate e{max_level_, kDefaultEstimates[0].ratio,
+                    kDefaultEstimates[0].speed};
+    if (!estimates_.empty()) {
+      e.ratio = estimates_.back().ratio;
+      e.speed = estimates_.back().speed;
+    }
+    estimates_.push_back(e);
+  }
+}
+
+int CompressionLevelSelector::SelectLevel(size_t raw_size,
+                                          absl::optional<double> bandwidth,
+                                          double cpu_load) {
+  AUTOLOCK(lock, &mu_);
+  int level = max_level_;
+  if (raw_size < kMinCompressSize) {
+    level = 0;
+  } else if (bandwidth.has_value() && *bandwidth > 0) {
+    // Compression competes with other processes for CPU if overloaded.
+    const double cpu_factor = std::max(1.0, cpu_load);
+    level = 0;
+    double best_time = raw_size / *bandwidth;
+    for (const auto& e : estimates_) {
+      const double time = raw_size / e.speed * cpu_factor +
+                          raw_size * e.ratio / *bandwidth;
+      if (time < best_time) {
+        level = e.level;
+        best_time = time;
+      }
+    }
+  }
+  ++num_selected_[level];
+  return level;
+}
+
+void CompressionLevelSelector::RecordCompression(int level,
+                                                 size_t raw_size,
+                                                 size_t compressed_size,
+                                                 absl::Duration duration) {
+  if (raw_size < kMinRecordSize || duration <= absl::ZeroDuration()) {
+    return;
+  }
+  const double ratio = static_cast<double>(compressed_size) / raw_size;
+  const double speed = raw_size / absl::ToDoubleSeconds(duration);
+  AUTOLOCK(lock, &mu_);
+  for (auto& e : estimates_) {
+    if (e.level != level) {
+      continue;
+    }
+    e.ratio = e.ratio * (1 - kRecordWeight) + ratio * kRecordWeight;
+    e.speed = e.speed * (1 - kRecordWeight) + speed * kRecordWeight;
+    VLOG(2) << "compression level=" << level << " ratio=" << e.ratio
+            << " speed=" << e.speed;
+    return;
+  }
+}
+
+void CompressionLevelSelector::DumpStatsToProto(HttpRPCStats* stats) const {
+  AUTOLOCK(lock, &mu_);
+  for (const auto& it : num_selected_) {
+    HttpRPCStats_CompressionLevel* level = stats->add_compression_level();
+    level->set_level(it.first);
+    level->set_count(it.second);
+  }
+}
+
+}  // namespace devtools_goma
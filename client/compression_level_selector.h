@@ -0,0 +1,81 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DEVTOOLS_GOMA_CLIENT_COMPRESSION_LEVEL_SELECTOR_H_
+#define DEVTOOLS_GOMA_CLIENT_COMPRESSION_LEVEL_SELECTOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <vector>
+
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "lockhelper.h"
+
+namespace devtools_goma {
+
+class HttpRPCStats;
+
+// CompressionLevelSelector picks compression level for each request to
+// minimize estimated time to compress and send the request.
+//
+// Sending |raw_size| bytes without compression is estimated to take
+// raw_size / bandwidth, and with compression level L,
+//   raw_size / speed(L) * cpu_load + raw_size * ratio(L) / bandwidth
+// where speed(L) and ratio(L) start from rough defaults and are updated
+// by actual compression results.
+// So compression is turned off on a fast network, and higher level is
+// used on a slow network.
+//
+// Thread-safe.
+class CompressionLevelSelector {
+ public:
+  // |max_level| is the highest level to use, and must be positive.
+  explicit CompressionLevelSelector(int max_level);
+
+  CompressionLevelSelector(const CompressionLevelSelector&) = delete;
+  CompressionLevelSelector& operator=(const CompressionLevelSelector&) =
+      delete;
+
+  // Returns compression level for a request of |raw_size| bytes.
+  // 0 means the request should not be compressed.
+  // |bandwidth| is network bandwidth in bytes per second.  If it is not
+  // known, |max_level| is returned.
+  // |cpu_load| is load average divided by the number of CPUs.
+  int SelectLevel(size_t raw_size,
+                  absl::optional<double> bandwidth,
+                  double cpu_load) LOCKS_EXCLUDED(mu_);
+
+  // Records result of compression with |level|, to update its estimate.
+  void RecordCompression(int level,
+                         size_t raw_size,
+                         size_t compressed_size,
+                         absl::Duration duration) LOCKS_EXCLUDED(mu_);
+
+  // Dumps distribution of selected levels.
+  void DumpStatsToProto(HttpRPCStats* stats) const LOCKS_EXCLUDED(mu_);
+
+  int max_level() const { return max_level_; }
+
+ private:
+  struct LevelEstimate {
+    int level;
+    // Compressed size / raw size.
+    double ratio;
+    // Raw bytes compressed per second.
+    double speed;
+  };
+
+  const int max_level_;
+
+  mutable Lock mu_;
+  std::vector<LevelEstimate> estimates_ GUARDED_BY(mu_);
+  std::map<int, int64_t> num_selected_ GUARDED_BY(mu_);
+};
+
+}  // namespace devtools_goma
+
+#endif  // DEVTOOLS_GOMA_CLIENT_COMPRESSION_LEVEL_SELECTOR_H_
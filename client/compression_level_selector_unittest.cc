@@ -0,0 +1,102 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "compression_level_selector.h"
+
+#include <map>
+
+#include "absl/time/time.h"
+#include "gtest/gtest.h"
+#include "prototmp/goma_stats.pb.h"
+
+namespace devtools_goma {
+
+namespace {
+
+const double kMegaBytesPerSec = 1e6;
+
+std::map<int, int64_t> LevelCounts(const CompressionLevelSelector& selector) {
+  HttpRPCStats stats;
+  selector.DumpStatsToProto(&stats);
+  std::map<int, int64_t> counts;
+  for (const auto& level : stats.compression_level()) {
+    counts[level.level()] = level.count();
+  }
+  return counts;
+}
+
+}  // anonymous namespace
+
+TEST(CompressionLevelSelectorTest, UnknownBandwidth) {
+  CompressionLevelSelector selector(6);
+  EXPECT_EQ(6, selector.SelectLevel(1024 * 1024, absl::nullopt, 0.0));
+}
+
+TEST(CompressionLevelSelectorTest, SmallRequest) {
+  CompressionLevelSelector selector(6);
+  EXPECT_EQ(0, selector.SelectLevel(10, 1 * kMegaBytesPerSec, 0.0));
+}
+
+TEST(CompressionLevelSelectorTest, FastNetwork) {
+  CompressionLevelSelector selector(9);
+  // 10GbE.
+  EXPECT_EQ(0, selector.SelectLevel(1024 * 1024, 1250 * kMegaBytesPerSec,
+                                    0.0));
+}
+
+TEST(CompressionLevelSelectorTest, SlowNetwork) {
+  CompressionLevelSelector selector(9);
+  // Slow VPN.
+  EXPECT_EQ(9, selector.SelectLevel(1024 * 1024, 0.1 * kMegaBytesPerSec,
+                                    0.0));
+  // Moderate network.
+  const int level =
+      selector.SelectLevel(1024 * 1024, 20 * kMegaBytesPerSec, 0.0);
+  EXPECT_GT(level, 0);
+  EXPECT_LT(level, 9);
+}
+
+TEST(CompressionLevelSelectorTest, CPULoad) {
+  CompressionLevelSelector selector(9);
+  const int idle_level =
+      selector.SelectLevel(1024 * 1024, 5 * kMegaBytesPerSec, 0.0);
+  const int busy_level =
+      selector.SelectLevel(1024 * 1024, 5 * kMegaBytesPerSec, 8.0);
+  EXPECT_GT(idle_level, 0);
+  EXPECT_LT(busy_level, idle_level);
+}
+
+TEST(CompressionLevelSelectorTest, MaxLevel) {
+  CompressionLevelSelector selector(2);
+  EXPECT_EQ(2, selector.max_level());
+  for (double bandwidth : {0.1, 1.0, 10.0, 100.0, 1000.0}) {
+    EXPECT_LE(selector.SelectLevel(1024 * 1024, bandwidth * kMegaBytesPerSec,
+                                   0.0),
+              2)
+        << bandwidth;
+  }
+}
+
+TEST(CompressionLevelSelectorTest, RecordCompression) {
+  CompressionLevelSelector selector(1);
+  const size_t kSize = 1024 * 1024;
+  EXPECT_EQ(1, selector.SelectLevel(kSize, 10 * kMegaBytesPerSec, 0.0));
+  // Data doesn't shrink at all, so it should stop compressing.
+  for (int i = 0; i < 100; ++i) {
+    selector.RecordCompression(1, kSize, kSize, absl::Milliseconds(10));
+  }
+  EXPECT_EQ(0, selector.SelectLevel(kSize, 10 * kMegaBytesPerSec, 0.0));
+}
+
+TEST(CompressionLevelSelectorTest, DumpStatsToProto) {
+  CompressionLevelSelector selector(6);
+  selector.SelectLevel(10, 1 * kMegaBytesPerSec, 0.0);
+  selector.SelectLevel(1024 * 1024, absl::nullopt, 0.0);
+  selector.SelectLevel(1024 * 1024, absl::nullopt, 0.0);
+
+  std::map<int, int64_t> expected{{0, 1}, {6, 2}};
+  EXPECT_EQ(expected, LevelCounts(selector));
+}
+
+}  // namespace devtools_goma
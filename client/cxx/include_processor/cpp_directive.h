@@ -68,8 +68,9 @@ class CppDirective {
 
  private:
   friend class CppDirectiveParser;
+  friend class CppDirectiveSerializer;
 
-  // CppDirectiveParser can set position.
+  // CppDirectiveParser and CppDirectiveSerializer can set position.
   void set_position(int pos) { position_ = pos; }
 
   const CppDirectiveType directive_type_;
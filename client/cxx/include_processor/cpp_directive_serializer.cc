@@ -0,0 +1,387 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "cpp_directive_serializer.h"
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+
+namespace devtools_goma {
+
+constexpr int CppDirectiveSerializer::kFormatVersion;
+
+namespace {
+
+void AppendVarint(std::uint64_t v, std::string* out) {
+  while (v >= 0x80) {
+    out->push_back(static_cast<char>((v & 0x7f) | 0x80));
+    v >>= 7;
+  }
+  out->push_back(static_cast<char>(v));
+}
+
+// position is -1 for directives made by CppDirectiveOptimizer, so it is
+// zigzag encoded.
+void AppendSignedVarint(std::int64_t v, std::string* out) {
+  AppendVarint((static_cast<std::uint64_t>(v) << 1) ^
+                   static_cast<std::uint64_t>(v >> 63),
+               out);
+}
+
+void AppendString(absl::string_view s, std::string* out) {
+  AppendVarint(s.size(), out);
+  out->append(s.data(), s.size());
+}
+
+void AppendTokens(const std::vector<CppToken>& tokens, std::string* out) {
+  AppendVarint(tokens.size(), out);
+  for (const auto& token : tokens) {
+    AppendVarint(token.type, out);
+    AppendString(token.string_value, out);
+    // |v| is a union, whose largest member is param_index. Copying it
+    // keeps int_value and char_value as well.
+    AppendVarint(token.v.param_index, out);
+  }
+}
+
+// Reader consumes serialized data from the front.
+// Each method returns false when data is too short or malformed.
+class Reader {
+ public:
+  explicit Reader(absl::string_view data) : data_(data) {}
+
+  bool empty() const { return data_.empty(); }
+
+  bool ReadVarint(std::uint64_t* v) {
+    std::uint64_t r = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (data_.empty()) {
+        return false;
+      }
+      const unsigned char c = data_[0];
+      data_.remove_prefix(1);
+      r |= static_cast<std::uint64_t>(c & 0x7f) << shift;
+      if ((c & 0x80) == 0) {
+        *v = r;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool ReadSignedVarint(std::int64_t* v) {
+    std::uint64_t u;
+    if (!ReadVarint(&u)) {
+      return false;
+    }
+    *v = static_cast<std::int64_t>(u >> 1) ^ -static_cast<std::int64_t>(u & 1);
+    return true;
+  }
+
+  bool ReadInt(int* v) {
+    std::uint64_t u;
+    if (!ReadVarint(&u) || u > static_cast<std::uint64_t>(INT32_MAX)) {
+      return false;
+    }
+    *v = static_cast<int>(u);
+    return true;
+  }
+
+  bool ReadByte(char* c) {
+    if (data_.empty()) {
+      return false;
+    }
+    *c = data_[0];
+    data_.remove_prefix(1);
+    return true;
+  }
+
+  bool ReadString(std::string* s) {
+    std::uint64_t size;
+    if (!ReadVarint(&size) || size > data_.size()) {
+      return false;
+    }
+    s->assign(data_.data(), size);
+    data_.remove_prefix(size);
+    return true;
+  }
+
+  // Reads the number of following elements. Since each element takes at
+  // least 1 byte, a larger number than the remaining bytes is invalid.
+  bool ReadCount(size_t* n) {
+    std::uint64_t u;
+    if (!ReadVarint(&u) || u > data_.size()) {
+      return false;
+    }
+    *n = static_cast<size_t>(u);
+    return true;
+  }
+
+  bool ReadTokens(std::vector<CppToken>* tokens) {
+    size_t n;
+    if (!ReadCount(&n)) {
+      return false;
+    }
+    tokens->reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+      std::uint64_t type;
+      if (!ReadVarint(&type) || type > CppToken::LOR) {
+        return false;
+      }
+      CppToken token(static_cast<CppToken::Type>(type));
+      std::uint64_t value;
+      if (!ReadString(&token.string_value) || !ReadVarint(&value)) {
+        return false;
+      }
+      token.v.param_index = static_cast<size_t>(value);
+      tokens->push_back(std::move(token));
+    }
+    return true;
+  }
+
+ private:
+  absl::string_view data_;
+};
+
+std::unique_ptr<CppDirective> ReadIncludeBase(CppDirectiveType type,
+                                              Reader* reader) {
+  char delimiter;
+  if (!reader->ReadByte(&delimiter)) {
+    return nullptr;
+  }
+  if (delimiter == ' ') {
+    std::vector<CppToken> tokens;
+    if (!reader->ReadTokens(&tokens)) {
+      return nullptr;
+    }
+    switch (type) {
+      case CppDirectiveType::DIRECTIVE_INCLUDE:
+        return std::unique_ptr<CppDirective>(
+            new CppDirectiveInclude(std::move(tokens)));
+      case CppDirectiveType::DIRECTIVE_IMPORT:
+        return std::unique_ptr<CppDirective>(
+            new CppDirectiveImport(std::move(tokens)));
+      default:
+        return std::unique_ptr<CppDirective>(
+            new CppDirectiveIncludeNext(std::move(tokens)));
+    }
+  }
+  if (delimiter != '<' && delimiter != '"') {
+    return nullptr;
+  }
+  std::string filename;
+  if (!reader->ReadString(&filename)) {
+    return nullptr;
+  }
+  switch (type) {
+    case CppDirectiveType::DIRECTIVE_INCLUDE:
+      return std::unique_ptr<CppDirective>(
+          new CppDirectiveInclude(delimiter, std::move(filename)));
+    case CppDirectiveType::DIRECTIVE_IMPORT:
+      return std::unique_ptr<CppDirective>(
+          new CppDirectiveImport(delimiter, std::move(filename)));
+    default:
+      return std::unique_ptr<CppDirective>(
+          new CppDirectiveIncludeNext(delimiter, std::move(filename)));
+  }
+}
+
+std::unique_ptr<CppDirective> ReadDefine(Reader* reader) {
+  std::string name;
+  char is_function_macro;
+  if (!reader->ReadString(&name) || !reader->ReadByte(&is_function_macro)) {
+    return nullptr;
+  }
+  if (!is_function_macro) {
+    std::vector<CppToken> replacement;
+    if (!reader->ReadTokens(&replacement)) {
+      return nullptr;
+    }
+    return std::unique_ptr<CppDirective>(
+        new CppDirectiveDefine(std::move(name), std::move(replacement)));
+  }
+  int num_args;
+  char has_vararg;
+  std::vector<CppToken> replacement;
+  if (!reader->ReadInt(&num_args) || !reader->ReadByte(&has_vararg) ||
+      !reader->ReadTokens(&replacement)) {
+    return nullptr;
+  }
+  return std::unique_ptr<CppDirective>(
+      new CppDirectiveDefine(std::move(name), num_args, has_vararg != 0,
+                             std::move(replacement)));
+}
+
+std::unique_ptr<CppDirective> ReadDirective(CppDirectiveType type,
+                                            Reader* reader) {
+  switch (type) {
+    case CppDirectiveType::DIRECTIVE_INCLUDE:
+    case CppDirectiveType::DIRECTIVE_IMPORT:
+    case CppDirectiveType::DIRECTIVE_INCLUDE_NEXT:
+      return ReadIncludeBase(type, reader);
+    case CppDirectiveType::DIRECTIVE_DEFINE:
+      return ReadDefine(reader);
+    case CppDirectiveType::DIRECTIVE_UNDEF:
+    case CppDirectiveType::DIRECTIVE_IFDEF:
+    case CppDirectiveType::DIRECTIVE_IFNDEF: {
+      std::string name;
+      if (!reader->ReadString(&name)) {
+        return nullptr;
+      }
+      if (type == CppDirectiveType::DIRECTIVE_UNDEF) {
+        return std::unique_ptr<CppDirective>(
+            new CppDirectiveUndef(std::move(name)));
+      }
+      if (type == CppDirectiveType::DIRECTIVE_IFDEF) {
+        return std::unique_ptr<CppDirective>(
+            new CppDirectiveIfdef(std::move(name)));
+      }
+      return std::unique_ptr<CppDirective>(
+          new CppDirectiveIfndef(std::move(name)));
+    }
+    case CppDirectiveType::DIRECTIVE_IF:
+    case CppDirectiveType::DIRECTIVE_ELIF: {
+      std::vector<CppToken> tokens;
+      if (!reader->ReadTokens(&tokens)) {
+        return nullptr;
+      }
+      if (type == CppDirectiveType::DIRECTIVE_IF) {
+        return std::unique_ptr<CppDirective>(
+            new CppDirectiveIf(std::move(tokens)));
+      }
+      return std::unique_ptr<CppDirective>(
+          new CppDirectiveElif(std::move(tokens)));
+    }
+    case CppDirectiveType::DIRECTIVE_ELSE:
+      return std::unique_ptr<CppDirective>(new CppDirectiveElse());
+    case CppDirectiveType::DIRECTIVE_ENDIF:
+      return std::unique_ptr<CppDirective>(new CppDirectiveEndif());
+    case CppDirectiveType::DIRECTIVE_PRAGMA: {
+      char is_pragma_once;
+      if (!reader->ReadByte(&is_pragma_once)) {
+        return nullptr;
+      }
+      return std::unique_ptr<CppDirective>(
+          new CppDirectivePragma(is_pragma_once != 0));
+    }
+    case CppDirectiveType::DIRECTIVE_ERROR: {
+      std::string error_reason;
+      std::string arg;
+      if (!reader->ReadString(&error_reason) || !reader->ReadString(&arg)) {
+        return nullptr;
+      }
+      return CppDirective::Error(std::move(error_reason), std::move(arg));
+    }
+  }
+  return nullptr;
+}
+
+}  // anonymous namespace
+
+// static
+void CppDirectiveSerializer::Serialize(const CppDirectiveList& directives,
+                                       std::string* out) {
+  AppendVarint(directives.size(), out);
+  for (const auto& directive : directives) {
+    AppendVarint(static_cast<int>(directive->type()), out);
+    AppendSignedVarint(directive->position(), out);
+
+    switch (directive->type()) {
+      case CppDirectiveType::DIRECTIVE_INCLUDE:
+      case CppDirectiveType::DIRECTIVE_IMPORT:
+      case CppDirectiveType::DIRECTIVE_INCLUDE_NEXT: {
+        const CppDirectiveIncludeBase& d =
+            AsCppDirectiveIncludeBase(*directive);
+        out->push_back(d.delimiter());
+        if (d.delimiter() == ' ') {
+          AppendTokens(d.tokens(), out);
+        } else {
+          AppendString(d.filename(), out);
+        }
+        break;
+      }
+      case CppDirectiveType::DIRECTIVE_DEFINE: {
+        const CppDirectiveDefine& d = AsCppDirectiveDefine(*directive);
+        AppendString(d.name(), out);
+        out->push_back(d.is_function_macro() ? 1 : 0);
+        if (d.is_function_macro()) {
+          AppendVarint(d.num_args(), out);
+          out->push_back(d.has_vararg() ? 1 : 0);
+        }
+        AppendTokens(d.replacement(), out);
+        break;
+      }
+      case CppDirectiveType::DIRECTIVE_UNDEF:
+        AppendString(AsCppDirectiveUndef(*directive).name(), out);
+        break;
+      case CppDirectiveType::DIRECTIVE_IFDEF:
+        AppendString(AsCppDirectiveIfdef(*directive).name(), out);
+        break;
+      case CppDirectiveType::DIRECTIVE_IFNDEF:
+        AppendString(AsCppDirectiveIfndef(*directive).name(), out);
+        break;
+      case CppDirectiveType::DIRECTIVE_IF:
+        AppendTokens(AsCppDirectiveIf(*directive).tokens(), out);
+        break;
+      case CppDirectiveType::DIRECTIVE_ELIF:
+        AppendTokens(AsCppDirectiveElif(*directive).tokens(), out);
+        break;
+      case CppDirectiveType::DIRECTIVE_ELSE:
+      case CppDirectiveType::DIRECTIVE_ENDIF:
+        break;
+      case CppDirectiveType::DIRECTIVE_PRAGMA:
+        out->push_back(AsCppDirectivePragma(*directive).is_pragma_once() ? 1
+                                                                         : 0);
+        break;
+      case CppDirectiveType::DIRECTIVE_ERROR: {
+        const CppDirectiveError& d = AsCppDirectiveError(*directive);
+        AppendString(d.error_reason(), out);
+        AppendString(d.arg(), out);
+        break;
+      }
+    }
+  }
+}
+
+// static
+bool CppDirectiveSerializer::Deserialize(absl::string_view data,
+                                         CppDirectiveList* directives) {
+  Reader reader(data);
+  size_t n;
+  if (!reader.ReadCount(&n)) {
+    return false;
+  }
+
+  CppDirectiveList result;
+  result.reserve(n);
+  for (size_t i = 0; i < n; ++i) {
+    std::uint64_t type;
+    std::int64_t position;
+    if (!reader.ReadVarint(&type) ||
+        type >= static_cast<std::uint64_t>(kCppDirectiveTypeSize) ||
+        !reader.ReadSignedVarint(&position) || position < -1 ||
+        position > INT32_MAX) {
+      return false;
+    }
+    std::unique_ptr<CppDirective> directive(
+        ReadDirective(static_cast<CppDirectiveType>(type), &reader));
+    if (!directive) {
+      return false;
+    }
+    directive->set_position(static_cast<int>(position));
+    result.push_back(std::move(directive));
+  }
+  if (!reader.empty()) {
+    return false;
+  }
+
+  *directives = std::move(result);
+  return true;
+}
+
+}  // namespace devtools_goma
@@ -0,0 +1,37 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DEVTOOLS_GOMA_CLIENT_CXX_INCLUDE_PROCESSOR_CPP_DIRECTIVE_SERIALIZER_H_
+#define DEVTOOLS_GOMA_CLIENT_CXX_INCLUDE_PROCESSOR_CPP_DIRECTIVE_SERIALIZER_H_
+
+#include <string>
+
+#include "absl/strings/string_view.h"
+#include "cpp_directive.h"
+
+namespace devtools_goma {
+
+// CppDirectiveSerializer converts CppDirectiveList to a compact binary
+// format and back, so that parsed directives can be stored on disk.
+//
+// Integers are encoded as varint, and strings are encoded as varint length
+// followed by bytes. The format is not stable across versions; callers
+// should store kFormatVersion along with the serialized data.
+class CppDirectiveSerializer {
+ public:
+  // Bump this when the encoding, CppDirectiveParser or
+  // CppDirectiveOptimizer changes its output.
+  static constexpr int kFormatVersion = 1;
+
+  static void Serialize(const CppDirectiveList& directives, std::string* out);
+
+  // Returns false if |data| is not valid serialized directives.
+  // |directives| is not modified in that case.
+  static bool Deserialize(absl::string_view data,
+                          CppDirectiveList* directives);
+};
+
+}  // namespace devtools_goma
+
+#endif  // DEVTOOLS_GOMA_CLIENT_CXX_INCLUDE_PROCESSOR_CPP_DIRECTIVE_SERIALIZER_H_
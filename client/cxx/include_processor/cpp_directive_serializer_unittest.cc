@@ -0,0 +1,187 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "cpp_directive_serializer.h"
+
+#include <string>
+
+#include "absl/strings/string_view.h"
+#include "content.h"
+#include "cpp_directive_optimizer.h"
+#include "cpp_directive_parser.h"
+#include "cpp_parser.h"
+#include "gtest/gtest.h"
+
+namespace devtools_goma {
+
+namespace {
+
+CppDirectiveList Parse(absl::string_view text) {
+  std::unique_ptr<Content> content =
+      Content::CreateFromBuffer(text.data(), text.size());
+
+  CppDirectiveList directives;
+  EXPECT_TRUE(CppDirectiveParser().Parse(*content, "<string>", &directives));
+  return directives;
+}
+
+void ExpectSameTokens(const std::vector<CppToken>& expected,
+                      const std::vector<CppToken>& actual) {
+  ASSERT_EQ(expected.size(), actual.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(expected[i], actual[i]) << i;
+    EXPECT_EQ(expected[i].v.param_index, actual[i].v.param_index) << i;
+  }
+}
+
+void ExpectSameDirectives(const CppDirectiveList& expected,
+                          const CppDirectiveList& actual) {
+  ASSERT_EQ(expected.size(), actual.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    const CppDirective& e = *expected[i];
+    const CppDirective& a = *actual[i];
+    EXPECT_EQ(e.type(), a.type()) << i;
+    EXPECT_EQ(e.position(), a.position()) << i;
+    EXPECT_EQ(e.DebugString(), a.DebugString()) << i;
+    switch (e.type()) {
+      case CppDirectiveType::DIRECTIVE_INCLUDE:
+      case CppDirectiveType::DIRECTIVE_IMPORT:
+      case CppDirectiveType::DIRECTIVE_INCLUDE_NEXT:
+        EXPECT_EQ(AsCppDirectiveIncludeBase(e).delimiter(),
+                  AsCppDirectiveIncludeBase(a).delimiter());
+        if (AsCppDirectiveIncludeBase(e).delimiter() == ' ') {
+          ExpectSameTokens(AsCppDirectiveIncludeBase(e).tokens(),
+                           AsCppDirectiveIncludeBase(a).tokens());
+        }
+        break;
+      case CppDirectiveType::DIRECTIVE_DEFINE: {
+        const Macro* em = AsCppDirectiveDefine(e).macro();
+        const Macro* am = AsCppDirectiveDefine(a).macro();
+        EXPECT_EQ(em->name, am->name);
+        EXPECT_EQ(em->type, am->type);
+        EXPECT_EQ(em->num_args, am->num_args);
+        EXPECT_EQ(em->is_vararg, am->is_vararg);
+        EXPECT_EQ(em->is_paren_balanced, am->is_paren_balanced);
+        ExpectSameTokens(em->replacement, am->replacement);
+        break;
+      }
+      case CppDirectiveType::DIRECTIVE_IF:
+        ExpectSameTokens(AsCppDirectiveIf(e).tokens(),
+                         AsCppDirectiveIf(a).tokens());
+        break;
+      case CppDirectiveType::DIRECTIVE_ELIF:
+        ExpectSameTokens(AsCppDirectiveElif(e).tokens(),
+                         AsCppDirectiveElif(a).tokens());
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+const char kSource[] =
+    "#ifndef FOO_H_\n"
+    "#define FOO_H_\n"
+    "#pragma once\n"
+    "#pragma comment(lib, \"foo\")\n"
+    "#include <stdio.h>\n"
+    "#include \"foo/bar.h\"\n"
+    "#import <Foundation/Foundation.h>\n"
+    "#include_next <limits.h>\n"
+    "#include FOO_HEADER(x)\n"
+    "#define A 1\n"
+    "#define B(x, y) ((x) * (y) + -1 >> 2)\n"
+    "#define C(fmt, ...) printf(fmt, __VA_ARGS__) #fmt x ## y\n"
+    "#define D(fmt, ...) f(fmt __VA_OPT__(,) __VA_ARGS__)\n"
+    "#define E 'c' \"str\" 0x7fffffff 1.5e3\n"
+    "#undef A\n"
+    "#ifdef B\n"
+    "#if defined(A) && A >= 2 || (B(1, 2) != 3)\n"
+    "#elif __has_include(<foo.h>)\n"
+    "#else\n"
+    "#endif\n"
+    "#endif\n"
+    "#error unknown\n"
+    "#define\n"
+    "#endif\n";
+
+}  // anonymous namespace
+
+class CppDirectiveSerializerTest : public testing::Test {
+ protected:
+  CppDirectiveSerializerTest() {
+    // HACK: To initialize tables.
+    CppParser parser;
+  }
+};
+
+TEST_F(CppDirectiveSerializerTest, RoundTrip) {
+  CppDirectiveList directives = Parse(kSource);
+  ASSERT_FALSE(directives.empty());
+
+  std::string serialized;
+  CppDirectiveSerializer::Serialize(directives, &serialized);
+
+  CppDirectiveList deserialized;
+  ASSERT_TRUE(CppDirectiveSerializer::Deserialize(serialized, &deserialized));
+  ExpectSameDirectives(directives, deserialized);
+
+  // Serialization should be deterministic.
+  std::string reserialized;
+  CppDirectiveSerializer::Serialize(deserialized, &reserialized);
+  EXPECT_EQ(serialized, reserialized);
+}
+
+TEST_F(CppDirectiveSerializerTest, RoundTripOptimized) {
+  CppDirectiveList directives = Parse(kSource);
+  CppDirectiveOptimizer::Optimize(&directives);
+
+  std::string serialized;
+  CppDirectiveSerializer::Serialize(directives, &serialized);
+
+  CppDirectiveList deserialized;
+  ASSERT_TRUE(CppDirectiveSerializer::Deserialize(serialized, &deserialized));
+  ExpectSameDirectives(directives, deserialized);
+}
+
+TEST_F(CppDirectiveSerializerTest, Empty) {
+  std::string serialized;
+  CppDirectiveSerializer::Serialize(CppDirectiveList(), &serialized);
+
+  CppDirectiveList deserialized;
+  ASSERT_TRUE(CppDirectiveSerializer::Deserialize(serialized, &deserialized));
+  EXPECT_TRUE(deserialized.empty());
+}
+
+TEST_F(CppDirectiveSerializerTest, RejectBrokenData) {
+  CppDirectiveList directives = Parse(kSource);
+  std::string serialized;
+  CppDirectiveSerializer::Serialize(directives, &serialized);
+
+  // Truncated data must be rejected without crash.
+  for (size_t i = 0; i < serialized.size(); ++i) {
+    CppDirectiveList deserialized;
+    EXPECT_FALSE(CppDirectiveSerializer::Deserialize(
+        absl::string_view(serialized).substr(0, i), &deserialized))
+        << i;
+    EXPECT_TRUE(deserialized.empty());
+  }
+
+  // Trailing garbage.
+  CppDirectiveList deserialized;
+  EXPECT_FALSE(
+      CppDirectiveSerializer::Deserialize(serialized + "x", &deserialized));
+
+  // Unknown directive type.
+  std::string unknown_type("\x01\x7f\x00", 3);
+  EXPECT_FALSE(CppDirectiveSerializer::Deserialize(unknown_type,
+                                                   &deserialized));
+
+  // Too large count.
+  std::string large_count("\xff\xff\xff\xff\x0f", 5);
+  EXPECT_FALSE(CppDirectiveSerializer::Deserialize(large_count,
+                                                   &deserialized));
+}
+
+}  // namespace devtools_goma
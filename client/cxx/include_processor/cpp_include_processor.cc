@@ -28,6 +28,7 @@
 #include <vector>
 
 #include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_split.h"
 #include "absl/strings/string_view.h"
 #include "autolock_timer.h"
@@ -53,6 +54,7 @@
 #include "include_cache.h"
 #include "include_file_utils.h"
 #include "ioutil.h"
+#include "linked_unordered_map.h"
 #include "list_dir_cache.h"
 #include "lockhelper.h"
 #include "options.h"
@@ -100,6 +102,79 @@ IncludeItem TryInclude(const std::string& cwd,
   return IncludeCache::instance()->GetIncludeItem(abs_filepath, file_stat);
 }
 
+// Keeps macro environments after compiler predefined macros and command line
+// macros are defined, so that translation units compiled by the same compiler
+// with the same macro flags can start from a snapshot instead of parsing and
+// defining the same macros again.
+// Only macros defined before reading the source file are cached. Macros
+// defined by headers commonly included first (e.g. config.h) are not, because
+// processing a header also has side effects on IncludePathsObserver (included
+// files and checked file stats), which would need to be replayed for each
+// translation unit.
+class MacroEnvSnapshotCache {
+ public:
+  static MacroEnvSnapshotCache* Instance() {
+    static MacroEnvSnapshotCache* cache = new MacroEnvSnapshotCache;
+    return cache;
+  }
+
+  // Returns a key for macros defined for |compiler_info|, |gcc_like_hosted|
+  // and |commandline_macros|.
+  // |compiler_info| is identified by its predefined directives, which are
+  // kept alive by the snapshot, so the address is never reused while the
+  // snapshot is cached.
+  static std::string Key(
+      const CxxCompilerInfo& compiler_info,
+      bool gcc_like_hosted,
+      const std::vector<std::pair<std::string, bool>>& commandline_macros) {
+    const CppDirectiveList* predefined_directives =
+        compiler_info.predefined_directives().get();
+    std::string key =
+        absl::StrCat(reinterpret_cast<uintptr_t>(predefined_directives),
+                     gcc_like_hosted ? ":hosted" : ":freestanding");
+    for (const auto& commandline_macro : commandline_macros) {
+      absl::StrAppend(&key, "\n", commandline_macro.second ? "D" : "U",
+                      commandline_macro.first);
+    }
+    return key;
+  }
+
+  std::shared_ptr<const CppParser::MacroEnvSnapshot> Lookup(
+      const std::string& key) LOCKS_EXCLUDED(mu_) {
+    AUTOLOCK(lock, &mu_);
+    auto it = snapshots_.find(key);
+    if (it == snapshots_.end()) {
+      GOMA_COUNTERZ("macro env snapshot miss");
+      return nullptr;
+    }
+    GOMA_COUNTERZ("macro env snapshot hit");
+    snapshots_.MoveToBack(it);
+    return it->second;
+  }
+
+  void Insert(std::string key,
+              std::shared_ptr<const CppParser::MacroEnvSnapshot> snapshot)
+      LOCKS_EXCLUDED(mu_) {
+    AUTOLOCK(lock, &mu_);
+    snapshots_.emplace_back(std::move(key), std::move(snapshot));
+    while (snapshots_.size() > kMaxSnapshots) {
+      snapshots_.pop_front();
+    }
+  }
+
+ private:
+  static constexpr size_t kMaxSnapshots = 128;
+
+  MacroEnvSnapshotCache() = default;
+
+  Lock mu_;
+  LinkedUnorderedMap<std::string,
+                     std::shared_ptr<const CppParser::MacroEnvSnapshot>>
+      snapshots_ GUARDED_BY(mu_);
+};
+
+constexpr size_t MacroEnvSnapshotCache::kMaxSnapshots;
+
 }  // anonymous namespace
 
 class IncludePathsObserver : public CppParser::IncludeObserver {
@@ -583,11 +658,6 @@ bool CppIncludeProcessor::GetIncludeFiles(const std::string& filename,
   cpp_parser_.set_include_observer(&include_observer);
   if (VLOG_IS_ON(1))
     cpp_parser_.set_error_observer(&error_observer);
-  cpp_parser_.SetCompilerInfo(&compiler_info);
-  if (compiler_flags.type() == CompilerFlagType::Clexe) {
-    cpp_parser_.set_is_vc();
-  }
-
   // True if the compiler is gcc-like and we are building in hosted mode.
   bool gcc_like_hosted = false;
   if (compiler_flags.type() == CompilerFlagType::Gcc) {
@@ -595,31 +665,50 @@ bool CppIncludeProcessor::GetIncludeFiles(const std::string& filename,
     gcc_like_hosted = !(flags.has_ffreestanding() || flags.has_fno_hosted());
   }
 
-  if (gcc_like_hosted) {
-    // CompilerInfo was generated with -ffreestanding, and set
-    // __STDC_HOSTED__=0 - we must override this.
-    cpp_parser_.DeleteMacro("__STDC_HOSTED__");
-    cpp_parser_.AddMacroByString("__STDC_HOSTED__", "1");
-  }
-
-  for (const auto& commandline_macro : commandline_macros) {
-    const std::string& macro = commandline_macro.first;
-    if (commandline_macro.second) {
-      size_t found = macro.find('=');
-      if (found == std::string::npos) {
-        // https://gcc.gnu.org/onlinedocs/gcc/Preprocessor-Options.html
-        // -D name
-        //   Predefine name as a macro, with definition 1.
-        cpp_parser_.AddMacroByString(macro, "1");
-        continue;
+  const std::string macro_env_key = MacroEnvSnapshotCache::Key(
+      compiler_info, gcc_like_hosted, commandline_macros);
+  std::shared_ptr<const CppParser::MacroEnvSnapshot> macro_env_snapshot =
+      MacroEnvSnapshotCache::Instance()->Lookup(macro_env_key);
+  if (macro_env_snapshot) {
+    cpp_parser_.RestoreMacroEnvSnapshot(&compiler_info,
+                                        std::move(macro_env_snapshot));
+  } else {
+    cpp_parser_.SetCompilerInfo(&compiler_info);
+
+    if (gcc_like_hosted) {
+      // CompilerInfo was generated with -ffreestanding, and set
+      // __STDC_HOSTED__=0 - we must override this.
+      cpp_parser_.DeleteMacro("__STDC_HOSTED__");
+      cpp_parser_.AddMacroByString("__STDC_HOSTED__", "1");
+    }
+
+    for (const auto& commandline_macro : commandline_macros) {
+      const std::string& macro = commandline_macro.first;
+      if (commandline_macro.second) {
+        size_t found = macro.find('=');
+        if (found == std::string::npos) {
+          // https://gcc.gnu.org/onlinedocs/gcc/Preprocessor-Options.html
+          // -D name
+          //   Predefine name as a macro, with definition 1.
+          cpp_parser_.AddMacroByString(macro, "1");
+          continue;
+        }
+        const std::string& key = macro.substr(0, found);
+        const std::string& value =
+            macro.substr(found + 1, macro.size() - (found + 1));
+        cpp_parser_.AddMacroByString(key, value);
+      } else {
+        cpp_parser_.DeleteMacro(macro);
       }
-      const std::string& key = macro.substr(0, found);
-      const std::string& value =
-          macro.substr(found + 1, macro.size() - (found + 1));
-      cpp_parser_.AddMacroByString(key, value);
-    } else {
-      cpp_parser_.DeleteMacro(macro);
     }
+
+    if (!cpp_parser_.disabled()) {
+      MacroEnvSnapshotCache::Instance()->Insert(
+          macro_env_key, cpp_parser_.TakeMacroEnvSnapshot());
+    }
+  }
+  if (compiler_flags.type() == CompilerFlagType::Clexe) {
+    cpp_parser_.set_is_vc();
   }
 
   if (gcc_like_hosted) {
@@ -5,24 +5,55 @@
 #ifndef DEVTOOLS_GOMA_CLIENT_CXX_INCLUDE_PROCESSOR_CPP_MACRO_ENV_H_
 #define DEVTOOLS_GOMA_CLIENT_CXX_INCLUDE_PROCESSOR_CPP_MACRO_ENV_H_
 
+#include <memory>
 #include <string>
 
 #include "absl/container/flat_hash_map.h"
 #include "cpp_macro.h"
+#include "glog/logging.h"
 
 namespace devtools_goma {
 
+// CppMacroEnv is copy-on-write. Fork() returns a copy sharing the underlying
+// map, so that a snapshot of macros can be taken cheaply. After that, both
+// of them don't own the map, and copy it when they are modified first.
+// A CppMacroEnv can be copied only if it doesn't own the map, e.g. from a
+// forked one, so that the owner won't modify the shared map.
+// A CppMacroEnv instance is thread-unsafe, but copies of it can be used
+// in other threads.
 class CppMacroEnv {
  public:
   using UnderlyingMapType =
       absl::flat_hash_map<absl::string_view, const Macro*>;
 
+  CppMacroEnv() : env_(std::make_shared<UnderlyingMapType>()) {}
+
+  CppMacroEnv(const CppMacroEnv& other)
+      : env_(other.env_), owns_env_(false) {
+    DCHECK(!other.owns_env_) << "use Fork() to copy CppMacroEnv";
+  }
+  CppMacroEnv& operator=(const CppMacroEnv& other) {
+    DCHECK(!other.owns_env_) << "use Fork() to copy CppMacroEnv";
+    env_ = other.env_;
+    owns_env_ = false;
+    return *this;
+  }
+  CppMacroEnv(CppMacroEnv&&) = default;
+  CppMacroEnv& operator=(CppMacroEnv&&) = default;
+
+  // Returns a copy sharing the underlying map with this.
+  CppMacroEnv Fork() {
+    owns_env_ = false;
+    return CppMacroEnv(*this);
+  }
+
   // Add |macro| to map.
   // If the same name macro exists, |macro| overrides the existing one,
   // and the old macro is returned. nullptr if not.
   const Macro* Add(const Macro* macro) {
     absl::string_view name = macro->name;
-    auto p = env_.emplace(name, macro);
+    UnderlyingMapType* env = MutableEnv();
+    auto p = env->emplace(name, macro);
     if (p.second) {
       // no existing macro.
       return nullptr;
@@ -33,16 +64,16 @@ class CppMacroEnv {
     // Be careful. key must be always the view of macro name.
     // Otherwise, string_view won't be alive.
     // So, we need to erase & insert to update key.
-    env_.erase(p.first);
-    env_.emplace(name, macro);
+    env->erase(p.first);
+    env->emplace(name, macro);
 
     return existing_macro;
   }
 
   // Get a macro by |name|.
   const Macro* Get(const std::string& name) const {
-    auto it = env_.find(name);
-    if (it == env_.end()) {
+    auto it = env_->find(name);
+    if (it == env_->end()) {
       return nullptr;
     }
 
@@ -52,21 +83,34 @@ class CppMacroEnv {
   // Delete a macro by name.
   // The deleted macro is returned.
   const Macro* Delete(const std::string& name) {
-    auto it = env_.find(name);
-    if (it == env_.end()) {
+    if (env_->find(name) == env_->end()) {
       return nullptr;
     }
 
+    UnderlyingMapType* env = MutableEnv();
+    auto it = env->find(name);
     const Macro* existing = it->second;
-    env_.erase(it);
+    env->erase(it);
     return existing;
   }
 
   // Returns the underlying map. for dump, debug, etc.
-  const UnderlyingMapType& UnderlyingMap() const { return env_; }
+  const UnderlyingMapType& UnderlyingMap() const { return *env_; }
 
  private:
-  UnderlyingMapType env_;
+  // Returns the underlying map to modify, which is copied if it is not
+  // owned by this.
+  UnderlyingMapType* MutableEnv() {
+    if (!owns_env_) {
+      env_ = std::make_shared<UnderlyingMapType>(*env_);
+      owns_env_ = true;
+    }
+    return env_.get();
+  }
+
+  std::shared_ptr<UnderlyingMapType> env_;
+  // True if |env_| is not shared with other CppMacroEnv.
+  bool owns_env_ = true;
 };
 
 }  // namespace devtools_goma
@@ -11,7 +11,7 @@ namespace devtools_goma {
 
 ArrayTokenList CppMacroExpander::Expand(const ArrayTokenList& input_tokens,
                                         SpaceHandling space_handling) {
-  ArrayTokenList result;
+  ArrayTokenList result = parser_->token_list_pool()->Acquire();
 
   // Try CBV one first.
   if (CppMacroExpanderCBV(parser_).ExpandMacro(input_tokens, space_handling,
@@ -10,14 +10,15 @@ bool CppMacroExpanderCBV::ExpandMacro(const ArrayTokenList& input,
                                       SpaceHandling space_handling,
                                       ArrayTokenList* output) {
   output->reserve(32);
-  return Expand(input.begin(), input.end(), space_handling, MacroSet(), Env(),
+  MacroSet hideset;
+  return Expand(input.begin(), input.end(), space_handling, &hideset, Env(),
                 output);
 }
 
 bool CppMacroExpanderCBV::Expand(ArrayTokenList::const_iterator input_begin,
                                  ArrayTokenList::const_iterator input_end,
                                  SpaceHandling space_handling,
-                                 const MacroSet& hideset,
+                                 MacroSet* hideset,
                                  const Env& env,
                                  ArrayTokenList* output) {
   for (auto it = input_begin; it != input_end; ++it) {
@@ -63,7 +64,7 @@ bool CppMacroExpanderCBV::Expand(ArrayTokenList::const_iterator input_begin,
     }
 
     const Macro* macro = parser_->GetMacro(token.string_value);
-    if (!macro || hideset.Has(macro)) {
+    if (!macro || hideset->Has(macro)) {
       output->push_back(token);
       continue;
     }
@@ -76,12 +77,12 @@ bool CppMacroExpanderCBV::Expand(ArrayTokenList::const_iterator input_begin,
     }
 
     if (macro->type == Macro::OBJ) {
-      MacroSet new_hideset(hideset);
-      new_hideset.Set(macro);
+      hideset->Set(macro);
       if (!Expand(macro->replacement.begin(), macro->replacement.end(),
-                  space_handling, new_hideset, Env(), output)) {
+                  space_handling, hideset, Env(), output)) {
         return false;
       }
+      hideset->Remove(macro);
       continue;
     }
 
@@ -105,33 +106,37 @@ bool CppMacroExpanderCBV::Expand(ArrayTokenList::const_iterator input_begin,
       }
       DCHECK_EQ(macro->num_args, args.size());
 
+      // Argument token lists are taken from the parser's pool, and returned
+      // after the replacement is expanded.
+      CppTokenListPool* pool = parser_->token_list_pool();
       Env new_env(args.size());
-      for (size_t i = 0; i < args.size(); ++i) {
-        if (!Expand(args[i].first, args[i].second, space_handling, hideset, env,
-                    &new_env[i])) {
-          return false;
-        }
+      bool ok = true;
+      for (size_t i = 0; ok && i < args.size(); ++i) {
+        new_env[i] = pool->Acquire();
+        ok = Expand(args[i].first, args[i].second, space_handling, hideset,
+                    env, &new_env[i]);
       }
 
-      if (macro->type == Macro::CBK_FUNC) {
+      if (ok && macro->type == Macro::CBK_FUNC) {
         // Since CBK_FUNC's num_args is 1, new_env's size must also be 1.
         DCHECK_EQ(1, macro->num_args);
         DCHECK_EQ(1, new_env.size());
 
         // CBK_FUNC should always return no-more expandable token.
         output->push_back((parser_->*(macro->callback_func))(new_env[0]));
-      } else {
-        // TODO: Don't make new hideset, but update the current
-        // hideset (and remove it after Expand to reduce memory allocation).
-        MacroSet new_hideset(hideset);
-        new_hideset.Set(macro);
-
-        if (!Expand(macro->replacement.begin(), macro->replacement.end(),
-                    space_handling, new_hideset, new_env, output)) {
-          return false;
-        }
+      } else if (ok) {
+        hideset->Set(macro);
+        ok = Expand(macro->replacement.begin(), macro->replacement.end(),
+                    space_handling, hideset, new_env, output);
+        hideset->Remove(macro);
       }
 
+      for (auto& tokens : new_env) {
+        pool->Release(std::move(tokens));
+      }
+      if (!ok) {
+        return false;
+      }
       continue;
     }
 
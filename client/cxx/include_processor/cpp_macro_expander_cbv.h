@@ -200,10 +200,13 @@ class CppMacroExpanderCBV {
                              ArrayTokenList::const_iterator>;
   using ArgRangeVector = absl::InlinedVector<ArgRange, 8>;
 
+  // Expands [input_begin, input_end) to |output|.
+  // |hideset| is updated while a macro replacement is expanded, and
+  // restored when this returns true.
   bool Expand(ArrayTokenList::const_iterator input_begin,
               ArrayTokenList::const_iterator input_end,
               SpaceHandling space_handling,
-              const MacroSet& hideset,
+              MacroSet* hideset,
               const Env& env,
               ArrayTokenList* output);
 
@@ -398,6 +398,47 @@ TEST(CppMacroExpanderTest, ExpandHideSet) {
               "#define G(X) F(X) + 1",
               "F(1)",
               "F(1) + 1");
+
+  // A hideset is restored after a macro is expanded.
+  CheckExpand(CheckFlag::kPassAll,
+              "#define A B\n"
+              "#define B 1\n",
+              "A B A",
+              "1 1 1");
+
+  CheckExpand(CheckFlag::kPassAll,
+              "#define F(X) X + 1\n",
+              "F(F(1)) F(2)",
+              "1 + 1 + 1 2 + 1");
+}
+
+TEST(CppMacroExpanderTest, ReuseTokenListsInPool) {
+  CppParser cpp_parser;
+  cpp_parser.AddStringInput("#define F(X, Y) X + Y\n"
+                            "#define G(X) F(X, 1)\n",
+                            "(string)");
+  EXPECT_TRUE(cpp_parser.ProcessDirectives());
+
+  ArrayTokenList tokens;
+  ASSERT_TRUE(
+      CppTokenizer::TokenizeAll("G(G(2))", SpaceHandling::kKeep, &tokens));
+  ArrayTokenList expected;
+  ASSERT_TRUE(CppTokenizer::TokenizeAll("2 + 1 + 1", SpaceHandling::kSkip,
+                                        &expected));
+
+  CppTokenListPool* pool = cpp_parser.token_list_pool();
+  ArrayTokenList expanded =
+      CppMacroExpander(&cpp_parser).Expand(tokens, SpaceHandling::kSkip);
+  EXPECT_EQ(expected, expanded);
+  pool->Release(std::move(expanded));
+  const size_t num_free_lists = pool->num_free_lists();
+  EXPECT_GT(num_free_lists, 0U);
+
+  // The second expansion uses token lists released by the first one.
+  expanded = CppMacroExpander(&cpp_parser).Expand(tokens, SpaceHandling::kSkip);
+  EXPECT_EQ(expected, expanded);
+  pool->Release(std::move(expanded));
+  EXPECT_EQ(num_free_lists, pool->num_free_lists());
 }
 
 // This test does not pass with CBV expander.
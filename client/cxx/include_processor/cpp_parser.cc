@@ -114,6 +114,27 @@ void CppParser::SetCompilerInfo(const CxxCompilerInfo* compiler_info) {
   ProcessDirectives();
 }
 
+std::shared_ptr<const CppParser::MacroEnvSnapshot>
+CppParser::TakeMacroEnvSnapshot() {
+  DCHECK(inputs_.empty());
+  return std::make_shared<MacroEnvSnapshot>(macro_env_.Fork(),
+                                            input_protects_, is_cplusplus_);
+}
+
+void CppParser::RestoreMacroEnvSnapshot(
+    const CxxCompilerInfo* compiler_info,
+    std::shared_ptr<const MacroEnvSnapshot> snapshot) {
+  DCHECK(inputs_.empty());
+  DCHECK(macro_env_.UnderlyingMap().empty());
+  compiler_info_ = compiler_info;
+  set_is_cplusplus(snapshot->is_cplusplus_);
+  // Shares the underlying map until a macro is modified.
+  macro_env_ = snapshot->macro_env_;
+  input_protects_.insert(input_protects_.end(),
+                         snapshot->input_protects_.begin(),
+                         snapshot->input_protects_.end());
+}
+
 bool CppParser::ProcessDirectives() {
   GOMA_COUNTERZ("ProcessDirectives");
   if (disabled_)
@@ -656,7 +677,9 @@ void CppParser::ProcessIncludeInternal(const CppDirectiveIncludeBase& d) {
 
 int CppParser::EvalCondition(const ArrayTokenList& orig_tokens) {
   // TODO: Add DCHECK here orig_tokens does not contain spaces.
-  ArrayTokenList tokens;
+  // Token lists made while evaluating the condition are taken from
+  // |token_list_pool_|, and returned to it at the end.
+  ArrayTokenList tokens = token_list_pool_.Acquire();
   tokens.reserve(orig_tokens.size());
 
   // convert "[defined][(][xxx][)] or [defined][xxx]
@@ -692,7 +715,11 @@ int CppParser::EvalCondition(const ArrayTokenList& orig_tokens) {
       CppMacroExpander(this).Expand(tokens, SpaceHandling::kSkip);
 
   // 3. Evaluates the expanded integer constant expression.
-  return CppIntegerConstantEvaluator(expanded, this).GetValue();
+  int value = CppIntegerConstantEvaluator(expanded, this).GetValue();
+
+  token_list_pool_.Release(std::move(tokens));
+  token_list_pool_.Release(std::move(expanded));
+  return value;
 }
 
 void CppParser::PopInput() {
@@ -12,6 +12,7 @@
 #include <set>
 #include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "absl/base/call_once.h"
@@ -27,6 +28,7 @@
 #include "cpp_macro_expander.h"
 #include "cpp_macro_set.h"
 #include "cpp_token.h"
+#include "cpp_token_list_pool.h"
 #include "cxx/cxx_compiler_info.h"
 #include "glog/logging.h"
 #include "gtest/gtest_prod.h"
@@ -87,6 +89,41 @@ class CppParser {
   void set_error_observer(ErrorObserver* obs) { error_observer_ = obs; }
   void SetCompilerInfo(const CxxCompilerInfo* compiler_info);
 
+  // MacroEnvSnapshot holds macros defined in a CppParser, and directives
+  // that keep them alive. It is immutable, so it can be shared among
+  // CppParsers in other threads.
+  class MacroEnvSnapshot {
+   public:
+    MacroEnvSnapshot(CppMacroEnv macro_env,
+                     std::vector<SharedCppDirectives> input_protects,
+                     bool is_cplusplus)
+        : macro_env_(std::move(macro_env)),
+          input_protects_(std::move(input_protects)),
+          is_cplusplus_(is_cplusplus) {}
+
+    MacroEnvSnapshot(const MacroEnvSnapshot&) = delete;
+    MacroEnvSnapshot& operator=(const MacroEnvSnapshot&) = delete;
+
+   private:
+    const CppMacroEnv macro_env_;
+    const std::vector<SharedCppDirectives> input_protects_;
+    const bool is_cplusplus_;
+
+    friend class CppParser;
+  };
+
+  // Takes a snapshot of the current macros.
+  // All inputs must have been processed.
+  std::shared_ptr<const MacroEnvSnapshot> TakeMacroEnvSnapshot();
+
+  // Restores macros from |snapshot|, instead of SetCompilerInfo() and
+  // defining the same macros again. |snapshot| must be taken after
+  // SetCompilerInfo() with the same |compiler_info|.
+  // This must be called before any other macros are defined.
+  void RestoreMacroEnvSnapshot(
+      const CxxCompilerInfo* compiler_info,
+      std::shared_ptr<const MacroEnvSnapshot> snapshot);
+
   void set_is_vc() { is_vc_ = true; }
   bool is_vc() const { return is_vc_; }
   void set_is_cplusplus(bool is_cplusplus) { is_cplusplus_ = is_cplusplus; }
@@ -134,6 +171,10 @@ class CppParser {
   bool disabled() const { return disabled_; }
   void ClearDisabled() { disabled_ = false; }
 
+  // Token lists used in macro expansion can be acquired from this pool,
+  // and released to it after use.
+  CppTokenListPool* token_list_pool() { return &token_list_pool_; }
+
   int total_files() const { return total_files_; }
   int skipped_files() const { return skipped_files_; }
 
@@ -324,6 +365,8 @@ class CppParser {
   std::vector<SharedCppDirectives> input_protects_;
   CppMacroEnv macro_env_;
 
+  CppTokenListPool token_list_pool_;
+
   std::vector<Condition> conditions_;
   int condition_in_false_depth_;
 
@@ -1253,4 +1253,49 @@ TEST(CppParserTest, ObjectiveCXXIsCPlusPlus) {
   EXPECT_TRUE(cpp_parser.IsMacroDefined("OK"));
 }
 
+TEST(CppParserTest, MacroEnvSnapshot) {
+  std::unique_ptr<CompilerInfoData> info_data(new CompilerInfoData);
+  info_data->set_lang("c++");
+  info_data->mutable_cxx()->set_predefined_macros("#define PREDEFINED 1\n");
+  CxxCompilerInfo info(std::move(info_data));
+
+  std::shared_ptr<const CppParser::MacroEnvSnapshot> snapshot;
+  {
+    CppParser cpp_parser;
+    cpp_parser.SetCompilerInfo(&info);
+    cpp_parser.AddMacroByString("COMMANDLINE", "2");
+    snapshot = cpp_parser.TakeMacroEnvSnapshot();
+
+    // Macros modified after the snapshot is taken are not in the snapshot.
+    cpp_parser.AddMacroByString("AFTER_SNAPSHOT", "3");
+    EXPECT_TRUE(cpp_parser.IsMacroDefined("AFTER_SNAPSHOT"));
+    cpp_parser.DeleteMacro("PREDEFINED");
+    EXPECT_FALSE(cpp_parser.IsMacroDefined("PREDEFINED"));
+  }
+
+  CppParser cpp_parser;
+  cpp_parser.RestoreMacroEnvSnapshot(&info, snapshot);
+  EXPECT_TRUE(cpp_parser.is_cplusplus());
+  EXPECT_TRUE(cpp_parser.IsMacroDefined("PREDEFINED"));
+  EXPECT_TRUE(cpp_parser.IsMacroDefined("COMMANDLINE"));
+  EXPECT_FALSE(cpp_parser.IsMacroDefined("AFTER_SNAPSHOT"));
+
+  cpp_parser.AddStringInput(
+      "#if PREDEFINED == 1 && COMMANDLINE == 2\n"
+      "# define OK\n"
+      "#endif\n"
+      "#undef COMMANDLINE\n",
+      "a.cc");
+  EXPECT_TRUE(cpp_parser.ProcessDirectives());
+  EXPECT_TRUE(cpp_parser.IsMacroDefined("OK"));
+  EXPECT_FALSE(cpp_parser.IsMacroDefined("COMMANDLINE"));
+
+  // Modification in a parser doesn't affect other parsers restored from the
+  // same snapshot.
+  CppParser other_cpp_parser;
+  other_cpp_parser.RestoreMacroEnvSnapshot(&info, snapshot);
+  EXPECT_TRUE(other_cpp_parser.IsMacroDefined("COMMANDLINE"));
+  EXPECT_FALSE(other_cpp_parser.IsMacroDefined("OK"));
+}
+
 }  // namespace devtools_goma
@@ -0,0 +1,60 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DEVTOOLS_GOMA_CLIENT_CXX_INCLUDE_PROCESSOR_CPP_TOKEN_LIST_POOL_H_
+#define DEVTOOLS_GOMA_CLIENT_CXX_INCLUDE_PROCESSOR_CPP_TOKEN_LIST_POOL_H_
+
+#include <vector>
+
+#include "cpp_token.h"
+
+namespace devtools_goma {
+
+// CppTokenListPool keeps buffers of ArrayTokenList released after macro
+// expansion, so that short-lived token lists made while evaluating #if
+// don't allocate memory each time.
+// CppTokenListPool is thread-unsafe. CppParser has one.
+class CppTokenListPool {
+ public:
+  CppTokenListPool() = default;
+
+  CppTokenListPool(const CppTokenListPool&) = delete;
+  CppTokenListPool& operator=(const CppTokenListPool&) = delete;
+
+  // Returns an empty token list, which may have capacity of a released one.
+  ArrayTokenList Acquire() {
+    if (free_lists_.empty()) {
+      ArrayTokenList tokens;
+      tokens.reserve(kInitialCapacity);
+      return tokens;
+    }
+    ArrayTokenList tokens = std::move(free_lists_.back());
+    free_lists_.pop_back();
+    return tokens;
+  }
+
+  // Returns the buffer of |tokens| to the pool.
+  // Too large buffers are freed not to keep memory.
+  void Release(ArrayTokenList tokens) {
+    if (free_lists_.size() >= kMaxFreeLists ||
+        tokens.capacity() > kMaxCapacity) {
+      return;
+    }
+    tokens.clear();
+    free_lists_.push_back(std::move(tokens));
+  }
+
+  size_t num_free_lists() const { return free_lists_.size(); }
+
+ private:
+  static constexpr size_t kInitialCapacity = 32;
+  static constexpr size_t kMaxFreeLists = 64;
+  static constexpr size_t kMaxCapacity = 4096;
+
+  std::vector<ArrayTokenList> free_lists_;
+};
+
+}  // namespace devtools_goma
+
+#endif  // DEVTOOLS_GOMA_CLIENT_CXX_INCLUDE_PROCESSOR_CPP_TOKEN_LIST_POOL_H_
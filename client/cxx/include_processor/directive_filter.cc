@@ -7,6 +7,15 @@
 
 #include <string.h>
 
+#ifndef NO_SSE2
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif  // NO_SSE2
+
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+
 #include <memory>
 #include <vector>
 
@@ -14,10 +23,224 @@
 #include "absl/strings/string_view.h"
 #include "absl/strings/strip.h"
 #include "content.h"
+#include "cpu.h"
 #include "glog/logging.h"
 
+#if !defined(NO_SSE2) && (defined(__x86_64__) || defined(_M_X64))
+#define DIRECTIVE_FILTER_HAS_AVX2 1
+#if defined(_WIN32) && !defined(__clang__)
+// cl.exe can use AVX2 intrinsics without /arch:AVX2.
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
 namespace devtools_goma {
 
+namespace {
+
+// Finds the first byte in [pos, end) which is |a|, |b| or |c|.
+// Returns |end| if not found.
+// Pass the same character more than once to find fewer characters.
+using FindFirstOfFunc = const char* (*)(const char* pos,
+                                        const char* end,
+                                        char a,
+                                        char b,
+                                        char c);
+
+const char* FindFirstOfScalar(const char* pos,
+                              const char* end,
+                              char a,
+                              char b,
+                              char c) {
+  for (; pos != end; ++pos) {
+    if (*pos == a || *pos == b || *pos == c) {
+      return pos;
+    }
+  }
+  return end;
+}
+
+#ifndef NO_SSE2
+
+#ifdef _WIN32
+inline int CountZero(unsigned int v) {
+  unsigned long r;
+  _BitScanForward(&r, v);
+  return r;
+}
+#else
+inline int CountZero(unsigned int v) {
+  return __builtin_ctz(v);
+}
+#endif
+
+const char* FindFirstOfSSE2(const char* pos,
+                            const char* end,
+                            char a,
+                            char b,
+                            char c) {
+  const __m128i a_pattern = _mm_set1_epi8(a);
+  const __m128i b_pattern = _mm_set1_epi8(b);
+  const __m128i c_pattern = _mm_set1_epi8(c);
+  while (end - pos >= 16) {
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+    __m128i test = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(s, a_pattern), _mm_cmpeq_epi8(s, b_pattern)),
+        _mm_cmpeq_epi8(s, c_pattern));
+    unsigned int mask = _mm_movemask_epi8(test);
+    if (mask != 0) {
+      return pos + CountZero(mask);
+    }
+    pos += 16;
+  }
+  return FindFirstOfScalar(pos, end, a, b, c);
+}
+
+#endif  // NO_SSE2
+
+#ifdef DIRECTIVE_FILTER_HAS_AVX2
+
+TARGET_AVX2
+const char* FindFirstOfAVX2(const char* pos,
+                            const char* end,
+                            char a,
+                            char b,
+                            char c) {
+  const __m256i a_pattern = _mm256_set1_epi8(a);
+  const __m256i b_pattern = _mm256_set1_epi8(b);
+  const __m256i c_pattern = _mm256_set1_epi8(c);
+  while (end - pos >= 32) {
+    __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos));
+    __m256i test = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(s, a_pattern),
+                        _mm256_cmpeq_epi8(s, b_pattern)),
+        _mm256_cmpeq_epi8(s, c_pattern));
+    unsigned int mask = _mm256_movemask_epi8(test);
+    if (mask != 0) {
+      return pos + CountZero(mask);
+    }
+    pos += 32;
+  }
+  return FindFirstOfSSE2(pos, end, a, b, c);
+}
+
+#endif  // DIRECTIVE_FILTER_HAS_AVX2
+
+bool IsScanImplSupported(DirectiveFilter::ScanImpl impl) {
+  switch (impl) {
+    case DirectiveFilter::ScanImpl::kScalar:
+      return true;
+    case DirectiveFilter::ScanImpl::kSSE2:
+#ifndef NO_SSE2
+      return true;
+#else
+      return false;
+#endif
+    case DirectiveFilter::ScanImpl::kAVX2:
+#ifdef DIRECTIVE_FILTER_HAS_AVX2
+      return CPU().has_avx2();
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+FindFirstOfFunc GetFindFirstOfFunc(DirectiveFilter::ScanImpl impl) {
+  switch (impl) {
+    case DirectiveFilter::ScanImpl::kScalar:
+      return FindFirstOfScalar;
+    case DirectiveFilter::ScanImpl::kSSE2:
+#ifndef NO_SSE2
+      return FindFirstOfSSE2;
+#else
+      break;
+#endif
+    case DirectiveFilter::ScanImpl::kAVX2:
+#ifdef DIRECTIVE_FILTER_HAS_AVX2
+      return FindFirstOfAVX2;
+#else
+      break;
+#endif
+  }
+  return FindFirstOfScalar;
+}
+
+DirectiveFilter::ScanImpl DefaultScanImpl() {
+  if (IsScanImplSupported(DirectiveFilter::ScanImpl::kAVX2)) {
+    return DirectiveFilter::ScanImpl::kAVX2;
+  }
+  if (IsScanImplSupported(DirectiveFilter::ScanImpl::kSSE2)) {
+    return DirectiveFilter::ScanImpl::kSSE2;
+  }
+  return DirectiveFilter::ScanImpl::kScalar;
+}
+
+struct ScanState {
+  ScanState()
+      : impl(DefaultScanImpl()), find_first_of(GetFindFirstOfFunc(impl)) {}
+
+  DirectiveFilter::ScanImpl impl;
+  FindFirstOfFunc find_first_of;
+};
+
+ScanState* GetScanState() {
+  static ScanState* state = new ScanState;
+  return state;
+}
+
+inline const char* FindFirstOf(const char* pos,
+                               const char* end,
+                               char a,
+                               char b,
+                               char c) {
+  return GetScanState()->find_first_of(pos, end, a, b, c);
+}
+
+inline const char* FindChar(const char* pos, const char* end, char a) {
+  return GetScanState()->find_first_of(pos, end, a, a, a);
+}
+
+// Copies [src, src + n) to |dst|. |src| and |dst| may overlap.
+inline void CopyBytes(const char* src, size_t n, char* dst) {
+  if (src != dst && n > 0) {
+    memmove(dst, src, n);
+  }
+}
+
+}  // anonymous namespace
+
+// static
+DirectiveFilter::ScanImpl DirectiveFilter::scan_impl() {
+  return GetScanState()->impl;
+}
+
+// static
+bool DirectiveFilter::SetScanImpl(ScanImpl impl) {
+  if (!IsScanImplSupported(impl)) {
+    return false;
+  }
+  ScanState* state = GetScanState();
+  state->impl = impl;
+  state->find_first_of = GetFindFirstOfFunc(impl);
+  return true;
+}
+
+// static
+const char* DirectiveFilter::ScanImplName(ScanImpl impl) {
+  switch (impl) {
+    case ScanImpl::kScalar:
+      return "scalar";
+    case ScanImpl::kSSE2:
+      return "sse2";
+    case ScanImpl::kAVX2:
+      return "avx2";
+  }
+  return "unknown";
+}
+
 // static
 std::unique_ptr<Content> DirectiveFilter::MakeFilteredContent(
     const Content& content) {
@@ -58,15 +281,21 @@ const char* DirectiveFilter::SkipSpaces(const char* pos, const char* end) {
 
 /* static */
 const char* DirectiveFilter::NextLineHead(const char* pos, const char* end) {
+  const char* const begin = pos;
   while (pos != end) {
-    if (*pos == '\n')
-      return pos + 1;
-
-    int newline_byte = IsEscapedNewLine(pos, end);
-    if (newline_byte)
-      pos += newline_byte;
-    else
-      pos += 1;
+    const char* newline = FindChar(pos, end, '\n');
+    if (newline == end)
+      return end;
+
+    // "\\\n" and "\\\r\n" are escaped newlines, which don't end the line.
+    // Backslash before |begin| is not taken into account.
+    if ((newline - begin >= 1 && newline[-1] == '\\') ||
+        (newline - begin >= 2 && newline[-1] == '\r' &&
+         newline[-2] == '\\')) {
+      pos = newline + 1;
+      continue;
+    }
+    return newline + 1;
   }
 
   return end;
@@ -118,6 +347,15 @@ int DirectiveFilter::CopyStringLiteral(const char* pos, const char* end,
   *dst++ = *pos++;
 
   while (pos != end) {
+    // Copy characters that don't need special handling at once.
+    const char* special = FindFirstOf(pos, end, '\"', '\n', '\\');
+    CopyBytes(pos, special - pos, dst);
+    dst += special - pos;
+    pos = special;
+    if (pos == end) {
+      break;
+    }
+
     // String literal ends.
     if (*pos == '\"') {
       *dst++ = *pos++;
@@ -180,6 +418,20 @@ size_t DirectiveFilter::RemoveComments(const char* src, const char* end,
   const char* original_dst = dst;
 
   while (src != end) {
+    // Copy characters that can't start a string literal or comment at once.
+    // 'R' followed by '\"' starts a raw string literal, so stop before it.
+    const char* special = FindFirstOf(src, end, '\"', '/', '/');
+    if (special != end && *special == '\"' && special != src &&
+        special[-1] == 'R') {
+      --special;
+    }
+    CopyBytes(src, special - src, dst);
+    dst += special - src;
+    src = special;
+    if (src == end) {
+      break;
+    }
+
     // Raw string literal starts.
     if (*src == 'R' && src + 1 < end && *(src + 1) == '\"') {
       int num = CaptureRawStringLiteral(src, end);
@@ -213,7 +465,12 @@ size_t DirectiveFilter::RemoveComments(const char* src, const char* end,
       const char* end_comment = nullptr;
       const char* pos = src + 2;
       while (pos + 2 <= end) {
-        if (*pos == '*' && *(pos + 1) == '/') {
+        // '*' at end - 1 can't be the end of comment.
+        pos = FindChar(pos, end - 1, '*');
+        if (pos == end - 1) {
+          break;
+        }
+        if (*(pos + 1) == '/') {
           end_comment = pos;
           break;
         }
@@ -251,6 +508,14 @@ size_t DirectiveFilter::RemoveEscapedNewLine(
   const char* initial_dst = dst;
 
   while (src != end) {
+    const char* backslash = FindChar(src, end, '\\');
+    CopyBytes(src, backslash - src, dst);
+    dst += backslash - src;
+    src = backslash;
+    if (src == end) {
+      break;
+    }
+
     int newline_bytes = IsEscapedNewLine(src, end);
     if (newline_bytes == 0) {
       *dst++ = *src++;
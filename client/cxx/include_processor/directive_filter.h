@@ -19,11 +19,29 @@ namespace devtools_goma {
 // TODO: Currently we cannot handle #include <foo//bar> correctly.
 class DirectiveFilter {
  public:
+  // Implementation used to scan bytes. All of them produce the same result.
+  enum class ScanImpl {
+    kScalar,
+    kSSE2,
+    kAVX2,
+  };
+
   // Removes lines that do not affect included files from |content|.
   // The result Content is newly generated.
   static std::unique_ptr<Content> MakeFilteredContent(
       const Content& content);
 
+  // Returns the scan implementation in use. By default, the fastest one
+  // supported by the CPU is used.
+  static ScanImpl scan_impl();
+
+  // Sets the scan implementation. Returns false if |impl| is not supported
+  // on this CPU or build. This is for testing and benchmarking, and must not
+  // be called while other threads are filtering.
+  static bool SetScanImpl(ScanImpl impl);
+
+  static const char* ScanImplName(ScanImpl impl);
+
  private:
   // Returns the pointer to the next non-space character. If nothing, |end| will
   // be returned.
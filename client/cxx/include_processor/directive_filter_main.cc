@@ -5,24 +5,111 @@
 #include "directive_filter.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 
 using devtools_goma::Content;
 using devtools_goma::DirectiveFilter;
 
+namespace {
+
+void Usage() {
+  fprintf(stderr,
+          "Usage: directive_filter <header or source>\n"
+          "       directive_filter --benchmark[=<iterations>] "
+          "<header or source>...\n");
+}
+
+// Filters |contents| |iterations| times with each scan implementation,
+// and prints the throughput.
+int RunBenchmark(const std::vector<std::unique_ptr<Content>>& contents,
+                 int iterations) {
+  size_t total_bytes = 0;
+  for (const auto& content : contents) {
+    total_bytes += content->size();
+  }
+  printf("files=%zu bytes=%zu iterations=%d\n", contents.size(), total_bytes,
+         iterations);
+
+  const DirectiveFilter::ScanImpl impls[] = {
+      DirectiveFilter::ScanImpl::kScalar,
+      DirectiveFilter::ScanImpl::kSSE2,
+      DirectiveFilter::ScanImpl::kAVX2,
+  };
+  for (const auto impl : impls) {
+    if (!DirectiveFilter::SetScanImpl(impl)) {
+      printf("%-8s not supported\n", DirectiveFilter::ScanImplName(impl));
+      continue;
+    }
+    size_t filtered_bytes = 0;
+    const absl::Time start = absl::Now();
+    for (int i = 0; i < iterations; ++i) {
+      for (const auto& content : contents) {
+        std::unique_ptr<Content> filtered(
+            DirectiveFilter::MakeFilteredContent(*content));
+        filtered_bytes += filtered->size();
+      }
+    }
+    const absl::Duration elapsed = absl::Now() - start;
+    const double seconds = absl::ToDoubleSeconds(elapsed);
+    printf("%-8s time=%s throughput=%.1fMB/s filtered_bytes=%zu\n",
+           DirectiveFilter::ScanImplName(impl),
+           absl::FormatDuration(elapsed).c_str(),
+           seconds > 0 ? total_bytes * iterations / seconds / 1e6 : 0.0,
+           filtered_bytes / iterations);
+  }
+  return 0;
+}
+
+}  // anonymous namespace
+
 int main(int argc, char* argv[]) {
   if (argc < 2) {
-    fprintf(stderr, "Usage: directive_filter <header or source>\n");
+    Usage();
     return 1;
   }
 
-  std::unique_ptr<Content> content(Content::CreateFromFile(argv[1]));
-  if (!content.get()) {
-    fprintf(stderr, "Cannot read %s\n", argv[1]);
+  int iterations = 0;
+  int argi = 1;
+  if (absl::StartsWith(argv[1], "--benchmark")) {
+    iterations = 100;
+    const char* value = argv[1] + strlen("--benchmark");
+    if (*value == '=' && (!absl::SimpleAtoi(value + 1, &iterations) ||
+                          iterations <= 0)) {
+      Usage();
+      return 1;
+    }
+    ++argi;
+  }
+  if (argi >= argc) {
+    Usage();
     return 1;
   }
 
+  std::vector<std::unique_ptr<Content>> contents;
+  for (int i = argi; i < argc; ++i) {
+    std::unique_ptr<Content> content(Content::CreateFromFile(argv[i]));
+    if (!content.get()) {
+      fprintf(stderr, "Cannot read %s\n", argv[i]);
+      return 1;
+    }
+    contents.push_back(std::move(content));
+  }
+
+  if (iterations > 0) {
+    return RunBenchmark(contents, iterations);
+  }
+
   std::unique_ptr<Content> filtered(
-      DirectiveFilter::MakeFilteredContent(*content));
+      DirectiveFilter::MakeFilteredContent(*contents[0]));
 
   fwrite(filtered->buf(), sizeof(char), filtered->size(), stdout);
   fflush(stdout);
@@ -6,7 +6,9 @@
 #include "directive_filter.h"
 
 #include <memory>
+#include <random>
 #include <string>
+#include <vector>
 
 #include <glog/logging.h>
 #include <gtest/gtest.h>
@@ -516,4 +518,46 @@ TEST_F(DirectiveFilterTest, SkipRawStringLiteral) {
                                   filtered->buf_end() - filtered->buf()));
 }
 
+TEST_F(DirectiveFilterTest, ScanImplsProduceSameResult) {
+  const DirectiveFilter::ScanImpl original_impl = DirectiveFilter::scan_impl();
+  const std::vector<DirectiveFilter::ScanImpl> impls = {
+      DirectiveFilter::ScanImpl::kScalar,
+      DirectiveFilter::ScanImpl::kSSE2,
+      DirectiveFilter::ScanImpl::kAVX2,
+  };
+
+  // Characters which have special meaning in DirectiveFilter are chosen
+  // frequently, so that they appear at various offsets of SIMD blocks.
+  static const char kChars[] = "#/*\"\\\n\rR() \tabcdefghijklmnop";
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<size_t> char_dist(0, sizeof(kChars) - 2);
+  std::uniform_int_distribution<size_t> len_dist(0, 256);
+
+  for (int i = 0; i < 2000; ++i) {
+    std::string src;
+    const size_t len = len_dist(gen);
+    for (size_t j = 0; j < len; ++j) {
+      src += kChars[char_dist(gen)];
+    }
+    std::unique_ptr<Content> content(Content::CreateFromString(src));
+
+    ASSERT_TRUE(DirectiveFilter::SetScanImpl(
+        DirectiveFilter::ScanImpl::kScalar));
+    std::unique_ptr<Content> expected(
+        DirectiveFilter::MakeFilteredContent(*content));
+
+    for (const auto impl : impls) {
+      if (!DirectiveFilter::SetScanImpl(impl)) {
+        continue;
+      }
+      std::unique_ptr<Content> filtered(
+          DirectiveFilter::MakeFilteredContent(*content));
+      ASSERT_EQ(expected->ToStringView(), filtered->ToStringView())
+          << DirectiveFilter::ScanImplName(impl) << " src=" << src;
+    }
+  }
+
+  EXPECT_TRUE(DirectiveFilter::SetScanImpl(original_impl));
+}
+
 }  // namespace devtools_goma
@@ -5,7 +5,12 @@
 
 #include "include_cache.h"
 
+#include <algorithm>
+
+#include "absl/hash/hash.h"
 #include "absl/memory/memory.h"
+#include "callback.h"
+#include "compiler_proxy_info.h"
 #include "compiler_specific.h"
 #include "content.h"
 #include "counterz.h"
@@ -13,9 +18,12 @@
 #include "cxx/include_processor/cpp_directive_parser.h"
 #include "cxx/include_processor/directive_filter.h"
 #include "cxx/include_processor/include_guard_detector.h"
+#include "cxx/include_processor/preparsed_directive_cache.h"
+#include "file_dir.h"
 #include "file_stat.h"
 #include "goma_hash.h"
 #include "histogram.h"
+#include "worker_thread_manager.h"
 
 MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
 #include "prototmp/goma_stats.pb.h"
@@ -23,27 +31,128 @@ MSVC_POP_WARNING()
 
 namespace devtools_goma {
 
+namespace {
+
+// Interval to check the size of preparsed directive cache.
+constexpr absl::Duration kPreparsedDirectiveCacheGCInterval =
+    absl::Minutes(1);
+
+size_t EstimateTokensSize(const std::vector<CppToken>& tokens) {
+  size_t size = tokens.capacity() * sizeof(CppToken);
+  for (const auto& token : tokens) {
+    size += token.string_value.capacity();
+  }
+  return size;
+}
+
+// Returns approximate heap usage of |directives| in bytes.
+size_t EstimateDirectivesSize(const CppDirectiveList& directives) {
+  size_t size = sizeof(CppDirectiveList) +
+                directives.capacity() * sizeof(CppDirectiveList::value_type);
+  for (const auto& directive : directives) {
+    switch (directive->type()) {
+      case CppDirectiveType::DIRECTIVE_INCLUDE:
+      case CppDirectiveType::DIRECTIVE_IMPORT:
+      case CppDirectiveType::DIRECTIVE_INCLUDE_NEXT: {
+        const auto& d =
+            static_cast<const CppDirectiveIncludeBase&>(*directive);
+        size += sizeof(CppDirectiveIncludeBase);
+        if (d.delimiter() == ' ') {
+          size += EstimateTokensSize(d.tokens());
+        } else {
+          size += d.filename().capacity();
+        }
+        break;
+      }
+      case CppDirectiveType::DIRECTIVE_DEFINE: {
+        const auto& d = AsCppDirectiveDefine(*directive);
+        size += sizeof(CppDirectiveDefine) + sizeof(Macro) +
+                d.name().capacity() + EstimateTokensSize(d.replacement());
+        break;
+      }
+      case CppDirectiveType::DIRECTIVE_UNDEF:
+        size += sizeof(CppDirectiveUndef) +
+                AsCppDirectiveUndef(*directive).name().capacity();
+        break;
+      case CppDirectiveType::DIRECTIVE_IFDEF:
+        size += sizeof(CppDirectiveIfdef) +
+                AsCppDirectiveIfdef(*directive).name().capacity();
+        break;
+      case CppDirectiveType::DIRECTIVE_IFNDEF:
+        size += sizeof(CppDirectiveIfndef) +
+                AsCppDirectiveIfndef(*directive).name().capacity();
+        break;
+      case CppDirectiveType::DIRECTIVE_IF:
+        size += sizeof(CppDirectiveIf) +
+                EstimateTokensSize(AsCppDirectiveIf(*directive).tokens());
+        break;
+      case CppDirectiveType::DIRECTIVE_ELIF:
+        size += sizeof(CppDirectiveElif) +
+                EstimateTokensSize(AsCppDirectiveElif(*directive).tokens());
+        break;
+      case CppDirectiveType::DIRECTIVE_ERROR: {
+        const auto& d = AsCppDirectiveError(*directive);
+        size += sizeof(CppDirectiveError) + d.error_reason().capacity() +
+                d.arg().capacity();
+        break;
+      }
+      default:
+        size += sizeof(CppDirectivePragma);
+        break;
+    }
+  }
+  return size;
+}
+
+}  // anonymous namespace
+
 // IncludeCache::Item owns |content|.
 class IncludeCache::Item {
  public:
   Item(IncludeItem include_item,
        absl::optional<SHA256HashValue> directive_hash,
-       const FileStat& content_file_stat)
+       const FileStat& content_file_stat,
+       size_t key_size)
       : include_item_(std::move(include_item)),
         directive_hash_(std::move(directive_hash)),
         content_file_stat_(content_file_stat),
+        // The key is held twice in LinkedUnorderedMap.
+        size_in_bytes_(sizeof(Item) + key_size * 2 +
+                       include_item_.include_guard_ident().capacity() +
+                       (include_item_.directives()
+                            ? EstimateDirectivesSize(
+                                  *include_item_.directives())
+                            : 0)),
         updated_count_(0) {}
 
   ~Item() {}
 
-  static std::unique_ptr<Item> CreateFromFile(const std::string& filepath,
-                                              const FileStat& file_stat,
-                                              bool needs_directive_hash) {
+  // If |preparsed| is not nullptr, directives are looked up from it by
+  // hash of the file content before parsing, and stored to it after parsing.
+  static std::unique_ptr<Item> CreateFromFile(
+      const std::string& filepath,
+      const FileStat& file_stat,
+      bool needs_directive_hash,
+      PreparsedDirectiveCache* preparsed) {
     std::unique_ptr<Content> content(Content::CreateFromFile(filepath));
     if (!content) {
       return nullptr;
     }
 
+    SHA256HashValue content_hash;
+    if (preparsed != nullptr) {
+      ComputeDataHashKeyForSHA256HashValue(content->ToStringView(),
+                                           &content_hash);
+      PreparsedDirectiveCache::Entry entry;
+      if (preparsed->Lookup(content_hash, needs_directive_hash, &entry)) {
+        if (!needs_directive_hash) {
+          entry.directive_hash.reset();
+        }
+        return Create(filepath, file_stat, std::move(entry.directives),
+                      std::move(entry.directive_hash));
+      }
+    }
+
     std::unique_ptr<Content> filtered_content(
         DirectiveFilter::MakeFilteredContent(*content));
 
@@ -55,20 +164,25 @@ class IncludeCache::Item {
 
     CppDirectiveOptimizer::Optimize(&directives);
 
-    std::string include_guard_ident = IncludeGuardDetector::Detect(directives);
-
     absl::optional<SHA256HashValue> directive_hash;
-    if (needs_directive_hash) {
+    // The stored entry should be usable for both needs_directive_hash
+    // cases, so calculate it anyway if |preparsed| is available.
+    if (needs_directive_hash || preparsed != nullptr) {
       SHA256HashValue h;
       ComputeDataHashKeyForSHA256HashValue(filtered_content->ToStringView(),
                                            &h);
       directive_hash = std::move(h);
     }
 
-    return absl::make_unique<Item>(
-        IncludeItem(std::make_shared<CppDirectiveList>(std::move(directives)),
-                    std::move(include_guard_ident)),
-        directive_hash, file_stat);
+    if (preparsed != nullptr) {
+      preparsed->Store(content_hash, directives, directive_hash);
+      if (!needs_directive_hash) {
+        directive_hash.reset();
+      }
+    }
+
+    return Create(filepath, file_stat, std::move(directives),
+                  std::move(directive_hash));
   }
 
   const IncludeItem& include_item() const { return include_item_; }
@@ -76,15 +190,30 @@ class IncludeCache::Item {
     return directive_hash_;
   }
   const FileStat& content_file_stat() const { return content_file_stat_; }
+  // Approximate memory usage of this item, used for the cache budget.
+  size_t size_in_bytes() const { return size_in_bytes_; }
 
   size_t updated_count() const { return updated_count_; }
   void set_updated_count(size_t c) { updated_count_ = c; }
 
  private:
+  static std::unique_ptr<Item> Create(
+      const std::string& filepath,
+      const FileStat& file_stat,
+      CppDirectiveList directives,
+      absl::optional<SHA256HashValue> directive_hash) {
+    std::string include_guard_ident = IncludeGuardDetector::Detect(directives);
+    return absl::make_unique<Item>(
+        IncludeItem(std::make_shared<CppDirectiveList>(std::move(directives)),
+                    std::move(include_guard_ident)),
+        std::move(directive_hash), file_stat, filepath.size());
+  }
+
   const IncludeItem include_item_;
   const absl::optional<SHA256HashValue> directive_hash_;
 
   const FileStat content_file_stat_;
+  const size_t size_in_bytes_;
   size_t updated_count_;
 
   DISALLOW_COPY_AND_ASSIGN(Item);
@@ -92,9 +221,47 @@ class IncludeCache::Item {
 
 IncludeCache* IncludeCache::instance_;
 
+constexpr size_t IncludeCache::kNumShards;
+
 // static
-void IncludeCache::Init(int max_cache_entries, bool calculates_directive_hash) {
-  instance_ = new IncludeCache(max_cache_entries, calculates_directive_hash);
+void IncludeCache::Init(int max_cache_size_in_mb,
+                        bool calculates_directive_hash) {
+  Init(max_cache_size_in_mb, calculates_directive_hash, "", 0, nullptr);
+}
+
+// static
+void IncludeCache::Init(int max_cache_size_in_mb,
+                        bool calculates_directive_hash,
+                        const std::string& preparsed_directive_cache_dir,
+                        int preparsed_directive_cache_max_in_mb,
+                        WorkerThreadManager* wm) {
+  std::unique_ptr<PreparsedDirectiveCache> preparsed;
+  if (!preparsed_directive_cache_dir.empty()) {
+    if (EnsureDirectory(preparsed_directive_cache_dir, 0755)) {
+      LOG(INFO) << "preparsed directive cache is enabled: "
+                << preparsed_directive_cache_dir
+                << " max_in_mb=" << preparsed_directive_cache_max_in_mb;
+      // Like LocalOutputCache, GC removes entries until the total size is
+      // well below the max, so that it won't run again soon.
+      const std::int64_t max_amount_byte =
+          static_cast<std::int64_t>(
+              std::max(preparsed_directive_cache_max_in_mb, 0)) *
+          1024 * 1024;
+      preparsed = absl::make_unique<PreparsedDirectiveCache>(
+          preparsed_directive_cache_dir, kBuiltRevisionString, max_amount_byte,
+          max_amount_byte / 4 * 3, wm);
+    } else {
+      LOG(ERROR) << "failed to create preparsed directive cache dir. "
+                 << "preparsed directive cache is disabled: "
+                 << preparsed_directive_cache_dir;
+    }
+  }
+  instance_ = new IncludeCache(
+      static_cast<size_t>(std::max(max_cache_size_in_mb, 0)) * 1024 * 1024,
+      kNumShards, calculates_directive_hash, std::move(preparsed));
+  if (wm != nullptr) {
+    instance_->StartPreparsedDirectiveCacheGC(wm);
+  }
 }
 
 // static
@@ -103,23 +270,61 @@ void IncludeCache::Quit() {
   instance_ = nullptr;
 }
 
-IncludeCache::IncludeCache(size_t max_cache_entries,
-                           bool calculates_directive_hash)
-    : max_cache_entries_(max_cache_entries),
+IncludeCache::IncludeCache(
+    size_t max_cache_size_in_bytes,
+    size_t num_shards,
+    bool calculates_directive_hash,
+    std::unique_ptr<PreparsedDirectiveCache> preparsed_directive_cache)
+    : max_cache_size_in_bytes_(max_cache_size_in_bytes),
+      max_shard_size_in_bytes_(max_cache_size_in_bytes / num_shards),
       calculates_directive_hash_(calculates_directive_hash),
-      count_item_updated_(0),
-      count_item_evicted_(0) {}
+      preparsed_directive_cache_(std::move(preparsed_directive_cache)) {
+  DCHECK_GT(num_shards, 0U);
+  shards_.reserve(num_shards);
+  for (size_t i = 0; i < num_shards; ++i) {
+    shards_.push_back(absl::make_unique<Shard>());
+  }
+}
 
 IncludeCache::~IncludeCache() {
+  if (preparsed_directive_cache_gc_closure_id_ != kInvalidPeriodicClosureId) {
+    preparsed_directive_cache_gc_wm_->UnregisterPeriodicClosure(
+        preparsed_directive_cache_gc_closure_id_);
+    preparsed_directive_cache_gc_closure_id_ = kInvalidPeriodicClosureId;
+  }
+}
+
+void IncludeCache::StartPreparsedDirectiveCacheGC(WorkerThreadManager* wm) {
+  if (!preparsed_directive_cache_ ||
+      !preparsed_directive_cache_->ShouldCollectGarbage()) {
+    return;
+  }
+  // The first run scans the cache dir to know the current total size.
+  preparsed_directive_cache_gc_wm_ = wm;
+  preparsed_directive_cache_gc_closure_id_ = wm->RegisterPeriodicClosure(
+      FROM_HERE, kPreparsedDirectiveCacheGCInterval,
+      NewPermanentCallback(this, &IncludeCache::RunPreparsedDirectiveCacheGC));
+}
+
+void IncludeCache::RunPreparsedDirectiveCacheGC() {
+  if (preparsed_directive_cache_->ShouldCollectGarbage()) {
+    preparsed_directive_cache_->CollectGarbage();
+  }
+}
+
+IncludeCache::Shard* IncludeCache::GetShard(const std::string& key) {
+  return shards_[absl::Hash<std::string>()(key) % shards_.size()].get();
 }
 
 IncludeItem IncludeCache::GetIncludeItem(const std::string& filepath,
                                          const FileStat& file_stat) {
   GOMA_COUNTERZ("GetDirectiveList");
 
+  Shard* shard = GetShard(filepath);
   {
-    AUTO_SHARED_LOCK(lock, &rwlock_);
-    if (const Item* item = GetItemIfNotModifiedUnlocked(filepath, file_stat)) {
+    AUTOLOCK(lock, &shard->mu);
+    if (const Item* item =
+            GetItemIfNotModifiedUnlocked(shard, filepath, file_stat)) {
       hit_count_.Add(1);
       return item->include_item();
     }
@@ -128,7 +333,8 @@ IncludeItem IncludeCache::GetIncludeItem(const std::string& filepath,
   missed_count_.Add(1);
 
   std::unique_ptr<Item> item(
-      Item::CreateFromFile(filepath, file_stat, calculates_directive_hash()));
+      Item::CreateFromFile(filepath, file_stat, calculates_directive_hash(),
+                           preparsed_directive_cache_.get()));
   if (!item) {
     return IncludeItem();
   }
@@ -136,8 +342,8 @@ IncludeItem IncludeCache::GetIncludeItem(const std::string& filepath,
   IncludeItem include_item = item->include_item();
 
   {
-    AUTO_EXCLUSIVE_LOCK(lock, &rwlock_);
-    InsertUnlocked(filepath, std::move(item), file_stat);
+    AUTOLOCK(lock, &shard->mu);
+    InsertUnlocked(shard, filepath, std::move(item));
   }
 
   return include_item;
@@ -148,90 +354,146 @@ absl::optional<SHA256HashValue> IncludeCache::GetDirectiveHash(
     const FileStat& file_stat) {
   DCHECK(calculates_directive_hash_);
 
+  Shard* shard = GetShard(filepath);
   {
-    AUTO_SHARED_LOCK(lock, &rwlock_);
-    if (const Item* item = GetItemIfNotModifiedUnlocked(filepath, file_stat)) {
+    AUTOLOCK(lock, &shard->mu);
+    if (const Item* item =
+            GetItemIfNotModifiedUnlocked(shard, filepath, file_stat)) {
       return item->directive_hash();
     }
   }
 
   std::unique_ptr<Item> item(
-      Item::CreateFromFile(filepath, file_stat, calculates_directive_hash()));
+      Item::CreateFromFile(filepath, file_stat, calculates_directive_hash(),
+                           preparsed_directive_cache_.get()));
   if (!item) {
     return absl::nullopt;
   }
   absl::optional<SHA256HashValue> directive_hash = item->directive_hash();
 
   {
-    AUTO_EXCLUSIVE_LOCK(lock, &rwlock_);
-    InsertUnlocked(filepath, std::move(item), file_stat);
+    AUTOLOCK(lock, &shard->mu);
+    InsertUnlocked(shard, filepath, std::move(item));
   }
   return directive_hash;
 }
 
 const IncludeCache::Item* IncludeCache::GetItemIfNotModifiedUnlocked(
+    Shard* shard,
     const std::string& key,
-    const FileStat& file_stat) const {
-  auto it = cache_items_.find(key);
-  if (it == cache_items_.end())
+    const FileStat& file_stat) {
+  auto it = shard->cache_items.find(key);
+  if (it == shard->cache_items.end())
     return nullptr;
 
   const Item* item = it->second.get();
   if (file_stat != item->content_file_stat())
     return nullptr;
 
+  shard->cache_items.MoveToBack(it);
   return item;
 }
 
-void IncludeCache::InsertUnlocked(const std::string& key,
-                                  std::unique_ptr<Item> item,
-                                  const FileStat& file_stat) {
-  auto it = cache_items_.find(key);
-  if (it == cache_items_.end()) {
-    cache_items_.emplace_back(key, std::move(item));
+void IncludeCache::InsertUnlocked(Shard* shard,
+                                  const std::string& key,
+                                  std::unique_ptr<Item> item) {
+  shard->resident_bytes += item->size_in_bytes();
+  auto it = shard->cache_items.find(key);
+  if (it == shard->cache_items.end()) {
+    shard->cache_items.emplace_back(key, std::move(item));
   } else {
+    DCHECK_GE(shard->resident_bytes, it->second->size_in_bytes());
+    shard->resident_bytes -= it->second->size_in_bytes();
     item->set_updated_count(it->second->updated_count() + 1);
-    it->second = std::move(item);
+    count_item_updated_.Add(1);
+    // emplace_back moves the entry to the last.
+    shard->cache_items.emplace_back(key, std::move(item));
   }
 
-  EvictCacheUnlocked();
+  EvictCacheUnlocked(shard);
 }
 
-void IncludeCache::EvictCacheUnlocked() {
-  // Evicts older cache.
-  while (max_cache_entries_ < cache_items_.size()) {
-    DCHECK(!cache_items_.empty());
-    cache_items_.pop_front();
-    count_item_evicted_++;
+void IncludeCache::EvictCacheUnlocked(Shard* shard) {
+  // Evicts least recently used cache.
+  while (max_shard_size_in_bytes_ < shard->resident_bytes) {
+    DCHECK(!shard->cache_items.empty());
+    const size_t size = shard->cache_items.front().second->size_in_bytes();
+    DCHECK_GE(shard->resident_bytes, size);
+    shard->resident_bytes -= size;
+    shard->cache_items.pop_front();
+    count_item_evicted_.Add(1);
   }
 }
 
-void IncludeCache::Dump(std::ostringstream* ss) {
-  AUTO_SHARED_LOCK(lock, &rwlock_);
+size_t IncludeCache::TotalEntries() const {
+  size_t total = 0;
+  for (const auto& shard : shards_) {
+    AUTOLOCK(lock, &shard->mu);
+    total += shard->cache_items.size();
+  }
+  return total;
+}
+
+size_t IncludeCache::TotalResidentBytes() const {
+  size_t total = 0;
+  for (const auto& shard : shards_) {
+    AUTOLOCK(lock, &shard->mu);
+    total += shard->resident_bytes;
+  }
+  return total;
+}
 
-  size_t num_cache_item = cache_items_.size();
+void IncludeCache::Dump(std::ostringstream* ss) {
+  size_t num_cache_item = 0;
+  size_t resident_bytes = 0;
 
   Histogram item_update_count_histogram;
   item_update_count_histogram.SetName("Item Update Count Histogram");
 
-  for (const auto& it : cache_items_) {
-    const Item* item = it.second.get();
-    item_update_count_histogram.Add(item->updated_count());
+  for (const auto& shard : shards_) {
+    AUTOLOCK(lock, &shard->mu);
+    num_cache_item += shard->cache_items.size();
+    resident_bytes += shard->resident_bytes;
+    for (const auto& it : shard->cache_items) {
+      const Item* item = it.second.get();
+      item_update_count_histogram.Add(item->updated_count());
+    }
   }
 
   (*ss) << "IncludeCache summary" << std::endl;
 
   (*ss) << std::endl;
   (*ss) << "current cache entries = " << num_cache_item << std::endl
-        << "entry capacity = " << max_cache_entries_ << std::endl;
+        << "resident bytes = " << resident_bytes << std::endl
+        << "capacity bytes = " << max_cache_size_in_bytes_ << std::endl
+        << "shards = " << shards_.size() << std::endl;
 
   (*ss) << std::endl;
   (*ss) << " Hit    = " << hit_count_.value() << std::endl;
   (*ss) << " Missed = " << missed_count_.value() << std::endl;
 
   (*ss) << std::endl;
-  (*ss) << "Item updated count = " << count_item_updated_ << std::endl;
-  (*ss) << "Item evicted count = " << count_item_evicted_ << std::endl;
+  (*ss) << "Item updated count = " << count_item_updated_.value() << std::endl;
+  (*ss) << "Item evicted count = " << count_item_evicted_.value() << std::endl;
+
+  if (preparsed_directive_cache_) {
+    (*ss) << std::endl;
+    (*ss) << "Preparsed directive cache dir = "
+          << preparsed_directive_cache_->cache_dir() << std::endl;
+    (*ss) << " Hit     = " << preparsed_directive_cache_->hit() << std::endl;
+    (*ss) << " Missed  = " << preparsed_directive_cache_->missed()
+          << std::endl;
+    (*ss) << " Invalid = " << preparsed_directive_cache_->invalid()
+          << std::endl;
+    (*ss) << " Stored  = " << preparsed_directive_cache_->stored()
+          << std::endl;
+    (*ss) << " GC count         = " << preparsed_directive_cache_->gc_count()
+          << std::endl;
+    (*ss) << " GC removed items = "
+          << preparsed_directive_cache_->gc_removed_items() << std::endl;
+    (*ss) << " GC removed bytes = "
+          << preparsed_directive_cache_->gc_removed_bytes() << std::endl;
+  }
 
   // TODO: DebugString() will crash when there is no item.
   // Add a unittest and fix it later.
@@ -248,7 +510,7 @@ void IncludeCache::DumpAll(std::ostringstream* ss) {
   if (!IncludeCache::IsEnabled()) {
     (*ss) << "IncludeCache is not enabled." << std::endl;
     (*ss) << "To enable it, set environment variable "
-          << "GOMA_MAX_INCLUDE_CACHE_SIZE more than 0." << std::endl;
+          << "GOMA_MAX_INCLUDE_CACHE_SIZE_IN_MB more than 0." << std::endl;
     return;
   }
 
@@ -256,16 +518,17 @@ void IncludeCache::DumpAll(std::ostringstream* ss) {
 }
 
 void IncludeCache::DumpStatsToProto(IncludeCacheStats* stats) {
-
   stats->set_hit(hit_count_.value());
   stats->set_missed(missed_count_.value());
-
-  {
-    AUTO_SHARED_LOCK(lock, &rwlock_);
-    stats->set_total_entries(cache_items_.size());
-
-    stats->set_updated(count_item_updated_);
-    stats->set_evicted(count_item_evicted_);
+  stats->set_updated(count_item_updated_.value());
+  stats->set_evicted(count_item_evicted_.value());
+  stats->set_total_entries(TotalEntries());
+  stats->set_resident_bytes(TotalResidentBytes());
+  if (preparsed_directive_cache_) {
+    stats->set_preparsed_hit(preparsed_directive_cache_->hit());
+    stats->set_preparsed_missed(preparsed_directive_cache_->missed() +
+                                preparsed_directive_cache_->invalid());
+    stats->set_preparsed_stored(preparsed_directive_cache_->stored());
   }
 }
 
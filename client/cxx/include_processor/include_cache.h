@@ -6,9 +6,10 @@
 #ifndef DEVTOOLS_GOMA_CLIENT_CXX_INCLUDE_PROCESSOR_INCLUDE_CACHE_H_
 #define DEVTOOLS_GOMA_CLIENT_CXX_INCLUDE_PROCESSOR_INCLUDE_CACHE_H_
 
-#include <list>
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "absl/base/thread_annotations.h"
 #include "absl/types/optional.h"
@@ -18,11 +19,14 @@
 #include "cxx/include_processor/include_item.h"
 #include "goma_hash.h"
 #include "linked_unordered_map.h"
+#include "worker_thread.h"
 
 namespace devtools_goma {
 
 struct FileStat;
 class IncludeCacheStats;
+class PreparsedDirectiveCache;
+class WorkerThreadManager;
 
 // IncludeCache stores the parsed result of include headers.
 class IncludeCache {
@@ -31,11 +35,24 @@ class IncludeCache {
   static bool IsEnabled() { return instance_ != NULL; }
 
   // Initializes IncludeCache.
-  // |max_cache_entries| specifies the maximum number of cache entries.
-  // If the number of cache entries exceeds this value, the oldest cache will be
-  // evicted. When |calculates_directive_hash| is true, we also calculate the
-  // hash value of cache item. This value will be used from DepsCache.
-  static void Init(int max_cache_entries, bool calculates_directive_hash);
+  // |max_cache_size_in_mb| specifies the memory budget of cache entries.
+  // If the estimated size of cache entries exceeds this value, the least
+  // recently used cache will be evicted. When |calculates_directive_hash| is
+  // true, we also calculate the hash value of cache item. This value will be
+  // used from DepsCache.
+  static void Init(int max_cache_size_in_mb, bool calculates_directive_hash);
+  // Same as above, but parsed directives are also stored in
+  // |preparsed_directive_cache_dir| by hash of file content, and reused
+  // across compiler_proxy processes. Disabled if the dir is empty.
+  // If |wm| is not nullptr, entries are written in worker threads, and
+  // if |preparsed_directive_cache_max_in_mb| is also positive, least recently
+  // used entries in the dir are removed periodically so that their total
+  // size doesn't exceed the max.
+  static void Init(int max_cache_size_in_mb,
+                   bool calculates_directive_hash,
+                   const std::string& preparsed_directive_cache_dir,
+                   int preparsed_directive_cache_max_in_mb,
+                   WorkerThreadManager* wm);
   static void Quit();
 
   // Get IncludeItem from cache or file.
@@ -61,35 +78,65 @@ class IncludeCache {
   class Item;
   friend class IncludeCacheTest;
 
-  IncludeCache(size_t max_cache_entries, bool calculates_directive_hash);
+  // Cache entries are split into shards by filepath, so that lookups of
+  // different files don't contend on one lock. Each shard is an LRU with
+  // |max_cache_size_in_bytes_| / |num_shards| budget.
+  struct Shard {
+    mutable Lock mu;
+    // A map from filepath to unique_ptr<Item>.
+    // The least recently used item comes first.
+    LinkedUnorderedMap<std::string, std::unique_ptr<Item>> cache_items
+        GUARDED_BY(mu);
+    // Sum of Item::size_in_bytes() of |cache_items|.
+    size_t resident_bytes GUARDED_BY(mu) = 0;
+  };
+
+  static constexpr size_t kNumShards = 16;
+
+  IncludeCache(size_t max_cache_size_in_bytes,
+               size_t num_shards,
+               bool calculates_directive_hash,
+               std::unique_ptr<PreparsedDirectiveCache>
+                   preparsed_directive_cache);
   ~IncludeCache();
 
+  Shard* GetShard(const std::string& key);
+
+  // Returns the cached item of |key| if it is not modified, and marks it as
+  // most recently used.
   const IncludeCache::Item* GetItemIfNotModifiedUnlocked(
+      Shard* shard,
       const std::string& key,
-      const FileStat& file_stat) const SHARED_LOCKS_REQUIRED(rwlock_);
-  void InsertUnlocked(const std::string& key,
-                      std::unique_ptr<Item> include_item,
-                      const FileStat& file_stat)
-      EXCLUSIVE_LOCKS_REQUIRED(rwlock_);
-  void EvictCacheUnlocked() EXCLUSIVE_LOCKS_REQUIRED(rwlock_);
+      const FileStat& file_stat) EXCLUSIVE_LOCKS_REQUIRED(shard->mu);
+  void InsertUnlocked(Shard* shard,
+                      const std::string& key,
+                      std::unique_ptr<Item> include_item)
+      EXCLUSIVE_LOCKS_REQUIRED(shard->mu);
+  void EvictCacheUnlocked(Shard* shard) EXCLUSIVE_LOCKS_REQUIRED(shard->mu);
+
+  void StartPreparsedDirectiveCacheGC(WorkerThreadManager* wm);
+  void RunPreparsedDirectiveCacheGC();
+
+  size_t TotalEntries() const;
+  size_t TotalResidentBytes() const;
 
   static IncludeCache* instance_;
 
-  const size_t max_cache_entries_;
+  const size_t max_cache_size_in_bytes_;
+  const size_t max_shard_size_in_bytes_;
   const bool calculates_directive_hash_;
+  // nullptr if preparsed directive cache is disabled.
+  const std::unique_ptr<PreparsedDirectiveCache> preparsed_directive_cache_;
+  WorkerThreadManager* preparsed_directive_cache_gc_wm_ = nullptr;
+  PeriodicClosureId preparsed_directive_cache_gc_closure_id_ =
+      kInvalidPeriodicClosureId;
 
-  ReadWriteLock rwlock_;
-  // A map from filepath to unique_ptr<Item>.
-  // The oldest item comes first.
-  // TODO: We might want to use LRU instead of just queue.
-  // Currently we're not updating |cache_items_| after referring.
-  LinkedUnorderedMap<std::string, std::unique_ptr<Item>> cache_items_;
-
-  size_t count_item_updated_;
-  size_t count_item_evicted_;
+  std::vector<std::unique_ptr<Shard>> shards_;
 
   StatsCounter hit_count_;
   StatsCounter missed_count_;
+  StatsCounter count_item_updated_;
+  StatsCounter count_item_evicted_;
 
   DISALLOW_COPY_AND_ASSIGN(IncludeCache);
 };
@@ -6,32 +6,56 @@
 #include "include_cache.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <vector>
 
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
 #include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "compiler_specific.h"
 #include "content.h"
+#include "cxx/include_processor/directive_filter.h"
+#include "cxx/include_processor/preparsed_directive_cache.h"
+#include "file_helper.h"
 #include "file_stat.h"
 #include "file_stat_cache.h"
 #include "goma_hash.h"
+#include "path.h"
 #include "unittest_util.h"
+#include "worker_thread_manager.h"
+
+MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
+#include "prototmp/goma_stats.pb.h"
+MSVC_POP_WARNING()
 
 namespace devtools_goma {
 
 class IncludeCacheTest : public testing::Test {
  protected:
   void SetUp() override {
-    IncludeCache::Init(2, true);  // can keep only 2 items.
+    IncludeCache::Init(32, true);
   }
 
   void TearDown() override {
     IncludeCache::Quit();
   }
 
+  // Replaces the instance with a single shard cache, so that the budget
+  // is checked against all entries.
+  void InitWithMaxBytes(size_t max_cache_size_in_bytes) {
+    IncludeCache::Quit();
+    IncludeCache::instance_ =
+        new IncludeCache(max_cache_size_in_bytes, 1, true, nullptr);
+  }
+
   int Size(IncludeCache* include_cache) const {
-    return include_cache->cache_items_.size();
+    return include_cache->TotalEntries();
+  }
+  size_t ResidentBytes(IncludeCache* include_cache) const {
+    return include_cache->TotalResidentBytes();
   }
 
   size_t HitCount(IncludeCache* include_cache) const {
@@ -109,12 +133,9 @@ TEST_F(IncludeCacheTest, SetGetIfMaxSizeIsZero) {
 }
 
 TEST_F(IncludeCacheTest, ExceedMemory) {
-  IncludeCache* ic = IncludeCache::instance();
-
   TmpdirUtil tmpdir("includecache");
 
   std::vector<std::string> paths;
-  std::vector<std::string> contents;
   std::vector<FileStat> file_stats;
   for (size_t i = 0; i < 3; ++i) {
     std::string filename = absl::StrCat("a", i, ".h");
@@ -127,10 +148,16 @@ TEST_F(IncludeCacheTest, ExceedMemory) {
     file_stat.mtime = absl::FromTimeT(100);
 
     paths.push_back(std::move(path));
-    contents.push_back(std::move(content));
     file_stats.push_back(std::move(file_stat));
   }
 
+  // All items have the same size. Keep only 2 items.
+  (void)IncludeCache::instance()->GetIncludeItem(paths[0], file_stats[0]);
+  const size_t item_size = ResidentBytes(IncludeCache::instance());
+  ASSERT_GT(item_size, 0U);
+  InitWithMaxBytes(item_size * 2 + item_size / 2);
+  IncludeCache* ic = IncludeCache::instance();
+
   size_t hit_count_0 = HitCount(ic);
   size_t missed_count_0 = MissedCount(ic);
 
@@ -138,16 +165,19 @@ TEST_F(IncludeCacheTest, ExceedMemory) {
   EXPECT_EQ(hit_count_0, HitCount(ic));
   EXPECT_EQ(missed_count_0 + 1, MissedCount(ic));
   EXPECT_EQ(1, Size(ic));
+  EXPECT_EQ(item_size, ResidentBytes(ic));
 
   (void)ic->GetIncludeItem(paths[1], file_stats[1]);
   EXPECT_EQ(hit_count_0, HitCount(ic));
   EXPECT_EQ(missed_count_0 + 2, MissedCount(ic));
   EXPECT_EQ(2, Size(ic));
+  EXPECT_EQ(item_size * 2, ResidentBytes(ic));
 
   (void)ic->GetIncludeItem(paths[2], file_stats[2]);
   EXPECT_EQ(hit_count_0, HitCount(ic));
   EXPECT_EQ(missed_count_0 + 3, MissedCount(ic));
   EXPECT_EQ(2, Size(ic));
+  EXPECT_EQ(item_size * 2, ResidentBytes(ic));
 
   // Reload [0]. It must have been evicted.
   (void)ic->GetIncludeItem(paths[0], file_stats[0]);
@@ -156,6 +186,80 @@ TEST_F(IncludeCacheTest, ExceedMemory) {
   EXPECT_EQ(2, Size(ic));
 }
 
+TEST_F(IncludeCacheTest, EvictLeastRecentlyUsed) {
+  TmpdirUtil tmpdir("includecache");
+
+  std::vector<std::string> paths;
+  std::vector<FileStat> file_stats;
+  for (size_t i = 0; i < 3; ++i) {
+    std::string filename = absl::StrCat("a", i, ".h");
+    std::string content = absl::StrCat("#include <b", i, ".h>\n");
+    tmpdir.CreateTmpFile(filename, content);
+
+    FileStat file_stat;
+    file_stat.size = content.size();
+    file_stat.mtime = absl::FromTimeT(100);
+
+    paths.push_back(tmpdir.FullPath(filename));
+    file_stats.push_back(std::move(file_stat));
+  }
+
+  (void)IncludeCache::instance()->GetIncludeItem(paths[0], file_stats[0]);
+  const size_t item_size = ResidentBytes(IncludeCache::instance());
+  InitWithMaxBytes(item_size * 2 + item_size / 2);
+  IncludeCache* ic = IncludeCache::instance();
+
+  (void)ic->GetIncludeItem(paths[0], file_stats[0]);
+  (void)ic->GetIncludeItem(paths[1], file_stats[1]);
+
+  // Hit [0], so [1] becomes the least recently used.
+  size_t hit_count_0 = HitCount(ic);
+  (void)ic->GetIncludeItem(paths[0], file_stats[0]);
+  EXPECT_EQ(hit_count_0 + 1, HitCount(ic));
+
+  // Loading [2] evicts [1].
+  (void)ic->GetIncludeItem(paths[2], file_stats[2]);
+  EXPECT_EQ(2, Size(ic));
+
+  size_t missed_count_0 = MissedCount(ic);
+  (void)ic->GetIncludeItem(paths[0], file_stats[0]);
+  EXPECT_EQ(hit_count_0 + 2, HitCount(ic));
+  EXPECT_EQ(missed_count_0, MissedCount(ic));
+
+  (void)ic->GetIncludeItem(paths[1], file_stats[1]);
+  EXPECT_EQ(hit_count_0 + 2, HitCount(ic));
+  EXPECT_EQ(missed_count_0 + 1, MissedCount(ic));
+}
+
+TEST_F(IncludeCacheTest, DumpStatsToProto) {
+  IncludeCache* ic = IncludeCache::instance();
+
+  TmpdirUtil tmpdir("includecache");
+  std::string ah = tmpdir.FullPath("a.h");
+  std::string content = "#include <stdio.h>\n#define A(x) x + 1\n";
+  tmpdir.CreateTmpFile("a.h", content);
+
+  FileStat file_stat;
+  file_stat.size = content.size();
+  file_stat.mtime = absl::FromTimeT(100);
+
+  (void)ic->GetIncludeItem(ah, file_stat);
+  (void)ic->GetIncludeItem(ah, file_stat);
+  // Update the entry.
+  file_stat.mtime = absl::FromTimeT(105);
+  (void)ic->GetIncludeItem(ah, file_stat);
+
+  IncludeCacheStats stats;
+  ic->DumpStatsToProto(&stats);
+  EXPECT_EQ(1, stats.total_entries());
+  EXPECT_EQ(1, stats.hit());
+  EXPECT_EQ(2, stats.missed());
+  EXPECT_EQ(1, stats.updated());
+  EXPECT_EQ(0, stats.evicted());
+  EXPECT_GT(stats.resident_bytes(), static_cast<int64_t>(ah.size()));
+  EXPECT_EQ(static_cast<int64_t>(ResidentBytes(ic)), stats.resident_bytes());
+}
+
 TEST_F(IncludeCacheTest, GetDirectiveHash)
 {
   IncludeCache* ic = IncludeCache::instance();
@@ -224,6 +328,185 @@ TEST_F(IncludeCacheTest, GetDirectiveHash)
   }
 }
 
+TEST_F(IncludeCacheTest, PreparsedDirectiveCache) {
+  TmpdirUtil tmpdir("includecache");
+  const std::string cache_dir = tmpdir.FullPath("preparsed");
+  const std::string ah = tmpdir.FullPath("a.h");
+  const std::string content =
+      "#ifndef A_H_\n"
+      "#define A_H_\n"
+      "#include <stdio.h>\n"
+      "#define F(x, ...) x(__VA_ARGS__)\n"
+      "#endif\n";
+  tmpdir.CreateTmpFile("a.h", content);
+
+  FileStat file_stat;
+  file_stat.size = content.size();
+  file_stat.mtime = absl::FromTimeT(100);
+
+  IncludeCache::Quit();
+  IncludeCache::Init(32, false, cache_dir, 0, nullptr);
+  IncludeItem parsed = IncludeCache::instance()->GetIncludeItem(ah, file_stat);
+  ASSERT_TRUE(parsed.IsValid());
+  {
+    IncludeCacheStats stats;
+    IncludeCache::instance()->DumpStatsToProto(&stats);
+    EXPECT_EQ(0, stats.preparsed_hit());
+    EXPECT_EQ(1, stats.preparsed_missed());
+    EXPECT_EQ(1, stats.preparsed_stored());
+  }
+
+  // Emulates restart of compiler_proxy. Directives should be loaded from
+  // the preparsed directive cache, and directive hash should be available
+  // even though the entry was stored without calculates_directive_hash.
+  IncludeCache::Quit();
+  IncludeCache::Init(32, true, cache_dir, 0, nullptr);
+  IncludeCache* ic = IncludeCache::instance();
+  IncludeItem loaded = ic->GetIncludeItem(ah, file_stat);
+  ASSERT_TRUE(loaded.IsValid());
+  EXPECT_EQ(parsed.include_guard_ident(), loaded.include_guard_ident());
+  EXPECT_EQ("A_H_", loaded.include_guard_ident());
+  ASSERT_EQ(parsed.directives()->size(), loaded.directives()->size());
+  for (size_t i = 0; i < parsed.directives()->size(); ++i) {
+    EXPECT_EQ((*parsed.directives())[i]->DebugString(),
+              (*loaded.directives())[i]->DebugString());
+  }
+  {
+    IncludeCacheStats stats;
+    ic->DumpStatsToProto(&stats);
+    EXPECT_EQ(1, stats.preparsed_hit());
+    EXPECT_EQ(0, stats.preparsed_missed());
+    EXPECT_EQ(0, stats.preparsed_stored());
+  }
+
+  // The same file content in another path hits the cache, too.
+  const std::string bh = tmpdir.FullPath("b.h");
+  tmpdir.CreateTmpFile("b.h", content);
+  std::unique_ptr<Content> filtered(DirectiveFilter::MakeFilteredContent(
+      *Content::CreateFromBuffer(content.data(), content.size())));
+  SHA256HashValue hash_expected;
+  ComputeDataHashKeyForSHA256HashValue(filtered->ToStringView(),
+                                       &hash_expected);
+  absl::optional<SHA256HashValue> hash_actual =
+      ic->GetDirectiveHash(bh, file_stat);
+  ASSERT_TRUE(hash_actual.has_value());
+  EXPECT_EQ(hash_expected, hash_actual.value());
+  {
+    IncludeCacheStats stats;
+    ic->DumpStatsToProto(&stats);
+    EXPECT_EQ(2, stats.preparsed_hit());
+  }
+
+  // Modified content is parsed again.
+  const std::string new_content = content + "#include <string.h>\n";
+  tmpdir.CreateTmpFile("a.h", new_content);
+  file_stat.size = new_content.size();
+  IncludeItem modified = ic->GetIncludeItem(ah, file_stat);
+  ASSERT_TRUE(modified.IsValid());
+  EXPECT_EQ(parsed.directives()->size() + 1, modified.directives()->size());
+  {
+    IncludeCacheStats stats;
+    ic->DumpStatsToProto(&stats);
+    EXPECT_EQ(2, stats.preparsed_hit());
+    EXPECT_EQ(1, stats.preparsed_missed());
+    EXPECT_EQ(1, stats.preparsed_stored());
+  }
+}
+
+TEST_F(IncludeCacheTest, PreparsedDirectiveCacheRevision) {
+  TmpdirUtil tmpdir("includecache");
+  const std::string cache_dir = tmpdir.FullPath("preparsed");
+  SHA256HashValue hash;
+  ComputeDataHashKeyForSHA256HashValue("a", &hash);
+
+  // Entries are written in a worker thread.
+  WorkerThreadManager wm;
+  wm.Start(1);
+  {
+    PreparsedDirectiveCache cache(cache_dir, "old", 0, 0, &wm);
+    EXPECT_TRUE(cache.Store(hash, CppDirectiveList(), absl::nullopt));
+    // Destructor waits for the write.
+  }
+  wm.Finish();
+
+  PreparsedDirectiveCache::Entry entry;
+  {
+    PreparsedDirectiveCache cache(cache_dir, "old", 0, 0, nullptr);
+    EXPECT_TRUE(cache.Lookup(hash, false, &entry));
+    EXPECT_EQ(1, cache.hit());
+  }
+
+  // Entries stored by another revision of compiler_proxy must not be used.
+  PreparsedDirectiveCache cache(cache_dir, "new", 0, 0, nullptr);
+  EXPECT_FALSE(cache.Lookup(hash, false, &entry));
+  EXPECT_EQ(1, cache.invalid());
+  ASSERT_TRUE(cache.Store(hash, CppDirectiveList(), absl::nullopt));
+  EXPECT_TRUE(cache.Lookup(hash, false, &entry));
+  EXPECT_EQ(1, cache.hit());
+}
+
+#ifndef _WIN32
+// mtime of entries are not updated on lookup on Windows.
+TEST_F(IncludeCacheTest, PreparsedDirectiveCacheGC) {
+  TmpdirUtil tmpdir("includecache");
+  const std::string cache_dir = tmpdir.FullPath("preparsed");
+
+  std::vector<std::string> paths;
+  std::vector<SHA256HashValue> hashes;
+  for (const auto& content : {"a", "b", "c"}) {
+    SHA256HashValue hash;
+    ComputeDataHashKeyForSHA256HashValue(content, &hash);
+    const std::string hex = hash.ToHexString();
+    hashes.push_back(hash);
+    paths.push_back(file::JoinPath(cache_dir, hex.substr(0, 2), hex));
+  }
+
+  // All entries have the same size.
+  {
+    PreparsedDirectiveCache cache(cache_dir, "rev", 0, 0, nullptr);
+    for (const auto& hash : hashes) {
+      ASSERT_TRUE(cache.Store(hash, CppDirectiveList(), absl::nullopt));
+    }
+    EXPECT_FALSE(cache.ShouldCollectGarbage());
+  }
+  const std::int64_t entry_size = FileStat(paths[0]).size;
+  ASSERT_GT(entry_size, 0);
+
+  const absl::Time now = absl::Now();
+  ASSERT_TRUE(UpdateMtime(paths[0], now - absl::Hours(4)));
+  ASSERT_TRUE(UpdateMtime(paths[1], now - absl::Hours(3)));
+  ASSERT_TRUE(UpdateMtime(paths[2], now - absl::Hours(2)));
+  // Stale tmp file should be removed, too.
+  const std::string tmp_path = paths[0] + ".tmp.1.0";
+  ASSERT_TRUE(WriteStringToFile("broken", tmp_path));
+  ASSERT_TRUE(UpdateMtime(tmp_path, now - absl::Hours(2)));
+
+  PreparsedDirectiveCache cache(cache_dir, "rev", entry_size * 2, entry_size,
+                                nullptr);
+  // Total size is not known yet.
+  EXPECT_TRUE(cache.ShouldCollectGarbage());
+
+  // Looking up "b" makes it the most recently used.
+  PreparsedDirectiveCache::Entry entry;
+  ASSERT_TRUE(cache.Lookup(hashes[1], false, &entry));
+
+  cache.CollectGarbage();
+  EXPECT_FALSE(FileStat(paths[0]).IsValid());
+  EXPECT_TRUE(FileStat(paths[1]).IsValid());
+  EXPECT_FALSE(FileStat(paths[2]).IsValid());
+  EXPECT_FALSE(FileStat(tmp_path).IsValid());
+  EXPECT_EQ(2, cache.gc_removed_items());
+  EXPECT_EQ(entry_size * 2, cache.gc_removed_bytes());
+  EXPECT_FALSE(cache.ShouldCollectGarbage());
+
+  // Stores exceeding the max need another GC.
+  ASSERT_TRUE(cache.Store(hashes[0], CppDirectiveList(), absl::nullopt));
+  EXPECT_FALSE(cache.ShouldCollectGarbage());
+  ASSERT_TRUE(cache.Store(hashes[2], CppDirectiveList(), absl::nullopt));
+  EXPECT_TRUE(cache.ShouldCollectGarbage());
+}
+#endif
+
 TEST_F(IncludeCacheTest, DumpEmpty) {
   IncludeCache* ic = IncludeCache::instance();
 
@@ -8,12 +8,15 @@
 
 #include "absl/strings/ascii.h"
 #include "absl/strings/match.h"
+#include "autolock_timer.h"
 #include "counterz.h"
 #include "cpp_parser.h"
 #include "file_dir.h"
 #include "file_stat_cache.h"
 #include "include_file_utils.h"
+#include "linked_unordered_map.h"
 #include "list_dir_cache.h"
+#include "lockhelper.h"
 #include "path.h"
 #include "path_resolver.h"
 
@@ -34,36 +37,117 @@ std::string RemoveDuplicateSlash(const std::string& path) {
   return res;
 }
 
+// Shared IncludeDirIndexes keyed by (cwd, ignore_case, include_dirs).
+// The least recently used one comes first.
+struct SharedIncludeDirIndexes {
+  Lock mu;
+  LinkedUnorderedMap<std::string, std::shared_ptr<IncludeDirIndex>> indexes
+      GUARDED_BY(mu);
+};
+
+SharedIncludeDirIndexes* GetSharedIncludeDirIndexes() {
+  static SharedIncludeDirIndexes* shared = new SharedIncludeDirIndexes;
+  return shared;
+}
+
+std::string IncludeDirIndexKey(const std::string& cwd,
+                               bool ignore_case,
+                               const std::vector<std::string>& include_dirs) {
+  std::string key = cwd;
+  key += ignore_case ? "\n1" : "\n0";
+  for (const auto& dir : include_dirs) {
+    key += '\n';
+    key += dir;
+  }
+  return key;
+}
+
+// Returns true if |current| can be different from |old|.
+bool IsDirUpdated(const FileStat& current, const FileStat& old) {
+  if (!old.mtime.has_value() || !current.mtime.has_value()) {
+    return current != old;
+  }
+  return current.CanBeNewerThan(old);
+}
+
 }  // anonymous namespace
 
-bool IncludeFileFinder::gch_hack_ = false;
+constexpr size_t IncludeDirIndex::kMaxSharedIndexes;
 
 /* static */
-void IncludeFileFinder::Init(bool gch_hack) {
-  gch_hack_ = gch_hack;
+std::shared_ptr<IncludeDirIndex> IncludeDirIndex::Get(
+    const std::string& cwd,
+    bool ignore_case,
+    const std::vector<std::string>& include_dirs,
+    FileStatCache* file_stat_cache) {
+  SharedIncludeDirIndexes* shared = GetSharedIncludeDirIndexes();
+  const std::string key = IncludeDirIndexKey(cwd, ignore_case, include_dirs);
+
+  std::shared_ptr<IncludeDirIndex> index;
+  {
+    AUTOLOCK(lock, &shared->mu);
+    auto iter = shared->indexes.find(key);
+    if (iter != shared->indexes.end()) {
+      index = iter->second;
+      shared->indexes.MoveToBack(iter);
+    }
+  }
+  if (index && index->IsUpToDate(cwd, include_dirs, file_stat_cache)) {
+    GOMA_COUNTERZ("hit");
+    return index;
+  }
+  GOMA_COUNTERZ("miss");
+
+  index.reset(
+      new IncludeDirIndex(cwd, ignore_case, include_dirs, file_stat_cache));
+  if (!index->shareable_) {
+    return index;
+  }
+
+  AUTOLOCK(lock, &shared->mu);
+  shared->indexes.emplace_back(key, index);
+  while (shared->indexes.size() > kMaxSharedIndexes) {
+    shared->indexes.pop_front();
+  }
+  return index;
 }
 
-IncludeFileFinder::IncludeFileFinder(
-    std::string cwd,
-    bool ignore_case,
-    const std::vector<std::string>* include_dirs,
-    const std::vector<std::string>* framework_dirs,
-    FileStatCache* file_stat_cache)
-    : cwd_(std::move(cwd)),
-      ignore_case_(ignore_case),
-      include_dirs_(include_dirs),
-      framework_dirs_(framework_dirs),
-      file_stat_cache_(file_stat_cache) {
-  GOMA_COUNTERZ("IncludeFileFinder");
+/* static */
+void IncludeDirIndex::ClearSharedIndexes() {
+  SharedIncludeDirIndexes* shared = GetSharedIncludeDirIndexes();
+  AUTOLOCK(lock, &shared->mu);
+  while (!shared->indexes.empty()) {
+    shared->indexes.pop_front();
+  }
+}
 
-  files_in_include_dirs_.resize(include_dirs_->size());
+/* static */
+size_t IncludeDirIndex::NumSharedIndexes() {
+  SharedIncludeDirIndexes* shared = GetSharedIncludeDirIndexes();
+  AUTOLOCK(lock, &shared->mu);
+  return shared->indexes.size();
+}
+
+IncludeDirIndex::IncludeDirIndex(const std::string& cwd,
+                                 bool ignore_case,
+                                 const std::vector<std::string>& include_dirs,
+                                 FileStatCache* file_stat_cache) {
+  GOMA_COUNTERZ("IncludeDirIndex");
+
+  dir_stats_.resize(include_dirs.size());
+  files_in_include_dirs_.resize(include_dirs.size());
 
   // Enumerate all files and directories in each of |include_dirs|.
   // Files and directories are used to skip unnecessary file checks.
   for (size_t i = CppParser::kIncludeDirIndexStarting;
-       i < include_dirs_->size(); ++i) {
+       i < include_dirs.size(); ++i) {
     const std::string& abs_include_dir =
-        file::JoinPathRespectAbsolute(cwd_, (*include_dirs)[i]);
+        file::JoinPathRespectAbsolute(cwd, include_dirs[i]);
+    dir_stats_[i] = file_stat_cache->Get(abs_include_dir);
+    if (dir_stats_[i].mtime.has_value() && dir_stats_[i].CanBeStale()) {
+      shareable_ = false;
+    }
+
     if (absl::EndsWith(abs_include_dir, ".hmap")) {
       std::vector<std::pair<std::string, std::string>> entries;
       if (!ReadHeaderMapContent(abs_include_dir, &entries)) {
@@ -75,7 +159,8 @@ IncludeFileFinder::IncludeFileFinder(
         const std::string& key = entry.first;
         const std::string& filename = entry.second;
 
-        std::string top = TopPathComponent(key, ignore_case_);
+        std::string top =
+            IncludeFileFinder::TopPathComponent(key, ignore_case);
 
         files_in_include_dirs_[i].insert(top);
 
@@ -89,15 +174,14 @@ IncludeFileFinder::IncludeFileFinder(
 
     std::vector<DirEntry> entries;
     if (!ListDirCache::instance()->GetDirEntries(
-            abs_include_dir, file_stat_cache_->Get(abs_include_dir),
-            &entries)) {
+            abs_include_dir, dir_stats_[i], &entries)) {
       continue;
     }
 
     for (const auto& entry : entries) {
       std::string name = entry.name;
 
-      if (ignore_case_) {
+      if (ignore_case) {
         absl::AsciiStrToLower(&name);
       }
 
@@ -108,6 +192,65 @@ IncludeFileFinder::IncludeFileFinder(
   }
 }
 
+bool IncludeDirIndex::IsUpToDate(const std::string& cwd,
+                                 const std::vector<std::string>& include_dirs,
+                                 FileStatCache* file_stat_cache) const {
+  DCHECK_EQ(dir_stats_.size(), include_dirs.size());
+  for (size_t i = CppParser::kIncludeDirIndexStarting;
+       i < include_dirs.size(); ++i) {
+    const FileStat current = file_stat_cache->Get(
+        file::JoinPathRespectAbsolute(cwd, include_dirs[i]));
+    if (IsDirUpdated(current, dir_stats_[i])) {
+      VLOG(1) << "include dir updated:" << include_dirs[i]
+              << " old=" << dir_stats_[i] << " current=" << current;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool IncludeDirIndex::FindLowerbound(const std::string& name,
+                                     size_t* index) const {
+  auto iter = include_dir_index_lowerbound_.find(name);
+  if (iter == include_dir_index_lowerbound_.end()) {
+    return false;
+  }
+  *index = iter->second;
+  return true;
+}
+
+const std::string* IncludeDirIndex::FindHeaderMapEntry(
+    size_t i, const std::string& key) const {
+  auto iter = hmap_map_.find(std::make_pair(i, key));
+  if (iter == hmap_map_.end()) {
+    return nullptr;
+  }
+  return &iter->second;
+}
+
+bool IncludeFileFinder::gch_hack_ = false;
+
+/* static */
+void IncludeFileFinder::Init(bool gch_hack) {
+  gch_hack_ = gch_hack;
+}
+
+IncludeFileFinder::IncludeFileFinder(
+    std::string cwd,
+    bool ignore_case,
+    const std::vector<std::string>* include_dirs,
+    const std::vector<std::string>* framework_dirs,
+    FileStatCache* file_stat_cache)
+    : cwd_(std::move(cwd)),
+      ignore_case_(ignore_case),
+      include_dirs_(include_dirs),
+      framework_dirs_(framework_dirs),
+      file_stat_cache_(file_stat_cache),
+      index_(IncludeDirIndex::Get(cwd_, ignore_case_, *include_dirs_,
+                                  file_stat_cache_)) {
+  GOMA_COUNTERZ("IncludeFileFinder");
+}
+
 /* static */
 std::string IncludeFileFinder::TopPathComponent(std::string path_in_directive,
                                                 bool ignore_case) {
@@ -159,9 +302,9 @@ bool IncludeFileFinder::Lookup(const std::string& path_in_directive,
     // |path_in_directive|.
     // e.g. if |top| is "base" and 1,2,3-th include directories do not
     // have "base" entry, then search_start_index becomes 4.
-    auto iter = include_dir_index_lowerbound_.find(top);
-    if (iter != include_dir_index_lowerbound_.end()) {
-      search_start_index = std::max(search_start_index, iter->second);
+    size_t lowerbound = 0;
+    if (index_->FindLowerbound(top, &lowerbound)) {
+      search_start_index = std::max(search_start_index, lowerbound);
     } else if (!gch_hack_enabled() &&
                !absl::StartsWith(path_in_directive, ".")) {
       // Do not search entry that is not in include_dirs.
@@ -183,16 +326,17 @@ bool IncludeFileFinder::Lookup(const std::string& path_in_directive,
     // because it may point to some sibling directory
     // that not in |files_in_include_dirs_|.
     if (!absl::StartsWith(top, ".") &&
-        !files_in_include_dirs_[i].contains(top)) {
+        !index_->HasEntry(i, top)) {
       VLOG(2) << "not in " << i;
       continue;
     }
 
     std::string join_path;
     {
-      auto iter = hmap_map_.find(std::make_pair(i, path_in_directive));
-      if (iter != hmap_map_.end()) {
-        join_path = iter->second;
+      const std::string* hmap_filename =
+          index_->FindHeaderMapEntry(i, path_in_directive);
+      if (hmap_filename != nullptr) {
+        join_path = *hmap_filename;
       } else {
         join_path = file::JoinPath((*include_dirs_)[i], path_in_directive);
       }
@@ -222,10 +366,9 @@ bool IncludeFileFinder::Lookup(const std::string& path_in_directive,
       continue;
     }
 
-    include_path_cache_.insert(
-        std::make_pair(
-            std::make_pair(path_in_directive, *include_dir_index),
-            std::make_pair(try_path, i)));
+    include_path_cache_.emplace(
+        std::make_pair(path_in_directive, *include_dir_index),
+        std::make_pair(try_path, i));
     *filepath = try_path;
     *include_dir_index = i;
     return true;
@@ -5,16 +5,100 @@
 #ifndef DEVTOOLS_GOMA_CLIENT_CXX_INCLUDE_PROCESSOR_INCLUDE_FILE_FINDER_H_
 #define DEVTOOLS_GOMA_CLIENT_CXX_INCLUDE_PROCESSOR_INCLUDE_FILE_FINDER_H_
 
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
+#include "file_stat.h"
 
 namespace devtools_goma {
 
 class FileStatCache;
 
+// IncludeDirIndex holds entries of include directories, which is used to
+// skip include directories that cannot have an included file.
+// Since building it for each compile task is costly and a lot of tasks
+// share the same include directories, the index is shared process-wide
+// by (cwd, ignore_case, include_dirs). Note that include_dirs already
+// reflects compiler info, i.e. its system include paths and toolchain root.
+//
+// The index is immutable. It is rebuilt when some include directory (or
+// header map) is updated, which is detected by FileStat of include
+// directories as ListDirCache does.
+// Resolved include paths are not shared, since a file created in
+// a subdirectory of an include directory doesn't update FileStat of the
+// include directory, and it may shadow the file resolved before.
+class IncludeDirIndex {
+ public:
+  // The max number of shared indexes.
+  static constexpr size_t kMaxSharedIndexes = 128;
+
+  // Returns the index for |include_dirs| in |cwd|. The shared one is
+  // returned if none of include directories is updated since it was built.
+  static std::shared_ptr<IncludeDirIndex> Get(
+      const std::string& cwd,
+      bool ignore_case,
+      const std::vector<std::string>& include_dirs,
+      FileStatCache* file_stat_cache);
+
+  // Clears shared indexes. For testing.
+  static void ClearSharedIndexes();
+  static size_t NumSharedIndexes();
+
+  IncludeDirIndex(const IncludeDirIndex&) = delete;
+  IncludeDirIndex& operator=(const IncludeDirIndex&) = delete;
+
+  // Returns true if i-th include directory has |name| entry.
+  bool HasEntry(size_t i, const std::string& name) const {
+    return files_in_include_dirs_[i].contains(name);
+  }
+
+  // Sets the minimum index of include directories having |name| entry to
+  // |index|. Returns false if no include directory has |name| entry.
+  bool FindLowerbound(const std::string& name, size_t* index) const;
+
+  // Returns the filename for |key| in the header map of i-th include
+  // directory, or nullptr if not found.
+  const std::string* FindHeaderMapEntry(size_t i,
+                                        const std::string& key) const;
+
+ private:
+  IncludeDirIndex(const std::string& cwd,
+                  bool ignore_case,
+                  const std::vector<std::string>& include_dirs,
+                  FileStatCache* file_stat_cache);
+
+  // Returns true if include directories are not updated since this index
+  // was built.
+  bool IsUpToDate(const std::string& cwd,
+                  const std::vector<std::string>& include_dirs,
+                  FileStatCache* file_stat_cache) const;
+
+  // FileStat of each include directory (or header map) when the index was
+  // built. Used to detect updates of include directories.
+  std::vector<FileStat> dir_stats_;
+
+  // True if all |dir_stats_| are not stale, so the index can be shared.
+  bool shareable_ = true;
+
+  // Holds entries in i-th include directory.
+  // |files_in_include_dirs_[i]| is set of file/directory name in
+  // i-th include directory.
+  std::vector<absl::flat_hash_set<std::string>> files_in_include_dirs_;
+
+  // Holds the minimum include directories index for each entries in
+  // include directories.
+  // e.g. |include_dir_index_lowerbound_["stdio.h"]| represents minimum index
+  // of include directory containing "stdio.h".
+  absl::flat_hash_map<std::string, size_t> include_dir_index_lowerbound_;
+
+  // Map for "include_dir idx + (key in .hmap file)" -> filename in .hmap file.
+  absl::flat_hash_map<std::pair<size_t, std::string>, std::string> hmap_map_;
+};
+
 class IncludeFileFinder {
  public:
   static void Init(bool gch_hack);
@@ -68,24 +152,13 @@ class IncludeFileFinder {
   const std::vector<std::string>* const framework_dirs_;
   FileStatCache* file_stat_cache_;
 
-  // Holds entries in i-th include directory.
-  // |files_in_include_dirs_[i]| is set of file/directory name in
-  // i-th include directory.
-  std::vector<absl::flat_hash_set<std::string>> files_in_include_dirs_;
-
-  // Holds the minimum include directories index for each entries in
-  // include directories.
-  // e.g. |include_dir_index_lowerbound_["stdio.h"]| represents minimum index
-  // of include directory containing "stdio.h".
-  absl::flat_hash_map<std::string, size_t> include_dir_index_lowerbound_;
+  // Shared with other IncludeFileFinders having the same include dirs.
+  std::shared_ptr<IncludeDirIndex> index_;
 
   // Cache for (path_in_directive, include_dir_index_start) ->
   //           (filepath, used_include_dir_index).
   absl::flat_hash_map<std::pair<std::string, int>, std::pair<std::string, int>>
       include_path_cache_;
-
-  // Map for "include_dir idx + (key in .hmap file)" -> filename in .hmap file.
-  absl::flat_hash_map<std::pair<int, std::string>, std::string> hmap_map_;
 };
 
 }  // namespace devtools_goma
@@ -8,9 +8,11 @@
 
 #include <gtest/gtest.h>
 
+#include "absl/time/clock.h"
 #include "cpp_include_processor_unittest_helper.h"
 #include "file_stat_cache.h"
 #include "include_file_utils.h"
+#include "list_dir_cache.h"
 #include "path.h"
 #include "unittest_util.h"
 
@@ -21,6 +23,13 @@ class IncludeFileFinderTest : public testing::Test {
   void SetUp() override {
     tmpdir_util_ = std::make_unique<TmpdirUtil>("include_file_finder_unittest");
     tmpdir_util_->SetCwd("");
+    ListDirCache::Init(1024);
+    IncludeDirIndex::ClearSharedIndexes();
+  }
+
+  void TearDown() override {
+    IncludeDirIndex::ClearSharedIndexes();
+    ListDirCache::Quit();
   }
 
   void CreateTmpFile(const std::string& name, const std::string& content) {
@@ -31,6 +40,11 @@ class IncludeFileFinderTest : public testing::Test {
     tmpdir_util_->MkdirForPath(dirname, true);
   }
 
+  // Sets old mtime to |path|, so that its FileStat is not stale.
+  void SetOldMtime(const std::string& path, absl::Duration ago) {
+    ASSERT_TRUE(UpdateMtime(tmpdir_util_->FullPath(path), absl::Now() - ago));
+  }
+
  protected:
   std::unique_ptr<TmpdirUtil> tmpdir_util_;
 };
@@ -91,4 +105,162 @@ TEST_F(IncludeFileFinderTest, LookupFrameworkWithHmap) {
   EXPECT_EQ(1, dir_index);
 }
 
+TEST_F(IncludeFileFinderTest, SharedIncludeDirIndex) {
+  CreateTmpDir("a");
+  CreateTmpDir("b");
+  CreateTmpFile(file::JoinPath("b", "foo.h"), "");
+  SetOldMtime("a", absl::Hours(2));
+  SetOldMtime("b", absl::Hours(2));
+
+  std::vector<std::string> include_dirs = {
+      tmpdir_util_->realcwd(),
+      "a",
+      "b",
+  };
+  std::vector<std::string> framework_dirs;
+  {
+    FileStatCache file_stat_cache;
+    IncludeFileFinder finder(tmpdir_util_->realcwd(), /*ignore_case=*/false,
+                             &include_dirs, &framework_dirs,
+                             &file_stat_cache);
+    std::string file_path;
+    int dir_index = 1;
+    EXPECT_TRUE(finder.Lookup("foo.h", &file_path, &dir_index));
+    EXPECT_EQ(file::JoinPath("b", "foo.h"), file_path);
+    EXPECT_EQ(2, dir_index);
+    EXPECT_FALSE(finder.Lookup("bar.h", &file_path, &dir_index));
+  }
+  EXPECT_EQ(1U, IncludeDirIndex::NumSharedIndexes());
+
+  // Other task with the same include dirs shares the index.
+  {
+    FileStatCache file_stat_cache;
+    IncludeFileFinder finder(tmpdir_util_->realcwd(), /*ignore_case=*/false,
+                             &include_dirs, &framework_dirs,
+                             &file_stat_cache);
+    std::string file_path;
+    int dir_index = 1;
+    EXPECT_TRUE(finder.Lookup("foo.h", &file_path, &dir_index));
+    EXPECT_EQ(file::JoinPath("b", "foo.h"), file_path);
+    EXPECT_EQ(2, dir_index);
+  }
+  EXPECT_EQ(1U, IncludeDirIndex::NumSharedIndexes());
+
+  // Include dirs of different order use different index.
+  std::vector<std::string> reversed_include_dirs = {
+      tmpdir_util_->realcwd(),
+      "b",
+      "a",
+  };
+  {
+    FileStatCache file_stat_cache;
+    IncludeFileFinder finder(tmpdir_util_->realcwd(), /*ignore_case=*/false,
+                             &reversed_include_dirs, &framework_dirs,
+                             &file_stat_cache);
+    std::string file_path;
+    int dir_index = 1;
+    EXPECT_TRUE(finder.Lookup("foo.h", &file_path, &dir_index));
+    EXPECT_EQ(1, dir_index);
+  }
+  EXPECT_EQ(2U, IncludeDirIndex::NumSharedIndexes());
+}
+
+TEST_F(IncludeFileFinderTest, SharedIncludeDirIndexUpdated) {
+  CreateTmpDir("a");
+  CreateTmpDir("b");
+  CreateTmpFile(file::JoinPath("b", "foo.h"), "");
+  SetOldMtime("a", absl::Hours(2));
+  SetOldMtime("b", absl::Hours(2));
+
+  std::vector<std::string> include_dirs = {
+      tmpdir_util_->realcwd(),
+      "a",
+      "b",
+  };
+  std::vector<std::string> framework_dirs;
+  {
+    FileStatCache file_stat_cache;
+    IncludeFileFinder finder(tmpdir_util_->realcwd(), /*ignore_case=*/false,
+                             &include_dirs, &framework_dirs,
+                             &file_stat_cache);
+    std::string file_path;
+    int dir_index = 1;
+    EXPECT_TRUE(finder.Lookup("foo.h", &file_path, &dir_index));
+    EXPECT_EQ(2, dir_index);
+  }
+
+  // foo.h in "a" comes first once it is created.
+  CreateTmpFile(file::JoinPath("a", "foo.h"), "");
+  const absl::Time mtime = absl::Now() - absl::Hours(1);
+  ASSERT_TRUE(UpdateMtime(tmpdir_util_->FullPath("a"), mtime));
+  {
+    FileStatCache file_stat_cache;
+    IncludeFileFinder finder(tmpdir_util_->realcwd(), /*ignore_case=*/false,
+                             &include_dirs, &framework_dirs,
+                             &file_stat_cache);
+    std::string file_path;
+    int dir_index = 1;
+    EXPECT_TRUE(finder.Lookup("foo.h", &file_path, &dir_index));
+    EXPECT_EQ(file::JoinPath("a", "foo.h"), file_path);
+    EXPECT_EQ(1, dir_index);
+  }
+
+  // Removed file is not found even if the index is reused.
+  tmpdir_util_->RemoveTmpFile(file::JoinPath("a", "foo.h"));
+  ASSERT_TRUE(UpdateMtime(tmpdir_util_->FullPath("a"), mtime));
+  {
+    FileStatCache file_stat_cache;
+    IncludeFileFinder finder(tmpdir_util_->realcwd(), /*ignore_case=*/false,
+                             &include_dirs, &framework_dirs,
+                             &file_stat_cache);
+    std::string file_path;
+    int dir_index = 1;
+    EXPECT_TRUE(finder.Lookup("foo.h", &file_path, &dir_index));
+    EXPECT_EQ(file::JoinPath("b", "foo.h"), file_path);
+    EXPECT_EQ(2, dir_index);
+  }
+  EXPECT_EQ(1U, IncludeDirIndex::NumSharedIndexes());
+}
+
+TEST_F(IncludeFileFinderTest, SharedIncludeDirIndexShadowedInSubdir) {
+  CreateTmpDir(file::JoinPath("a", "base"));
+  CreateTmpFile(file::JoinPath("b", "base", "foo.h"), "");
+  SetOldMtime("a", absl::Hours(2));
+  SetOldMtime("b", absl::Hours(2));
+
+  std::vector<std::string> include_dirs = {
+      tmpdir_util_->realcwd(),
+      "a",
+      "b",
+  };
+  std::vector<std::string> framework_dirs;
+  {
+    FileStatCache file_stat_cache;
+    IncludeFileFinder finder(tmpdir_util_->realcwd(), /*ignore_case=*/false,
+                             &include_dirs, &framework_dirs,
+                             &file_stat_cache);
+    std::string file_path;
+    int dir_index = 1;
+    EXPECT_TRUE(finder.Lookup("base/foo.h", &file_path, &dir_index));
+    EXPECT_EQ(file::JoinPath("b", "base", "foo.h"), file_path);
+    EXPECT_EQ(2, dir_index);
+  }
+
+  // Creating a file in "a/base" doesn't update mtime of "a", so the index
+  // is reused, but the new file should shadow "b/base/foo.h".
+  CreateTmpFile(file::JoinPath("a", "base", "foo.h"), "");
+  {
+    FileStatCache file_stat_cache;
+    IncludeFileFinder finder(tmpdir_util_->realcwd(), /*ignore_case=*/false,
+                             &include_dirs, &framework_dirs,
+                             &file_stat_cache);
+    std::string file_path;
+    int dir_index = 1;
+    EXPECT_TRUE(finder.Lookup("base/foo.h", &file_path, &dir_index));
+    EXPECT_EQ(file::JoinPath("a", "base", "foo.h"), file_path);
+    EXPECT_EQ(1, dir_index);
+  }
+  EXPECT_EQ(1U, IncludeDirIndex::NumSharedIndexes());
+}
+
 }  // namespace devtools_goma
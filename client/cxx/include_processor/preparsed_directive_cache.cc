@@ -0,0 +1,316 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "preparsed_directive_cache.h"
+
+#include <stdio.h>  // For rename
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "absl/strings/match.h"
+#include "absl/strings/strip.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "autolock_timer.h"
+#include "callback.h"
+#include "counterz.h"
+#include "cxx/include_processor/cpp_directive_serializer.h"
+#include "file_dir.h"
+#include "file_helper.h"
+#include "file_stat.h"
+#include "glog/logging.h"
+#include "path.h"
+#include "simple_timer.h"
+#include "util.h"
+#include "worker_thread_manager.h"
+
+namespace devtools_goma {
+
+namespace {
+
+constexpr absl::string_view kMagic("GOMAPDC", 7);
+constexpr size_t kHashSize = 32;
+constexpr size_t kMaxRevisionSize = 255;
+
+// mtime of an entry is updated on lookup only if it is older than this,
+// to avoid writing metadata for every lookup.
+constexpr absl::Duration kMtimeUpdateInterval = absl::Hours(1);
+
+// Tmp files older than this are considered to be left by crashed writers.
+constexpr absl::Duration kStaleTmpFileAge = absl::Hours(1);
+
+}  // anonymous namespace
+
+PreparsedDirectiveCache::PreparsedDirectiveCache(
+    std::string cache_dir,
+    std::string built_revision,
+    std::int64_t max_cache_amount_byte,
+    std::int64_t threshold_cache_amount_byte,
+    WorkerThreadManager* wm)
+    : cache_dir_(std::move(cache_dir)),
+      built_revision_(built_revision.substr(0, kMaxRevisionSize)),
+      wm_(wm),
+      max_cache_amount_byte_(max_cache_amount_byte),
+      threshold_cache_amount_byte_(threshold_cache_amount_byte),
+      total_cache_amount_byte_(-1) {}
+
+PreparsedDirectiveCache::~PreparsedDirectiveCache() {
+  AUTOLOCK(lock, &pending_mu_);
+  while (num_pending_stores_ > 0) {
+    pending_cond_.Wait(&pending_mu_);
+  }
+}
+
+std::string PreparsedDirectiveCache::EntryPath(
+    const SHA256HashValue& content_hash) const {
+  const std::string hex = content_hash.ToHexString();
+  return file::JoinPath(cache_dir_, hex.substr(0, 2), hex);
+}
+
+bool PreparsedDirectiveCache::Lookup(const SHA256HashValue& content_hash,
+                                     bool needs_directive_hash,
+                                     Entry* entry) {
+  GOMA_COUNTERZ("PreparsedDirectiveCache::Lookup");
+
+  const std::string path = EntryPath(content_hash);
+  std::string data;
+  if (!ReadFileToString(path, &data)) {
+    missed_.Add(1);
+    return false;
+  }
+
+  // Entry format:
+  //   magic, format version (1 byte), revision size (1 byte), revision,
+  //   has directive hash (1 byte), [directive hash (32 bytes)],
+  //   serialized directives.
+  absl::string_view rest(data);
+  if (!absl::ConsumePrefix(&rest, kMagic) || rest.size() < 2 ||
+      rest[0] != CppDirectiveSerializer::kFormatVersion) {
+    invalid_.Add(1);
+    return false;
+  }
+  const size_t revision_size = static_cast<unsigned char>(rest[1]);
+  rest.remove_prefix(2);
+  if (rest.size() < revision_size + 1 ||
+      rest.substr(0, revision_size) != built_revision_) {
+    VLOG(1) << "preparsed directive entry of another revision: " << path;
+    invalid_.Add(1);
+    return false;
+  }
+  rest.remove_prefix(revision_size);
+  const bool has_directive_hash = rest[0] != 0;
+  rest.remove_prefix(1);
+
+  Entry result;
+  if (has_directive_hash) {
+    SHA256HashValue h;
+    if (rest.size() < kHashSize) {
+      invalid_.Add(1);
+      return false;
+    }
+    memcpy(h.mutable_data(), rest.data(), kHashSize);
+    rest.remove_prefix(kHashSize);
+    result.directive_hash = h;
+  } else if (needs_directive_hash) {
+    missed_.Add(1);
+    return false;
+  }
+
+  if (!CppDirectiveSerializer::Deserialize(rest, &result.directives)) {
+    LOG(WARNING) << "broken preparsed directive entry: " << path;
+    invalid_.Add(1);
+    return false;
+  }
+
+#ifndef _WIN32
+  // Mark the entry as recently used for CollectGarbage().
+  FileStat file_stat(path);
+  if (file_stat.mtime.has_value() &&
+      *file_stat.mtime < absl::Now() - kMtimeUpdateInterval) {
+    if (utimes(path.c_str(), nullptr) != 0) {
+      PLOG(WARNING) << "failed to update mtime of " << path;
+    }
+  }
+#endif
+
+  hit_.Add(1);
+  *entry = std::move(result);
+  return true;
+}
+
+bool PreparsedDirectiveCache::Store(
+    const SHA256HashValue& content_hash,
+    const CppDirectiveList& directives,
+    const absl::optional<SHA256HashValue>& directive_hash) {
+  GOMA_COUNTERZ("PreparsedDirectiveCache::Store");
+
+  std::string data(kMagic);
+  data.push_back(CppDirectiveSerializer::kFormatVersion);
+  data.push_back(static_cast<char>(built_revision_.size()));
+  data.append(built_revision_);
+  data.push_back(directive_hash.has_value() ? 1 : 0);
+  if (directive_hash.has_value()) {
+    data.append(reinterpret_cast<const char*>(directive_hash->data()),
+                kHashSize);
+  }
+  CppDirectiveSerializer::Serialize(directives, &data);
+
+  std::string path = EntryPath(content_hash);
+  if (wm_ == nullptr) {
+    return WriteEntry(path, data);
+  }
+  // Don't block include processing on file I/O.
+  {
+    AUTOLOCK(lock, &pending_mu_);
+    ++num_pending_stores_;
+  }
+  wm_->RunClosure(
+      FROM_HERE,
+      NewCallback(this, &PreparsedDirectiveCache::WriteEntryInWorker,
+                  std::move(path), std::move(data)),
+      WorkerThread::PRIORITY_LOW);
+  return true;
+}
+
+void PreparsedDirectiveCache::WriteEntryInWorker(std::string path,
+                                                 std::string data) {
+  WriteEntry(path, data);
+  AUTOLOCK(lock, &pending_mu_);
+  --num_pending_stores_;
+  pending_cond_.Broadcast();
+}
+
+bool PreparsedDirectiveCache::WriteEntry(const std::string& path,
+                                         const std::string& data) {
+  if (!EnsureDirectory(std::string(file::Dirname(path)), 0755)) {
+    LOG(ERROR) << "failed to create directory for " << path;
+    return false;
+  }
+
+  // Another thread or compiler_proxy may write the same entry concurrently,
+  // so the tmp file name must be unique to this writer.
+  static std::atomic<int> tmp_id;
+  const std::string tmp_path =
+      absl::StrCat(path, ".tmp.", Getpid(), ".", tmp_id.fetch_add(1));
+  if (!WriteStringToFile(data, tmp_path)) {
+    LOG(ERROR) << "failed to write " << tmp_path;
+    remove(tmp_path.c_str());
+    return false;
+  }
+#ifdef _WIN32
+  remove(path.c_str());
+#endif
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    PLOG(ERROR) << "failed to rename " << tmp_path << " to " << path;
+    remove(tmp_path.c_str());
+    return false;
+  }
+
+  stored_.Add(1);
+  // Overwriting an existing entry is counted twice, but the total is
+  // recomputed by the next CollectGarbage() anyway.
+  if (total_cache_amount_byte_.load() >= 0) {
+    total_cache_amount_byte_ += static_cast<std::int64_t>(data.size());
+  }
+  return true;
+}
+
+bool PreparsedDirectiveCache::ShouldCollectGarbage() const {
+  if (max_cache_amount_byte_ <= 0) {
+    return false;
+  }
+  const std::int64_t total = total_cache_amount_byte_.load();
+  return total < 0 || total > max_cache_amount_byte_;
+}
+
+void PreparsedDirectiveCache::CollectGarbage() {
+  AUTOLOCK(lock, &gc_mu_);
+  GOMA_COUNTERZ("PreparsedDirectiveCache::CollectGarbage");
+  gc_count_.Add(1);
+  SimpleTimer timer(SimpleTimer::START);
+
+  struct CacheFile {
+    std::string path;
+    absl::Time mtime;
+    std::int64_t size;
+  };
+  std::vector<CacheFile> cache_files;
+  std::int64_t total = 0;
+
+  const absl::Time now = absl::Now();
+  std::vector<DirEntry> prefix_entries;
+  if (!ListDirectory(cache_dir_, &prefix_entries)) {
+    LOG(ERROR) << "failed to list preparsed directive cache: " << cache_dir_;
+    return;
+  }
+  for (const auto& prefix_entry : prefix_entries) {
+    if (!prefix_entry.is_dir || prefix_entry.name == "." ||
+        prefix_entry.name == "..") {
+      continue;
+    }
+    const std::string dir = file::JoinPath(cache_dir_, prefix_entry.name);
+    std::vector<DirEntry> entries;
+    if (!ListDirectory(dir, &entries)) {
+      continue;
+    }
+    for (const auto& entry : entries) {
+      if (entry.is_dir) {
+        continue;
+      }
+      std::string path = file::JoinPath(dir, entry.name);
+      FileStat file_stat(path);
+      if (!file_stat.IsValid() || !file_stat.mtime.has_value()) {
+        continue;
+      }
+      if (absl::StrContains(entry.name, ".tmp.")) {
+        if (*file_stat.mtime < now - kStaleTmpFileAge) {
+          remove(path.c_str());
+        }
+        continue;
+      }
+      total += file_stat.size;
+      cache_files.push_back(
+          CacheFile{std::move(path), *file_stat.mtime, file_stat.size});
+    }
+  }
+
+  std::int64_t removed_items = 0;
+  std::int64_t removed_bytes = 0;
+  if (max_cache_amount_byte_ > 0 && total > max_cache_amount_byte_) {
+    std::sort(cache_files.begin(), cache_files.end(),
+              [](const CacheFile& a, const CacheFile& b) {
+                return a.mtime < b.mtime;
+              });
+    for (const auto& cache_file : cache_files) {
+      if (total <= threshold_cache_amount_byte_) {
+        break;
+      }
+      if (remove(cache_file.path.c_str()) != 0) {
+        PLOG(WARNING) << "failed to remove " << cache_file.path;
+        continue;
+      }
+      total -= cache_file.size;
+      ++removed_items;
+      removed_bytes += cache_file.size;
+    }
+  }
+  total_cache_amount_byte_ = total;
+  gc_removed_items_.Add(removed_items);
+  gc_removed_bytes_.Add(removed_bytes);
+
+  LOG(INFO) << "PreparsedDirectiveCache GC done:"
+            << " total_bytes=" << total
+            << " removed_items=" << removed_items
+            << " removed_bytes=" << removed_bytes
+            << " time=" << timer.GetDuration();
+}
+
+}  // namespace devtools_goma
@@ -0,0 +1,134 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DEVTOOLS_GOMA_CLIENT_CXX_INCLUDE_PROCESSOR_PREPARSED_DIRECTIVE_CACHE_H_
+#define DEVTOOLS_GOMA_CLIENT_CXX_INCLUDE_PROCESSOR_PREPARSED_DIRECTIVE_CACHE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/types/optional.h"
+#include "atomic_stats_counter.h"
+#include "basictypes.h"
+#include "cxx/include_processor/cpp_directive.h"
+#include "goma_hash.h"
+#include "lockhelper.h"
+
+namespace devtools_goma {
+
+class WorkerThreadManager;
+
+// PreparsedDirectiveCache is an on-disk store of parsed directives keyed by
+// hash of file content, so that a header parsed by a previous
+// compiler_proxy process doesn't need to be filtered and parsed again.
+//
+// Each entry is stored in its own file <cache_dir>/<hh>/<hash>, where <hh> is
+// the first 2 hex digits of the hash. Entries are written to a tmp file and
+// renamed, so several compiler_proxy processes can share |cache_dir|.
+// Each entry records the revision of compiler_proxy which stored it, and
+// entries stored by another revision are not used, because DirectiveFilter
+// or the parser may have been changed.
+//
+// If the total size of entries exceeds |max_cache_amount_byte|,
+// CollectGarbage() removes least recently used entries until the total size
+// is below |threshold_cache_amount_byte|. mtime of an entry is used as its
+// last used time, and it is updated when the entry is looked up.
+//
+// This class is thread-safe.
+class PreparsedDirectiveCache {
+ public:
+  struct Entry {
+    CppDirectiveList directives;
+    // Hash of filtered content, which is used as directive hash in
+    // IncludeCache. Set only if it was stored.
+    absl::optional<SHA256HashValue> directive_hash;
+  };
+
+  // If |max_cache_amount_byte| is 0, entries are never removed.
+  // If |wm| is not nullptr, entries are written in worker threads.
+  PreparsedDirectiveCache(std::string cache_dir,
+                          std::string built_revision,
+                          std::int64_t max_cache_amount_byte,
+                          std::int64_t threshold_cache_amount_byte,
+                          WorkerThreadManager* wm);
+  // Waits until pending Store() finishes.
+  ~PreparsedDirectiveCache();
+
+  // Returns true and fills |entry| if |content_hash| is found.
+  // If |needs_directive_hash| is true, entries stored without directive
+  // hash are treated as missing.
+  bool Lookup(const SHA256HashValue& content_hash,
+              bool needs_directive_hash,
+              Entry* entry);
+
+  // Stores |directives| and |directive_hash| for |content_hash|.
+  // If a worker thread writes the entry, this returns true when the write
+  // is scheduled.
+  bool Store(const SHA256HashValue& content_hash,
+             const CppDirectiveList& directives,
+             const absl::optional<SHA256HashValue>& directive_hash);
+
+  // Returns true if the total size of entries might exceed the max, or
+  // it is not known yet.
+  bool ShouldCollectGarbage() const;
+
+  // Scans |cache_dir_| to compute the total size of entries, and removes
+  // least recently used entries if it exceeds the max. Stale tmp files left
+  // by crashed writers are removed, too.
+  void CollectGarbage() LOCKS_EXCLUDED(gc_mu_);
+
+  const std::string& cache_dir() const { return cache_dir_; }
+
+  int64_t hit() const { return hit_.value(); }
+  int64_t missed() const { return missed_.value(); }
+  int64_t stored() const { return stored_.value(); }
+  int64_t invalid() const { return invalid_.value(); }
+  int64_t gc_count() const { return gc_count_.value(); }
+  int64_t gc_removed_items() const { return gc_removed_items_.value(); }
+  int64_t gc_removed_bytes() const { return gc_removed_bytes_.value(); }
+
+ private:
+  std::string EntryPath(const SHA256HashValue& content_hash) const;
+
+  // Writes |data| to |path| via a tmp file.
+  bool WriteEntry(const std::string& path, const std::string& data);
+  void WriteEntryInWorker(std::string path, std::string data)
+      LOCKS_EXCLUDED(pending_mu_);
+
+  const std::string cache_dir_;
+  // Truncated to fit in the 1 byte length field of entries.
+  const std::string built_revision_;
+  WorkerThreadManager* const wm_;
+  const std::int64_t max_cache_amount_byte_;
+  const std::int64_t threshold_cache_amount_byte_;
+
+  // Estimated total size of entries. Set by CollectGarbage(), and
+  // increased by Store(). -1 until the first CollectGarbage().
+  std::atomic<std::int64_t> total_cache_amount_byte_;
+
+  // Serializes CollectGarbage().
+  Lock gc_mu_;
+
+  Lock pending_mu_;
+  ConditionVariable pending_cond_;
+  int num_pending_stores_ GUARDED_BY(pending_mu_) = 0;
+
+  StatsCounter hit_;
+  StatsCounter missed_;
+  StatsCounter stored_;
+  // The number of entries found but could not be used, e.g. written by
+  // a compiler_proxy having another revision or format version.
+  StatsCounter invalid_;
+  StatsCounter gc_count_;
+  StatsCounter gc_removed_items_;
+  StatsCounter gc_removed_bytes_;
+
+  DISALLOW_COPY_AND_ASSIGN(PreparsedDirectiveCache);
+};
+
+}  // namespace devtools_goma
+
+#endif  // DEVTOOLS_GOMA_CLIENT_CXX_INCLUDE_PROCESSOR_PREPARSED_DIRECTIVE_CACHE_H_
@@ -5,6 +5,9 @@
 
 #include "deps_cache.h"
 
+#include <errno.h>
+#include <stdio.h>  // For rename
+
 #include <cmath>
 #include <fstream>
 #include <functional>
@@ -16,6 +19,7 @@
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_join.h"
 #include "absl/time/clock.h"
 #include "autolock_timer.h"
@@ -27,13 +31,18 @@
 #include "cxx/cxx_compiler_info.h"
 #include "cxx/include_processor/directive_filter.h"
 #include "cxx/include_processor/include_cache.h"
+#include "file_helper.h"
 #include "gcc_flags.h"
 #include "goma_hash.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
 #include "path.h"
 #include "path_resolver.h"
 #include "proto_util.h"
+#include "simple_timer.h"
 #include "util.h"
 #include "vc_flags.h"
+#include "worker_thread_manager.h"
 
 MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
 #include "prototmp/deps_cache_data.pb.h"
@@ -58,31 +67,181 @@ void AppendCompilerFlagsInfo(const Flags& flags, std::stringstream* ss) {
   }
 }
 
+// The number of dependencies a validation worker takes at once.
+constexpr size_t kValidationChunkSize = 32;
+
+// Journal buffer is flushed without waiting for periodic flush when it
+// exceeds this size.
+constexpr size_t kMaxJournalBufferSize = 1024 * 1024;
+
+// Appends |message| to |out| with its size as varint prefix.
+void AppendDelimitedMessage(const google::protobuf::MessageLite& message,
+                            std::string* out) {
+  google::protobuf::io::StringOutputStream sos(out);
+  google::protobuf::io::CodedOutputStream output(&sos);
+  output.WriteVarint32(message.ByteSizeLong());
+  message.SerializeWithCachedSizes(&output);
+}
+
+// Parses a message written by AppendDelimitedMessage at |*pos| of |data|,
+// and advances |*pos|.
+bool ParseDelimitedMessage(absl::string_view data,
+                           size_t* pos,
+                           google::protobuf::MessageLite* message) {
+  google::protobuf::io::CodedInputStream input(
+      reinterpret_cast<const google::protobuf::uint8*>(data.data() + *pos),
+      data.size() - *pos);
+  google::protobuf::uint32 size;
+  if (!input.ReadVarint32(&size)) {
+    return false;
+  }
+  const size_t offset = input.CurrentPosition();
+  if (size > data.size() - *pos - offset) {
+    return false;
+  }
+  if (!message->ParseFromArray(data.data() + *pos + offset, size)) {
+    return false;
+  }
+  *pos += offset + size;
+  return true;
+}
+
 }  // anonymous namespace
 
 namespace devtools_goma {
 
 DepsCache* DepsCache::instance_;
 
+// ParallelValidation is shared by GetDependencies and validation workers.
+// Since GetDependencies returns as soon as a modified file is found,
+// workers may still hold it after that.
+class DepsCache::ParallelValidation {
+ public:
+  struct Item {
+    std::string abs_filename;
+    FileStat file_stat;
+    SHA256HashValue directive_hash;
+  };
+
+  explicit ParallelValidation(std::vector<Item> items)
+      : items_(std::move(items)) {}
+
+  static void RunOnWorker(std::shared_ptr<ParallelValidation> validation) {
+    validation->Run();
+  }
+
+  // Validates items until all items are taken or a modified one is found.
+  void Run() {
+    GlobalFileStatCache* global_file_stat_cache =
+        GlobalFileStatCache::Instance();
+    while (!modified_.load(std::memory_order_relaxed)) {
+      const size_t begin = next_.fetch_add(kValidationChunkSize);
+      if (begin >= items_.size()) {
+        return;
+      }
+      const size_t end = std::min(begin + kValidationChunkSize, items_.size());
+      bool modified = false;
+      for (size_t i = begin; i < end; ++i) {
+        const Item& item = items_[i];
+        const FileStat file_stat =
+            global_file_stat_cache != nullptr
+                ? global_file_stat_cache->Get(item.abs_filename)
+                : FileStat(item.abs_filename);
+        if (IsDirectiveModified(item.abs_filename, file_stat, item.file_stat,
+                                item.directive_hash)) {
+          modified = true;
+          break;
+        }
+        if (modified_.load(std::memory_order_relaxed)) {
+          break;
+        }
+      }
+
+      AUTOLOCK(lock, &mu_);
+      if (modified) {
+        modified_ = true;
+      }
+      num_done_ += end - begin;
+      if (modified || num_done_ >= items_.size()) {
+        cond_.Signal();
+      }
+    }
+  }
+
+  // Waits until all items are validated or a modified one is found.
+  // Returns true if modified.
+  bool Wait() {
+    AUTOLOCK(lock, &mu_);
+    while (!modified_ && num_done_ < items_.size()) {
+      cond_.Wait(&mu_);
+    }
+    return modified_;
+  }
+
+  size_t size() const { return items_.size(); }
+
+ private:
+  const std::vector<Item> items_;
+  std::atomic<size_t> next_{0};
+  std::atomic<bool> modified_{false};
+
+  Lock mu_;
+  ConditionVariable cond_;
+  size_t num_done_ GUARDED_BY(mu_) = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(ParallelValidation);
+};
+
 DepsCache::DepsCache(const std::string& cache_filename,
                      absl::optional<absl::Duration> identifier_alive_duration,
                      size_t deps_table_size_threshold,
-                     int max_proto_size_in_mega_bytes)
+                     int max_proto_size_in_mega_bytes,
+                     absl::optional<JournalOptions> journal_options)
     : cache_file_(cache_filename),
       identifier_alive_duration_(identifier_alive_duration),
       deps_table_size_threshold_(deps_table_size_threshold),
       max_proto_size_in_mega_bytes_(max_proto_size_in_mega_bytes),
+      load_done_(false),
+      journal_options_(std::move(journal_options)),
       hit_count_(0),
       missed_count_(0),
       missed_by_updated_count_(0) {}
 
-DepsCache::~DepsCache() {}
+DepsCache::~DepsCache() {
+  WaitUntilLoaded();
+  if (journal_flush_closure_id_ != kInvalidPeriodicClosureId) {
+    journal_options_->wm->UnregisterPeriodicClosure(journal_flush_closure_id_);
+    journal_flush_closure_id_ = kInvalidPeriodicClosureId;
+  }
+  WaitUntilCompactionDone();
+}
 
 // static
 void DepsCache::Init(const std::string& cache_filename,
                      absl::optional<absl::Duration> identifier_alive_duration,
                      size_t deps_table_size_threshold,
                      int max_proto_size_in_mega_bytes) {
+  Init(cache_filename, identifier_alive_duration, deps_table_size_threshold,
+       max_proto_size_in_mega_bytes, absl::nullopt);
+}
+
+// static
+void DepsCache::Init(const std::string& cache_filename,
+                     absl::optional<absl::Duration> identifier_alive_duration,
+                     size_t deps_table_size_threshold,
+                     int max_proto_size_in_mega_bytes,
+                     const JournalOptions& journal_options) {
+  Init(cache_filename, identifier_alive_duration, deps_table_size_threshold,
+       max_proto_size_in_mega_bytes,
+       absl::optional<JournalOptions>(journal_options));
+}
+
+// static
+void DepsCache::Init(const std::string& cache_filename,
+                     absl::optional<absl::Duration> identifier_alive_duration,
+                     size_t deps_table_size_threshold,
+                     int max_proto_size_in_mega_bytes,
+                     absl::optional<JournalOptions> journal_options) {
   if (cache_filename.empty()) {
     LOG(INFO) << "DepsCache is disabled.";
     return;
@@ -99,16 +258,54 @@ void DepsCache::Init(const std::string& cache_filename,
     return;
   }
 
-  LOG(INFO) << "DepsCache is enabled. cache_filename=" << cache_filename;
+  LOG(INFO) << "DepsCache is enabled. cache_filename=" << cache_filename
+            << " journal=" << journal_options.has_value();
   instance_ = new DepsCache(cache_filename, identifier_alive_duration,
                             deps_table_size_threshold,
-                            max_proto_size_in_mega_bytes);
+                            max_proto_size_in_mega_bytes,
+                            std::move(journal_options));
+
+  const absl::optional<JournalOptions>& options = instance_->journal_options_;
+  if (options.has_value() && options->wm != nullptr) {
+    options->wm->RunClosure(FROM_HERE,
+                            NewCallback(instance_, &DepsCache::Load),
+                            WorkerThread::PRIORITY_LOW);
+    return;
+  }
+  instance_->Load();
+}
 
-  if (!instance_->LoadGomaDeps()) {
+void DepsCache::Load() {
+  SimpleTimer timer;
+  int64_t journal_generation = 0;
+  if (!LoadGomaDeps(&journal_generation)) {
     // If deps cache is broken (or does not exist), clear all cache.
     LOG(INFO) << "couldn't load deps cache file. "
               << "The cache file is broken or too large";
-    instance_->Clear();
+    Clear();
+    journal_generation = 0;
+  }
+  // Journal files are replayed even if the journal is disabled now,
+  // so that they won't be replayed on a newer snapshot later.
+  ReplayJournal(journal_generation);
+
+  if (journal_options_.has_value() && journal_options_->wm != nullptr) {
+    journal_flush_closure_id_ =
+        journal_options_->wm->RegisterPeriodicClosure(
+            FROM_HERE, journal_options_->flush_interval,
+            NewPermanentCallback(this, &DepsCache::RunFlushJournal));
+  }
+  LOG(INFO) << "DepsCache loaded in " << timer.GetDuration();
+
+  AUTOLOCK(lock, &load_mu_);
+  load_done_.store(true);
+  load_cond_.Broadcast();
+}
+
+void DepsCache::WaitUntilLoaded() {
+  AUTOLOCK(lock, &load_mu_);
+  while (!load_done_.load()) {
+    load_cond_.Wait(&load_mu_);
   }
 }
 
@@ -117,7 +314,30 @@ void DepsCache::Quit() {
   if (!IsEnabled())
     return;
 
-  instance_->SaveGomaDeps();
+  instance_->WaitUntilLoaded();
+
+  if (instance_->journal_options_.has_value()) {
+    // Updates since the last snapshot are in the journal, so we don't need
+    // to rewrite whole cache file here.
+    if (instance_->journal_flush_closure_id_ != kInvalidPeriodicClosureId) {
+      instance_->journal_options_->wm->UnregisterPeriodicClosure(
+          instance_->journal_flush_closure_id_);
+      instance_->journal_flush_closure_id_ = kInvalidPeriodicClosureId;
+    }
+    instance_->WaitUntilCompactionDone();
+    instance_->FlushJournal();
+  } else {
+    int64_t oldest_generation;
+    int64_t generation;
+    {
+      AUTOLOCK(lock, &instance_->journal_mu_);
+      oldest_generation = instance_->oldest_journal_generation_;
+      generation = instance_->journal_generation_;
+    }
+    if (instance_->SaveGomaDeps(generation)) {
+      instance_->RemoveJournalFiles(oldest_generation, generation);
+    }
+  }
   delete instance_;
   instance_ = nullptr;
 }
@@ -144,6 +364,10 @@ bool DepsCache::SetDependencies(const DepsCache::Identifier& identifier,
   DCHECK(identifier.has_value());
   DCHECK(file::IsAbsolutePath(cwd)) << cwd;
 
+  if (!IsLoaded()) {
+    return false;
+  }
+
   std::vector<DepsHashId> deps_hash_ids;
 
   // We set input_file as dependency also.
@@ -183,12 +407,19 @@ bool DepsCache::SetDependencies(const DepsCache::Identifier& identifier,
 
   AUTO_EXCLUSIVE_LOCK(lock, &mu_);
   if (!all_ok) {
-    deps_table_.erase(identifier.value());
+    if (deps_table_.erase(identifier.value()) > 0 &&
+        journal_options_.has_value()) {
+      AppendRemoveDependencyJournalUnlocked(identifier.value());
+    }
     return false;
   }
 
-  deps_table_[identifier.value()].last_used_time = absl::ToTimeT(absl::Now());
-  std::swap(deps_table_[identifier.value()].deps_hash_ids, deps_hash_ids);
+  DepsTableData* data = &deps_table_[identifier.value()];
+  data->last_used_time = absl::ToTimeT(absl::Now());
+  std::swap(data->deps_hash_ids, deps_hash_ids);
+  if (journal_options_.has_value()) {
+    AppendSetDependenciesJournalUnlocked(identifier.value(), *data);
+  }
   return true;
 }
 
@@ -200,6 +431,11 @@ bool DepsCache::GetDependencies(const DepsCache::Identifier& identifier,
   DCHECK(identifier.has_value());
   DCHECK(file::IsAbsolutePath(cwd)) << cwd;
 
+  if (!IsLoaded()) {
+    IncrMissedCount();
+    return false;
+  }
+
   std::vector<DepsHashId> deps_hash_ids;
   {
     AUTO_SHARED_LOCK(lock, &mu_);
@@ -212,27 +448,34 @@ bool DepsCache::GetDependencies(const DepsCache::Identifier& identifier,
     deps_hash_ids = it->second.deps_hash_ids;
   }
 
-  std::set<std::string> result;
+  std::vector<std::string> filenames;
+  filenames.reserve(deps_hash_ids.size());
   for (const auto& deps_hash_id : deps_hash_ids) {
-    const std::string& filename =
-        filename_id_table_.ToFilename(deps_hash_id.id);
+    std::string filename = filename_id_table_.ToFilename(deps_hash_id.id);
     if (filename.empty()) {
       LOG(ERROR) << "Unexpected FilenameIdTable conversion failure: "
                  << "id=" << deps_hash_id.id;
       IncrMissedCount();
       return false;
     }
+    filenames.push_back(std::move(filename));
+  }
 
-    if (IsDirectiveModified(file::JoinPathRespectAbsolute(cwd, filename),
-                            deps_hash_id.file_stat, deps_hash_id.directive_hash,
-                            file_stat_cache)) {
-      IncrMissedByUpdatedCount();
-      return false;
-    }
-
-    result.insert(filename);
+  SimpleTimer timer;
+  const bool parallel = validation_wm_ != nullptr &&
+                        deps_hash_ids.size() >= parallel_validation_min_deps_;
+  const bool modified =
+      parallel
+          ? IsAnyDirectiveModifiedInParallel(cwd, filenames, deps_hash_ids)
+          : IsAnyDirectiveModified(cwd, filenames, deps_hash_ids,
+                                   file_stat_cache);
+  RecordValidation(timer.GetDuration(), parallel);
+  if (modified) {
+    IncrMissedByUpdatedCount();
+    return false;
   }
 
+  std::set<std::string> result(filenames.begin(), filenames.end());
   // We don't add input_file in dependencies.
   result.erase(input_file);
 
@@ -244,8 +487,392 @@ bool DepsCache::GetDependencies(const DepsCache::Identifier& identifier,
 void DepsCache::RemoveDependency(const DepsCache::Identifier& identifier) {
   DCHECK(identifier.has_value());
 
+  if (!IsLoaded()) {
+    return;
+  }
+
+  AUTO_EXCLUSIVE_LOCK(lock, &mu_);
+  if (deps_table_.erase(identifier.value()) > 0 &&
+      journal_options_.has_value()) {
+    AppendRemoveDependencyJournalUnlocked(identifier.value());
+  }
+}
+
+std::string DepsCache::JournalPath(int64_t generation) const {
+  return absl::StrCat(cache_file_.filename(), ".journal.", generation);
+}
+
+void DepsCache::AppendSetDependenciesJournalUnlocked(
+    const Key& key,
+    const DepsTableData& data) {
+  GomaDepsJournalRecord record;
+
+  AUTOLOCK(lock, &journal_mu_);
+  GomaDependencyTableRecord* dependency = record.mutable_set_dependency();
+  dependency->set_identifier(key.ToHexString());
+  dependency->set_last_used_time(data.last_used_time);
+  for (const auto& deps_hash_id : data.deps_hash_ids) {
+    if (journaled_filename_ids_.insert(deps_hash_id.id).second) {
+      GomaFilenameIdTableRecord* filename = record.add_filename();
+      filename->set_filename(filename_id_table_.ToFilename(deps_hash_id.id));
+      filename->set_filename_id(deps_hash_id.id);
+    }
+
+    auto p = journaled_deps_ids_.emplace(
+        deps_hash_id.id,
+        std::make_pair(deps_hash_id.file_stat, deps_hash_id.directive_hash));
+    if (!p.second) {
+      if (p.first->second.first == deps_hash_id.file_stat &&
+          p.first->second.second == deps_hash_id.directive_hash) {
+        dependency->add_filename_id(deps_hash_id.id);
+        continue;
+      }
+      p.first->second =
+          std::make_pair(deps_hash_id.file_stat, deps_hash_id.directive_hash);
+    }
+    GomaDepsIdTableRecord* deps_id = record.add_deps_id();
+    deps_id->set_filename_id(deps_hash_id.id);
+    if (deps_hash_id.file_stat.IsValid()) {
+      *deps_id->mutable_mtime_ts() = TimeToProto(*deps_hash_id.file_stat.mtime);
+    }
+    deps_id->set_size(deps_hash_id.file_stat.size);
+    deps_id->set_directive_hash(deps_hash_id.directive_hash.ToHexString());
+    dependency->add_filename_id(deps_hash_id.id);
+  }
+  AppendJournalRecordUnlocked(record);
+}
+
+void DepsCache::AppendRemoveDependencyJournalUnlocked(const Key& key) {
+  GomaDepsJournalRecord record;
+  record.set_removed_identifier(key.ToHexString());
+
+  AUTOLOCK(lock, &journal_mu_);
+  AppendJournalRecordUnlocked(record);
+}
+
+void DepsCache::AppendJournalRecordUnlocked(
+    const GomaDepsJournalRecord& record) {
+  AppendDelimitedMessage(record, &journal_buffer_);
+  ++journal_records_;
+  if (journal_buffer_.size() >= kMaxJournalBufferSize) {
+    FlushJournalUnlocked();
+  }
+}
+
+void DepsCache::ResetJournalFileUnlocked() {
+  journal_fd_.Close();
+  journal_buffer_.clear();
+  journaled_filename_ids_.clear();
+  journaled_deps_ids_.clear();
+}
+
+void DepsCache::FlushJournal() {
+  AUTOLOCK(lock, &journal_mu_);
+  FlushJournalUnlocked();
+}
+
+void DepsCache::FlushJournalUnlocked() {
+  if (journal_buffer_.empty()) {
+    return;
+  }
+
+  std::string data;
+  if (!journal_fd_.valid()) {
+    const std::string path = JournalPath(journal_generation_);
+    journal_fd_.reset(ScopedFd::Create(path, 0644));
+    if (!journal_fd_.valid()) {
+      LOG(ERROR) << "failed to create journal file " << path;
+      // Records in the buffer refer filenames recorded in the buffer, so
+      // we can't keep some of them. Start over with a new journal file.
+      ResetJournalFileUnlocked();
+      return;
+    }
+    GomaDepsJournalHeader header;
+    header.set_built_revision(kBuiltRevisionString);
+    header.set_generation(journal_generation_);
+    AppendDelimitedMessage(header, &data);
+  }
+  data.append(journal_buffer_);
+  journal_buffer_.clear();
+
+  const ssize_t written = journal_fd_.Write(data.data(), data.size());
+  if (written != static_cast<ssize_t>(data.size())) {
+    LOG(ERROR) << "failed to write journal file "
+               << JournalPath(journal_generation_)
+               << " written=" << written << " size=" << data.size();
+    // The file may end with a partial record, so no more records can be
+    // appended. Later records are written to the next generation.
+    ResetJournalFileUnlocked();
+    ++journal_generation_;
+  }
+  journal_bytes_ += data.size();
+}
+
+void DepsCache::RunFlushJournal() {
+  bool needs_compaction = false;
+  {
+    AUTOLOCK(lock, &journal_mu_);
+    FlushJournalUnlocked();
+    if (!journal_compacting_ &&
+        journal_bytes_ >= journal_options_->compaction_threshold_bytes) {
+      journal_compacting_ = true;
+      needs_compaction = true;
+    }
+  }
+  if (needs_compaction) {
+    journal_options_->wm->RunClosure(
+        FROM_HERE, NewCallback(this, &DepsCache::CompactJournal),
+        WorkerThread::PRIORITY_LOW);
+  }
+}
+
+void DepsCache::CompactJournal() {
+  int64_t oldest_generation;
+  int64_t generation;
+  {
+    AUTOLOCK(lock, &journal_mu_);
+    journal_compacting_ = true;
+    FlushJournalUnlocked();
+    ResetJournalFileUnlocked();
+    oldest_generation = oldest_journal_generation_;
+    generation = ++journal_generation_;
+    journal_bytes_ = 0;
+  }
+
+  // The snapshot contains all updates recorded in journal files before
+  // |generation|. It may also contain some updates in |generation|, but
+  // it's ok to replay them on the snapshot.
+  const bool saved = SaveGomaDeps(generation);
+  if (saved) {
+    RemoveJournalFiles(oldest_generation, generation);
+  }
+
+  AUTOLOCK(lock, &journal_mu_);
+  if (saved) {
+    oldest_journal_generation_ = generation;
+    ++journal_compactions_;
+  }
+  journal_compacting_ = false;
+  journal_cond_.Broadcast();
+}
+
+void DepsCache::WaitUntilCompactionDone() {
+  AUTOLOCK(lock, &journal_mu_);
+  while (journal_compacting_) {
+    journal_cond_.Wait(&journal_mu_);
+  }
+}
+
+void DepsCache::RemoveJournalFiles(int64_t from, int64_t to) const {
+  for (int64_t generation = from; generation < to; ++generation) {
+    const std::string path = JournalPath(generation);
+    if (remove(path.c_str()) != 0 && errno != ENOENT) {
+      PLOG(WARNING) << "failed to remove journal file " << path;
+    }
+  }
+}
+
+void DepsCache::ReplayJournal(int64_t generation) {
+  size_t replayed_bytes = 0;
+  int64_t last_generation = generation;
+  while (ReplayJournalFile(last_generation, &replayed_bytes)) {
+    ++last_generation;
+  }
+  if (last_generation > generation) {
+    LOG(INFO) << "replayed journal generation [" << generation << ", "
+              << last_generation << ") " << replayed_bytes << " bytes";
+  }
+
+  // Remove journal files which won't be replayed: older ones which should
+  // have been removed after compaction, and ones after broken or missing
+  // generation. The file at |last_generation| is overwritten.
+  for (int64_t g = generation - 1;
+       g >= 0 && remove(JournalPath(g).c_str()) == 0; --g) {
+  }
+  for (int64_t g = last_generation + 1;
+       remove(JournalPath(g).c_str()) == 0; ++g) {
+  }
+
+  AUTOLOCK(lock, &journal_mu_);
+  oldest_journal_generation_ = generation;
+  journal_generation_ = last_generation;
+  journal_bytes_ = replayed_bytes;
+}
+
+bool DepsCache::ReplayJournalFile(int64_t generation,
+                                  size_t* replayed_bytes) {
+  const std::string path = JournalPath(generation);
+  std::string data;
+  if (!ReadFileToString(path, &data)) {
+    return false;
+  }
+
+  size_t pos = 0;
+  GomaDepsJournalHeader header;
+  if (!ParseDelimitedMessage(data, &pos, &header)) {
+    LOG(WARNING) << "broken journal header: " << path;
+    return false;
+  }
+  if (header.built_revision() != kBuiltRevisionString ||
+      header.generation() != generation) {
+    LOG(INFO) << "journal file is ignored: " << path
+              << " built_revision=" << header.built_revision()
+              << " generation=" << header.generation();
+    return false;
+  }
+
+  absl::flat_hash_map<int64_t, FilenameIdTable::Id> id_map;
+  absl::flat_hash_map<int64_t, std::pair<FileStat, SHA256HashValue>> deps_ids;
   AUTO_EXCLUSIVE_LOCK(lock, &mu_);
-  deps_table_.erase(identifier.value());
+  while (pos < data.size()) {
+    GomaDepsJournalRecord record;
+    if (!ParseDelimitedMessage(data, &pos, &record) ||
+        !ApplyJournalRecordUnlocked(record, &id_map, &deps_ids)) {
+      // Can happen when compiler_proxy crashed during writing a record.
+      // Remaining records in this file are dropped, but records in the next
+      // generation can be replayed since they don't refer this file.
+      LOG(WARNING) << "broken journal record: " << path << " at " << pos;
+      break;
+    }
+  }
+  *replayed_bytes += pos;
+  return true;
+}
+
+bool DepsCache::ApplyJournalRecordUnlocked(
+    const GomaDepsJournalRecord& record,
+    absl::flat_hash_map<int64_t, FilenameIdTable::Id>* id_map,
+    absl::flat_hash_map<int64_t, std::pair<FileStat, SHA256HashValue>>*
+        deps_ids) {
+  for (const auto& filename : record.filename()) {
+    FilenameIdTable::Id id =
+        filename_id_table_.InsertFilename(filename.filename());
+    if (id == FilenameIdTable::kInvalidId) {
+      return false;
+    }
+    (*id_map)[filename.filename_id()] = id;
+  }
+
+  for (const auto& deps_id : record.deps_id()) {
+    if (!id_map->contains(deps_id.filename_id())) {
+      return false;
+    }
+    FileStat file_stat;
+    if (deps_id.has_mtime_ts()) {
+      file_stat.mtime = ProtoToTime(deps_id.mtime_ts());
+      file_stat.size = deps_id.size();
+    }
+    SHA256HashValue directive_hash;
+    if (!SHA256HashValue::ConvertFromHexString(deps_id.directive_hash(),
+                                               &directive_hash)) {
+      return false;
+    }
+    (*deps_ids)[deps_id.filename_id()] =
+        std::make_pair(file_stat, directive_hash);
+  }
+
+  if (record.has_set_dependency()) {
+    const GomaDependencyTableRecord& dependency = record.set_dependency();
+    Key key;
+    if (!SHA256HashValue::ConvertFromHexString(dependency.identifier(),
+                                               &key)) {
+      return false;
+    }
+    std::vector<DepsHashId> deps_hash_ids;
+    deps_hash_ids.reserve(dependency.filename_id_size());
+    for (const auto& journal_id : dependency.filename_id()) {
+      auto id = id_map->find(journal_id);
+      auto hash_id = deps_ids->find(journal_id);
+      if (id == id_map->end() || hash_id == deps_ids->end()) {
+        return false;
+      }
+      deps_hash_ids.push_back(DepsHashId(id->second, hash_id->second.first,
+                                         hash_id->second.second));
+    }
+    DepsTableData* data = &deps_table_[key];
+    data->last_used_time = dependency.last_used_time();
+    std::swap(data->deps_hash_ids, deps_hash_ids);
+  }
+
+  if (record.has_removed_identifier()) {
+    Key key;
+    if (!SHA256HashValue::ConvertFromHexString(record.removed_identifier(),
+                                               &key)) {
+      return false;
+    }
+    deps_table_.erase(key);
+  }
+  return true;
+}
+
+void DepsCache::EnableParallelValidation(WorkerThreadManager* wm,
+                                         int pool,
+                                         int num_threads,
+                                         size_t min_deps) {
+  LOG(INFO) << "DepsCache parallel validation is enabled."
+            << " num_threads=" << num_threads << " min_deps=" << min_deps;
+  validation_wm_ = wm;
+  validation_pool_ = pool;
+  validation_num_threads_ = num_threads;
+  parallel_validation_min_deps_ = min_deps;
+}
+
+// static
+bool DepsCache::IsAnyDirectiveModified(
+    const std::string& cwd,
+    const std::vector<std::string>& filenames,
+    const std::vector<DepsHashId>& deps_hash_ids,
+    FileStatCache* file_stat_cache) {
+  DCHECK_EQ(filenames.size(), deps_hash_ids.size());
+  for (size_t i = 0; i < deps_hash_ids.size(); ++i) {
+    if (IsDirectiveModified(file::JoinPathRespectAbsolute(cwd, filenames[i]),
+                            deps_hash_ids[i].file_stat,
+                            deps_hash_ids[i].directive_hash,
+                            file_stat_cache)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool DepsCache::IsAnyDirectiveModifiedInParallel(
+    const std::string& cwd,
+    const std::vector<std::string>& filenames,
+    const std::vector<DepsHashId>& deps_hash_ids) {
+  DCHECK_EQ(filenames.size(), deps_hash_ids.size());
+  std::vector<ParallelValidation::Item> items;
+  items.reserve(deps_hash_ids.size());
+  for (size_t i = 0; i < deps_hash_ids.size(); ++i) {
+    items.push_back(ParallelValidation::Item{
+        file::JoinPathRespectAbsolute(cwd, filenames[i]),
+        deps_hash_ids[i].file_stat, deps_hash_ids[i].directive_hash});
+  }
+  auto validation = std::make_shared<ParallelValidation>(std::move(items));
+
+  // The calling thread also validates, so it needs one chunk less.
+  const size_t num_chunks =
+      (validation->size() + kValidationChunkSize - 1) / kValidationChunkSize;
+  const size_t num_workers = std::min<size_t>(
+      validation_num_threads_, num_chunks > 0 ? num_chunks - 1 : 0);
+  for (size_t i = 0; i < num_workers; ++i) {
+    validation_wm_->RunClosureInPool(
+        FROM_HERE, validation_pool_,
+        NewCallback(&ParallelValidation::RunOnWorker, validation),
+        WorkerThread::PRIORITY_HIGH);
+  }
+
+  validation->Run();
+  return validation->Wait();
+}
+
+void DepsCache::RecordValidation(absl::Duration duration, bool parallel) {
+  AUTOLOCK(lock, &count_mu_);
+  ++validation_count_;
+  if (parallel) {
+    ++parallel_validation_count_;
+  }
+  validation_time_ += duration;
+  max_validation_time_ = std::max(max_validation_time_, duration);
 }
 
 void DepsCache::IncrMissedCount() {
@@ -283,6 +910,17 @@ void DepsCache::DumpStatsToProto(DepsCacheStats* stat) const {
     stat->set_hit(hit_count_);
     stat->set_updated(missed_by_updated_count_);
     stat->set_missed(missed_count_);
+    stat->set_validation_count(validation_count_);
+    stat->set_parallel_validation_count(parallel_validation_count_);
+    stat->set_validation_time_ms(absl::ToInt64Milliseconds(validation_time_));
+    stat->set_max_validation_time_ms(
+        absl::ToInt64Milliseconds(max_validation_time_));
+  }
+  {
+    AUTOLOCK(lock, &journal_mu_);
+    stat->set_journal_records(journal_records_);
+    stat->set_journal_bytes(journal_bytes_);
+    stat->set_journal_compactions(journal_compactions_);
   }
 }
 
@@ -291,8 +929,15 @@ bool DepsCache::IsDirectiveModified(const std::string& filename,
                                     const FileStat& old_file_stat,
                                     const SHA256HashValue& old_directive_hash,
                                     FileStatCache* file_stat_cache) {
-  FileStat file_stat(file_stat_cache->Get(filename));
+  return IsDirectiveModified(filename, file_stat_cache->Get(filename),
+                             old_file_stat, old_directive_hash);
+}
 
+// static
+bool DepsCache::IsDirectiveModified(const std::string& filename,
+                                    const FileStat& file_stat,
+                                    const FileStat& old_file_stat,
+                                    const SHA256HashValue& old_directive_hash) {
   if (!file_stat.IsValid()) {
     // When file doesn't exist, let's consider a directive is changed.
     return true;
@@ -344,7 +989,7 @@ bool DepsCache::GetDepsHashId(const Identifier& identifier,
   return false;
 }
 
-bool DepsCache::LoadGomaDeps() {
+bool DepsCache::LoadGomaDeps(int64_t* journal_generation) {
   absl::optional<absl::Time> time_threshold;
   if (identifier_alive_duration_.has_value()) {
     time_threshold = absl::Now() - *identifier_alive_duration_;
@@ -354,9 +999,9 @@ bool DepsCache::LoadGomaDeps() {
   const int total_bytes_limit = max_proto_size_in_mega_bytes_ * 1024 * 1024;
   const int warning_threshold = total_bytes_limit * 3 / 4;
 
-  if (!cache_file_.LoadWithMaxLimit(&goma_deps,
-                                    total_bytes_limit,
-                                    warning_threshold)) {
+  if (!cache_file_.LoadWithEmbeddedChecksum(&goma_deps,
+                                            total_bytes_limit,
+                                            warning_threshold)) {
     LOG(ERROR) << "failed to load cache file " << cache_file_.filename();
     return false;
   }
@@ -470,49 +1115,61 @@ bool DepsCache::LoadGomaDeps() {
     }
   }
 
-  LOG(INFO) << cache_file_.filename() << " has been successfully loaded.";
+  *journal_generation = goma_deps.journal_generation();
+  LOG(INFO) << cache_file_.filename() << " has been successfully loaded."
+            << " journal_generation=" << *journal_generation;
 
   return true;
 }
 
-bool DepsCache::SaveGomaDeps() {
-  AUTO_SHARED_LOCK(lock, &mu_);
-
+bool DepsCache::SaveGomaDeps(int64_t journal_generation) {
   GomaDeps goma_deps;
   goma_deps.set_built_revision(kBuiltRevisionString);
+  goma_deps.set_journal_generation(journal_generation);
 
   // First, drop older DepsTable entry from deps_table_.
-  if (identifier_alive_duration_.has_value()) {
-    absl::Time time_threshold = absl::Now() - *identifier_alive_duration_;
-    for (auto it = deps_table_.begin(); it != deps_table_.end(); ) {
-      if (absl::FromTimeT(it->second.last_used_time) < time_threshold) {
-        // should be OK since all iterators but deleted one keep valid.
-        deps_table_.erase(it++);
-      } else {
-        ++it;
+  // Note that dropped entries are not recorded in the journal. They will be
+  // dropped again if they are replayed on an older snapshot.
+  {
+    AUTO_EXCLUSIVE_LOCK(lock, &mu_);
+    if (identifier_alive_duration_.has_value()) {
+      absl::Time time_threshold = absl::Now() - *identifier_alive_duration_;
+      for (auto it = deps_table_.begin(); it != deps_table_.end(); ) {
+        if (absl::FromTimeT(it->second.last_used_time) < time_threshold) {
+          // should be OK since all iterators but deleted one keep valid.
+          deps_table_.erase(it++);
+        } else {
+          ++it;
+        }
       }
     }
-  }
 
-  // Checks the size of DepsTable. If it exceeds threshold, we'd like to remove
-  // older identifiers.
-  if (deps_table_.size() > deps_table_size_threshold_) {
-    LOG(INFO) << "DepsTable size " << deps_table_.size()
-              << " exceeds the threshold " << deps_table_size_threshold_
-              << ". Older cache will be deleted";
-    std::vector<std::pair<absl::Time, Key>> keys_by_time;
-    keys_by_time.reserve(deps_table_.size());
-    for (const auto& entry : deps_table_) {
-      keys_by_time.emplace_back(
-          absl::FromTimeT(entry.second.last_used_time.load()), entry.first);
-    }
-    std::sort(keys_by_time.begin(), keys_by_time.end(),
-         std::greater<std::pair<absl::Time, Key>>());
-    for (size_t i = deps_table_size_threshold_; i < keys_by_time.size(); ++i) {
-      deps_table_.erase(keys_by_time[i].second);
+    // Checks the size of DepsTable. If it exceeds threshold, we'd like to
+    // remove older identifiers.
+    if (deps_table_.size() > deps_table_size_threshold_) {
+      LOG(INFO) << "DepsTable size " << deps_table_.size()
+                << " exceeds the threshold " << deps_table_size_threshold_
+                << ". Older cache will be deleted";
+      std::vector<std::pair<absl::Time, Key>> keys_by_time;
+      keys_by_time.reserve(deps_table_.size());
+      for (const auto& entry : deps_table_) {
+        keys_by_time.emplace_back(
+            absl::FromTimeT(entry.second.last_used_time.load()), entry.first);
+      }
+      std::sort(keys_by_time.begin(), keys_by_time.end(),
+                std::greater<std::pair<absl::Time, Key>>());
+      for (size_t i = deps_table_size_threshold_; i < keys_by_time.size();
+           ++i) {
+        deps_table_.erase(keys_by_time[i].second);
+      }
     }
   }
 
+  // Other threads can use the cache while the snapshot is being created.
+  // Note that last_used_time updated by GetDependencies is not recorded in
+  // the journal, but persisted in the snapshot.
+  AUTO_SHARED_LOCK(lock, &mu_);
+
   // We create a map:
   //   FilenameIdTable::Id -> pair<FileStat, directive-hash>.
   // When we saw multiple DepsHashId for one FilenameIdTable::Id,
@@ -582,11 +1239,28 @@ bool DepsCache::SaveGomaDeps() {
   // because no one will refer it.
   filename_id_table_.SaveTo(used_ids, goma_deps.mutable_filename_id_table());
 
-  if (!cache_file_.Save(goma_deps)) {
-    LOG(ERROR) << "failed to save cache file " << cache_file_.filename();
+  // Write to tmp file first, so that the previous snapshot is kept if
+  // compiler_proxy crashes during writing. It is still needed to replay
+  // journal files. The checksum is in the same file, so the snapshot is
+  // replaced by one rename.
+  const std::string& filename = cache_file_.filename();
+  const CacheFile tmp_file(filename + ".tmp");
+  if (!tmp_file.SaveWithEmbeddedChecksum(goma_deps)) {
+    LOG(ERROR) << "failed to save cache file " << tmp_file.filename();
+    return false;
+  }
+#ifdef _WIN32
+  remove(filename.c_str());
+#endif
+  if (rename(tmp_file.filename().c_str(), filename.c_str()) != 0) {
+    PLOG(ERROR) << "failed to rename " << tmp_file.filename() << " to "
+                << filename;
     return false;
   }
-  LOG(INFO) << "saved to " << cache_file_.filename();
+  // Remove *.sha256 written by older compiler_proxy.
+  remove((filename + ".sha256").c_str());
+  LOG(INFO) << "saved to " << filename
+            << " journal_generation=" << journal_generation;
   return true;
 }
 
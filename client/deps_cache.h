@@ -7,12 +7,15 @@
 #define DEVTOOLS_GOMA_CLIENT_DEPS_CACHE_H_
 
 #include <atomic>
+#include <memory>
 #include <set>
 #include <sstream>
 #include <string>
 #include <unordered_map>
 #include <utility>
 
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
 #include "absl/container/node_hash_map.h"
 #include "absl/time/time.h"
 #include "absl/types/optional.h"
@@ -21,12 +24,16 @@
 #include "file_stat_cache.h"
 #include "filename_id_table.h"
 #include "goma_hash.h"
+#include "scoped_fd.h"
+#include "worker_thread.h"
 
 namespace devtools_goma {
 
 class CompilerFlags;
 class CompilerInfo;
 class DepsCacheStats;
+class GomaDepsJournalRecord;
+class WorkerThreadManager;
 
 // DepsCache is a cache for dependent files.
 // We make an 'identifier' which identifies compile command,
@@ -39,10 +46,32 @@ class DepsCacheStats;
 //   1. Check FileStat. If it's the same, we think a file is not changed.
 //   2. Check directive_hash, which is a hash value created from file's
 //      directive lines. If it's the same, dependant files won't be changed.
+//
+// The cache is saved to |cache_filename| as a snapshot. When the journal is
+// enabled, updates are also appended to journal files
+// (|cache_filename|.journal.<generation>), so that they are not lost even if
+// compiler_proxy crashes. The journal is compacted into a new snapshot in
+// background when it becomes large.
+// When the journal is enabled with a WorkerThreadManager, the snapshot is
+// loaded and the journal is replayed in background, so startup doesn't
+// wait for parsing the snapshot. Until loading finishes, GetDependencies
+// misses and updates are not recorded.
 class DepsCache {
  public:
   using Identifier = absl::optional<SHA256HashValue>;
 
+  struct JournalOptions {
+    // Used to load the snapshot in background, and to flush and compact
+    // the journal periodically.
+    // If nullptr, the snapshot is loaded in Init, and the journal is
+    // flushed only on Quit.
+    WorkerThreadManager* wm = nullptr;
+    absl::Duration flush_interval = absl::Seconds(10);
+    // When the journal exceeds this size, it is compacted into a new
+    // snapshot.
+    size_t compaction_threshold_bytes = 64 * 1024 * 1024;
+  };
+
   static DepsCache* instance() { return instance_; }
   static bool IsEnabled() { return instance_ != nullptr; }
 
@@ -53,8 +82,15 @@ class DepsCache {
                    absl::optional<absl::Duration> identifier_alive_duration,
                    size_t deps_table_size_threshold,
                    int max_proto_size_in_mega_bytes);
+  // Same as above, but updates are also recorded in the journal.
+  static void Init(const std::string& cache_filename,
+                   absl::optional<absl::Duration> identifier_alive_duration,
+                   size_t deps_table_size_threshold,
+                   int max_proto_size_in_mega_bytes,
+                   const JournalOptions& journal_options);
 
   // Saves .goma_deps file is DepsCache is initialized.
+  // If the journal is enabled, flushes the journal instead.
   static void Quit();
 
   // Creates identifier to set/get dependencies.
@@ -90,6 +126,15 @@ class DepsCache {
 
   void RemoveDependency(const Identifier& identifier);
 
+  // Makes GetDependencies validate dependencies in |pool| of |wm| when
+  // an entry has |min_deps| files or more. |num_threads| is the number of
+  // threads in |pool|. The calling thread of GetDependencies also validates
+  // them. Must be called before GetDependencies is used.
+  void EnableParallelValidation(WorkerThreadManager* wm,
+                                int pool,
+                                int num_threads,
+                                size_t min_deps);
+
   // Dump internal stats.
   void DumpStatsToProto(DepsCacheStats* stats) const;
 
@@ -126,25 +171,95 @@ class DepsCache {
   typedef SHA256HashValue Key;
   typedef absl::node_hash_map<Key, DepsTableData> DepsTable;
 
+  class ParallelValidation;
+
   DepsCache(const std::string& cache_filename,
             absl::optional<absl::Duration> identifier_alive_duration,
             size_t deps_table_size_threshold,
-            int max_proto_size_in_mega_bytes);
+            int max_proto_size_in_mega_bytes,
+            absl::optional<JournalOptions> journal_options);
   ~DepsCache();
 
+  static void Init(const std::string& cache_filename,
+                   absl::optional<absl::Duration> identifier_alive_duration,
+                   size_t deps_table_size_threshold,
+                   int max_proto_size_in_mega_bytes,
+                   absl::optional<JournalOptions> journal_options);
+
   void Clear();
 
-  bool SaveGomaDeps();
-  bool LoadGomaDeps();
+  // Loads the snapshot and replays the journal.
+  void Load() LOCKS_EXCLUDED(load_mu_);
+  bool IsLoaded() const { return load_done_.load(); }
+  void WaitUntilLoaded() LOCKS_EXCLUDED(load_mu_);
+
+  // Saves a snapshot which includes journal files before
+  // |journal_generation|.
+  bool SaveGomaDeps(int64_t journal_generation);
+  bool LoadGomaDeps(int64_t* journal_generation);
+
+  std::string JournalPath(int64_t generation) const;
+  // Replays journal files from |generation|, and removes stale journal
+  // files. Subsequent records are written to the generation next to the
+  // last replayed one.
+  void ReplayJournal(int64_t generation);
+  // Returns false if the journal file does not exist or its header is
+  // invalid. If a record is broken, records before it are applied.
+  bool ReplayJournalFile(int64_t generation, size_t* replayed_bytes);
+  // |id_map| and |deps_ids| are keyed by filename id in the journal file.
+  bool ApplyJournalRecordUnlocked(
+      const GomaDepsJournalRecord& record,
+      absl::flat_hash_map<int64_t, FilenameIdTable::Id>* id_map,
+      absl::flat_hash_map<int64_t, std::pair<FileStat, SHA256HashValue>>*
+          deps_ids) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  // Removes journal files in [from, to).
+  void RemoveJournalFiles(int64_t from, int64_t to) const;
+
+  // Appends a record to the journal buffer. Called with |mu_| held, so
+  // that the order of records is the same as the order of updates.
+  void AppendSetDependenciesJournalUnlocked(
+      const Key& key,
+      const DepsTableData& data) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void AppendRemoveDependencyJournalUnlocked(const Key& key)
+      EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void AppendJournalRecordUnlocked(const GomaDepsJournalRecord& record)
+      EXCLUSIVE_LOCKS_REQUIRED(journal_mu_);
+  void ResetJournalFileUnlocked() EXCLUSIVE_LOCKS_REQUIRED(journal_mu_);
+
+  // Writes buffered records to the journal file.
+  void FlushJournal() LOCKS_EXCLUDED(journal_mu_);
+  void FlushJournalUnlocked() EXCLUSIVE_LOCKS_REQUIRED(journal_mu_);
+  // Called periodically on alarm worker.
+  void RunFlushJournal();
+  // Writes a new snapshot, and removes journal files included in it.
+  void CompactJournal() LOCKS_EXCLUDED(mu_, journal_mu_);
+  void WaitUntilCompactionDone() LOCKS_EXCLUDED(journal_mu_);
 
   void IncrMissedCount();
   void IncrMissedByUpdatedCount();
   void IncrHitCount();
+  void RecordValidation(absl::Duration duration, bool parallel);
+
+  // Returns true if any of |deps_hash_ids| is modified. |filenames| are
+  // filenames of |deps_hash_ids|.
+  static bool IsAnyDirectiveModified(
+      const std::string& cwd,
+      const std::vector<std::string>& filenames,
+      const std::vector<DepsHashId>& deps_hash_ids,
+      FileStatCache* file_stat_cache);
+  bool IsAnyDirectiveModifiedInParallel(
+      const std::string& cwd,
+      const std::vector<std::string>& filenames,
+      const std::vector<DepsHashId>& deps_hash_ids);
 
   static bool IsDirectiveModified(const std::string& filename,
                                   const FileStat& old_file_stat,
                                   const SHA256HashValue& old_directive_hash,
                                   FileStatCache* file_stat_cache);
+  static bool IsDirectiveModified(const std::string& filename,
+                                  const FileStat& file_stat,
+                                  const FileStat& old_file_stat,
+                                  const SHA256HashValue& old_directive_hash);
 
   // Used for test.
   bool UpdateLastUsedTime(const Identifier& identifier,
@@ -178,10 +293,50 @@ class DepsCache {
   // between filename and id.
   FilenameIdTable filename_id_table_;
 
+  mutable Lock load_mu_;
+  ConditionVariable load_cond_;
+  std::atomic<bool> load_done_;
+
+  // Journal. Enabled only if |journal_options_| is set.
+  const absl::optional<JournalOptions> journal_options_;
+  PeriodicClosureId journal_flush_closure_id_ = kInvalidPeriodicClosureId;
+
+  mutable Lock journal_mu_ ACQUIRED_AFTER(mu_);
+  ConditionVariable journal_cond_;
+  // Oldest journal file which may exist.
+  int64_t oldest_journal_generation_ GUARDED_BY(journal_mu_) = 0;
+  // Journal file currently written. Records are appended to a new
+  // generation after compaction.
+  int64_t journal_generation_ GUARDED_BY(journal_mu_) = 0;
+  // Opened lazily when records are flushed.
+  ScopedFd journal_fd_ GUARDED_BY(journal_mu_);
+  std::string journal_buffer_ GUARDED_BY(journal_mu_);
+  // Filename ids and their FileStat and directive hash, already recorded in
+  // the current journal file.
+  absl::flat_hash_set<FilenameIdTable::Id> journaled_filename_ids_
+      GUARDED_BY(journal_mu_);
+  absl::flat_hash_map<FilenameIdTable::Id, std::pair<FileStat, SHA256HashValue>>
+      journaled_deps_ids_ GUARDED_BY(journal_mu_);
+  // Bytes of journal files which are not compacted yet.
+  size_t journal_bytes_ GUARDED_BY(journal_mu_) = 0;
+  bool journal_compacting_ GUARDED_BY(journal_mu_) = false;
+  int64_t journal_records_ GUARDED_BY(journal_mu_) = 0;
+  int64_t journal_compactions_ GUARDED_BY(journal_mu_) = 0;
+
+  // Parallel validation. Enabled only if |validation_wm_| is set.
+  WorkerThreadManager* validation_wm_ = nullptr;
+  int validation_pool_ = 0;
+  int validation_num_threads_ = 0;
+  size_t parallel_validation_min_deps_ = 0;
+
   mutable Lock count_mu_;
   unsigned int hit_count_ GUARDED_BY(count_mu_);
   unsigned int missed_count_ GUARDED_BY(count_mu_);
   unsigned int missed_by_updated_count_ GUARDED_BY(count_mu_);
+  int64_t validation_count_ GUARDED_BY(count_mu_) = 0;
+  int64_t parallel_validation_count_ GUARDED_BY(count_mu_) = 0;
+  absl::Duration validation_time_ GUARDED_BY(count_mu_);
+  absl::Duration max_validation_time_ GUARDED_BY(count_mu_);
 
   DISALLOW_COPY_AND_ASSIGN(DepsCache);
 };
@@ -8,14 +8,17 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
-#include <fstream>
 #include <memory>
 #include <set>
 #include <string>
 #include <vector>
 
 #include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/notification.h"
 #include "absl/time/time.h"
+#include "cache_file.h"
+#include "callback.h"
 #include "compiler_flags.h"
 #include "compiler_info.h"
 #include "cxx/cxx_compiler_info.h"
@@ -27,14 +30,20 @@
 #include "path.h"
 #include "path_resolver.h"
 #include "prototmp/deps_cache_data.pb.h"
+#include "prototmp/goma_stats.pb.h"
 #include "subprocess.h"
 #include "unittest_util.h"
 #include "vc_flags.h"
+#include "worker_thread_manager.h"
 
 namespace {
 constexpr absl::Duration kDepsCacheAliveDuration = absl::Hours(3 * 24);
 constexpr int kDepsCacheThreshold = 10;
 constexpr int kDepsCacheMaxProtoSizeInMB = 64;
+
+void WaitForNotification(absl::Notification* n) {
+  n->WaitForNotification();
+}
 }
 
 namespace devtools_goma {
@@ -88,54 +97,43 @@ class DepsCacheTest : public testing::Test {
     return dc_->UpdateLastUsedTime(identifier, std::move(last_used_time));
   }
 
+  void EnableParallelValidation(WorkerThreadManager* wm,
+                                int pool,
+                                int num_threads,
+                                size_t min_deps) {
+    dc_->EnableParallelValidation(wm, pool, num_threads, min_deps);
+  }
+
+  DepsCacheStats GetStats() const {
+    DepsCacheStats stats;
+    dc_->DumpStatsToProto(&stats);
+    return stats;
+  }
+
   void UpdateGomaBuiltRevision() {
-    const std::string deps_path =
-        file::JoinPath(tmpdir_->tmpdir(), ".goma_deps");
-    const std::string deps_sha256_path =
-        file::JoinPath(tmpdir_->tmpdir(), ".goma_deps.sha256");
+    const CacheFile cache_file(
+        file::JoinPath(tmpdir_->tmpdir(), ".goma_deps"));
 
     GomaDeps goma_deps;
-
-    // Load GomaDeps.
-    {
-      std::ifstream dot_goma_deps(deps_path.c_str(), std::ifstream::binary);
-      ASSERT_TRUE(dot_goma_deps.is_open());
-      ASSERT_TRUE(goma_deps.ParseFromIstream(&dot_goma_deps));
-    }
+    ASSERT_TRUE(cache_file.LoadWithEmbeddedChecksum(&goma_deps, -1, -1));
 
     goma_deps.set_built_revision(goma_deps.built_revision() + "-new");
 
-    // Save GomaDeps + .sha256
-    // Without updating .sha256, integrity check will revoke the cache. That's
-    // not what we wan to test.
-    {
-      std::ofstream dot_goma_deps(deps_path.c_str(), std::ofstream::binary);
-      ASSERT_TRUE(dot_goma_deps.is_open());
-      ASSERT_TRUE(goma_deps.SerializeToOstream(&dot_goma_deps));
-    }
-
-    {
-      std::string sha256_str;
-      ASSERT_TRUE(GomaSha256FromFile(deps_path, &sha256_str));
-      ASSERT_TRUE(WriteStringToFile(sha256_str, deps_sha256_path));
-    }
+    // Save GomaDeps with its checksum.
+    // Without updating the checksum, integrity check will revoke the cache.
+    // That's not what we wan to test.
+    ASSERT_TRUE(cache_file.SaveWithEmbeddedChecksum(goma_deps));
   }
 
   void UpdateIdentifierLastUsedTime(const DepsCache::Identifier& identifier,
                                     absl::Time last_used_time) {
     CHECK(identifier.has_value());
 
-    const std::string& deps_path =
-        file::JoinPath(tmpdir_->tmpdir(), ".goma_deps");
+    const CacheFile cache_file(
+        file::JoinPath(tmpdir_->tmpdir(), ".goma_deps"));
 
     GomaDeps goma_deps;
-
-    // Load GomaDeps
-    {
-      std::ifstream dot_goma_deps(deps_path.c_str(), std::ifstream::binary);
-      ASSERT_TRUE(dot_goma_deps.is_open());
-      ASSERT_TRUE(goma_deps.ParseFromIstream(&dot_goma_deps));
-    }
+    ASSERT_TRUE(cache_file.LoadWithEmbeddedChecksum(&goma_deps, -1, -1));
 
     GomaDependencyTable* table = goma_deps.mutable_dependency_table();
     for (int i = 0; i < table->record_size(); ++i) {
@@ -146,11 +144,7 @@ class DepsCacheTest : public testing::Test {
     }
 
     // Save GomaDeps
-    {
-      std::ofstream dot_goma_deps(deps_path.c_str(), std::ofstream::binary);
-      ASSERT_TRUE(dot_goma_deps.is_open());
-      ASSERT_TRUE(goma_deps.SerializeToOstream(&dot_goma_deps));
-    }
+    ASSERT_TRUE(cache_file.SaveWithEmbeddedChecksum(goma_deps));
   }
 
   std::unique_ptr<CompilerInfoData> CreateBarebornCompilerInfo(
@@ -195,6 +189,69 @@ class DepsCacheTest : public testing::Test {
 
   int DepsCacheSize() const { return static_cast<int>(dc_->deps_table_size()); }
 
+  // Restarts DepsCache with the journal enabled. If |crash| is true,
+  // DepsCache is destructed without Quit() after the journal is flushed.
+  void RestartWithJournal(bool crash) {
+    if (crash) {
+      dc_->FlushJournal();
+      delete DepsCache::instance_;
+      DepsCache::instance_ = nullptr;
+    } else {
+      DepsCache::Quit();
+    }
+    IncludeCache::Quit();
+    IncludeCache::Init(32, true);
+    DepsCache::Init(file::JoinPath(tmpdir_->tmpdir(), ".goma_deps"),
+                    kDepsCacheAliveDuration,
+                    kDepsCacheThreshold,
+                    kDepsCacheMaxProtoSizeInMB,
+                    DepsCache::JournalOptions());
+    dc_ = DepsCache::instance();
+  }
+
+  // Restarts DepsCache with the journal enabled, loading the snapshot on
+  // |wm|.
+  void RestartWithJournalInBackground(WorkerThreadManager* wm) {
+    DepsCache::Quit();
+    IncludeCache::Quit();
+    IncludeCache::Init(32, true);
+    DepsCache::JournalOptions journal_options;
+    journal_options.wm = wm;
+    DepsCache::Init(file::JoinPath(tmpdir_->tmpdir(), ".goma_deps"),
+                    kDepsCacheAliveDuration,
+                    kDepsCacheThreshold,
+                    kDepsCacheMaxProtoSizeInMB,
+                    journal_options);
+    dc_ = DepsCache::instance();
+  }
+
+  bool IsLoaded() const {
+    return dc_->IsLoaded();
+  }
+
+  void WaitUntilLoaded() {
+    dc_->WaitUntilLoaded();
+  }
+
+  void FlushJournal() {
+    dc_->FlushJournal();
+  }
+
+  void CompactJournal() {
+    dc_->CompactJournal();
+  }
+
+  std::string JournalPath(int64_t generation) const {
+    return dc_->JournalPath(generation);
+  }
+
+  bool JournalFileExists(int64_t generation) const {
+    const std::string path =
+        file::JoinPath(tmpdir_->tmpdir(),
+                       absl::StrCat(".goma_deps.journal.", generation));
+    return access(path.c_str(), F_OK) == 0;
+  }
+
   DepsCache::Identifier MakeFreshIdentifier() {
     SHA256HashValue hash_value;
     SHA256HashValue::ConvertFromHexString(
@@ -824,7 +881,7 @@ TEST_F(DepsCacheTest, RestartWithBuiltRevisionUpdate) {
   }
 }
 
-TEST_F(DepsCacheTest, RestartWithMissingSha256) {
+TEST_F(DepsCacheTest, RestartWithTruncatedCacheFile) {
   const DepsCache::Identifier identifier = MakeFreshIdentifier();
 
   const std::string& ah = tmpdir_->FullPath("a.h");
@@ -851,11 +908,15 @@ TEST_F(DepsCacheTest, RestartWithMissingSha256) {
   DepsCache::Quit();
   IncludeCache::Quit();
 
-  // Remove .goma_deps.sha256
+  // Truncate .goma_deps, as if it were partially written.
   {
-    const std::string& sha256_deps_path =
-        file::JoinPath(tmpdir_->tmpdir(), ".goma_deps.sha256");
-    ASSERT_EQ(0, remove(sha256_deps_path.c_str()));
+    const std::string deps_path =
+        file::JoinPath(tmpdir_->tmpdir(), ".goma_deps");
+    std::string content;
+    ASSERT_TRUE(ReadFileToString(deps_path, &content));
+    ASSERT_GT(content.size(), 1U);
+    content.resize(content.size() - 1);
+    ASSERT_TRUE(WriteStringToFile(content, deps_path));
   }
 
   IncludeCache::Init(32, true);
@@ -874,7 +935,7 @@ TEST_F(DepsCacheTest, RestartWithMissingSha256) {
   }
 }
 
-TEST_F(DepsCacheTest, RestartWithInvalidSha256) {
+TEST_F(DepsCacheTest, RestartWithCorruptedCacheFile) {
   const DepsCache::Identifier identifier = MakeFreshIdentifier();
 
   const std::string& ah = tmpdir_->FullPath("a.h");
@@ -901,11 +962,16 @@ TEST_F(DepsCacheTest, RestartWithInvalidSha256) {
   DepsCache::Quit();
   IncludeCache::Quit();
 
-  // Convert .goma_deps.sha256 to invalid one
+  // Corrupt the last byte of .goma_deps, so that it doesn't match
+  // the embedded checksum.
   {
-    const std::string& sha256_deps_path =
-        file::JoinPath(tmpdir_->tmpdir(), ".goma_deps.sha256");
-    ASSERT_TRUE(WriteStringToFile("invalid-sha256", sha256_deps_path));
+    const std::string deps_path =
+        file::JoinPath(tmpdir_->tmpdir(), ".goma_deps");
+    std::string content;
+    ASSERT_TRUE(ReadFileToString(deps_path, &content));
+    ASSERT_FALSE(content.empty());
+    content.back() ^= 1;
+    ASSERT_TRUE(WriteStringToFile(content, deps_path));
   }
 
   IncludeCache::Init(32, true);
@@ -1032,6 +1098,396 @@ TEST_F(DepsCacheTest, RestartWithLargeNumberIdentifiers) {
   EXPECT_EQ(kDepsCacheThreshold, DepsCacheSize());
 }
 
+TEST_F(DepsCacheTest, RestartWithJournal) {
+  const DepsCache::Identifier identifier1 = MakeFreshIdentifier();
+  const DepsCache::Identifier identifier2 = MakeFreshIdentifier();
+
+  const std::string& ah = tmpdir_->FullPath("a.h");
+  const std::string& acc = tmpdir_->FullPath("a.cc");
+
+  tmpdir_->CreateTmpFile("a.h", "kotori");
+  tmpdir_->CreateTmpFile("a.cc",
+      "#include <stdio.h>\n"
+      "piyo");
+
+  RestartWithJournal(false);
+
+  {
+    FileStatCache file_stat_cache;
+    std::set<std::string> deps;
+    deps.insert(ah);
+    EXPECT_TRUE(SetDependencies(identifier1, acc, deps, &file_stat_cache));
+    EXPECT_TRUE(SetDependencies(identifier2, acc, deps, &file_stat_cache));
+  }
+  RemoveDependency(identifier2);
+
+  // Restart without saving .goma_deps.
+  RestartWithJournal(true);
+
+  {
+    FileStatCache file_stat_cache;
+    std::set<std::string> deps;
+    EXPECT_TRUE(GetDependencies(identifier1, acc, &deps, &file_stat_cache));
+
+    std::set<std::string> deps_expected;
+    deps_expected.insert(ah);
+    EXPECT_EQ(deps_expected, deps);
+
+    EXPECT_FALSE(GetDependencies(identifier2, acc, &deps, &file_stat_cache));
+  }
+
+  // Records after restart should be appended to the next journal file.
+  {
+    FileStatCache file_stat_cache;
+    std::set<std::string> deps;
+    EXPECT_TRUE(SetDependencies(identifier2, acc, deps, &file_stat_cache));
+  }
+  RestartWithJournal(true);
+  EXPECT_TRUE(JournalFileExists(0));
+  EXPECT_TRUE(JournalFileExists(1));
+
+  {
+    FileStatCache file_stat_cache;
+    std::set<std::string> deps;
+    EXPECT_TRUE(GetDependencies(identifier1, acc, &deps, &file_stat_cache));
+    EXPECT_TRUE(GetDependencies(identifier2, acc, &deps, &file_stat_cache));
+    EXPECT_TRUE(deps.empty());
+  }
+}
+
+TEST_F(DepsCacheTest, RestartWithJournalLoadInBackground) {
+  const DepsCache::Identifier identifier1 = MakeFreshIdentifier();
+  const DepsCache::Identifier identifier2 = MakeFreshIdentifier();
+
+  const std::string& ah = tmpdir_->FullPath("a.h");
+  const std::string& acc = tmpdir_->FullPath("a.cc");
+
+  tmpdir_->CreateTmpFile("a.h", "kotori");
+  tmpdir_->CreateTmpFile("a.cc",
+      "#include <stdio.h>\n"
+      "piyo");
+
+  std::set<std::string> deps;
+  deps.insert(ah);
+  {
+    FileStatCache file_stat_cache;
+    ASSERT_TRUE(SetDependencies(identifier1, acc, deps, &file_stat_cache));
+  }
+
+  WorkerThreadManager wm;
+  wm.Start(1);
+  // Keep the worker busy, so that the snapshot is not loaded until
+  // |loadable| is notified.
+  absl::Notification loadable;
+  wm.RunClosure(FROM_HERE, NewCallback(&WaitForNotification, &loadable),
+                WorkerThread::PRIORITY_LOW);
+  RestartWithJournalInBackground(&wm);
+
+  {
+    FileStatCache file_stat_cache;
+    std::set<std::string> result;
+    EXPECT_FALSE(IsLoaded());
+    EXPECT_FALSE(GetDependencies(identifier1, acc, &result, &file_stat_cache));
+    EXPECT_FALSE(SetDependencies(identifier2, acc, deps, &file_stat_cache));
+  }
+
+  loadable.Notify();
+  WaitUntilLoaded();
+
+  {
+    FileStatCache file_stat_cache;
+    std::set<std::string> result;
+    EXPECT_TRUE(GetDependencies(identifier1, acc, &result, &file_stat_cache));
+    EXPECT_EQ(deps, result);
+    EXPECT_FALSE(GetDependencies(identifier2, acc, &result, &file_stat_cache));
+    EXPECT_TRUE(SetDependencies(identifier2, acc, deps, &file_stat_cache));
+  }
+
+  // Unregisters the periodic flush on |wm| before it finishes.
+  DepsCache::Quit();
+  dc_ = nullptr;
+  wm.Finish();
+}
+
+TEST_F(DepsCacheTest, RestartWithJournalDirectiveHashUpdate) {
+  const DepsCache::Identifier identifier1 = MakeFreshIdentifier();
+  const DepsCache::Identifier identifier2 = MakeFreshIdentifier();
+
+  const std::string& ah = tmpdir_->FullPath("a.h");
+  const std::string& acc = tmpdir_->FullPath("a.cc");
+
+  tmpdir_->CreateTmpFile("a.h", "kotori");
+  tmpdir_->CreateTmpFile("a.cc",
+      "#include <math.h>\n"
+      "piyo");
+
+  RestartWithJournal(false);
+
+  {
+    FileStatCache file_stat_cache;
+    std::set<std::string> deps;
+    deps.insert(ah);
+    ASSERT_TRUE(SetDependencies(identifier1, acc, deps, &file_stat_cache));
+  }
+
+  // Update a.cc with different directive hash.
+  tmpdir_->CreateTmpFile("a.cc",
+      "#include <string.h>\n"
+      "piyopiyo");
+
+  {
+    FileStatCache file_stat_cache;
+
+    // mtime might be the same as before (machine too fast).
+    FileStat file_stat = file_stat_cache.Get(acc);
+    ASSERT_TRUE(file_stat.mtime.has_value());
+    *file_stat.mtime += absl::Seconds(1);
+    SetFileStat(&file_stat_cache, acc, file_stat);
+
+    std::set<std::string> deps;
+    deps.insert(ah);
+    ASSERT_TRUE(SetDependencies(identifier2, acc, deps, &file_stat_cache));
+  }
+
+  DepsHashId deps_hash_id1;
+  DepsHashId deps_hash_id2;
+  ASSERT_TRUE(GetDepsHashId(identifier1, acc, &deps_hash_id1));
+  ASSERT_TRUE(GetDepsHashId(identifier2, acc, &deps_hash_id2));
+  ASSERT_NE(deps_hash_id1.directive_hash, deps_hash_id2.directive_hash);
+
+  RestartWithJournal(true);
+
+  // Unlike the snapshot, the journal keeps both of them.
+  {
+    DepsHashId replayed_deps_hash_id1;
+    DepsHashId replayed_deps_hash_id2;
+    ASSERT_TRUE(GetDepsHashId(identifier1, acc, &replayed_deps_hash_id1));
+    ASSERT_TRUE(GetDepsHashId(identifier2, acc, &replayed_deps_hash_id2));
+    EXPECT_EQ(deps_hash_id1.directive_hash,
+              replayed_deps_hash_id1.directive_hash);
+    EXPECT_EQ(deps_hash_id1.file_stat, replayed_deps_hash_id1.file_stat);
+    EXPECT_EQ(deps_hash_id2.directive_hash,
+              replayed_deps_hash_id2.directive_hash);
+    EXPECT_EQ(deps_hash_id2.file_stat, replayed_deps_hash_id2.file_stat);
+  }
+}
+
+TEST_F(DepsCacheTest, JournalCompaction) {
+  const DepsCache::Identifier identifier1 = MakeFreshIdentifier();
+  const DepsCache::Identifier identifier2 = MakeFreshIdentifier();
+
+  const std::string& ah = tmpdir_->FullPath("a.h");
+  const std::string& acc = tmpdir_->FullPath("a.cc");
+
+  tmpdir_->CreateTmpFile("a.h", "kotori");
+  tmpdir_->CreateTmpFile("a.cc",
+      "#include <stdio.h>\n"
+      "piyo");
+
+  RestartWithJournal(false);
+
+  std::set<std::string> deps;
+  deps.insert(ah);
+  {
+    FileStatCache file_stat_cache;
+    ASSERT_TRUE(SetDependencies(identifier1, acc, deps, &file_stat_cache));
+  }
+
+  CompactJournal();
+  EXPECT_FALSE(JournalFileExists(0));
+
+  {
+    FileStatCache file_stat_cache;
+    ASSERT_TRUE(SetDependencies(identifier2, acc, deps, &file_stat_cache));
+  }
+
+  RestartWithJournal(true);
+  EXPECT_FALSE(JournalFileExists(0));
+  EXPECT_TRUE(JournalFileExists(1));
+
+  {
+    FileStatCache file_stat_cache;
+    std::set<std::string> result;
+    EXPECT_TRUE(GetDependencies(identifier1, acc, &result, &file_stat_cache));
+    EXPECT_EQ(deps, result);
+    EXPECT_TRUE(GetDependencies(identifier2, acc, &result, &file_stat_cache));
+    EXPECT_EQ(deps, result);
+  }
+
+  // Disabling the journal saves .goma_deps and removes journal files.
+  DepsCache::Quit();
+  IncludeCache::Quit();
+  IncludeCache::Init(32, true);
+  DepsCache::Init(file::JoinPath(tmpdir_->tmpdir(), ".goma_deps"),
+                  kDepsCacheAliveDuration,
+                  kDepsCacheThreshold,
+                  kDepsCacheMaxProtoSizeInMB);
+  dc_ = DepsCache::instance();
+  DepsCache::Quit();
+  EXPECT_FALSE(JournalFileExists(1));
+  EXPECT_FALSE(JournalFileExists(2));
+  IncludeCache::Quit();
+  IncludeCache::Init(32, true);
+  DepsCache::Init(file::JoinPath(tmpdir_->tmpdir(), ".goma_deps"),
+                  kDepsCacheAliveDuration,
+                  kDepsCacheThreshold,
+                  kDepsCacheMaxProtoSizeInMB);
+  dc_ = DepsCache::instance();
+
+  {
+    FileStatCache file_stat_cache;
+    std::set<std::string> result;
+    EXPECT_TRUE(GetDependencies(identifier1, acc, &result, &file_stat_cache));
+    EXPECT_TRUE(GetDependencies(identifier2, acc, &result, &file_stat_cache));
+  }
+}
+
+TEST_F(DepsCacheTest, RestartWithBrokenJournal) {
+  const DepsCache::Identifier identifier1 = MakeFreshIdentifier();
+  const DepsCache::Identifier identifier2 = MakeFreshIdentifier();
+
+  const std::string& ah = tmpdir_->FullPath("a.h");
+  const std::string& acc = tmpdir_->FullPath("a.cc");
+
+  tmpdir_->CreateTmpFile("a.h", "kotori");
+  tmpdir_->CreateTmpFile("a.cc",
+      "#include <stdio.h>\n"
+      "piyo");
+
+  RestartWithJournal(false);
+
+  std::set<std::string> deps;
+  deps.insert(ah);
+  {
+    FileStatCache file_stat_cache;
+    ASSERT_TRUE(SetDependencies(identifier1, acc, deps, &file_stat_cache));
+  }
+  FlushJournal();
+  {
+    FileStatCache file_stat_cache;
+    ASSERT_TRUE(SetDependencies(identifier2, acc, deps, &file_stat_cache));
+  }
+  FlushJournal();
+
+  // Emulate a crash during writing the last record.
+  const std::string journal_path = JournalPath(0);
+  RestartWithJournal(true);
+  std::string journal;
+  ASSERT_TRUE(ReadFileToString(journal_path, &journal));
+  journal.resize(journal.size() - 1);
+  ASSERT_TRUE(WriteStringToFile(journal, journal_path));
+  RestartWithJournal(true);
+
+  {
+    FileStatCache file_stat_cache;
+    std::set<std::string> result;
+    EXPECT_TRUE(GetDependencies(identifier1, acc, &result, &file_stat_cache));
+    EXPECT_FALSE(GetDependencies(identifier2, acc, &result, &file_stat_cache));
+    EXPECT_TRUE(SetDependencies(identifier2, acc, deps, &file_stat_cache));
+  }
+
+  // Records in the next generation are replayed after the broken one.
+  RestartWithJournal(true);
+  {
+    FileStatCache file_stat_cache;
+    std::set<std::string> result;
+    EXPECT_TRUE(GetDependencies(identifier1, acc, &result, &file_stat_cache));
+    EXPECT_TRUE(GetDependencies(identifier2, acc, &result, &file_stat_cache));
+  }
+}
+
+TEST_F(DepsCacheTest, ParallelValidation) {
+  constexpr int kNumThreads = 3;
+  constexpr int kNumHeaders = 200;
+
+  WorkerThreadManager wm;
+  wm.Start(1);
+  EnableParallelValidation(
+      &wm, wm.StartPool(kNumThreads, "deps_cache_validation"), kNumThreads,
+      kNumHeaders / 2);
+
+  const DepsCache::Identifier identifier_small = MakeFreshIdentifier();
+  const DepsCache::Identifier identifier_large = MakeFreshIdentifier();
+
+  const std::string& acc = tmpdir_->FullPath("a.cc");
+  tmpdir_->CreateTmpFile("a.cc",
+      "#include <stdio.h>\n"
+      "piyo");
+
+  std::set<std::string> headers;
+  for (int i = 0; i < kNumHeaders; ++i) {
+    const std::string name = absl::StrCat("h", i, ".h");
+    tmpdir_->CreateTmpFile(name, "#define FOO 1\n");
+    headers.insert(tmpdir_->FullPath(name));
+  }
+  const std::set<std::string> small_headers(headers.begin(),
+                                            std::next(headers.begin(), 10));
+
+  {
+    FileStatCache file_stat_cache;
+    ASSERT_TRUE(SetDependencies(identifier_small, acc, small_headers,
+                                &file_stat_cache));
+    ASSERT_TRUE(SetDependencies(identifier_large, acc, headers,
+                                &file_stat_cache));
+  }
+
+  {
+    FileStatCache file_stat_cache;
+    std::set<std::string> deps;
+    EXPECT_TRUE(GetDependencies(identifier_large, acc, &deps,
+                                &file_stat_cache));
+    EXPECT_EQ(headers, deps);
+    EXPECT_TRUE(GetDependencies(identifier_small, acc, &deps,
+                                &file_stat_cache));
+    EXPECT_EQ(small_headers, deps);
+  }
+  DepsCacheStats stats = GetStats();
+  EXPECT_EQ(2, stats.validation_count());
+  EXPECT_EQ(1, stats.parallel_validation_count());
+
+  // Update a header without changing its directives.
+  const std::string last_header = absl::StrCat("h", kNumHeaders - 1, ".h");
+  tmpdir_->CreateTmpFile(last_header, "#define FOO 1\nint foo;\n");
+  {
+    FileStatCache file_stat_cache;
+    std::set<std::string> deps;
+    EXPECT_TRUE(GetDependencies(identifier_large, acc, &deps,
+                                &file_stat_cache));
+    EXPECT_EQ(headers, deps);
+  }
+
+  // Update directives of a header.
+  tmpdir_->CreateTmpFile(last_header, "#define FOO 22\nint foo;\n");
+  {
+    FileStatCache file_stat_cache;
+    std::set<std::string> deps;
+    EXPECT_FALSE(GetDependencies(identifier_large, acc, &deps,
+                                 &file_stat_cache));
+    EXPECT_TRUE(deps.empty());
+  }
+
+  // Remove a header.
+  {
+    FileStatCache file_stat_cache;
+    ASSERT_TRUE(SetDependencies(identifier_large, acc, headers,
+                                &file_stat_cache));
+  }
+  tmpdir_->RemoveTmpFile("h0.h");
+  {
+    FileStatCache file_stat_cache;
+    std::set<std::string> deps;
+    EXPECT_FALSE(GetDependencies(identifier_large, acc, &deps,
+                                 &file_stat_cache));
+  }
+
+  stats = GetStats();
+  EXPECT_EQ(5, stats.validation_count());
+  EXPECT_EQ(4, stats.parallel_validation_count());
+  EXPECT_EQ(2, stats.updated());
+
+  wm.Finish();
+}
+
 TEST_F(DepsCacheTest, MakeDepsIdentifierGcc) {
   const std::string bare_gcc = "/usr/bin/gcc";
   const std::string bare_clang = "/usr/bin/clang";
@@ -5,6 +5,8 @@
 
 #include "descriptor_poller.h"
 
+#include <atomic>
+
 #include "autolock_timer.h"
 #include "socket_descriptor.h"
 #include "glog/logging.h"
@@ -12,6 +14,22 @@
 
 namespace devtools_goma {
 
+namespace {
+
+std::atomic<bool> g_io_uring_enabled(false);
+
+}  // anonymous namespace
+
+// static
+void DescriptorPoller::EnableIoUring(bool enable) {
+  g_io_uring_enabled.store(enable);
+}
+
+// static
+bool DescriptorPoller::io_uring_enabled() {
+  return g_io_uring_enabled.load();
+}
+
 DescriptorPollerBase::DescriptorPollerBase(
     std::unique_ptr<SocketDescriptor> poll_breaker,
     ScopedSocket&& poll_signaler)
@@ -22,6 +40,10 @@ DescriptorPollerBase::DescriptorPollerBase(
   CHECK(poll_signaler_.valid());
 }
 
+// Defined here, where SocketDescriptor is complete, so that files including
+// descriptor_poller.h don't need socket_descriptor.h.
+DescriptorPollerBase::~DescriptorPollerBase() {}
+
 bool DescriptorPollerBase::PollEvents(
     const DescriptorMap& descriptors,
     absl::Duration timeout,
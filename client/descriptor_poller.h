@@ -36,6 +36,13 @@ class DescriptorPoller {
   static std::unique_ptr<DescriptorPoller> NewDescriptorPoller(
       std::unique_ptr<SocketDescriptor> poll_breaker,
       ScopedSocket&& poll_signaler);
+
+  // If |enable| is true, NewDescriptorPoller uses io_uring on Linux if the
+  // kernel supports it, and falls back to epoll otherwise.
+  // Affects only pollers created after this call.
+  static void EnableIoUring(bool enable);
+  static bool io_uring_enabled();
+
   DescriptorPoller() {}
   virtual ~DescriptorPoller() {}
 
@@ -70,7 +77,7 @@ class DescriptorPollerBase : public DescriptorPoller {
  public:
   DescriptorPollerBase(std::unique_ptr<SocketDescriptor> poll_breaker,
                        ScopedSocket&& poll_signaler);
-  ~DescriptorPollerBase() override {}
+  ~DescriptorPollerBase() override;
 
   class EventEnumerator {
    public:
@@ -19,6 +19,7 @@
 #include "absl/memory/memory.h"
 #include "absl/time/time.h"
 #include "compiler_specific.h"
+#include "descriptor_poller_io_uring.h"
 #include "glog/logging.h"
 #include "scoped_fd.h"
 #include "socket_descriptor.h"
@@ -195,6 +196,13 @@ absl::once_flag EpollDescriptorPoller::s_init_once_;
 std::unique_ptr<DescriptorPoller> DescriptorPoller::NewDescriptorPoller(
     std::unique_ptr<SocketDescriptor> breaker,
     ScopedSocket&& signaler) {
+  if (io_uring_enabled()) {
+    std::unique_ptr<DescriptorPoller> poller =
+        MaybeNewIoUringDescriptorPoller(&breaker, &signaler);
+    if (poller) {
+      return poller;
+    }
+  }
   return absl::make_unique<EpollDescriptorPoller>(std::move(breaker),
                                                   std::move(signaler));
 }
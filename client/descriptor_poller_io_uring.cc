@@ -0,0 +1,590 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "descriptor_poller_io_uring.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "absl/base/call_once.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/memory/memory.h"
+#include "absl/time/time.h"
+#include "compiler_specific.h"
+#include "glog/logging.h"
+#include "socket_descriptor.h"
+
+#if defined(IORING_OFF_SQ_RING) && defined(__NR_io_uring_setup)
+#define GOMA_HAVE_IO_URING 1
+#endif
+
+namespace devtools_goma {
+
+#ifdef GOMA_HAVE_IO_URING
+
+namespace {
+
+// Number of submission queue entries.  If more poll requests are queued in
+// one loop, they are submitted in several io_uring_enter calls.
+const unsigned kSubmissionQueueEntries = 1024;
+// Number of completion queue entries.  Each descriptor has at most one
+// poll request in flight.  Since IORING_FEAT_NODROP is required,
+// completions are not lost even if more descriptors are ready.
+const unsigned kCompletionQueueEntries = 8192;
+
+// user_data of requests other than IORING_OP_POLL_ADD.
+// user_data of IORING_OP_POLL_ADD has a non-zero sequence number in
+// upper 32 bits, so it never matches them.
+const uint64_t kTimeoutUserData = 0;
+const uint64_t kPollRemoveUserData = 1;
+
+// IoUring owns io_uring instance and its rings mapped in memory.
+// It must be used by one thread at a time.
+class IoUring {
+ public:
+  // Returns nullptr if io_uring is not available.
+  static std::unique_ptr<IoUring> Create() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = kCompletionQueueEntries;
+    ScopedFd fd(static_cast<int>(
+        syscall(__NR_io_uring_setup, kSubmissionQueueEntries, &params)));
+    if (!fd.valid()) {
+      PLOG(WARNING) << "io_uring_setup failed";
+      return nullptr;
+    }
+    if (!(params.features & IORING_FEAT_NODROP)) {
+      LOG(WARNING) << "io_uring doesn't support IORING_FEAT_NODROP";
+      return nullptr;
+    }
+    if (!IsOpSupported(fd.fd())) {
+      return nullptr;
+    }
+    std::unique_ptr<IoUring> ring(new IoUring(std::move(fd), params));
+    if (!ring->Map()) {
+      return nullptr;
+    }
+    return ring;
+  }
+
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  ~IoUring() {
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+      munmap(sq_ring_, sq_ring_size_);
+    }
+  }
+
+  // Returns an empty submission queue entry, or nullptr if the queue is
+  // full.  The entry is submitted by the next Enter().
+  struct io_uring_sqe* GetSqe() {
+    const unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sq_tail_ - head >= params_.sq_entries) {
+      return nullptr;
+    }
+    struct io_uring_sqe* sqe = &sqes_[sq_tail_ & *sq_mask_];
+    ++sq_tail_;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  // Submits queued entries, and waits for |min_complete| completions.
+  // Returns the result of io_uring_enter.
+  int Enter(unsigned min_complete) {
+    __atomic_store_n(sq_ktail_, sq_tail_, __ATOMIC_RELEASE);
+    const unsigned to_submit =
+        sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    const unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd_.fd(),
+                                    to_submit, min_complete, flags, nullptr,
+                                    0));
+  }
+
+  // Calls |f| for each completion queue entry, and consumes them.
+  template <typename F>
+  void ForEachCqe(F f) {
+    unsigned head = *cq_head_;
+    const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      f(cqes_[head & *cq_mask_]);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+ private:
+  IoUring(ScopedFd&& fd, const struct io_uring_params& params)
+      : ring_fd_(std::move(fd)), params_(params) {}
+
+  static bool IsOpSupported(int fd) {
+    const int kNumOps = 256;
+    std::vector<char> buf(sizeof(struct io_uring_probe) +
+                          kNumOps * sizeof(struct io_uring_probe_op));
+    auto* probe = reinterpret_cast<struct io_uring_probe*>(buf.data());
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+                kNumOps) < 0) {
+      PLOG(WARNING) << "io_uring_register(IORING_REGISTER_PROBE) failed";
+      return false;
+    }
+    for (int op : {IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE,
+                   IORING_OP_TIMEOUT}) {
+      if (op > probe->last_op ||
+          !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+        LOG(WARNING) << "io_uring doesn't support op=" << op;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool Map() {
+    sq_ring_size_ =
+        params_.sq_off.array + params_.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params_.cq_off.cqes +
+                    params_.cq_entries * sizeof(struct io_uring_cqe);
+    const bool single_mmap = params_.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_.fd(),
+                    IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+      PLOG(WARNING) << "mmap sq ring failed";
+      return false;
+    }
+    if (single_mmap) {
+      cq_ring_ = sq_ring_;
+    } else {
+      cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_.fd(),
+                      IORING_OFF_CQ_RING);
+      if (cq_ring_ == MAP_FAILED) {
+        PLOG(WARNING) << "mmap cq ring failed";
+        return false;
+      }
+    }
+    sqes_size_ = params_.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_.fd(),
+                      IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      PLOG(WARNING) << "mmap sqes failed";
+      return false;
+    }
+    sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params_.sq_off.head);
+    sq_ktail_ = reinterpret_cast<unsigned*>(sq + params_.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + params_.sq_off.ring_mask);
+    sq_tail_ = *sq_ktail_;
+    // Entries are always submitted in order, so the index array is fixed.
+    unsigned* array = reinterpret_cast<unsigned*>(sq + params_.sq_off.array);
+    for (unsigned i = 0; i < params_.sq_entries; ++i) {
+      array[i] = i;
+    }
+
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params_.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params_.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + params_.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params_.cq_off.cqes);
+    return true;
+  }
+
+  ScopedFd ring_fd_;
+  const struct io_uring_params params_;
+
+  void* sq_ring_ = MAP_FAILED;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = MAP_FAILED;
+  size_t cq_ring_size_ = 0;
+  struct io_uring_sqe* sqes_ = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+  size_t sqes_size_ = 0;
+
+  // Pointers in the mapped rings.
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_ktail_ = nullptr;
+  unsigned* sq_mask_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned* cq_mask_ = nullptr;
+  struct io_uring_cqe* cqes_ = nullptr;
+
+  // Tail of queued entries, which is published to the kernel in Enter().
+  unsigned sq_tail_ = 0;
+};
+
+struct PollEntry {
+  SocketDescriptor* d = nullptr;
+  // Events the descriptor waits for.
+  uint32_t events = 0;
+  // user_data of the poll request in flight, or 0.
+  uint64_t armed_user_data = 0;
+  // Events of the poll request in flight.
+  uint32_t armed_events = 0;
+};
+
+struct PollCompletion {
+  uint64_t user_data;
+  int32_t res;
+};
+
+struct ReadyEvent {
+  SocketDescriptor* d;
+  uint32_t revents;
+};
+
+class IoUringDescriptorPoller : public DescriptorPollerBase {
+ public:
+  IoUringDescriptorPoller(std::unique_ptr<IoUring> ring,
+                          std::unique_ptr<SocketDescriptor> breaker,
+                          ScopedSocket&& poll_signaler)
+      : DescriptorPollerBase(std::move(breaker), std::move(poll_signaler)),
+        ring_(std::move(ring)) {
+    absl::call_once(s_init_once_, LogDescriptorPollerType);
+    CHECK(ring_);
+    CHECK(poll_breaker());
+    PollEntry* entry = &entries_[poll_breaker()->fd()];
+    entry->d = poll_breaker();
+    entry->events = POLLIN;
+    dirty_fds_.insert(poll_breaker()->fd());
+  }
+
+  static void LogDescriptorPollerType() {
+    LOG(INFO) << "descriptor_poller will use \"io_uring\"";
+  }
+
+  void RegisterPollEvent(SocketDescriptor* d, EventType type) override {
+    DCHECK(d->wait_writable() || d->wait_readable());
+    uint32_t events = 0;
+    if (type == DescriptorEventType::kReadEvent || d->wait_readable()) {
+      DCHECK(d->wait_readable());
+      events |= POLLIN;
+    }
+    if (type == DescriptorEventType::kWriteEvent || d->wait_writable()) {
+      DCHECK(d->wait_writable());
+      events |= POLLOUT;
+    }
+    UpdateEvents(d, events);
+  }
+
+  void UnregisterPollEvent(SocketDescriptor* d,
+                           EventType type ALLOW_UNUSED) override {
+    auto found = entries_.find(d->fd());
+    if (found == entries_.end()) {
+      VLOG(1) << "fd has already been removed. fd=" << d->fd();
+      return;
+    }
+    uint32_t events = 0;
+    if (d->wait_readable()) {
+      events |= POLLIN;
+    }
+    if (d->wait_writable()) {
+      events |= POLLOUT;
+    }
+    UpdateEvents(d, events);
+  }
+
+  void RegisterTimeoutEvent(SocketDescriptor* d) override {
+    timeout_waiters_.insert(d);
+  }
+
+  void UnregisterTimeoutEvent(SocketDescriptor* d) override {
+    timeout_waiters_.erase(d);
+  }
+
+  void UnregisterDescriptor(SocketDescriptor* d) override {
+    CHECK(d);
+    timeout_waiters_.erase(d);
+    auto found = entries_.find(d->fd());
+    if (found == entries_.end()) {
+      return;
+    }
+    if (found->second.armed_user_data != 0) {
+      // Cancels by user_data, since |d| may be closed before the request
+      // is submitted.
+      pending_removes_.push_back(found->second.armed_user_data);
+    }
+    dirty_fds_.erase(d->fd());
+    entries_.erase(found);
+  }
+
+ protected:
+  void PreparePollEvents(const DescriptorMap& descriptors ALLOW_UNUSED)
+      override {
+    for (uint64_t user_data : pending_removes_) {
+      struct io_uring_sqe* sqe = GetSqe();
+      if (sqe == nullptr) {
+        break;
+      }
+      sqe->opcode = IORING_OP_POLL_REMOVE;
+      sqe->fd = -1;
+      sqe->addr = user_data;
+      sqe->user_data = kPollRemoveUserData;
+    }
+    pending_removes_.clear();
+
+    for (auto it = dirty_fds_.begin(); it != dirty_fds_.end();) {
+      auto found = entries_.find(*it);
+      if (found == entries_.end()) {
+        dirty_fds_.erase(it++);
+        continue;
+      }
+      PollEntry* entry = &found->second;
+      if (entry->armed_user_data != 0 &&
+          entry->armed_events != entry->events) {
+        struct io_uring_sqe* sqe = GetSqe();
+        if (sqe == nullptr) {
+          break;
+        }
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = entry->armed_user_data;
+        sqe->user_data = kPollRemoveUserData;
+        entry->armed_user_data = 0;
+      }
+      if (entry->armed_user_data == 0 && entry->events != 0) {
+        struct io_uring_sqe* sqe = GetSqe();
+        if (sqe == nullptr) {
+          break;
+        }
+        const uint64_t user_data = NextUserData(found->first);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = found->first;
+#ifdef IORING_FEAT_POLL_32BITS
+        sqe->poll32_events = entry->events;
+#else
+        sqe->poll_events = entry->events;
+#endif
+        sqe->user_data = user_data;
+        entry->armed_user_data = user_data;
+        entry->armed_events = entry->events;
+      }
+      dirty_fds_.erase(it++);
+    }
+    waiting_ = true;
+  }
+
+  int PollEventsInternal(absl::Duration timeout) override {
+    unsigned min_complete = 0;
+    if (timeout > absl::ZeroDuration()) {
+      struct io_uring_sqe* sqe = GetSqe();
+      if (sqe != nullptr) {
+        timeout_spec_.tv_sec = absl::ToInt64Seconds(timeout);
+        timeout_spec_.tv_nsec = absl::ToInt64Nanoseconds(
+            timeout - absl::Seconds(timeout_spec_.tv_sec));
+        // Completes when |timeout| passes or another request completes.
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = reinterpret_cast<uint64_t>(&timeout_spec_);
+        sqe->len = 1;
+        sqe->off = 1;
+        sqe->user_data = kTimeoutUserData;
+        min_complete = 1;
+      }
+    }
+    int r = ring_->Enter(min_complete);
+    if (r < 0 && errno != EBUSY) {
+      // Completions will be reaped in the next call.
+      return -1;
+    }
+    int nfds = 0;
+    ring_->ForEachCqe([this, &nfds](const struct io_uring_cqe& cqe) {
+      if (cqe.user_data == kTimeoutUserData ||
+          cqe.user_data == kPollRemoveUserData) {
+        return;
+      }
+      completions_.push_back(PollCompletion{cqe.user_data, cqe.res});
+      ++nfds;
+    });
+    return nfds;
+  }
+
+  class IoUringEventEnumerator : public DescriptorPollerBase::EventEnumerator {
+   public:
+    explicit IoUringEventEnumerator(IoUringDescriptorPoller* poller)
+        : poller_(poller), idx_(0), current_(nullptr) {
+      CHECK(poller_);
+      timedout_iter_ = poller_->timeout_waiters_.begin();
+    }
+
+    SocketDescriptor* Next() override {
+      // Iterates over fired events.
+      if (idx_ < poller_->ready_.size()) {
+        current_ = &poller_->ready_[idx_++];
+        event_received_.insert(current_->d);
+        return current_->d;
+      }
+      current_ = nullptr;
+      // Then iterates over timed out ones.
+      for (; timedout_iter_ != poller_->timeout_waiters_.end();
+           ++timedout_iter_) {
+        if (!event_received_.contains(*timedout_iter_))
+          return *timedout_iter_++;
+      }
+      return nullptr;
+    }
+
+    bool IsReadable() const override {
+      return current_ && (current_->revents & POLLIN);
+    }
+    bool IsWritable() const override {
+      return current_ && (current_->revents & POLLOUT);
+    }
+
+   private:
+    IoUringDescriptorPoller* poller_;
+    size_t idx_;
+    const ReadyEvent* current_;
+    absl::flat_hash_set<SocketDescriptor*>::const_iterator timedout_iter_;
+    absl::flat_hash_set<SocketDescriptor*> event_received_;
+
+    DISALLOW_COPY_AND_ASSIGN(IoUringEventEnumerator);
+  };
+
+  std::unique_ptr<EventEnumerator> GetEventEnumerator(
+      const DescriptorMap& descriptors ALLOW_UNUSED) override {
+    waiting_ = false;
+    ready_.clear();
+    for (const auto& completion : completions_) {
+      const int fd = static_cast<int>(completion.user_data & 0xffffffff);
+      auto found = entries_.find(fd);
+      if (found == entries_.end() ||
+          found->second.armed_user_data != completion.user_data) {
+        // Unregistered or re-registered after the request was submitted.
+        continue;
+      }
+      // Poll request is oneshot, so it will be submitted again in the
+      // next PreparePollEvents if the descriptor still waits for events.
+      PollEntry* entry = &found->second;
+      entry->armed_user_data = 0;
+      dirty_fds_.insert(fd);
+      if (completion.res < 0) {
+        LOG(WARNING) << "io_uring poll failed fd=" << fd
+                     << " err=" << -completion.res;
+        continue;
+      }
+      ready_.push_back(ReadyEvent{entry->d,
+                                  static_cast<uint32_t>(completion.res)});
+    }
+    completions_.clear();
+    return absl::make_unique<IoUringEventEnumerator>(this);
+  }
+
+ private:
+  friend class IoUringEventEnumerator;
+
+  void UpdateEvents(SocketDescriptor* d, uint32_t events) {
+    PollEntry* entry = &entries_[d->fd()];
+    entry->d = d;
+    if (entry->events == events && entry->armed_user_data != 0) {
+      return;
+    }
+    entry->events = events;
+    dirty_fds_.insert(d->fd());
+    if (waiting_) {
+      // Called on other thread while the poller is waiting, so the request
+      // should be submitted now.
+      Signal();
+    }
+  }
+
+  // Returns user_data for poll request of |fd|, which has sequence number
+  // in upper 32 bits and |fd| in lower 32 bits.
+  uint64_t NextUserData(int fd) {
+    if (++sequence_ == 0) {
+      ++sequence_;
+    }
+    return (static_cast<uint64_t>(sequence_) << 32) |
+           static_cast<uint32_t>(fd);
+  }
+
+  // Returns an entry of submission queue.  If the queue is full, submits
+  // queued entries without waiting.
+  struct io_uring_sqe* GetSqe() {
+    struct io_uring_sqe* sqe = ring_->GetSqe();
+    if (sqe != nullptr) {
+      return sqe;
+    }
+    if (ring_->Enter(0) < 0) {
+      PLOG(WARNING) << "io_uring_enter failed to submit";
+    }
+    sqe = ring_->GetSqe();
+    LOG_IF(WARNING, sqe == nullptr) << "io_uring submission queue is full";
+    return sqe;
+  }
+
+  static absl::once_flag s_init_once_;
+  std::unique_ptr<IoUring> ring_;
+
+  // Accessed with the lock of the worker thread.
+  absl::flat_hash_map<int, PollEntry> entries_;
+  absl::flat_hash_set<int> dirty_fds_;
+  std::vector<uint64_t> pending_removes_;
+  absl::flat_hash_set<SocketDescriptor*> timeout_waiters_;
+  std::vector<ReadyEvent> ready_;
+  // True while PollEventsInternal may wait without the lock.
+  bool waiting_ = false;
+
+  // Accessed only in the polling thread.
+  std::vector<PollCompletion> completions_;
+  struct __kernel_timespec timeout_spec_;
+  uint32_t sequence_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(IoUringDescriptorPoller);
+};
+
+absl::once_flag IoUringDescriptorPoller::s_init_once_;
+
+}  // anonymous namespace
+
+std::unique_ptr<DescriptorPoller> MaybeNewIoUringDescriptorPoller(
+    std::unique_ptr<SocketDescriptor>* poll_breaker,
+    ScopedSocket* poll_signaler) {
+  std::unique_ptr<IoUring> ring = IoUring::Create();
+  if (!ring) {
+    LOG_FIRST_N(WARNING, 1) << "io_uring is not available. use epoll.";
+    return nullptr;
+  }
+  return absl::make_unique<IoUringDescriptorPoller>(
+      std::move(ring), std::move(*poll_breaker), std::move(*poll_signaler));
+}
+
+#else  // GOMA_HAVE_IO_URING
+
+std::unique_ptr<DescriptorPoller> MaybeNewIoUringDescriptorPoller(
+    std::unique_ptr<SocketDescriptor>* poll_breaker ALLOW_UNUSED,
+    ScopedSocket* poll_signaler ALLOW_UNUSED) {
+  LOG_FIRST_N(WARNING, 1) << "io_uring is not supported in this build.";
+  return nullptr;
+}
+
+#endif  // GOMA_HAVE_IO_URING
+
+}  // namespace devtools_goma
@@ -0,0 +1,30 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DEVTOOLS_GOMA_CLIENT_DESCRIPTOR_POLLER_IO_URING_H_
+#define DEVTOOLS_GOMA_CLIENT_DESCRIPTOR_POLLER_IO_URING_H_
+
+#include <memory>
+
+#include "descriptor_poller.h"
+#include "scoped_fd.h"
+
+namespace devtools_goma {
+
+class SocketDescriptor;
+
+// Creates DescriptorPoller using io_uring (Linux 5.6 or later).
+// Poll requests of descriptors are queued while the worker runs closures,
+// and submitted with the wait for events in one io_uring_enter.
+//
+// Returns nullptr if the kernel or the build doesn't support io_uring
+// features needed.  In that case, |poll_breaker| and |poll_signaler| are
+// not taken, so the caller can use them for other DescriptorPoller.
+std::unique_ptr<DescriptorPoller> MaybeNewIoUringDescriptorPoller(
+    std::unique_ptr<SocketDescriptor>* poll_breaker,
+    ScopedSocket* poll_signaler);
+
+}  // namespace devtools_goma
+
+#endif  // DEVTOOLS_GOMA_CLIENT_DESCRIPTOR_POLLER_IO_URING_H_
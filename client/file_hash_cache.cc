@@ -11,16 +11,24 @@
 
 #include <sstream>
 #include <string>
+#include <utility>
 
+#include "absl/memory/memory.h"
 #include "absl/time/clock.h"
 #include "atomic_stats_counter.h"
 #include "autolock_timer.h"
+#include "compiler_specific.h"
 #include "env_flags.h"
 #include "file_hash_cache.h"
 #include "glog/logging.h"
 #include "path.h"
+#include "proto_util.h"
 #include "util.h"
 
+MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
+#include "prototmp/file_hash_cache_data.pb.h"
+MSVC_POP_WARNING()
+
 namespace devtools_goma {
 
 // Returns cache ID if it was found in cache.
@@ -33,23 +41,18 @@ bool FileHashCache::GetFileCacheKey(const std::string& filename,
 
   if (!file_stat.IsValid()) {
     LOG(INFO) << "Clear cache: file_stat is invalid: " << filename;
-    AUTO_EXCLUSIVE_LOCK(lock, &file_cache_mutex_);
     file_cache_.erase(filename);
     num_stat_error_.Add(1);
     return false;
   }
 
   FileInfo info;
-  {
-    AUTO_SHARED_LOCK(lock, &file_cache_mutex_);
-    auto it = file_cache_.find(filename);
-    if (it == file_cache_.end()) {
-      num_cache_miss_.Add(1);
-      return false;
-    }
-    info = it->second;
-    num_cache_hit_.Add(1);
+  const bool found = file_cache_.Find(filename, &info);
+  if (!found && !RestorePersistedFileInfo(filename, file_stat, &info)) {
+    num_cache_miss_.Add(1);
+    return false;
   }
+  num_cache_hit_.Add(1);
 
   // found in cache.  Verify (reasonably) that it is the one that are looking
   // for, using lightweight information.
@@ -78,7 +81,6 @@ bool FileHashCache::GetFileCacheKey(const std::string& filename,
     return false;
   }
 
-  AUTO_EXCLUSIVE_LOCK(lock, &file_cache_mutex_);
   LOG(INFO) << "Clear obsolete cache: " << filename << " " << *cache_key;
   file_cache_.erase(filename);
   num_clear_obsolete_.Add(1);
@@ -97,7 +99,6 @@ bool FileHashCache::StoreFileCacheKey(
     LOG(WARNING) << "Try to store, but clear cache: failed taking FileStat: "
                  << filename;
     // Remove the cache key if it's not found in the cache.
-    AUTO_EXCLUSIVE_LOCK(lock, &file_cache_mutex_);
     file_cache_.erase(filename);
     num_clear_cache_.Add(1);
     // we don't clear cache key from known_cache_keys_, because other file
@@ -112,29 +113,179 @@ bool FileHashCache::StoreFileCacheKey(
     info.last_checked = absl::Now();
     info.last_uploaded_timestamp = upload_timestamp;
 
-    AUTO_EXCLUSIVE_LOCK(lock, &file_cache_mutex_);
-
-    auto p = file_cache_.insert(make_pair(filename, info));
-    if (!p.second) {
-      if (!info.last_uploaded_timestamp.has_value()) {
-        info.last_uploaded_timestamp = p.first->second.last_uploaded_timestamp;
+    file_cache_.Update(filename, [&info](bool inserted, FileInfo* value) {
+      if (!inserted && !info.last_uploaded_timestamp.has_value()) {
+        info.last_uploaded_timestamp = value->last_uploaded_timestamp;
       }
-      p.first->second = info;
-    }
+      *value = std::move(info);
+    });
     num_store_cache_.Add(1);
   }
 
-  AUTO_EXCLUSIVE_LOCK(lock, &known_cache_keys_mutex_);
-  auto p2 = known_cache_keys_.insert(cache_key);
-  return p2.second;
+  return known_cache_keys_.Insert(cache_key);
 }
 
 bool FileHashCache::IsKnownCacheKey(const std::string& cache_key) {
-  AUTO_SHARED_LOCK(lock, &known_cache_keys_mutex_);
-  return known_cache_keys_.count(cache_key) > 0;
+  return known_cache_keys_.contains(cache_key);
+}
+
+bool FileHashCache::AddKnownCacheKey(const std::string& cache_key) {
+  return known_cache_keys_.Insert(cache_key);
+}
+
+bool FileHashCache::RestorePersistedFileInfo(const std::string& filename,
+                                             const FileStat& file_stat,
+                                             FileInfo* info) {
+  if (num_persisted_.load(std::memory_order_relaxed) == 0) {
+    return false;
+  }
+  PersistedFileInfo persisted;
+  if (!persisted_.Take(filename, &persisted)) {
+    return false;
+  }
+  num_persisted_.fetch_sub(1, std::memory_order_relaxed);
+
+  if (persisted.info.file_stat != file_stat) {
+    VLOG(1) << "obsolete persisted cache: " << filename
+            << " " << persisted.info.cache_key;
+    num_restore_obsolete_.Add(1);
+    return false;
+  }
+
+  bool inserted = false;
+  // StoreFileCacheKey might have stored newer info in the meantime.
+  file_cache_.Update(filename, [&](bool is_new, FileInfo* value) {
+    inserted = is_new;
+    if (is_new) {
+      *value = std::move(persisted.info);
+    }
+    *info = *value;
+  });
+  if (inserted) {
+    known_cache_keys_.Insert(info->cache_key);
+  }
+  num_restore_.Add(1);
+  return true;
+}
+
+void FileHashCache::SetCacheFile(
+    const std::string& cache_filename,
+    absl::optional<absl::Duration> alive_duration) {
+  cache_file_ = absl::make_unique<CacheFile>(cache_filename);
+  alive_duration_ = alive_duration;
+}
+
+bool FileHashCache::Load() {
+  if (cache_file_ == nullptr) {
+    return false;
+  }
+
+  FileHashCacheData data;
+  const bool loaded = cache_file_->Load(&data);
+  if (!loaded) {
+    LOG(INFO) << "couldn't load file hash cache file "
+              << cache_file_->filename()
+              << ". The cache file is broken or does not exist.";
+  }
+
+  size_t num_records = 0;
+  for (const auto& record : data.record()) {
+    if (!record.has_mtime_ts() || !record.has_last_checked_ts()) {
+      continue;
+    }
+    PersistedFileInfo p;
+    p.info.cache_key = record.cache_key();
+    p.info.file_stat.mtime = ProtoToTime(record.mtime_ts());
+    p.info.file_stat.size = record.size();
+    p.info.last_checked = ProtoToTime(record.last_checked_ts());
+    if (record.has_last_uploaded_ts()) {
+      p.info.last_uploaded_timestamp = ProtoToTime(record.last_uploaded_ts());
+    }
+    p.last_used = record.has_last_used_ts()
+                      ? ProtoToTime(record.last_used_ts())
+                      : *p.info.last_checked;
+    // Count before inserting, so that |num_persisted_| never gets smaller
+    // than the number of records in |persisted_|.
+    num_persisted_.fetch_add(1, std::memory_order_relaxed);
+    if (persisted_.Insert(record.filename(), std::move(p))) {
+      ++num_records;
+    } else {
+      num_persisted_.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+  load_done_.store(true);
+  if (loaded) {
+    LOG(INFO) << cache_file_->filename() << " has been successfully loaded."
+              << " records=" << num_records;
+  }
+  return loaded;
 }
 
-FileHashCache::FileHashCache() {
+bool FileHashCache::Save() {
+  if (cache_file_ == nullptr) {
+    return false;
+  }
+
+  const absl::Time now = absl::Now();
+  absl::optional<absl::Time> time_threshold;
+  if (alive_duration_.has_value()) {
+    time_threshold = now - *alive_duration_;
+  }
+
+  FileHashCacheData data;
+  auto add_record = [&data](const std::string& filename,
+                            const FileInfo& info,
+                            absl::Time last_used) {
+    if (!info.file_stat.IsValid() || !info.last_checked.has_value()) {
+      return;
+    }
+    FileHashCacheRecord* record = data.add_record();
+    record->set_filename(filename);
+    record->set_cache_key(info.cache_key);
+    *record->mutable_mtime_ts() = TimeToProto(*info.file_stat.mtime);
+    record->set_size(info.file_stat.size);
+    *record->mutable_last_checked_ts() = TimeToProto(*info.last_checked);
+    if (info.last_uploaded_timestamp.has_value()) {
+      *record->mutable_last_uploaded_ts() =
+          TimeToProto(*info.last_uploaded_timestamp);
+    }
+    *record->mutable_last_used_ts() = TimeToProto(last_used);
+  };
+
+  absl::flat_hash_set<std::string> saved;
+  saved.reserve(file_cache_.size());
+  file_cache_.ForEach([&](const std::string& filename, const FileInfo& info) {
+    add_record(filename, info, now);
+    saved.insert(filename);
+  });
+  if (!load_done_.load()) {
+    LOG(WARNING) << "file hash cache has not been loaded yet."
+                 << " skip saving to " << cache_file_->filename();
+    return false;
+  }
+  // Keep records not used in this compiler_proxy unless they are too old.
+  persisted_.ForEach([&](const std::string& filename,
+                         const PersistedFileInfo& persisted) {
+    if (saved.contains(filename)) {
+      return;
+    }
+    if (time_threshold.has_value() && persisted.last_used < *time_threshold) {
+      return;
+    }
+    add_record(filename, persisted.info, persisted.last_used);
+  });
+
+  if (!cache_file_->Save(data)) {
+    LOG(ERROR) << "failed to save cache file " << cache_file_->filename();
+    return false;
+  }
+  LOG(INFO) << "saved to " << cache_file_->filename()
+            << " records=" << data.record_size();
+  return true;
+}
+
+FileHashCache::FileHashCache() : num_persisted_(0), load_done_(false) {
 }
 
 std::string FileHashCache::DebugString() {
@@ -146,21 +297,24 @@ std::string FileHashCache::DebugString() {
   ss << "clear obsolete=" << num_clear_obsolete_.value() << std::endl;
   ss << "[StoreFileCacheKey]" << std::endl;
   ss << "store cache=" << num_store_cache_.value() << std::endl;
-  ss << "clear cache=" << num_clear_cache_.value() << std::endl << std::endl;
+  ss << "clear cache=" << num_clear_cache_.value() << std::endl;
+  ss << "[RestorePersistedFileInfo]" << std::endl;
+  ss << "restore=" << num_restore_.value() << std::endl;
+  ss << "restore obsolete=" << num_restore_obsolete_.value() << std::endl;
+  ss << "not restored yet=" << persisted_.size() << std::endl << std::endl;
 
-  AUTO_SHARED_LOCK(lock, &file_cache_mutex_);
   ss << "[file_cache] size=" << file_cache_.size() << std::endl;
-  for (const auto& it : file_cache_) {
-    ss << "filename:" << it.first << " key:" << it.second.cache_key
-       << " file_size:" << it.second.file_stat.size
+  file_cache_.ForEach([&ss](const std::string& filename, const FileInfo& info) {
+    ss << "filename:" << filename << " key:" << info.cache_key
+       << " file_size:" << info.file_stat.size
        << " mtime:";
-    if (it.second.file_stat.mtime.has_value()) {
-      ss << *it.second.file_stat.mtime;
+    if (info.file_stat.mtime.has_value()) {
+      ss << *info.file_stat.mtime;
     } else {
       ss << "(unknown)";
     }
     ss << std::endl;
-  }
+  });
   return ss.str();
 }
 
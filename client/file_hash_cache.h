@@ -6,17 +6,20 @@
 #ifndef DEVTOOLS_GOMA_CLIENT_FILE_HASH_CACHE_H_
 #define DEVTOOLS_GOMA_CLIENT_FILE_HASH_CACHE_H_
 
+#include <atomic>
+#include <memory>
 #include <string>
 
 #include "absl/base/thread_annotations.h"
-#include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
 #include "absl/time/time.h"
 #include "absl/types/optional.h"
 #include "atomic_stats_counter.h"
 #include "basictypes.h"
+#include "cache_file.h"
 #include "file_stat.h"
 #include "lockhelper.h"
+#include "sharded_hash_map.h"
 
 namespace devtools_goma {
 
@@ -65,6 +68,29 @@ class FileHashCache {
 
   bool IsKnownCacheKey(const std::string& cache_key);
 
+  // Adds |cache_key| that is not a key of a local file, e.g. a key of
+  // a chunk of a large file stored in file service.
+  // Returns true if |cache_key| was not known.
+  bool AddKnownCacheKey(const std::string& cache_key);
+
+  // Enables persistence of the cache in |cache_filename|.
+  // Records not used longer than |alive_duration| are dropped when saving.
+  // If |alive_duration| is unset, records are kept forever.
+  void SetCacheFile(const std::string& cache_filename,
+                    absl::optional<absl::Duration> alive_duration);
+
+  // Loads the snapshot from the cache file.
+  // Loaded records are not trusted as is. A record is moved to the cache
+  // when it is looked up by GetFileCacheKey and its FileStat matches with
+  // the current FileStat, so no stat is taken while loading.
+  // Returns true if the snapshot is loaded.
+  bool Load();
+
+  // Saves the snapshot to the cache file.
+  // Does nothing if the cache file is not set, or Load has not finished yet.
+  // Returns true if the snapshot is saved.
+  bool Save();
+
   std::string DebugString();
 
  private:
@@ -83,16 +109,41 @@ class FileHashCache {
     absl::optional<absl::Time> last_uploaded_timestamp;
   };
 
+  struct PersistedFileInfo {
+    FileInfo info;
+    // time when the record was used in the previous compiler_proxy.
+    absl::Time last_used;
+  };
+
+  // Moves a record loaded from the cache file to |file_cache_| if it
+  // exists and its FileStat matches with |file_stat|.
+  // Returns true and sets |info| if the record is moved.
+  bool RestorePersistedFileInfo(const std::string& filename,
+                                const FileStat& file_stat,
+                                FileInfo* info);
+
   // A map from filename to file cache info.
-  ReadWriteLock file_cache_mutex_;
-  absl::flat_hash_map<std::string, struct FileInfo> file_cache_
-      GUARDED_BY(file_cache_mutex_);
+  // This is accessed from all worker threads, so sharded to reduce lock
+  // contention.
+  ShardedHashMap<std::string, FileInfo> file_cache_;
 
   // A set of cache keys that have been stored, so we could believe a cache_key
   // in this set is in goma cache.
-  ReadWriteLock known_cache_keys_mutex_;
-  absl::flat_hash_set<std::string> known_cache_keys_
-      GUARDED_BY(known_cache_keys_mutex_);
+  ShardedHashSet<std::string> known_cache_keys_;
+
+  std::unique_ptr<CacheFile> cache_file_;
+  absl::optional<absl::Duration> alive_duration_;
+
+  // A map from filename to file cache info loaded from |cache_file_|,
+  // which is not validated yet.
+  // This is looked up on every miss of |file_cache_|, so sharded like
+  // |file_cache_|.
+  ShardedHashMap<std::string, PersistedFileInfo> persisted_;
+  // Upper bound of the number of records in |persisted_|.
+  // It is 0 when the cache file is not used or all records are restored,
+  // so that misses don't need to lock |persisted_|.
+  std::atomic<size_t> num_persisted_;
+  std::atomic<bool> load_done_;
 
   StatsCounter num_cache_hit_;
   StatsCounter num_cache_miss_;
@@ -100,6 +151,8 @@ class FileHashCache {
   StatsCounter num_clear_obsolete_;
   StatsCounter num_store_cache_;
   StatsCounter num_clear_cache_;
+  StatsCounter num_restore_;
+  StatsCounter num_restore_obsolete_;
 
   DISALLOW_COPY_AND_ASSIGN(FileHashCache);
 };
@@ -0,0 +1,128 @@
+// Copyright 2020 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "file_hash_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+
+#include "absl/memory/memory.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "file_stat.h"
+#include "path.h"
+#include "unittest_util.h"
+
+namespace devtools_goma {
+
+class FileHashCacheTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    tmpdir_ = absl::make_unique<TmpdirUtil>("file_hash_cache_test");
+    cache_filename_ = file::JoinPath(tmpdir_->tmpdir(), "file_hash_cache");
+  }
+
+  // Creates |path| whose mtime is old enough, so that the cache key stored
+  // now is considered valid.
+  std::string CreateOldFile(const std::string& path,
+                            const std::string& content) {
+    const std::string abs_path = tmpdir_->FullPath(path);
+    tmpdir_->CreateTmpFile(path, content);
+    EXPECT_TRUE(UpdateMtime(abs_path, absl::Now() - absl::Hours(1)));
+    return abs_path;
+  }
+
+  std::unique_ptr<TmpdirUtil> tmpdir_;
+  std::string cache_filename_;
+};
+
+TEST_F(FileHashCacheTest, NoCacheFile) {
+  FileHashCache cache;
+  EXPECT_FALSE(cache.Load());
+  EXPECT_FALSE(cache.Save());
+}
+
+TEST_F(FileHashCacheTest, SaveAndLoad) {
+  const std::string filename = CreateOldFile("a.h", "#pragma once\n");
+  const FileStat file_stat(filename);
+  ASSERT_TRUE(file_stat.IsValid());
+
+  {
+    FileHashCache cache;
+    cache.SetCacheFile(cache_filename_, absl::nullopt);
+    EXPECT_FALSE(cache.Load());
+    EXPECT_TRUE(cache.StoreFileCacheKey(filename, "hash_a", absl::nullopt,
+                                        file_stat));
+    EXPECT_TRUE(cache.Save());
+  }
+
+  FileHashCache cache;
+  cache.SetCacheFile(cache_filename_, absl::nullopt);
+  EXPECT_TRUE(cache.Load());
+  // Loaded record is not known until it is validated.
+  EXPECT_FALSE(cache.IsKnownCacheKey("hash_a"));
+
+  std::string cache_key;
+  EXPECT_TRUE(cache.GetFileCacheKey(filename, absl::nullopt, file_stat,
+                                    &cache_key));
+  EXPECT_EQ("hash_a", cache_key);
+  EXPECT_TRUE(cache.IsKnownCacheKey("hash_a"));
+}
+
+TEST_F(FileHashCacheTest, LoadModifiedFile) {
+  const std::string filename = CreateOldFile("a.h", "#pragma once\n");
+  {
+    FileHashCache cache;
+    cache.SetCacheFile(cache_filename_, absl::nullopt);
+    EXPECT_FALSE(cache.Load());
+    EXPECT_TRUE(cache.StoreFileCacheKey(filename, "hash_a", absl::nullopt,
+                                        FileStat(filename)));
+    EXPECT_TRUE(cache.Save());
+  }
+
+  CreateOldFile("a.h", "#pragma once\n#define A\n");
+  const FileStat file_stat(filename);
+  ASSERT_TRUE(file_stat.IsValid());
+
+  FileHashCache cache;
+  cache.SetCacheFile(cache_filename_, absl::nullopt);
+  EXPECT_TRUE(cache.Load());
+  std::string cache_key;
+  EXPECT_FALSE(cache.GetFileCacheKey(filename, absl::nullopt, file_stat,
+                                     &cache_key));
+  EXPECT_TRUE(cache_key.empty());
+  EXPECT_FALSE(cache.IsKnownCacheKey("hash_a"));
+}
+
+TEST_F(FileHashCacheTest, SaveDropsOldRecords) {
+  const std::string filename = CreateOldFile("a.h", "#pragma once\n");
+  const FileStat file_stat(filename);
+  {
+    FileHashCache cache;
+    cache.SetCacheFile(cache_filename_, absl::nullopt);
+    EXPECT_FALSE(cache.Load());
+    EXPECT_TRUE(cache.StoreFileCacheKey(filename, "hash_a", absl::nullopt,
+                                        file_stat));
+    EXPECT_TRUE(cache.Save());
+  }
+  {
+    // The record is not used in this session, and it is dropped since
+    // alive duration is zero.
+    FileHashCache cache;
+    cache.SetCacheFile(cache_filename_, absl::ZeroDuration());
+    EXPECT_TRUE(cache.Load());
+    EXPECT_TRUE(cache.Save());
+  }
+
+  FileHashCache cache;
+  cache.SetCacheFile(cache_filename_, absl::nullopt);
+  EXPECT_TRUE(cache.Load());
+  std::string cache_key;
+  EXPECT_FALSE(cache.GetFileCacheKey(filename, absl::nullopt, file_stat,
+                                     &cache_key));
+}
+
+}  // namespace devtools_goma
@@ -5,11 +5,15 @@
 
 #include "file_stat_cache.h"
 
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
 #include <string>
 
 #include <glog/logging.h>
 
-#include "autolock_timer.h"
+#include "absl/memory/memory.h"
 #include "counterz.h"
 #include "path.h"
 
@@ -17,33 +21,142 @@ namespace devtools_goma {
 
 // TODO: Add stats.
 
-FileStat GlobalFileStatCache::Get(const std::string& path) {
-  {
-    AUTO_SHARED_LOCK(lock, &mu_);
-    auto it = file_stats_.find(path);
-    if (it != file_stats_.end()) {
-      return it->second;
+namespace {
+
+// Returns true if |path| or any directory on |path| is a symlink.
+// FileStat follows symlinks, but FileWatcher is not notified of changes
+// of their targets unless the targets are in watched directories.
+bool HasSymlinkOnPath(const std::string& path) {
+#ifndef _WIN32
+  for (size_t pos = path.find('/', 1);; pos = path.find('/', pos + 1)) {
+    const std::string component =
+        pos == std::string::npos ? path : path.substr(0, pos);
+    struct stat st;
+    if (lstat(component.c_str(), &st) != 0) {
+      // Missing files are cached, and notified by creation.
+      return false;
+    }
+    if (S_ISLNK(st.st_mode)) {
+      return true;
     }
+    if (pos == std::string::npos) {
+      return false;
+    }
+  }
+#else
+  // FileWatcher is not available on Windows.
+  (void)path;
+  return false;
+#endif
+}
+
+}  // anonymous namespace
+
+class GlobalFileStatCache::Invalidator : public FileWatcher::Listener {
+ public:
+  explicit Invalidator(ShardedHashMap<std::string, FileStat>* file_stats)
+      : file_stats_(file_stats) {}
+
+  void OnFileChanged(const std::string& path) override {
+    VLOG(2) << "file changed: " << path;
+    file_stats_->erase(path);
+  }
+
+  void OnAllFilesChanged() override {
+    LOG(INFO) << "clear global file stat cache";
+    file_stats_->clear();
+  }
+
+ private:
+  ShardedHashMap<std::string, FileStat>* file_stats_;
+};
+
+GlobalFileStatCache::GlobalFileStatCache(
+    std::unique_ptr<FileWatcher> file_watcher)
+    : file_watcher_(std::move(file_watcher)),
+      invalidator_(absl::make_unique<Invalidator>(&file_stats_)) {}
+
+GlobalFileStatCache::~GlobalFileStatCache() = default;
+
+FileStat GlobalFileStatCache::Get(const std::string& path) {
+  if (file_watcher_) {
+    return GetWithFileWatcher(path);
+  }
+
+  FileStat id;
+  if (file_stats_.Find(path, &id)) {
+    return id;
   }
 
-  FileStat id(path);
+  id = FileStat(path);
   if (!id.IsValid() || id.is_directory) {
     return id;
   }
 
-  {
-    AUTO_EXCLUSIVE_LOCK(lock, &mu_);
-    file_stats_.emplace(path, id);
+  file_stats_.Insert(path, id);
+  return id;
+}
+
+FileStat GlobalFileStatCache::GetWithFileWatcher(const std::string& path) {
+  FileStat id;
+  if (file_stats_.Find(path, &id)) {
+    return id;
+  }
+
+  // FileWatcher notifies changes of |path| as the watched directory joined
+  // with the entry name, so it must be the same string as |path|.
+  const absl::string_view dir = file::Dirname(path);
+  if (dir.empty() || file::JoinPath(dir, file::Basename(path)) != path) {
+    return FileStat(path);
+  }
+
+  // Starts watching before FileStat is taken, so that later changes are
+  // notified.
+  const uint64_t generation = file_watcher_->generation();
+  if (!file_watcher_->Watch(std::string(dir))) {
+    return FileStat(path);
+  }
+  // A symlink created later on |path| is notified as a change of
+  // a watched directory.
+  if (HasSymlinkOnPath(path)) {
+    return FileStat(path);
+  }
+  id = FileStat(path);
+  if (id.is_directory) {
+    // mtime of a directory is updated when its entries are changed, which
+    // is notified only by watching the directory itself.
+    if (!file_watcher_->Watch(path)) {
+      return id;
+    }
+    id = FileStat(path);
+  }
+
+  file_stats_.Insert(path, id);
+  if (file_watcher_->generation() != generation) {
+    // Changes were notified while FileStat was taken, and might be about
+    // |path|.
+    file_stats_.erase(path);
   }
   return id;
 }
 
+void GlobalFileStatCache::ProcessFileChanges() {
+  if (file_watcher_) {
+    file_watcher_->ProcessPendingEvents(invalidator_.get());
+  }
+}
+
 GlobalFileStatCache* GlobalFileStatCache::instance_ = nullptr;
 
 /* static */
 void GlobalFileStatCache::Init() {
+  Init(nullptr);
+}
+
+/* static */
+void GlobalFileStatCache::Init(std::unique_ptr<FileWatcher> file_watcher) {
   CHECK(instance_ == nullptr);
-  instance_ = new GlobalFileStatCache;
+  instance_ = new GlobalFileStatCache(std::move(file_watcher));
 }
 
 /* static */
@@ -58,8 +171,12 @@ GlobalFileStatCache* GlobalFileStatCache::Instance() {
   return instance_;
 }
 
-FileStatCache::FileStatCache()
-    : is_acquired_(true), owner_thread_id_(GetCurrentThreadId()) {}
+FileStatCache::FileStatCache() : FileStatCache(true) {}
+
+FileStatCache::FileStatCache(bool use_global_cache)
+    : use_global_cache_(use_global_cache),
+      is_acquired_(true),
+      owner_thread_id_(GetCurrentThreadId()) {}
 
 FileStatCache::~FileStatCache() {
   DCHECK(!is_acquired_ || THREAD_ID_IS_SELF(owner_thread_id_));
@@ -77,7 +194,7 @@ FileStat FileStatCache::Get(const std::string& filename) {
 
   FileStat id;
 
-  if (GlobalFileStatCache::Instance() != nullptr) {
+  if (use_global_cache_ && GlobalFileStatCache::Instance() != nullptr) {
     id = GlobalFileStatCache::Instance()->Get(filename);
   } else {
     id = FileStat(filename);
@@ -6,6 +6,7 @@
 #ifndef DEVTOOLS_GOMA_CLIENT_FILE_STAT_CACHE_H_
 #define DEVTOOLS_GOMA_CLIENT_FILE_STAT_CACHE_H_
 
+#include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -14,25 +15,49 @@
 #include "absl/container/flat_hash_map.h"
 #include "basictypes.h"
 #include "file_stat.h"
+#include "file_watcher.h"
 #include "lockhelper.h"
 #include "platform_thread.h"
+#include "sharded_hash_map.h"
 
 namespace devtools_goma {
 
 // GlobalFileStatCache caches FileStats globally.
-// This only holds valid and non-directory FileStats.
+// Without FileWatcher, this only holds valid and non-directory FileStats,
+// and they are never invalidated.
+// With FileWatcher, this also holds FileStats of directories and missing
+// files in watched directories, and they are invalidated when the files
+// are changed. FileStats in directories that can't be watched, or of paths
+// via symlinks, whose targets might not be watched, are not cached.
 // The instance of this class is thread-safe.
 class GlobalFileStatCache {
  public:
   FileStat Get(const std::string& path);
 
+  // Processes file changes notified by FileWatcher, if any.
+  // FileStats of files changed before this call are not returned after it.
+  void ProcessFileChanges();
+
   static void Init();
+  static void Init(std::unique_ptr<FileWatcher> file_watcher);
   static void Quit();
   static GlobalFileStatCache* Instance();
 
+  FileWatcher* file_watcher() const { return file_watcher_.get(); }
+
  private:
-  mutable ReadWriteLock mu_;
-  absl::flat_hash_map<std::string, FileStat> file_stats_ GUARDED_BY(mu_);
+  class Invalidator;
+
+  explicit GlobalFileStatCache(std::unique_ptr<FileWatcher> file_watcher);
+  ~GlobalFileStatCache();
+
+  FileStat GetWithFileWatcher(const std::string& path);
+
+  // Sharded to reduce lock contention among worker threads.
+  ShardedHashMap<std::string, FileStat> file_stats_;
+
+  const std::unique_ptr<FileWatcher> file_watcher_;
+  const std::unique_ptr<Invalidator> invalidator_;
 
   static GlobalFileStatCache* instance_;
 };
@@ -42,6 +67,9 @@ class GlobalFileStatCache {
 class FileStatCache {
  public:
   FileStatCache();
+  // If |use_global_cache| is false, GlobalFileStatCache is not used, e.g.
+  // for files that compiler_proxy itself would update.
+  explicit FileStatCache(bool use_global_cache);
   ~FileStatCache();
 
   // Returns FileStat cache if any. If not, we create FileStat for |filename|.
@@ -61,6 +89,7 @@ class FileStatCache {
  private:
   typedef absl::flat_hash_map<std::string, FileStat> FileStatMap;
 
+  const bool use_global_cache_;
   bool is_acquired_;
   PlatformThreadId owner_thread_id_;
 
@@ -0,0 +1,57 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DEVTOOLS_GOMA_CLIENT_FILE_WATCHER_H_
+#define DEVTOOLS_GOMA_CLIENT_FILE_WATCHER_H_
+
+#include <cstdint>
+#include <string>
+
+namespace devtools_goma {
+
+// FileWatcher watches entries in directories, and tells which paths might
+// be changed, so that cached FileStats can be used without calling stat.
+//
+// Change events are queued by the OS, and notified to Listener only when
+// ProcessPendingEvents() is called.
+// All methods are thread-safe.
+class FileWatcher {
+ public:
+  class Listener {
+   public:
+    virtual ~Listener() = default;
+
+    // Called when |path| (a direct entry of a watched directory, or the
+    // directory itself) might be changed. |path| is the watched directory
+    // joined with the entry name by file::JoinPath.
+    virtual void OnFileChanged(const std::string& path) = 0;
+
+    // Called when any file might be changed, e.g. change events were lost,
+    // or a directory on watched paths was removed or renamed.
+    virtual void OnAllFilesChanged() = 0;
+  };
+
+  virtual ~FileWatcher() = default;
+
+  // Starts watching entries in |dir|, and in each directory on |dir|.
+  // Returns true if |dir| is watched.
+  // Returns false if |dir| can't be watched, e.g. it is not a directory,
+  // or the watch limit is exceeded.
+  virtual bool Watch(const std::string& dir) = 0;
+
+  // Reads queued change events, and notifies them to |listener|.
+  // Changes made before this call are notified by the time it returns.
+  virtual void ProcessPendingEvents(Listener* listener) = 0;
+
+  // Returns the number of times changes were notified, which is
+  // incremented before |listener| is called. Used to detect changes
+  // notified while a FileStat is taken.
+  virtual uint64_t generation() const = 0;
+
+  virtual size_t num_watches() const = 0;
+};
+
+}  // namespace devtools_goma
+
+#endif  // DEVTOOLS_GOMA_CLIENT_FILE_WATCHER_H_
@@ -0,0 +1,250 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "file_watcher_inotify.h"
+
+#include <errno.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/match.h"
+#include "autolock_timer.h"
+#include "glog/logging.h"
+#include "lockhelper.h"
+#include "path.h"
+#include "scoped_fd.h"
+
+namespace devtools_goma {
+
+namespace {
+
+// Events that may change FileStat of an entry in a watched directory.
+constexpr uint32_t kWatchMask =
+    IN_ATTRIB | IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE |
+    IN_DELETE_SELF | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+// Events that add or remove an entry, which also update mtime of the
+// watched directory.
+constexpr uint32_t kEntryMask =
+    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+
+constexpr size_t kEventBufferSize = 64 * 1024;
+
+class InotifyFileWatcher : public FileWatcher {
+ public:
+  explicit InotifyFileWatcher(ScopedFd fd)
+      : fd_(std::move(fd)), buffer_(kEventBufferSize) {}
+
+  InotifyFileWatcher(const InotifyFileWatcher&) = delete;
+  InotifyFileWatcher& operator=(const InotifyFileWatcher&) = delete;
+
+  bool Watch(const std::string& dir) override LOCKS_EXCLUDED(mu_) {
+    if (!file::IsAbsolutePath(dir)) {
+      return false;
+    }
+    AUTOLOCK(lock, &mu_);
+    if (dir_to_wd_.find(dir) != dir_to_wd_.end()) {
+      return true;
+    }
+    // Directories on |dir| are also watched, so that a rename of them, or
+    // a change of a symlink on |dir|, is noticed.
+    if (!WatchUnlocked("/")) {
+      return false;
+    }
+    for (size_t pos = dir.find('/', 1); pos != std::string::npos;
+         pos = dir.find('/', pos + 1)) {
+      if (!WatchUnlocked(dir.substr(0, pos))) {
+        return false;
+      }
+    }
+    return WatchUnlocked(dir);
+  }
+
+  void ProcessPendingEvents(Listener* listener) override LOCKS_EXCLUDED(mu_) {
+    AUTOLOCK(lock, &mu_);
+    for (;;) {
+      ssize_t n = read(fd_.fd(), buffer_.data(), buffer_.size());
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        PLOG_IF(ERROR, errno != EAGAIN) << "failed to read inotify events";
+        return;
+      }
+      if (n == 0) {
+        return;
+      }
+      for (ssize_t pos = 0; pos < n;) {
+        const struct inotify_event* event =
+            reinterpret_cast<const struct inotify_event*>(&buffer_[pos]);
+        HandleEventUnlocked(*event, listener);
+        pos += sizeof(struct inotify_event) + event->len;
+      }
+    }
+  }
+
+  uint64_t generation() const override {
+    return generation_.load();
+  }
+
+  size_t num_watches() const override LOCKS_EXCLUDED(mu_) {
+    AUTOLOCK(lock, &mu_);
+    return wd_to_dirs_.size();
+  }
+
+ private:
+  bool WatchUnlocked(const std::string& dir) EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    if (dir_to_wd_.find(dir) != dir_to_wd_.end()) {
+      return true;
+    }
+    if (watch_limit_exceeded_ || unwatchable_dirs_.contains(dir)) {
+      return false;
+    }
+    int wd = inotify_add_watch(fd_.fd(), dir.c_str(), kWatchMask);
+    if (wd < 0) {
+      if (errno == ENOSPC) {
+        LOG(WARNING) << "inotify watch limit exceeded."
+                     << " files in unwatched directories are checked by stat."
+                     << " num_watches=" << wd_to_dirs_.size();
+        watch_limit_exceeded_ = true;
+      } else {
+        VLOG(1) << "failed to watch " << dir << " errno=" << errno;
+        unwatchable_dirs_.insert(dir);
+      }
+      return false;
+    }
+    // The same wd is returned for the same directory, e.g. "/a/b" and
+    // "/a/c/../b".
+    dir_to_wd_.emplace(dir, wd);
+    wd_to_dirs_[wd].push_back(dir);
+    return true;
+  }
+
+  // Returns true if |path| is a watched directory, or on a watched
+  // directory.
+  bool IsOnWatchedPathUnlocked(const std::string& path) const
+      EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    if (dir_to_wd_.find(path) != dir_to_wd_.end()) {
+      return true;
+    }
+    const std::string prefix = path + "/";
+    auto iter = dir_to_wd_.lower_bound(prefix);
+    return iter != dir_to_wd_.end() && absl::StartsWith(iter->first, prefix);
+  }
+
+  void NotifyAllFilesChangedUnlocked(Listener* listener)
+      EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    generation_.fetch_add(1);
+    // Directories might be created.
+    unwatchable_dirs_.clear();
+    listener->OnAllFilesChanged();
+  }
+
+  void HandleEventUnlocked(const struct inotify_event& event,
+                           Listener* listener) EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    if (event.mask & IN_Q_OVERFLOW) {
+      LOG(WARNING) << "inotify event queue overflowed";
+      NotifyAllFilesChangedUnlocked(listener);
+      return;
+    }
+    if (event.mask & IN_IGNORED) {
+      // The watch was removed, e.g. the directory was removed.
+      auto iter = wd_to_dirs_.find(event.wd);
+      if (iter != wd_to_dirs_.end()) {
+        for (const auto& dir : iter->second) {
+          dir_to_wd_.erase(dir);
+        }
+        wd_to_dirs_.erase(iter);
+      }
+      watch_limit_exceeded_ = false;
+      NotifyAllFilesChangedUnlocked(listener);
+      return;
+    }
+
+    auto iter = wd_to_dirs_.find(event.wd);
+    if (iter == wd_to_dirs_.end()) {
+      return;
+    }
+    const std::vector<std::string>& dirs = iter->second;
+    if (event.mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+      NotifyAllFilesChangedUnlocked(listener);
+      return;
+    }
+    if (event.len == 0) {
+      // Change of the watched directory itself.
+      generation_.fetch_add(1);
+      for (const auto& dir : dirs) {
+        listener->OnFileChanged(dir);
+      }
+      return;
+    }
+
+    // |event.name| is null-terminated, and may be padded with nulls.
+    const std::string name(event.name);
+    std::vector<std::string> paths;
+    paths.reserve(dirs.size());
+    for (const auto& dir : dirs) {
+      paths.push_back(file::JoinPath(dir, name));
+    }
+    if (event.mask & kEntryMask) {
+      // Directories might be created.
+      unwatchable_dirs_.clear();
+      if (event.mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+        for (const auto& path : paths) {
+          if (IsOnWatchedPathUnlocked(path)) {
+            // Paths under |path| may point to other files now.
+            NotifyAllFilesChangedUnlocked(listener);
+            return;
+          }
+        }
+      }
+    }
+
+    generation_.fetch_add(1);
+    for (const auto& path : paths) {
+      listener->OnFileChanged(path);
+    }
+    if (event.mask & kEntryMask) {
+      for (const auto& dir : dirs) {
+        listener->OnFileChanged(dir);
+      }
+    }
+  }
+
+  const ScopedFd fd_;
+
+  mutable Lock mu_;
+  // Buffer to read events.
+  std::vector<char> buffer_ GUARDED_BY(mu_);
+  // Ordered to find watched directories under a path.
+  std::map<std::string, int> dir_to_wd_ GUARDED_BY(mu_);
+  absl::flat_hash_map<int, std::vector<std::string>> wd_to_dirs_
+      GUARDED_BY(mu_);
+  // Directories failed to watch, e.g. not found.
+  absl::flat_hash_set<std::string> unwatchable_dirs_ GUARDED_BY(mu_);
+  bool watch_limit_exceeded_ GUARDED_BY(mu_) = false;
+
+  std::atomic<uint64_t> generation_{0};
+};
+
+}  // anonymous namespace
+
+std::unique_ptr<FileWatcher> MaybeNewInotifyFileWatcher() {
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0) {
+    PLOG(WARNING) << "inotify is not available";
+    return nullptr;
+  }
+  return absl::make_unique<InotifyFileWatcher>(ScopedFd(fd));
+}
+
+}  // namespace devtools_goma
@@ -0,0 +1,23 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DEVTOOLS_GOMA_CLIENT_FILE_WATCHER_INOTIFY_H_
+#define DEVTOOLS_GOMA_CLIENT_FILE_WATCHER_INOTIFY_H_
+
+#include <memory>
+
+#include "file_watcher.h"
+
+namespace devtools_goma {
+
+// Creates FileWatcher using inotify.
+// Once the inotify watch limit (fs.inotify.max_user_watches) is exceeded,
+// Watch() fails for new directories, so callers fall back to stat them.
+//
+// Returns nullptr if inotify is not available.
+std::unique_ptr<FileWatcher> MaybeNewInotifyFileWatcher();
+
+}  // namespace devtools_goma
+
+#endif  // DEVTOOLS_GOMA_CLIENT_FILE_WATCHER_INOTIFY_H_
@@ -0,0 +1,173 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "file_watcher_inotify.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "file_stat_cache.h"
+#include "gtest/gtest.h"
+#include "path.h"
+#include "unittest_util.h"
+
+namespace devtools_goma {
+
+namespace {
+
+class RecordingListener : public FileWatcher::Listener {
+ public:
+  void OnFileChanged(const std::string& path) override {
+    changed_paths.push_back(path);
+  }
+  void OnAllFilesChanged() override { ++num_all_files_changed; }
+
+  bool HasChanged(const std::string& path) const {
+    for (const auto& changed : changed_paths) {
+      if (changed == path) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<std::string> changed_paths;
+  int num_all_files_changed = 0;
+};
+
+}  // anonymous namespace
+
+class FileWatcherInotifyTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    tmpdir_util_ = absl::make_unique<TmpdirUtil>("file_watcher_unittest");
+    tmpdir_util_->SetCwd("");
+    file_watcher_ = MaybeNewInotifyFileWatcher();
+    ASSERT_TRUE(file_watcher_ != nullptr);
+  }
+
+  std::string FullPath(const std::string& path) const {
+    return tmpdir_util_->FullPath(path);
+  }
+
+  std::unique_ptr<TmpdirUtil> tmpdir_util_;
+  std::unique_ptr<FileWatcher> file_watcher_;
+};
+
+TEST_F(FileWatcherInotifyTest, NotifyFileChanges) {
+  tmpdir_util_->CreateTmpFile("dir/foo.h", "foo");
+  ASSERT_TRUE(file_watcher_->Watch(FullPath("dir")));
+  // Directories on the path are also watched.
+  EXPECT_GE(file_watcher_->num_watches(), 3U);
+
+  RecordingListener listener;
+  file_watcher_->ProcessPendingEvents(&listener);
+  EXPECT_TRUE(listener.changed_paths.empty());
+
+  const uint64_t generation = file_watcher_->generation();
+  tmpdir_util_->CreateTmpFile("dir/foo.h", "foo updated");
+  file_watcher_->ProcessPendingEvents(&listener);
+  EXPECT_TRUE(listener.HasChanged(FullPath("dir/foo.h")));
+  EXPECT_FALSE(listener.HasChanged(FullPath("dir")));
+  EXPECT_GT(file_watcher_->generation(), generation);
+
+  listener.changed_paths.clear();
+  tmpdir_util_->CreateTmpFile("dir/bar.h", "bar");
+  file_watcher_->ProcessPendingEvents(&listener);
+  EXPECT_TRUE(listener.HasChanged(FullPath("dir/bar.h")));
+  // mtime of the directory is also updated.
+  EXPECT_TRUE(listener.HasChanged(FullPath("dir")));
+  EXPECT_EQ(0, listener.num_all_files_changed);
+}
+
+TEST_F(FileWatcherInotifyTest, WatchMissingDirectory) {
+  EXPECT_FALSE(file_watcher_->Watch(FullPath("missing")));
+  EXPECT_FALSE(file_watcher_->Watch("relative/dir"));
+
+  tmpdir_util_->CreateTmpFile("file", "");
+  EXPECT_FALSE(file_watcher_->Watch(FullPath("file")));
+}
+
+TEST_F(FileWatcherInotifyTest, RenameWatchedDirectory) {
+  tmpdir_util_->CreateTmpFile("dir/sub/foo.h", "foo");
+  ASSERT_TRUE(file_watcher_->Watch(FullPath("dir/sub")));
+
+  ASSERT_EQ(0, rename(FullPath("dir").c_str(), FullPath("dir2").c_str()));
+  RecordingListener listener;
+  file_watcher_->ProcessPendingEvents(&listener);
+  EXPECT_GT(listener.num_all_files_changed, 0);
+}
+
+class GlobalFileStatCacheWithFileWatcherTest : public FileWatcherInotifyTest {
+ protected:
+  void SetUp() override {
+    FileWatcherInotifyTest::SetUp();
+    GlobalFileStatCache::Init(std::move(file_watcher_));
+  }
+
+  void TearDown() override { GlobalFileStatCache::Quit(); }
+};
+
+TEST_F(GlobalFileStatCacheWithFileWatcherTest, InvalidateChangedFiles) {
+  GlobalFileStatCache* cache = GlobalFileStatCache::Instance();
+  tmpdir_util_->CreateTmpFile("dir/foo.h", "foo");
+  const std::string foo = FullPath("dir/foo.h");
+  const std::string bar = FullPath("dir/bar.h");
+
+  const FileStat foo_stat = cache->Get(foo);
+  EXPECT_TRUE(foo_stat.IsValid());
+  EXPECT_FALSE(cache->Get(bar).IsValid());
+  EXPECT_TRUE(cache->Get(FullPath("dir")).is_directory);
+
+  tmpdir_util_->CreateTmpFile("dir/foo.h", "foo updated");
+  tmpdir_util_->CreateTmpFile("dir/bar.h", "bar");
+  // Not notified yet.
+  EXPECT_EQ(foo_stat, cache->Get(foo));
+  EXPECT_FALSE(cache->Get(bar).IsValid());
+
+  cache->ProcessFileChanges();
+  EXPECT_EQ(FileStat(foo), cache->Get(foo));
+  EXPECT_NE(foo_stat.size, cache->Get(foo).size);
+  EXPECT_TRUE(cache->Get(bar).IsValid());
+  EXPECT_EQ(FileStat(FullPath("dir")), cache->Get(FullPath("dir")));
+}
+
+TEST_F(GlobalFileStatCacheWithFileWatcherTest, NotCachedInUnwatchedDirectory) {
+  GlobalFileStatCache* cache = GlobalFileStatCache::Instance();
+  const std::string foo = FullPath("dir/foo.h");
+  EXPECT_FALSE(cache->Get(foo).IsValid());
+
+  // "dir" didn't exist, so the missing file was not cached.
+  tmpdir_util_->CreateTmpFile("dir/foo.h", "foo");
+  EXPECT_TRUE(cache->Get(foo).IsValid());
+}
+
+TEST_F(GlobalFileStatCacheWithFileWatcherTest, NotCachedViaSymlink) {
+  GlobalFileStatCache* cache = GlobalFileStatCache::Instance();
+  tmpdir_util_->CreateTmpFile("target/foo.h", "foo");
+  tmpdir_util_->MkdirForPath("dir", true);
+  ASSERT_EQ(0, symlink(FullPath("target/foo.h").c_str(),
+                       FullPath("dir/foo.h").c_str()));
+  ASSERT_EQ(0, symlink(FullPath("target").c_str(),
+                       FullPath("dir/target").c_str()));
+  const std::string foo = FullPath("dir/foo.h");
+  const std::string foo_via_dir = FullPath("dir/target/foo.h");
+
+  const FileStat foo_stat = cache->Get(foo);
+  EXPECT_TRUE(foo_stat.IsValid());
+  EXPECT_EQ(foo_stat, cache->Get(foo_via_dir));
+
+  // "target" is not watched, so the change is not notified.
+  tmpdir_util_->CreateTmpFile("target/foo.h", "foo updated");
+  cache->ProcessFileChanges();
+  EXPECT_NE(foo_stat.size, cache->Get(foo).size);
+  EXPECT_NE(foo_stat.size, cache->Get(foo_via_dir).size);
+}
+
+}  // namespace devtools_goma
@@ -9,6 +9,7 @@
 #include "absl/memory/memory.h"
 #include "blob/file_blob_downloader.h"
 #include "blob/file_service_blob_uploader.h"
+#include "blob/known_chunk_skipping_blob_uploader.h"
 MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
 #include "prototmp/goma_data.pb.h"
 MSVC_POP_WARNING()
@@ -33,10 +34,22 @@ FileBlobClient::FileBlobClient(
     std::unique_ptr<FileServiceHttpClient> file_service_client)
     : BlobClient(), file_service_client_(std::move(file_service_client)) {}
 
+void FileBlobClient::EnableKnownChunkSkipping(
+    FileHashCache* file_hash_cache) {
+  file_hash_cache_ = file_hash_cache;
+}
+
 std::unique_ptr<BlobClient::Uploader> FileBlobClient::NewUploader(
     std::string filename,
     const RequesterInfo& requester_info,
     std::string trace_id) {
+  if (file_hash_cache_ != nullptr) {
+    return absl::make_unique<KnownChunkSkippingBlobUploader>(
+        std::move(filename),
+        file_service_client_->WithRequesterInfoAndTraceId(
+            requester_info, std::move(trace_id)),
+        file_hash_cache_);
+  }
   return absl::make_unique<FileServiceBlobUploader>(
       std::move(filename), file_service_client_->WithRequesterInfoAndTraceId(
                                requester_info, std::move(trace_id)));
@@ -16,6 +16,7 @@ namespace devtools_goma {
 
 class ExecReq_Input;
 class ExecResult_Output;
+class FileHashCache;
 class FileServiceClient;
 class RequesterInfo;
 
@@ -147,6 +148,11 @@ class FileBlobClient : public BlobClient {
       std::unique_ptr<FileServiceHttpClient> file_service_client);
   ~FileBlobClient() override = default;
 
+  // Makes uploaders skip storing chunks of large files known in
+  // |file_hash_cache|.
+  // It doesn't take ownership of |file_hash_cache|.
+  void EnableKnownChunkSkipping(FileHashCache* file_hash_cache);
+
   std::unique_ptr<BlobClient::Uploader> NewUploader(
       std::string filename,
       const RequesterInfo& requester_info,
@@ -160,6 +166,9 @@ class FileBlobClient : public BlobClient {
   // For handling FileBlobs in FileService over HTTP.
   std::unique_ptr<FileServiceHttpClient> file_service_client_;
 
+  // Set if known chunk skipping is enabled.
+  FileHashCache* file_hash_cache_ = nullptr;
+
   // TODO: Add BlobClients for other types of FileBlob handling.
 };
 
@@ -4,14 +4,20 @@
 
 #include "goma_blob.h"
 
+#include <map>
 #include <memory>
+#include <random>
 #include <string>
 
 #include "absl/memory/memory.h"
 #include "basictypes.h"
+#include "blob/known_chunk_skipping_blob_uploader.h"
 #include "compiler_specific.h"
+#include "file_hash_cache.h"
 #include "file_helper.h"
+#include "goma_data_util.h"
 #include "goma_file_http.h"
+#include "lib/file_data_output.h"
 MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
 #include "prototmp/goma_data.pb.h"
 MSVC_POP_WARNING()
@@ -256,4 +262,174 @@ TEST(FileBlobClient, ExampleDownloadEmbedded) {
             info_string.content);
 }
 
+// InMemoryFileServiceHttpClient is a file service stand-in that keeps stored
+// blobs in memory.
+class InMemoryFileServiceHttpClient : public FileServiceHttpClient {
+ public:
+  struct Storage {
+    std::map<std::string, FileBlob> blobs;
+    int num_stored_blobs = 0;
+    int64_t stored_bytes = 0;
+  };
+
+  explicit InMemoryFileServiceHttpClient(Storage* storage)
+      : FileServiceHttpClient(nullptr, "", "", nullptr), storage_(storage) {}
+  ~InMemoryFileServiceHttpClient() override = default;
+
+  std::unique_ptr<AsyncTask<StoreFileReq, StoreFileResp>>
+  NewAsyncStoreFileTask() override {
+    return nullptr;
+  }
+  std::unique_ptr<AsyncTask<LookupFileReq, LookupFileResp>>
+  NewAsyncLookupFileTask() override {
+    return nullptr;
+  }
+
+  bool StoreFile(const StoreFileReq* req, StoreFileResp* resp) override {
+    for (const auto& blob : req->blob()) {
+      const std::string hash_key = ComputeFileBlobHashKey(blob);
+      storage_->blobs[hash_key] = blob;
+      ++storage_->num_stored_blobs;
+      storage_->stored_bytes += blob.content().size();
+      resp->add_hash_key(hash_key);
+    }
+    return true;
+  }
+  bool LookupFile(const LookupFileReq* req, LookupFileResp* resp) override {
+    for (const auto& hash_key : req->hash_key()) {
+      FileBlob* blob = resp->add_blob();
+      auto found = storage_->blobs.find(hash_key);
+      if (found == storage_->blobs.end()) {
+        blob->set_blob_type(FileBlob::FILE);
+        blob->set_file_size(-1);
+        continue;
+      }
+      *blob = found->second;
+    }
+    return true;
+  }
+
+ private:
+  Storage* storage_;
+};
+
+class KnownChunkSkippingBlobUploaderTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    tmp_file_ = absl::make_unique<ScopedTmpFile>("known_chunk");
+    ASSERT_TRUE(tmp_file_->valid());
+    ASSERT_TRUE(tmp_file_->Close());
+  }
+
+  static std::string RandomData(size_t size) {
+    std::mt19937 gen(1);
+    std::string data(size, '\0');
+    for (auto& c : data) {
+      c = static_cast<char>(gen() & 0xff);
+    }
+    return data;
+  }
+
+  std::unique_ptr<KnownChunkSkippingBlobUploader> NewUploader() {
+    return absl::make_unique<KnownChunkSkippingBlobUploader>(
+        tmp_file_->filename(),
+        absl::make_unique<InMemoryFileServiceHttpClient>(&storage_),
+        &file_hash_cache_);
+  }
+
+  // Returns content of the uploaded file restored from |storage_|.
+  std::string Restore(const BlobClient::Uploader& uploader) {
+    ExecReq_Input input;
+    input.set_filename("input");
+    EXPECT_TRUE(uploader.GetInput(&input));
+    EXPECT_EQ(uploader.hash_key(), input.hash_key());
+    EXPECT_EQ(FileBlob::FILE_META, input.content().blob_type());
+
+    InMemoryFileServiceHttpClient file_service(&storage_);
+    std::string content;
+    std::unique_ptr<FileDataOutput> output =
+        FileDataOutput::NewStringOutput("input", &content);
+    EXPECT_TRUE(file_service.OutputFileBlob(input.content(), output.get()));
+    return content;
+  }
+
+  std::unique_ptr<ScopedTmpFile> tmp_file_;
+  InMemoryFileServiceHttpClient::Storage storage_;
+  FileHashCache file_hash_cache_;
+};
+
+TEST_F(KnownChunkSkippingBlobUploaderTest, SkipKnownChunks) {
+  const int64_t kFileSize = 16 * 1024 * 1024;
+  std::string content = RandomData(kFileSize);
+  ASSERT_TRUE(WriteStringToFile(content, tmp_file_->filename()));
+
+  std::unique_ptr<KnownChunkSkippingBlobUploader> uploader = NewUploader();
+  ASSERT_TRUE(uploader->Upload());
+  EXPECT_EQ(kFileSize, uploader->stored_chunk_bytes());
+  EXPECT_EQ(0, uploader->num_skipped_chunks());
+  EXPECT_EQ(kFileSize, storage_.stored_bytes);
+  EXPECT_EQ(content, Restore(*uploader));
+
+  // The same file doesn't need to be stored again.
+  uploader = NewUploader();
+  ASSERT_TRUE(uploader->Upload());
+  EXPECT_EQ(0, uploader->num_stored_chunks());
+  EXPECT_EQ(kFileSize, uploader->skipped_chunk_bytes());
+  EXPECT_EQ(kFileSize, storage_.stored_bytes);
+
+  // Modify a member in the middle of an archive in place.
+  // Only the 2MB chunk containing it needs to be stored.
+  const std::string old_hash_key = uploader->hash_key();
+  content.replace(kFileSize / 2 + 1000, 13, "modified data");
+  ASSERT_TRUE(WriteStringToFile(content, tmp_file_->filename()));
+
+  uploader = NewUploader();
+  ASSERT_TRUE(uploader->Upload());
+  EXPECT_NE(old_hash_key, uploader->hash_key());
+  EXPECT_EQ(1, uploader->num_stored_chunks());
+  EXPECT_EQ(2 * 1024 * 1024, uploader->stored_chunk_bytes());
+  EXPECT_EQ(kFileSize,
+            uploader->stored_chunk_bytes() + uploader->skipped_chunk_bytes());
+  EXPECT_EQ(kFileSize + uploader->stored_chunk_bytes(), storage_.stored_bytes);
+  EXPECT_EQ(content, Restore(*uploader));
+}
+
+TEST_F(KnownChunkSkippingBlobUploaderTest, ComputeKeyDoesNotStore) {
+  const int64_t kFileSize = 4 * 1024 * 1024;
+  ASSERT_TRUE(WriteStringToFile(RandomData(kFileSize), tmp_file_->filename()));
+
+  std::unique_ptr<KnownChunkSkippingBlobUploader> uploader = NewUploader();
+  ASSERT_TRUE(uploader->ComputeKey());
+  EXPECT_FALSE(uploader->hash_key().empty());
+  EXPECT_EQ(0, storage_.num_stored_blobs);
+  const std::string hash_key = uploader->hash_key();
+
+  // Chunks are split in the same way as FileServiceBlobUploader.
+  FileServiceBlobUploader file_service_uploader(
+      tmp_file_->filename(),
+      absl::make_unique<InMemoryFileServiceHttpClient>(&storage_));
+  ASSERT_TRUE(file_service_uploader.ComputeKey());
+  EXPECT_EQ(hash_key, file_service_uploader.hash_key());
+
+  uploader = NewUploader();
+  ASSERT_TRUE(uploader->Upload());
+  EXPECT_EQ(hash_key, uploader->hash_key());
+  EXPECT_EQ(kFileSize, storage_.stored_bytes);
+}
+
+TEST_F(KnownChunkSkippingBlobUploaderTest, SmallFile) {
+  const std::string content = "small file";
+  ASSERT_TRUE(WriteStringToFile(content, tmp_file_->filename()));
+
+  std::unique_ptr<KnownChunkSkippingBlobUploader> uploader = NewUploader();
+  ASSERT_TRUE(uploader->Upload());
+  ExecReq_Input input;
+  input.set_filename("input");
+  ASSERT_TRUE(uploader->GetInput(&input));
+  EXPECT_EQ(FileBlob::FILE, input.content().blob_type());
+  EXPECT_EQ(content, input.content().content());
+  EXPECT_EQ(0, uploader->num_stored_chunks());
+  EXPECT_EQ(0, storage_.num_stored_blobs);
+}
+
 }  // namespace devtools_goma
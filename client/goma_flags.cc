@@ -224,6 +224,17 @@ GOMA_DEFINE_int32(COMPILER_PROXY_NUM_FIND_PORTS, 10,
                   "specified by COMPILER_PROXY_PORT is in use.");
 GOMA_DEFINE_AUTOCONF_int32(COMPILER_PROXY_THREADS, NumDefaultProxyThreads,
                            "Number of threads compiler proxy will run in.");
+GOMA_DEFINE_bool(COMPILER_PROXY_WORK_STEALING, false,
+                 "If true, idle worker threads steal pending closures from "
+                 "busy worker threads in the same pool.");
+GOMA_DEFINE_bool(COMPILER_PROXY_USE_IO_URING, false,
+                 "If true, worker threads use io_uring to poll descriptors "
+                 "on Linux. Falls back to epoll if the kernel doesn't "
+                 "support it.");
+GOMA_DEFINE_int32(COMPILER_PROXY_TRACE_BUFFER_SIZE, 0,
+                  "Number of spans of compile task phases kept in ring "
+                  "buffers for /tracez (Chrome trace format). "
+                  "0 disables tracing.");
 GOMA_DEFINE_AUTOCONF_int32(COMPILER_PROXY_HTTP_THREADS,
                            NumDefaultProxyHttpThreads,
                            "Number of threads compiler proxy will handle "
@@ -240,6 +251,22 @@ GOMA_DEFINE_int32(MAX_OVERCOMMIT_INCOMING_SOCKETS,
                   "Number of overcommitted incoming sockets per threads on "
                   "select.");
 GOMA_DEFINE_int32(MAX_ACTIVE_TASKS, 2048, "Number of active tasks.");
+GOMA_DEFINE_int32(MAX_ACTIVE_INCLUDE_PROCESSOR_TASKS, 0,
+                  "Number of tasks running include processor at the same "
+                  "time. Waiting tasks are started in order of priority "
+                  "(link steps, then tasks that took longer last time). "
+                  "e.g. twice of GOMA_INCLUDE_PROCESSOR_THREADS keeps "
+                  "include processor threads busy. "
+                  "0 or negative means unlimited.");
+GOMA_DEFINE_int32(MAX_ACTIVE_FILE_REQUEST_TASKS, 0,
+                  "Number of tasks uploading input files at the same time. "
+                  "0 or negative means unlimited.");
+GOMA_DEFINE_int32(MAX_ACTIVE_CALL_EXEC_TASKS, 0,
+                  "Number of tasks waiting for remote execution at the same "
+                  "time. 0 or negative means unlimited.");
+GOMA_DEFINE_int32(MAX_ACTIVE_FILE_RESPONSE_TASKS, 0,
+                  "Number of tasks downloading output files at the same "
+                  "time. 0 or negative means unlimited.");
 GOMA_DEFINE_int32(MAX_FINISHED_TASKS, 1024,
                   "Number of task information to keep for monitoring.");
 GOMA_DEFINE_int32(MAX_FAILED_TASKS, 1024,
@@ -249,6 +276,9 @@ GOMA_DEFINE_int32(MAX_LONG_TASKS, 50,
 GOMA_DEFINE_bool(COMPILER_PROXY_STORE_FILE, false,
                  "True to store files first.  False to believe FileService "
                  "already has files and not send new file content.");
+GOMA_DEFINE_bool(SKIP_KNOWN_CHUNKS, false,
+                 "True not to store chunks of large input files already "
+                 "stored by this compiler_proxy.");
 GOMA_DEFINE_int32(COMPILER_PROXY_NEW_FILE_THRESHOLD,
                   5 * 60,
                   "Time(sec) to consider new file if the file is modified "
@@ -358,10 +388,23 @@ GOMA_DEFINE_bool(ENABLE_GCH_HACK, false,
                  "Enable *.gch hack");
 // As of 2018-08-21, we need keep more than 35000 header files to build
 // chrome. Some people builds chrome in several different directories.
-// So, 35000x4 is chosen.
-GOMA_DEFINE_int32(MAX_INCLUDE_CACHE_ENTRIES,
-                  140000,
-                  "The max count of include cache.");
+// Parsed directives of a header take a few KB on average, so 512MB can
+// keep 35000x4 headers.
+GOMA_DEFINE_int32(MAX_INCLUDE_CACHE_SIZE_IN_MB,
+                  512,
+                  "The max memory size of include cache in MB. "
+                  "Least recently used entries are evicted when exceeded.");
+GOMA_DEFINE_string(PREPARSED_DIRECTIVE_CACHE_DIR, "",
+                   "Directory to store parsed directives of headers by "
+                   "hash of file content, so that restarted compiler_proxy "
+                   "doesn't need to parse the same headers again. "
+                   "If empty, it won't be used. "
+                   "If not absolute path, it will be in GOMA_CACHE_DIR. "
+                   "See also PREPARSED_DIRECTIVE_CACHE_MAX_IN_MB.");
+GOMA_DEFINE_int32(PREPARSED_DIRECTIVE_CACHE_MAX_IN_MB, 1024,
+                  "The max size of preparsed directive cache. If the total "
+                  "amount exceeds this, least recently used entries will be "
+                  "removed. If 0, entries are not removed automatically.");
 GOMA_DEFINE_int32(MAX_LIST_DIR_CACHE_ENTRY_NUM, 32768,
                   "The entry limit in list dir cache.");
 GOMA_DEFINE_bool(ENABLE_REMOTE_CLANG_MODULES,
@@ -443,6 +486,34 @@ GOMA_DEFINE_int32(DEPS_CACHE_TABLE_THRESHOLD, 70000,
 GOMA_DEFINE_int32(DEPS_CACHE_MAX_PROTO_SIZE_IN_MB, 128,
                   "The max size of DepsCache file. If the file size exceeds "
                   "this limit, loading will fail. Unit is MB.");
+GOMA_DEFINE_bool(DEPS_CACHE_JOURNAL, false,
+                 "If true, DepsCache updates are appended to journal files "
+                 "next to DEPS_CACHE_FILE, and the cache file is loaded "
+                 "and rewritten in background instead of at startup and "
+                 "exit.");
+GOMA_DEFINE_int32(DEPS_CACHE_JOURNAL_FLUSH_INTERVAL_SEC, 10,
+                  "Interval to flush DepsCache journal in seconds.");
+GOMA_DEFINE_int32(DEPS_CACHE_JOURNAL_COMPACTION_THRESHOLD_IN_MB, 64,
+                  "When DepsCache journal exceeds this size, it is compacted "
+                  "into DEPS_CACHE_FILE. Unit is MB.");
+GOMA_DEFINE_int32(DEPS_CACHE_VALIDATION_THREADS, 0,
+                  "The number of threads to validate DepsCache entries, "
+                  "i.e. to check whether dependencies are modified. "
+                  "If 0, they are validated on the thread using the entry.");
+GOMA_DEFINE_int32(DEPS_CACHE_PARALLEL_VALIDATION_MIN_DEPS, 256,
+                  "DepsCache entries having this number of dependencies or "
+                  "more are validated in parallel if "
+                  "DEPS_CACHE_VALIDATION_THREADS > 0.");
+GOMA_DEFINE_string(FILE_HASH_CACHE_FILE, "",
+                   "Path to the FileHashCache cache file. It eliminates "
+                   "recomputing hash keys of unchanged input files after "
+                   "compiler_proxy restarts. "
+                   "If empty, file hash cache won't be saved. "
+                   "If not absolute path, it will be in GOMA_CACHE_DIR.");
+GOMA_DEFINE_int32(FILE_HASH_CACHE_ALIVE_DURATION, 7 * 24 * 3600,
+                  "File hash cache records not used longer than this value "
+                  "(in second) will be removed in saving. If negative, any "
+                  "record won't be removed.");
 GOMA_DEFINE_string(COMPILER_INFO_CACHE_FILE, "compiler_info_cache",
                    "Filename of compiler_info's cache. "
                    "If empty, compiler_info cache file is not used. "
@@ -452,6 +523,14 @@ GOMA_DEFINE_bool(ENABLE_GLOBAL_FILE_STAT_CACHE,
                  "Enable global file stat cache. "
                  "Do not enable this flag when any source file would be "
                  "changed between compilations.");
+GOMA_DEFINE_bool(ENABLE_FILE_WATCHER,
+                 false,
+                 "Enable global file stat cache, which is invalidated by "
+                 "watching directories of files with inotify, so that "
+                 "unchanged files are not checked by stat again. "
+                 "Files in directories that can't be watched (e.g. the "
+                 "inotify watch limit is exceeded) are checked by stat. "
+                 "Supported only on Linux.");
 GOMA_DEFINE_int32(COMPILER_INFO_CACHE_HOLDING_TIME_SEC, 60 * 60 * 24 * 30,
                   "CompilerInfo is not evicted if it is used within "
                   "COMPILER_INFO_CACHE_HOLDING_TIME_SEC. "
@@ -483,6 +562,14 @@ GOMA_DEFINE_int32(LOCAL_OUTPUT_CACHE_THRESHOLD_ITEMS, 80000,
                   "When LocalOutputCache garbage collection run, entries will "
                   "be removed until the number of entries are below of this "
                   "value");
+GOMA_DEFINE_string(LOCAL_OUTPUT_CACHE_COMMIT_MODE, "copy",
+                   "How LocalOutputCache stores and commits outputs. "
+                   "copy: outputs are stored in cache entry and copied. "
+                   "reflink: outputs are stored as blob files and cloned by "
+                   "reflink if filesystem supports it, otherwise copied. "
+                   "hardlink: outputs are stored as blob files and hard "
+                   "linked. Note that an output modified in place by other "
+                   "tools would invalidate the cache entry.");
 
 #ifdef _WIN32
 #define DEFAULT_CTL_SCRIPT_NAME "goma_ctl.bat"
@@ -647,7 +734,21 @@ GOMA_DEFINE_int32(HTTP_RPC_COMPRESSION_LEVEL, 3,
                   "0 forces to disable compression.");
 GOMA_DEFINE_string(HTTP_ACCEPT_ENCODING,
                    "gzip",
-                   "Accept-Encoding of goma's requests (e.g., lzma2)");
+                   "Accept-Encoding of goma's requests (e.g., lzma2, zstd)");
+GOMA_DEFINE_string(HTTP_RPC_ZSTD_DICTIONARY_FILE, "",
+                   "Dictionary file used for zstd encoding in HttpRPC. "
+                   "The server must use the same dictionary. "
+                   "Used only if zstd is picked by Accept-Encoding.");
+GOMA_DEFINE_bool(HTTP_RPC_ADAPTIVE_COMPRESSION, false,
+                 "If true, compression level is chosen for each request "
+                 "from network bandwidth, request size and CPU load, "
+                 "up to HTTP_RPC_COMPRESSION_LEVEL. "
+                 "Compression may be turned off on a fast network.");
+GOMA_DEFINE_bool(HTTP_RPC_STREAMING_REQUEST, false,
+                 "If true, requests are serialized and compressed while "
+                 "being sent, to reduce memory usage for large requests. "
+                 "Compressed requests are sent with chunked transfer "
+                 "encoding, so the server needs to accept it.");
 GOMA_DEFINE_bool(HTTP_RPC_START_COMPRESSION, true,
                  "Starts with compressed request. "
                  "Compression will be enabled/disabled by Accept-Encoding "
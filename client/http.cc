@@ -80,6 +80,13 @@ constexpr absl::Duration kRampUpDuration = absl::Minutes(10);
 
 constexpr int kMaxConnectionFailure = 5;
 
+// Responses smaller than this are dominated by latency rather than
+// bandwidth, so they are not used to estimate bandwidth.
+const size_t kMinBandwidthSampleSize = 64 * 1024;
+
+// Weight of a new sample in recent_bandwidth_.
+const double kBandwidthSampleWeight = 0.2;
+
 template <typename T>
 Json::Value VectorToJson(const std::vector<T>& vec) {
   Json::Value v;
@@ -686,7 +693,7 @@ class HttpClient::Task {
     // UpdateHealthStatusMessageForPing, we do not need to update it here.
     // (b/26701852)
     if (!is_ping_) {
-      client_->UpdateStats(*status_);
+      client_->UpdateStats(*status_, ElapsedTime());
     } else {
       LOG(INFO) << status_->trace_id << " We will not update status for ping.";
     }
@@ -1216,6 +1223,7 @@ std::string HttpClient::DebugString() const {
   ss << std::endl;
   ss << write_size_->DebugString() << std::endl;
   ss << read_size_->DebugString() << std::endl;
+  ss << latency_.GetSnapshot().DebugString(latency_.name()) << std::endl;
 
   ss << std::endl;
   if (options_.use_ssl) {
@@ -1342,6 +1350,7 @@ void HttpClient::DumpStatsToProto(HttpRPCStats* stats) const {
     http_status->set_status_code(iter.first);
     http_status->set_count(iter.second);
   }
+  latency_.GetSnapshot().DumpToProto(stats->mutable_latency());
 }
 
 int HttpClient::UpdateHealthStatusMessageForPing(
@@ -1437,6 +1446,11 @@ absl::Duration HttpClient::EstimatedRecvTime(size_t bytes) {
   return total_resp_time_ * bytes / total_resp_byte_;
 }
 
+absl::optional<double> HttpClient::EstimatedBandwidth() const {
+  AUTOLOCK(lock, &mu_);
+  return recent_bandwidth_;
+}
+
 /* static */
 absl::Duration HttpClient::GetNextBackoff(
     const Options& options, absl::Duration prev_backoff, bool in_error) {
@@ -1582,7 +1596,9 @@ void HttpClient::IncWriteByte(int n) {
   write_size_->Add(n);
 }
 
-void HttpClient::UpdateStats(const Status& status) {
+void HttpClient::UpdateStats(const Status& status, absl::Duration latency) {
+  latency_.AddTimeAsMilliseconds(latency);
+
   AUTOLOCK(lock, &mu_);
 
   AddStatusCodeHistoryUnlocked(status.http_return_code);
@@ -1618,6 +1634,17 @@ void HttpClient::UpdateStats(const Status& status) {
   num_http_oauth2_token_refreshed_ += status.num_oauth2_token_refreshed;
   total_resp_byte_ += status.resp_size;
   total_resp_time_ += status.resp_recv_time;
+  if (status.err == OK && status.resp_size >= kMinBandwidthSampleSize &&
+      status.resp_recv_time > absl::ZeroDuration()) {
+    const double bandwidth =
+        status.resp_size / absl::ToDoubleSeconds(status.resp_recv_time);
+    if (recent_bandwidth_.has_value()) {
+      recent_bandwidth_ = *recent_bandwidth_ * (1 - kBandwidthSampleWeight) +
+                          bandwidth * kBandwidthSampleWeight;
+    } else {
+      recent_bandwidth_ = bandwidth;
+    }
+  }
 
   // clear network_error_started_time_ in 2xx response.
   if (status.http_return_code / 100 == 2) {
@@ -2226,6 +2253,14 @@ HttpResponse::Body::ParsedStream() const {
 #else
       LOG(WARNING) << "unsuported encoding: lzma2.  need ENABLE_LZMA";
       return nullptr;
+#endif
+    case EncodingType::ZSTD:
+#ifdef ENABLE_ZSTD
+      return absl::make_unique<ZstdInputStream>(std::move(input),
+                                                zstd_dictionary_);
+#else
+      LOG(WARNING) << "unsuported encoding: zstd.  need ENABLE_ZSTD";
+      return nullptr;
 #endif
     default:
       VLOG(1) << "encoding: not specified";
@@ -39,6 +39,7 @@ MSVC_POP_WARNING()
 #include "luci_context.h"
 #include "oauth2.h"
 #include "scoped_fd.h"
+#include "sharded_histogram.h"
 #include "tls_engine.h"
 #include "worker_thread_manager.h"
 
@@ -520,6 +521,11 @@ class HttpClient {
       const Status& status,
       absl::optional<absl::Duration> round_trip_time) LOCKS_EXCLUDED(mu_);
 
+  // Returns recent throughput of receiving responses in bytes per second.
+  // It is used as an estimate of network bandwidth.
+  // Returns absl::nullopt if no large enough response has been received.
+  absl::optional<double> EstimatedBandwidth() const LOCKS_EXCLUDED(mu_);
+
   // NetworkErrorStartedTime return a time network error started.
   // Returns absl::nullopt if no error occurred recently.
   // The time will be set on fatal http error (302, 401, 403) and when
@@ -620,7 +626,9 @@ class HttpClient {
   void IncReadByte(int n) LOCKS_EXCLUDED(mu_);
   void IncWriteByte(int n) LOCKS_EXCLUDED(mu_);
 
-  void UpdateStats(const Status& status) LOCKS_EXCLUDED(mu_);
+  // |latency| is time taken for the task, including retries.
+  void UpdateStats(const Status& status, absl::Duration latency)
+      LOCKS_EXCLUDED(mu_);
 
   void UpdateTrafficHistory() LOCKS_EXCLUDED(mu_);
 
@@ -676,6 +684,10 @@ class HttpClient {
 
   size_t total_resp_byte_ GUARDED_BY(mu_);
   absl::Duration total_resp_time_ GUARDED_BY(mu_);  // msec.
+  // Not guarded by mu_; ShardedHistogram is thread-safe.
+  ShardedHistogram latency_{"HttpRPCLatency"};
+  // Exponential moving average of throughput of large responses.
+  absl::optional<double> recent_bandwidth_ GUARDED_BY(mu_);
 
   int ping_http_return_code_ GUARDED_BY(mu_);
   absl::optional<absl::Duration> ping_round_trip_time_ GUARDED_BY(mu_);
@@ -760,10 +772,17 @@ class HttpResponse : public HttpClient::Response {
     std::unique_ptr<google::protobuf::io::ZeroCopyInputStream>
       ParsedStream() const;
 
+    // Sets dictionary used to decode zstd encoded body.
+    // It doesn't take ownership of |dictionary|.
+    void set_zstd_dictionary(const ZstdDictionary* dictionary) {
+      zstd_dictionary_ = dictionary;
+    }
+
    private:
     const size_t content_length_;
     std::unique_ptr<HttpChunkParser> chunk_parser_;
     const EncodingType encoding_type_;
+    const ZstdDictionary* zstd_dictionary_ = nullptr;
 
     // buffer_ holds receiving data.
     // each char[] has kNetworkBufSize.
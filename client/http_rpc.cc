@@ -5,6 +5,7 @@
 
 #include "http_rpc.h"
 
+#include <algorithm>
 #include <memory>
 #include <sstream>
 #include <string>
@@ -23,6 +24,7 @@
 #include "autolock_timer.h"
 #include "callback.h"
 #include "compiler_specific.h"
+#include "compression_level_selector.h"
 #include "glog/logging.h"
 MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
 #include "google/protobuf/message.h"
@@ -32,6 +34,7 @@ MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
 #include "google/protobuf/io/zero_copy_stream_impl_lite.h"
 MSVC_POP_WARNING()
 #include "http_util.h"
+#include "machine_info.h"
 MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
 #include "prototmp/goma_data.pb.h"
 MSVC_POP_WARNING()
@@ -71,11 +74,16 @@ class HttpRPC::CallRequest : public HttpRPC::Request {
   ~CallRequest() override {}
   void EnableCompression(EncodingType encoding,
                          int level,
-                         const std::string& accept_encoding) {
+                         const std::string& accept_encoding,
+                         const ZstdDictionary* zstd_dictionary,
+                         CompressionLevelSelector* selector) {
     request_encoding_type_ = encoding;
     compression_level_ = level;
     accept_encoding_ = accept_encoding;
+    zstd_dictionary_ = zstd_dictionary;
+    compression_level_selector_ = selector;
   }
+  void EnableStreaming() { streaming_ = true; }
   std::unique_ptr<google::protobuf::io::ZeroCopyInputStream>
     NewStream() const override;
 
@@ -85,9 +93,26 @@ class HttpRPC::CallRequest : public HttpRPC::Request {
   }
 
  private:
+  void RecordCompression(size_t raw_size,
+                         size_t compressed_size,
+                         absl::Duration duration) const {
+    if (compression_level_selector_ != nullptr) {
+      compression_level_selector_->RecordCompression(
+          compression_level_, raw_size, compressed_size, duration);
+    }
+  }
+
+  // Returns stream to send |req_| compressed in chunked encoding,
+  // or nullptr if request_encoding_type_ is not supported.
+  std::unique_ptr<google::protobuf::io::ZeroCopyInputStream>
+    NewChunkedStream(std::vector<std::string> headers) const;
+
   EncodingType request_encoding_type_ = EncodingType::NO_ENCODING;
   int compression_level_ = 0;
   std::string accept_encoding_;
+  const ZstdDictionary* zstd_dictionary_ = nullptr;
+  CompressionLevelSelector* compression_level_selector_ = nullptr;
+  bool streaming_ = false;
   DISALLOW_ASSIGN(CallRequest);
 };
 
@@ -106,9 +131,14 @@ class HttpRPC::Response : public HttpClient::Response {
     response_body_ =
         absl::make_unique<HttpResponse::Body>(
             content_length, is_chunked, encoding_type);
+    response_body_->set_zstd_dictionary(zstd_dictionary_);
     return response_body_.get();
   }
 
+  void set_zstd_dictionary(const ZstdDictionary* dictionary) {
+    zstd_dictionary_ = dictionary;
+  }
+
  protected:
   void ParseBody() override;
 
@@ -117,6 +147,7 @@ class HttpRPC::Response : public HttpClient::Response {
 
  private:
   std::unique_ptr<HttpResponse::Body> response_body_;
+  const ZstdDictionary* zstd_dictionary_ = nullptr;
   DISALLOW_COPY_AND_ASSIGN(Response);
 };
 
@@ -156,9 +187,26 @@ class HttpRPC::CallData {
   DISALLOW_COPY_AND_ASSIGN(CallData);
 };
 
+namespace {
+
+// Returns encodings HttpRPC can use for request.
+std::vector<EncodingType> CapableEncodings() {
+  // TODO: deprecate deflate compression.
+  return {
+#ifdef ENABLE_ZSTD
+      EncodingType::ZSTD,
+#endif
+      EncodingType::GZIP, EncodingType::DEFLATE,
+  };
+}
+
+}  // anonymous namespace
+
 HttpRPC::Options::Options()
     : compression_level(0),
-      start_compression(false) {
+      start_compression(false),
+      adaptive_compression(false),
+      streaming_request(false) {
 }
 
 std::string HttpRPC::Options::DebugString() const {
@@ -166,8 +214,14 @@ std::string HttpRPC::Options::DebugString() const {
   ss << " compression_level=" << compression_level;
   if (start_compression)
     ss << " start_compression";
+  if (adaptive_compression)
+    ss << " adaptive_compression";
+  if (streaming_request)
+    ss << " streaming_request";
   ss << " accept_encoding=" << accept_encoding;
   ss << " content_type_for_protobuf=" << content_type_for_protobuf;
+  if (!zstd_dictionary.empty())
+    ss << " zstd_dictionary_size=" << zstd_dictionary.size();
   return ss.str();
 }
 
@@ -175,18 +229,33 @@ HttpRPC::HttpRPC(HttpClient* client,
                  const Options& options)
     : client_(client),
       options_(options),
-      request_encoding_type_(EncodingType::NO_ENCODING) {
+      request_encoding_type_(EncodingType::NO_ENCODING),
+      streaming_request_(options.streaming_request),
+      num_cpus_(std::max(GetNumCPUs(), 1)) {
   LOG(INFO) << options_.DebugString();
   CHECK(!options_.content_type_for_protobuf.empty());
   CHECK(options_.content_type_for_protobuf.find_first_of("\r\n") ==
         std::string::npos)
       << "content_type_for_protobuf must not contain CR LF:"
       << options_.content_type_for_protobuf;
+  if (!options_.zstd_dictionary.empty()) {
+#ifdef ENABLE_ZSTD
+    zstd_dictionary_ = ZstdDictionary::Create(options_.zstd_dictionary,
+                                              options_.compression_level);
+    LOG_IF(ERROR, zstd_dictionary_ == nullptr)
+        << "failed to load zstd dictionary."
+        << " size=" << options_.zstd_dictionary.size();
+#else
+    LOG(WARNING) << "zstd dictionary is ignored.  need ENABLE_ZSTD";
+#endif
+  }
+  if (options_.adaptive_compression && options_.compression_level > 0) {
+    compression_level_selector_ = absl::make_unique<CompressionLevelSelector>(
+        options_.compression_level);
+  }
   std::vector<EncodingType> encodings =
       ParseAcceptEncoding(options_.accept_encoding);
-  // TODO: deprecate deflate compression.
-  std::vector<EncodingType> capable{EncodingType::GZIP, EncodingType::DEFLATE};
-  request_encoding_type_ = PickEncoding(capable, encodings);
+  request_encoding_type_ = PickEncoding(CapableEncodings(), encodings);
   LOG(INFO) << "request encoding=" << GetEncodingName(request_encoding_type_);
 }
 
@@ -310,17 +379,26 @@ void HttpRPC::CallWithCallback(const std::string& path,
   std::unique_ptr<CallRequest> call_req(new CallRequest(req, status));
   if (IsCompressionEnabled()) {
     EncodingType encoding = request_encoding_type();
-    VLOG(2) << "compression enabled level=" << options_.compression_level
+    // It may be 0 in adaptive compression.  Even then, Accept-Encoding is
+    // sent.
+    const int compression_level = CompressionLevel(req);
+    VLOG(2) << "compression enabled level=" << compression_level
             << " request_encoding=" << GetEncodingName(encoding)
             << " accept_encoding=" << options_.accept_encoding;
     call_req->EnableCompression(
-        encoding, options_.compression_level, options_.accept_encoding);
+        encoding, compression_level, options_.accept_encoding,
+        zstd_dictionary(), compression_level_selector_.get());
   } else {
     VLOG(2) << "compression is not enabled";
   }
+  if (IsStreamingRequestEnabled()) {
+    call_req->EnableStreaming();
+  }
   std::unique_ptr<Request> http_req = std::move(call_req);
   client_->InitHttpRequest(http_req.get(), "POST", path);
-  std::unique_ptr<Response> http_resp(new CallResponse(resp, status));
+  std::unique_ptr<CallResponse> call_resp(new CallResponse(resp, status));
+  call_resp->set_zstd_dictionary(zstd_dictionary());
+  std::unique_ptr<Response> http_resp = std::move(call_resp);
   http_req->SetContentType(options_.content_type_for_protobuf);
   std::unique_ptr<CallData> call(
       new CallData(std::move(http_req), std::move(http_resp), callback));
@@ -347,6 +425,10 @@ void HttpRPC::CallDone(std::unique_ptr<CallData> call) {
         call->resp()->status_code() == 415) {
       DisableCompression();
     }
+    // Server doesn't accept request without Content-Length.
+    if (call->resp()->status_code() == 411) {
+      DisableStreamingRequest();
+    }
   } else {
     EnableCompression(call->resp()->Header());
   }
@@ -363,6 +445,10 @@ std::string HttpRPC::DebugString() const {
     ss << "disabled";
   }
   ss << std::endl;
+  ss << "Adaptive compression:"
+     << (compression_level_selector_ ? "enabled" : "disabled") << std::endl;
+  ss << "Streaming request:"
+     << (streaming_request_ ? "enabled" : "disabled") << std::endl;
   ss << "Accept-Encoding:" << options_.accept_encoding << std::endl;
   ss << "Content-Type:" << options_.content_type_for_protobuf << std::endl;
   ss << std::endl;
@@ -373,12 +459,17 @@ void HttpRPC::DumpToJson(Json::Value* json) const {
   client_->DumpToJson(json);
   AUTOLOCK(lock, &mu_);
   (*json)["compression"] = GetEncodingName(request_encoding_type_);
+  (*json)["adaptive_compression"] = compression_level_selector_ != nullptr;
+  (*json)["streaming_request"] = streaming_request_;
   (*json)["accept_encoding"] = options_.accept_encoding;
   (*json)["content_type"] = options_.content_type_for_protobuf;
 }
 
 void HttpRPC::DumpStatsToProto(HttpRPCStats* stats) const {
   client_->DumpStatsToProto(stats);
+  if (compression_level_selector_) {
+    compression_level_selector_->DumpStatsToProto(stats);
+  }
 }
 
 void HttpRPC::DisableCompression() {
@@ -394,9 +485,7 @@ void HttpRPC::EnableCompression(absl::string_view header) {
       ExtractHeaderField(header, kAcceptEncoding);
   std::vector<EncodingType> server_accepts =
       ParseAcceptEncoding(accept_encoding);
-  // TODO: deprecate deflate compression.
-  std::vector<EncodingType> capable{EncodingType::GZIP, EncodingType::DEFLATE};
-  EncodingType encoding = PickEncoding(capable, server_accepts);
+  EncodingType encoding = PickEncoding(CapableEncodings(), server_accepts);
   if (request_encoding_type_ == encoding) {
     return;
   }
@@ -411,11 +500,50 @@ void HttpRPC::EnableCompression(absl::string_view header) {
   request_encoding_type_ = encoding;
 }
 
+void HttpRPC::DisableStreamingRequest() {
+  AUTOLOCK(lock, &mu_);
+  if (streaming_request_)
+    LOG(WARNING) << "Streaming request disabled";
+  streaming_request_ = false;
+}
+
+bool HttpRPC::IsStreamingRequestEnabled() const {
+  AUTOLOCK(lock, &mu_);
+  return streaming_request_;
+}
+
 EncodingType HttpRPC::request_encoding_type() const {
   AUTOLOCK(lock, &mu_);
   return request_encoding_type_;
 }
 
+const ZstdDictionary* HttpRPC::zstd_dictionary() const {
+#ifdef ENABLE_ZSTD
+  return zstd_dictionary_.get();
+#else
+  return nullptr;
+#endif
+}
+
+int HttpRPC::CompressionLevel(const google::protobuf::Message* req) {
+  if (!compression_level_selector_) {
+    return options_.compression_level;
+  }
+  const size_t raw_size = req ? req->ByteSizeLong() : 0;
+  return compression_level_selector_->SelectLevel(
+      raw_size, client_->EstimatedBandwidth(), CPULoad());
+}
+
+double HttpRPC::CPULoad() {
+  const absl::Time now = absl::Now();
+  AUTOLOCK(lock, &mu_);
+  if (now - cpu_load_update_time_ >= absl::Seconds(1)) {
+    cpu_load_ = GetLoadAverage() / num_cpus_;
+    cpu_load_update_time_ = now;
+  }
+  return cpu_load_;
+}
+
 bool HttpRPC::IsCompressionEnabled() const {
   AUTOLOCK(lock, &mu_);
   if (request_encoding_type_ == EncodingType::NO_ENCODING)
@@ -442,6 +570,13 @@ HttpRPC::CallRequest::NewStream() const {
   // note: we don't send with lzma2.
   if (request_encoding_type_ != EncodingType::NO_ENCODING &&
       compression_level_ > 0 && req_) {
+    if (streaming_) {
+      std::unique_ptr<google::protobuf::io::ZeroCopyInputStream> stream =
+          NewChunkedStream(headers);
+      if (stream) {
+        return stream;
+      }
+    }
     switch (request_encoding_type_) {
       // TODO: deprecate deflate compression.
       case EncodingType::DEFLATE:
@@ -463,6 +598,8 @@ HttpRPC::CallRequest::NewStream() const {
           headers.push_back(CreateHeader(
               kContentEncoding, GetEncodingName(request_encoding_type_)));
           status_->raw_req_size = gzip_stream.ByteCount();
+          RecordCompression(gzip_stream.ByteCount(), compressed.size(),
+                            compression_timer.GetDuration());
           absl::string_view body(compressed);
           // Omit zlib header (since server assumes no zlib header).
           body.remove_prefix(2);
@@ -495,6 +632,8 @@ HttpRPC::CallRequest::NewStream() const {
               CreateHeader(kContentEncoding,
                            GetEncodingName(request_encoding_type_)));
           status_->raw_req_size = gzip_stream.ByteCount();
+          RecordCompression(gzip_stream.ByteCount(), compressed.size(),
+                            compression_timer.GetDuration());
           streams.reserve(2);
           streams.push_back(
               absl::make_unique<StringInputStream>(
@@ -505,6 +644,41 @@ HttpRPC::CallRequest::NewStream() const {
         }
         break;
 
+#ifdef ENABLE_ZSTD
+      case EncodingType::ZSTD:
+        {
+        std::string compressed;
+        SimpleTimer compression_timer;
+        ZstdOutputStream::Options options;
+        options.compression_level = compression_level_;
+        options.dictionary = zstd_dictionary_;
+        ZstdOutputStream zstd_stream(
+            absl::make_unique<google::protobuf::io::StringOutputStream>(
+                &compressed),
+            options);
+        req_->SerializeToZeroCopyStream(&zstd_stream);
+        if (!zstd_stream.Close()) {
+          LOG(ERROR) << "ZstdOutputStream error:"
+                     << zstd_stream.ErrorMessage();
+          break;
+        }
+        headers.push_back(
+            CreateHeader(kContentEncoding,
+                         GetEncodingName(request_encoding_type_)));
+        status_->raw_req_size = zstd_stream.ByteCount();
+        RecordCompression(zstd_stream.ByteCount(), compressed.size(),
+                          compression_timer.GetDuration());
+        streams.reserve(2);
+        streams.push_back(
+            absl::make_unique<StringInputStream>(
+                BuildHeader(headers, compressed.size())));
+        streams.push_back(
+            absl::make_unique<StringInputStream>(std::move(compressed)));
+        return absl::make_unique<ChainedInputStream>(std::move(streams));
+        }
+        break;
+#endif  // ENABLE_ZSTD
+
       default:
         LOG(FATAL) << "unsupported encoding type:"
                    << GetEncodingName(request_encoding_type_);
@@ -513,6 +687,19 @@ HttpRPC::CallRequest::NewStream() const {
     VLOG(1) << "compression unavailable.";
   }
 
+  if (streaming_ && req_) {
+    // Content-Length is known without serialization.
+    std::unique_ptr<MessageInputStream> body =
+        absl::make_unique<MessageInputStream>(req_);
+    status_->raw_req_size = body->size();
+    streams.reserve(2);
+    streams.push_back(
+        absl::make_unique<StringInputStream>(
+            BuildHeader(headers, body->size())));
+    streams.push_back(std::move(body));
+    return absl::make_unique<ChainedInputStream>(std::move(streams));
+  }
+
   // Fallback if compression is not supported or failed.
   std::string raw_body;
   if (req_) {
@@ -528,6 +715,56 @@ HttpRPC::CallRequest::NewStream() const {
   return absl::make_unique<ChainedInputStream>(std::move(streams));
 }
 
+std::unique_ptr<google::protobuf::io::ZeroCopyInputStream>
+HttpRPC::CallRequest::NewChunkedStream(std::vector<std::string> headers) const {
+  std::unique_ptr<MessageInputStream> message_stream =
+      absl::make_unique<MessageInputStream>(req_);
+  const size_t raw_size = message_stream->size();
+  std::unique_ptr<google::protobuf::io::ZeroCopyInputStream> body;
+  // Compression result is not recorded in compression_level_selector_,
+  // since compression runs while sending, and its duration includes
+  // waiting for the socket.
+  switch (request_encoding_type_) {
+    case EncodingType::GZIP:
+      {
+      GzipRequestInputStream::Options options;
+      options.compression_level = compression_level_;
+      body = absl::make_unique<GzipRequestInputStream>(
+          std::move(message_stream), options);
+      }
+      break;
+
+#ifdef ENABLE_ZSTD
+    case EncodingType::ZSTD:
+      {
+      ZstdRequestInputStream::Options options;
+      options.compression_level = compression_level_;
+      options.dictionary = zstd_dictionary_;
+      body = absl::make_unique<ZstdRequestInputStream>(
+          std::move(message_stream), options);
+      }
+      break;
+#endif  // ENABLE_ZSTD
+
+    default:
+      // TODO: deprecate deflate compression.
+      VLOG(1) << "streaming is not supported for "
+              << GetEncodingName(request_encoding_type_);
+      return nullptr;
+  }
+  status_->raw_req_size = raw_size;
+  headers.push_back(
+      CreateHeader(kContentEncoding, GetEncodingName(request_encoding_type_)));
+  headers.push_back(CreateHeader(kTransferEncoding, "chunked"));
+  std::vector<std::unique_ptr<google::protobuf::io::ZeroCopyInputStream>>
+      streams;
+  streams.reserve(2);
+  streams.push_back(
+      absl::make_unique<StringInputStream>(BuildHeader(headers, -1)));
+  streams.push_back(std::move(body));
+  return absl::make_unique<ChainedInputStream>(std::move(streams));
+}
+
 void HttpRPC::Response::ParseBody() {
   if (resp_) {
     std::unique_ptr<google::protobuf::io::ZeroCopyInputStream> input =
@@ -11,6 +11,7 @@
 
 #include <json/json.h>
 
+#include "absl/time/time.h"
 #include "basictypes.h"
 #include "gtest/gtest_prod.h"
 #include "lockhelper.h"
@@ -24,6 +25,7 @@ class Message;
 
 namespace devtools_goma {
 
+class CompressionLevelSelector;
 class ExecReq;
 class ExecResp;
 class HttpRPCStats;
@@ -36,10 +38,22 @@ class HttpRPC {
  public:
   struct Options {
     Options();
+    // Compression level.  If adaptive_compression is true, this is
+    // the highest level to use.
     int compression_level;
     bool start_compression;
+    // If true, compression level is chosen for each request from network
+    // bandwidth, request size and CPU load.
+    bool adaptive_compression;
+    // If true, request is serialized and compressed while it is sent,
+    // instead of being serialized in memory in advance.  Compressed request
+    // is sent in chunked transfer encoding, so the server needs to accept it.
+    bool streaming_request;
     std::string accept_encoding;
     std::string content_type_for_protobuf;
+    // Dictionary content used for zstd encoding, shared with the server.
+    // If empty, zstd is used without dictionary.
+    std::string zstd_dictionary;
 
     std::string DebugString() const;
   };
@@ -98,16 +112,33 @@ class HttpRPC {
 
   void DisableCompression();
   void EnableCompression(absl::string_view header);
+  void DisableStreamingRequest();
+  bool IsStreamingRequestEnabled() const;
   // Initial request_encoding_type is determined by options_.accept_encoding.
   // Once it received response, use server's Accept-Encoding: response header.
   // Prefers gzip to deflate.  no lzma2 support yet.
+  // zstd is used only if built with ENABLE_ZSTD.
   EncodingType request_encoding_type() const;
   bool IsCompressionEnabled() const;
+  // Returns nullptr if zstd dictionary is not used.
+  const ZstdDictionary* zstd_dictionary() const;
+  // Returns compression level for |req|.  0 means no compression.
+  int CompressionLevel(const google::protobuf::Message* req);
+  // Returns load average per CPU, updated every second.
+  double CPULoad() LOCKS_EXCLUDED(mu_);
 
   HttpClient* client_;
   const Options options_;
   mutable Lock mu_;
   EncodingType request_encoding_type_ GUARDED_BY(mu_);
+  bool streaming_request_ GUARDED_BY(mu_);
+#ifdef ENABLE_ZSTD
+  std::unique_ptr<ZstdDictionary> zstd_dictionary_;
+#endif
+  std::unique_ptr<CompressionLevelSelector> compression_level_selector_;
+  const int num_cpus_;
+  double cpu_load_ GUARDED_BY(mu_) = 0;
+  absl::Time cpu_load_update_time_ GUARDED_BY(mu_);
 
   DISALLOW_COPY_AND_ASSIGN(HttpRPC);
 };
@@ -4,6 +4,9 @@
 
 #include "http_rpc_init.h"
 
+#include "file_helper.h"
+#include "glog/logging.h"
+
 #define GOMA_DECLARE_FLAGS_ONLY
 #include "goma_flags.cc"
 
@@ -12,9 +15,18 @@ namespace devtools_goma {
 void InitHttpRPCOptions(HttpRPC::Options* options) {
   options->compression_level = FLAGS_HTTP_RPC_COMPRESSION_LEVEL;
   options->start_compression = FLAGS_HTTP_RPC_START_COMPRESSION;
+  options->adaptive_compression = FLAGS_HTTP_RPC_ADAPTIVE_COMPRESSION;
+  options->streaming_request = FLAGS_HTTP_RPC_STREAMING_REQUEST;
   options->accept_encoding = FLAGS_HTTP_ACCEPT_ENCODING;
   options->content_type_for_protobuf =
       FLAGS_CONTENT_TYPE_FOR_PROTOBUF;
+  if (!FLAGS_HTTP_RPC_ZSTD_DICTIONARY_FILE.empty() &&
+      !ReadFileToString(FLAGS_HTTP_RPC_ZSTD_DICTIONARY_FILE,
+                        &options->zstd_dictionary)) {
+    LOG(ERROR) << "failed to read zstd dictionary: "
+               << FLAGS_HTTP_RPC_ZSTD_DICTIONARY_FILE;
+    options->zstd_dictionary.clear();
+  }
 }
 
 }  // namespace devtools_goma
@@ -26,11 +26,13 @@ MSVC_POP_WARNING()
 #include "platform_thread.h"
 MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
 #include "prototmp/goma_data.pb.h"
+#include "prototmp/goma_stats.pb.h"
 MSVC_POP_WARNING()
 #include "scoped_fd.h"
 #include "socket_factory.h"
 #include "worker_thread.h"
 #include "worker_thread_manager.h"
+#include "zero_copy_stream_impl.h"
 
 #include <glog/logging.h>
 #include <gtest/gtest.h>
@@ -150,6 +152,38 @@ class HttpRPCTest : public ::testing::Test {
     *serialized = std::string(v);
   }
 
+  void SerializeGzipChunkedToString(const google::protobuf::Message& msg,
+                                    int compression_level,
+                                    std::string* serialized) {
+    serialized->clear();
+    GzipRequestInputStream::Options options;
+    options.compression_level = compression_level;
+    GzipRequestInputStream stream(
+        absl::make_unique<StringInputStream>(msg.SerializeAsString()),
+        options);
+    const void* data;
+    int size;
+    while (stream.Next(&data, &size)) {
+      serialized->append(static_cast<const char*>(data), size);
+    }
+  }
+
+#ifdef ENABLE_ZSTD
+  void SerializeZstdToString(const google::protobuf::Message& msg,
+                             int compression_level,
+                             std::string* serialized) {
+    serialized->clear();
+    ZstdOutputStream::Options options;
+    options.compression_level = compression_level;
+    ZstdOutputStream zstd_stream(
+        absl::make_unique<google::protobuf::io::StringOutputStream>(
+            serialized),
+        options);
+    msg.SerializeToZeroCopyStream(&zstd_stream);
+    ASSERT_TRUE(zstd_stream.Close()) << zstd_stream.ErrorMessage();
+  }
+#endif  // ENABLE_ZSTD
+
   std::unique_ptr<WorkerThreadManager> wm_;
   int pool_;
   std::unique_ptr<MockSocketServer> mock_server_;
@@ -424,6 +458,40 @@ TEST_F(HttpRPCTest, EnableCompression) {
   EXPECT_TRUE(http_rpc->IsCompressionEnabled());
   EXPECT_TRUE(http_rpc->request_encoding_type() == EncodingType::GZIP)
       << GetEncodingName(http_rpc->request_encoding_type());
+
+  rpc_options.accept_encoding = "zstd, gzip";
+  http_rpc = absl::make_unique<HttpRPC>(&http_client, rpc_options);
+#ifdef ENABLE_ZSTD
+  EXPECT_TRUE(http_rpc->IsCompressionEnabled());
+  EXPECT_TRUE(http_rpc->request_encoding_type() == EncodingType::ZSTD)
+      << GetEncodingName(http_rpc->request_encoding_type());
+#else
+  EXPECT_TRUE(http_rpc->IsCompressionEnabled());
+  EXPECT_TRUE(http_rpc->request_encoding_type() == EncodingType::GZIP)
+      << GetEncodingName(http_rpc->request_encoding_type());
+#endif
+  http_rpc->DisableCompression();
+  EXPECT_FALSE(http_rpc->IsCompressionEnabled());
+  http_rpc->EnableCompression("HTTP/1.1 200 OK\r\n"
+                              "Accept-Encoding: gzip, zstd\r\n"
+                              "Content-Length: 0\r\n"
+                              "\r\n");
+  EXPECT_TRUE(http_rpc->IsCompressionEnabled());
+  EXPECT_TRUE(http_rpc->request_encoding_type() == EncodingType::GZIP)
+      << GetEncodingName(http_rpc->request_encoding_type());
+  http_rpc->DisableCompression();
+  EXPECT_FALSE(http_rpc->IsCompressionEnabled());
+  http_rpc->EnableCompression("HTTP/1.1 200 OK\r\n"
+                              "Accept-Encoding: zstd\r\n"
+                              "Content-Length: 0\r\n"
+                              "\r\n");
+#ifdef ENABLE_ZSTD
+  EXPECT_TRUE(http_rpc->IsCompressionEnabled());
+  EXPECT_TRUE(http_rpc->request_encoding_type() == EncodingType::ZSTD)
+      << GetEncodingName(http_rpc->request_encoding_type());
+#else
+  EXPECT_FALSE(http_rpc->IsCompressionEnabled());
+#endif
 }
 
 TEST_F(HttpRPCTest, PingFail) {
@@ -966,6 +1034,243 @@ TEST_F(HttpRPCTest, TLSEngineCallLookupFileDeflate) {
   EXPECT_TRUE(socket_status.is_released());
 }
 
+TEST_F(HttpRPCTest, TLSEngineCallLookupFileAdaptiveCompression) {
+  int socks[2];
+  ASSERT_EQ(0, OpenSocketPairForTest(socks));
+  // Too small request is not compressed.
+  LookupFileReq req;
+  std::string serialized_req;
+  req.SerializeToString(&serialized_req);
+  std::ostringstream req_ss;
+  req_ss << "POST /l HTTP/1.1\r\n"
+         << "Host: goma.chromium.org\r\n"
+         << "User-Agent: " << kUserAgentString << "\r\n"
+         << "Content-Type: binary/x-protocol-buffer\r\n"
+         << "Content-Length: " << serialized_req.size() << "\r\n"
+         << "Accept-Encoding: deflate\r\n\r\n"
+         << serialized_req;
+
+  const std::string req_expected = req_ss.str();
+  std::string req_buf;
+  req_buf.resize(req_expected.size());
+  mock_server_->ServerRead(socks[0], &req_buf);
+  LookupFileResp resp;
+  std::string serialized_resp;
+  resp.SerializeToString(&serialized_resp);
+  std::ostringstream resp_ss;
+  resp_ss << "HTTP/1.1 200 OK\r\n"
+          << "Content-Type: text/x-protocol-buffer\r\n"
+          << "Accept-Encoding: deflate\r\n"
+          << "Content-Length: " << serialized_resp.size() << "\r\n\r\n"
+          << serialized_resp;
+  mock_server_->ServerWrite(socks[0], resp_ss.str());
+
+  MockSocketFactory::SocketStatus socket_status;
+  std::unique_ptr<MockSocketFactory> socket_factory(
+      absl::make_unique<MockSocketFactory>(socks[1], &socket_status));
+
+  socket_factory->set_dest("goma.chromium.org:443");
+  socket_factory->set_host_name("goma.chromium.org");
+  socket_factory->set_port(443);
+  std::unique_ptr<FakeTLSEngineFactory> tls_engine_factory(
+      absl::make_unique<FakeTLSEngineFactory>());
+  HttpClient::Options options;
+  options.dest_host_name = "goma.chromium.org";
+  options.dest_port = 443;
+  options.use_ssl = true;
+  HttpClient http_client(std::move(socket_factory),
+                         std::move(tls_engine_factory),
+                         options, wm_.get());
+  HttpRPC::Options rpc_options;
+  rpc_options.content_type_for_protobuf = "binary/x-protocol-buffer";
+  rpc_options.start_compression = true;
+  rpc_options.compression_level = 3;
+  rpc_options.adaptive_compression = true;
+  rpc_options.accept_encoding = "deflate";
+  HttpRPC http_rpc(&http_client, rpc_options);
+  TestLookupFileContext tc(&http_rpc, nullptr);
+  RunTestLookupFile(&tc);
+  {
+    AutoLock lock(&mu_);
+    while (tc.state_ != TestLookupFileContext::DONE) {
+      cond_.Wait(&mu_);
+    }
+
+    EXPECT_EQ(req_expected, req_buf);
+    EXPECT_EQ(0, tc.r_);
+    EXPECT_TRUE(tc.status_.finished);
+    EXPECT_EQ(0, tc.status_.err);
+    EXPECT_EQ(200, tc.status_.http_return_code);
+  }
+  http_client.WaitNoActive();
+
+  HttpRPCStats stats;
+  http_rpc.DumpStatsToProto(&stats);
+  ASSERT_EQ(1, stats.compression_level_size());
+  EXPECT_EQ(0, stats.compression_level(0).level());
+  EXPECT_EQ(1, stats.compression_level(0).count());
+}
+
+TEST_F(HttpRPCTest, TLSEngineCallLookupFileStreamingRequest) {
+  int socks[2];
+  ASSERT_EQ(0, OpenSocketPairForTest(socks));
+  const int kCompressionLevel = 3;
+  LookupFileReq req;
+  std::string serialized_req;
+  SerializeGzipChunkedToString(req, kCompressionLevel, &serialized_req);
+  std::ostringstream req_ss;
+  req_ss << "POST /l HTTP/1.1\r\n"
+         << "Host: goma.chromium.org\r\n"
+         << "User-Agent: " << kUserAgentString << "\r\n"
+         << "Content-Type: binary/x-protocol-buffer\r\n"
+         << "Accept-Encoding: gzip\r\n"
+         << "Content-Encoding: gzip\r\n"
+         << "Transfer-Encoding: chunked\r\n\r\n"
+         << serialized_req;
+
+  const std::string req_expected = req_ss.str();
+  std::string req_buf;
+  req_buf.resize(req_expected.size());
+  mock_server_->ServerRead(socks[0], &req_buf);
+  LookupFileResp resp;
+  std::string serialized_resp;
+  resp.SerializeToString(&serialized_resp);
+  std::ostringstream resp_ss;
+  resp_ss << "HTTP/1.1 200 OK\r\n"
+          << "Content-Type: text/x-protocol-buffer\r\n"
+          << "Accept-Encoding: gzip\r\n"
+          << "Content-Length: " << serialized_resp.size() << "\r\n\r\n"
+          << serialized_resp;
+  mock_server_->ServerWrite(socks[0], resp_ss.str());
+
+  MockSocketFactory::SocketStatus socket_status;
+  std::unique_ptr<MockSocketFactory> socket_factory(
+      absl::make_unique<MockSocketFactory>(socks[1], &socket_status));
+
+  socket_factory->set_dest("goma.chromium.org:443");
+  socket_factory->set_host_name("goma.chromium.org");
+  socket_factory->set_port(443);
+  std::unique_ptr<FakeTLSEngineFactory> tls_engine_factory(
+      absl::make_unique<FakeTLSEngineFactory>());
+  HttpClient::Options options;
+  options.dest_host_name = "goma.chromium.org";
+  options.dest_port = 443;
+  options.use_ssl = true;
+  HttpClient http_client(std::move(socket_factory),
+                         std::move(tls_engine_factory),
+                         options, wm_.get());
+  HttpRPC::Options rpc_options;
+  rpc_options.content_type_for_protobuf = "binary/x-protocol-buffer";
+  rpc_options.start_compression = true;
+  rpc_options.compression_level = kCompressionLevel;
+  rpc_options.streaming_request = true;
+  rpc_options.accept_encoding = "gzip";
+  HttpRPC http_rpc(&http_client, rpc_options);
+  TestLookupFileContext tc(&http_rpc, nullptr);
+  RunTestLookupFile(&tc);
+  {
+    AutoLock lock(&mu_);
+    while (tc.state_ != TestLookupFileContext::DONE) {
+      cond_.Wait(&mu_);
+    }
+
+    EXPECT_EQ(req_expected, req_buf);
+    EXPECT_EQ(0, tc.r_);
+    EXPECT_TRUE(tc.status_.finished);
+    EXPECT_EQ(0, tc.status_.err);
+    EXPECT_EQ(200, tc.status_.http_return_code);
+    EXPECT_EQ(0U, tc.status_.raw_req_size);
+  }
+  http_client.WaitNoActive();
+  EXPECT_TRUE(socket_status.is_owned());
+  EXPECT_FALSE(socket_status.is_closed());
+  EXPECT_TRUE(socket_status.is_released());
+}
+
+#ifdef ENABLE_ZSTD
+TEST_F(HttpRPCTest, TLSEngineCallLookupFileZstd) {
+  int socks[2];
+  ASSERT_EQ(0, OpenSocketPairForTest(socks));
+  const int kCompressionLevel = 3;
+  LookupFileReq req;
+  std::string serialized_req;
+  SerializeZstdToString(req, kCompressionLevel, &serialized_req);
+  std::ostringstream req_ss;
+  req_ss << "POST /l HTTP/1.1\r\n"
+         << "Host: goma.chromium.org\r\n"
+         << "User-Agent: " << kUserAgentString << "\r\n"
+         << "Content-Type: binary/x-protocol-buffer\r\n"
+         << "Content-Length: " << serialized_req.size() << "\r\n"
+         << "Accept-Encoding: zstd\r\n"
+         << "Content-Encoding: zstd\r\n\r\n"
+         << serialized_req;
+
+  const std::string req_expected = req_ss.str();
+  std::string req_buf;
+  req_buf.resize(req_expected.size());
+  mock_server_->ServerRead(socks[0], &req_buf);
+  LookupFileResp resp;
+  FileBlob* blob = resp.add_blob();
+  blob->set_blob_type(FileBlob::FILE);
+  blob->set_content(std::string(10000, 'z'));
+  std::string serialized_resp;
+  SerializeZstdToString(resp, kCompressionLevel, &serialized_resp);
+  std::ostringstream resp_ss;
+  resp_ss << "HTTP/1.1 200 OK\r\n"
+          << "Content-Type: text/x-protocol-buffer\r\n"
+          << "Accept-Encoding: zstd\r\n"
+          << "Content-Encoding: zstd\r\n"
+          << "Content-Length: " << serialized_resp.size() << "\r\n\r\n"
+          << serialized_resp;
+  mock_server_->ServerWrite(socks[0], resp_ss.str());
+
+  MockSocketFactory::SocketStatus socket_status;
+  std::unique_ptr<MockSocketFactory> socket_factory(
+      absl::make_unique<MockSocketFactory>(socks[1], &socket_status));
+
+  socket_factory->set_dest("goma.chromium.org:443");
+  socket_factory->set_host_name("goma.chromium.org");
+  socket_factory->set_port(443);
+  std::unique_ptr<FakeTLSEngineFactory> tls_engine_factory(
+      absl::make_unique<FakeTLSEngineFactory>());
+  HttpClient::Options options;
+  options.dest_host_name = "goma.chromium.org";
+  options.dest_port = 443;
+  options.use_ssl = true;
+  HttpClient http_client(std::move(socket_factory),
+                         std::move(tls_engine_factory),
+                         options, wm_.get());
+  HttpRPC::Options rpc_options;
+  rpc_options.content_type_for_protobuf = "binary/x-protocol-buffer";
+  rpc_options.start_compression = true;
+  rpc_options.compression_level = kCompressionLevel;
+  rpc_options.accept_encoding = "zstd";
+  HttpRPC http_rpc(&http_client, rpc_options);
+  TestLookupFileContext tc(&http_rpc, nullptr);
+  RunTestLookupFile(&tc);
+  {
+    AutoLock lock(&mu_);
+    while (tc.state_ != TestLookupFileContext::DONE) {
+      cond_.Wait(&mu_);
+    }
+
+    EXPECT_EQ(req_expected, req_buf);
+    EXPECT_EQ(0, tc.r_);
+    EXPECT_TRUE(tc.status_.connect_success);
+    EXPECT_TRUE(tc.status_.finished);
+    EXPECT_EQ(0, tc.status_.err);
+    EXPECT_EQ("", tc.status_.err_message);
+    EXPECT_EQ(200, tc.status_.http_return_code);
+    ASSERT_EQ(1, tc.resp_.blob_size());
+    EXPECT_EQ(std::string(10000, 'z'), tc.resp_.blob(0).content());
+  }
+  http_client.WaitNoActive();
+  EXPECT_TRUE(socket_status.is_owned());
+  EXPECT_FALSE(socket_status.is_closed());
+  EXPECT_TRUE(socket_status.is_released());
+}
+#endif  // ENABLE_ZSTD
+
 TEST_F(HttpRPCTest, TLSEngineCallAsyncLookupFile) {
   int socks[2];
   ASSERT_EQ(0, OpenSocketPairForTest(socks));
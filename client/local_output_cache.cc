@@ -28,18 +28,21 @@
 //
 // * Cache Directory Structure
 //
-// proto_file = <cache dir>/<first 2 chars of key>/<key>
+// entry_file = <cache dir>/<first 2 chars of key>/<key>
 //   <key> is always hex notation of SHA256.
+//   See local_output_cache_entry.h for the file format.
+// blob_file = <cache dir>/<first 2 chars of key>/<key>.<index>
+//   Only when commit mode is reflink or hardlink.
 
 #include "local_output_cache.h"
 
-#include <stdio.h>  // For rename
-
 #include <algorithm>
-#include <fstream>
 #include <memory>
 #include <vector>
 
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
 #include "absl/time/clock.h"
 #include "callback.h"
 #include "compiler_flag_type_specific.h"
@@ -81,6 +84,45 @@ bool DeleteFile(const char* path) {
 #endif
 }
 
+// Parses blob filename "<key>.<index>".
+bool ParseBlobFilename(absl::string_view name,
+                       absl::string_view* key,
+                       int* index) {
+  size_t pos = name.find('.');
+  if (pos == absl::string_view::npos) {
+    return false;
+  }
+  absl::string_view index_str = name.substr(pos + 1);
+  if (index_str.empty() || !absl::SimpleAtoi(index_str, index) || *index < 0) {
+    return false;
+  }
+  *key = name.substr(0, pos);
+  return true;
+}
+
+// Serializes |req| normalized for cache key into |serialized|.
+bool SerializeForCacheKey(const devtools_goma::ExecReq& req,
+                          std::string* serialized) {
+  devtools_goma::ExecReq normalized(req);
+
+  // Use the goma server default.
+  const std::vector<std::string> flags{"Xclang", "B", "gcc-toolchain",
+                                       "-sysroot", "resource-dir"};
+
+  // TODO: Set debug_prefix_map, too?
+  devtools_goma::CompilerFlagTypeSpecific::FromArg(req.command_spec().name())
+      .NewExecReqNormalizer()
+      ->NormalizeForCacheKey(0, true, false, flags,
+                             std::map<std::string, std::string>(), &normalized);
+
+  if (!normalized.SerializeToString(serialized)) {
+    LOG(ERROR) << "failed to make cache key: "
+               << normalized.DebugString();
+    return false;
+  }
+  return true;
+}
+
 }  // anonymous namespace
 
 namespace devtools_goma {
@@ -91,12 +133,14 @@ LocalOutputCache::LocalOutputCache(std::string cache_dir,
                                    std::int64_t max_cache_amount_byte,
                                    std::int64_t threshold_cache_amount_byte,
                                    size_t max_cache_items,
-                                   size_t threshold_cache_items)
+                                   size_t threshold_cache_items,
+                                   LocalOutputCacheCommitMode commit_mode)
     : cache_dir_(std::move(cache_dir)),
       max_cache_amount_byte_(max_cache_amount_byte),
       threshold_cache_amount_byte_(threshold_cache_amount_byte),
       max_cache_items_(max_cache_items),
       threshold_cache_items_(threshold_cache_items),
+      commit_mode_(commit_mode),
       ready_(false),
       entries_total_cache_amount_(0),
       gc_should_done_(false),
@@ -111,7 +155,8 @@ void LocalOutputCache::Init(std::string cache_dir,
                             int max_cache_amount_in_mb,
                             int threshold_cache_amount_in_mb,
                             size_t max_cache_items,
-                            size_t threshold_cache_items) {
+                            size_t threshold_cache_items,
+                            LocalOutputCacheCommitMode commit_mode) {
   CHECK(instance_ == nullptr);
   if (cache_dir.empty()) {
     return;
@@ -132,7 +177,8 @@ void LocalOutputCache::Init(std::string cache_dir,
                                    max_cache_amount_byte,
                                    threshold_cache_amount_byte,
                                    max_cache_items,
-                                   threshold_cache_items);
+                                   threshold_cache_items,
+                                   commit_mode);
   if (wm != nullptr) {
     // Loading cache entries can take long time. Don't block here.
     // When blocked, compiler_proxy start might be failed due to timeout.
@@ -181,6 +227,13 @@ void LocalOutputCache::LoadCacheEntries() {
 
   std::vector<std::pair<SHA256HashValue, CacheEntry>> cache_entries;
 
+  struct BlobFiles {
+    std::int64_t amount_byte = 0;
+    int num_blobs = 0;
+    std::vector<std::string> paths;
+  };
+  absl::flat_hash_map<SHA256HashValue, BlobFiles> blob_files;
+
   std::vector<DirEntry> key_prefix_entries;
   {
     SimpleTimer timer(SimpleTimer::START);
@@ -238,7 +291,22 @@ void LocalOutputCache::LoadCacheEntries() {
         continue;
       }
 
+      absl::string_view blob_key;
+      int blob_index = 0;
       SHA256HashValue key;
+      if (ParseBlobFilename(key_entry.name, &blob_key, &blob_index) &&
+          SHA256HashValue::ConvertFromHexString(std::string(blob_key), &key)) {
+        FileStat file_stat(cache_file_path);
+        if (!file_stat.IsValid()) {
+          continue;
+        }
+        BlobFiles* blobs = &blob_files[key];
+        blobs->amount_byte += file_stat.size;
+        blobs->num_blobs = std::max(blobs->num_blobs, blob_index + 1);
+        blobs->paths.push_back(std::move(cache_file_path));
+        continue;
+      }
+
       if (!SHA256HashValue::ConvertFromHexString(key_entry.name, &key)) {
         LOG(WARNING) << "Invalid filename found. remove: filename="
                      << cache_file_path;
@@ -267,7 +335,27 @@ void LocalOutputCache::LoadCacheEntries() {
 
       total_file_size += file_stat.size;
       cache_entries.emplace_back(
-          key, CacheEntry(*file_stat.mtime, file_stat.size));
+          key, CacheEntry(*file_stat.mtime, file_stat.size, 0));
+    }
+  }
+
+  for (auto& entry : cache_entries) {
+    auto found = blob_files.find(entry.first);
+    if (found == blob_files.end()) {
+      continue;
+    }
+    entry.second.amount_byte += found->second.amount_byte;
+    entry.second.num_blobs = found->second.num_blobs;
+    total_file_size += found->second.amount_byte;
+    blob_files.erase(found);
+  }
+  // Blob files without entry are left by interrupted SaveOutput or GC.
+  for (const auto& blobs : blob_files) {
+    for (const auto& path : blobs.second.paths) {
+      LOG(INFO) << "orphan blob found. remove: " << path;
+      if (!DeleteFile(path.c_str())) {
+        LOG(ERROR) << "failed to remove: " << path;
+      }
     }
   }
 
@@ -315,12 +403,13 @@ void LocalOutputCache::WaitUntilReady() {
 }
 
 void LocalOutputCache::AddCacheEntry(const SHA256HashValue& key,
-                                     std::int64_t cache_size) {
+                                     std::int64_t cache_size,
+                                     int num_blobs) {
   const absl::Time cache_mtime = absl::Now();
   bool needs_wake_gc_thread = false;
   {
     AUTO_EXCLUSIVE_LOCK(lock, &entries_mu_);
-    entries_.emplace_back(key, CacheEntry(cache_mtime, cache_size));
+    entries_.emplace_back(key, CacheEntry(cache_mtime, cache_size, num_blobs));
     entries_total_cache_amount_ += cache_size;
 
     if (ShouldInvokeGarbageCollectionUnlocked()) {
@@ -463,6 +552,15 @@ void LocalOutputCache::RunGarbageCollection(GarbageCollectionStat* stat) {
       LOG(ERROR) << "failed to remove cache: path=" << cache_file_path;
       break;
     }
+    // Outputs hard linked to blobs are kept even if blobs are removed.
+    // Remaining blobs will be removed in next LoadCacheEntries.
+    for (int i = 0; i < entry.num_blobs; ++i) {
+      const std::string blob_path =
+          LocalOutputCacheEntryReader::BlobPath(cache_file_path, i);
+      if (!DeleteFile(blob_path.c_str())) {
+        LOG(WARNING) << "failed to remove blob: path=" << blob_path;
+      }
+    }
 
     stat->num_removed += 1;
     stat->removed_bytes += entry.amount_byte;
@@ -511,7 +609,7 @@ bool LocalOutputCache::SaveOutput(const std::string& key,
   }
 
   // --- Make cache_entry.
-  LocalOutputCacheEntry cache_entry;
+  LocalOutputCacheEntryWriter cache_entry;
   const ExecResult& result = resp->result();
   for (const auto& output : result.output()) {
     std::string src_path =
@@ -527,48 +625,27 @@ bool LocalOutputCache::SaveOutput(const std::string& key,
       return false;
     }
 
-    LocalOutputCacheFile* cache_file = cache_entry.add_files();
-    cache_file->set_filename(output.filename());
-    cache_file->set_content(std::move(output_file_content));
-    cache_file->set_is_executable(output.is_executable());
+    if (commit_mode_ == LocalOutputCacheCommitMode::kCopy) {
+      cache_entry.AddFile(output.filename(), output.is_executable(),
+                          std::move(output_file_content));
+    } else {
+      cache_entry.AddBlobFile(output.filename(), output.is_executable(),
+                              std::move(output_file_content),
+                              std::move(src_path));
+    }
   }
 
-  // --- Serialize LocalOutputCacheEntry to a file.
-  // When compiler_proxy is killed during writing a file, the file will be
-  // invalid but it might be a valid proto (when we're unlucky).
-  // So, we serialize a data to a tmp file, and rename it.
-  // We should be able to expect this is atomic.
+  // --- Write cache_entry to a file.
   std::int64_t cache_amount_in_byte = 0;
-  {
-    std::string cache_file_path = CacheFilePath(key);
-    std::string cache_file_tmp_path = cache_file_path + ".tmp";
-
-    std::string serialized;
-    if (!cache_entry.SerializeToString(&serialized)) {
-      LOG(ERROR) << trace_id << " failed to serialize LocalOutputCacheEntry: "
-                 << " path=" << cache_file_path;
-      return false;
-    }
-    if (!WriteStringToFile(serialized, cache_file_tmp_path)) {
-      stats_save_failure_.Add(1);
-      LOG(ERROR) << trace_id << " failed to write LocalOutputCacheEntry:"
-                 << " path=" << cache_file_path;
-      return false;
-    }
-
-    int r = rename(cache_file_tmp_path.c_str(), cache_file_path.c_str());
-    if (r < 0) {
-      LOG(ERROR) << trace_id << " failed to rename LocalOutputCacheEntry:"
-                 << " path=" << cache_file_path
-                 << " result=" << r;
-      (void)DeleteFile(cache_file_path.c_str());
-      return false;
-    }
-
-    cache_amount_in_byte = serialized.size();
+  const std::string cache_file_path = CacheFilePath(key);
+  if (!cache_entry.WriteToFile(cache_file_path, &cache_amount_in_byte)) {
+    stats_save_failure_.Add(1);
+    LOG(ERROR) << trace_id << " failed to write LocalOutputCacheEntry:"
+               << " path=" << cache_file_path;
+    return false;
   }
 
-  AddCacheEntry(key_hash, cache_amount_in_byte);
+  AddCacheEntry(key_hash, cache_amount_in_byte, cache_entry.num_blobs());
 
   stats_save_success_.Add(1);
   stats_save_success_time_ms_.Add(
@@ -582,54 +659,67 @@ bool LocalOutputCache::Lookup(const std::string& key,
   WaitUntilReady();
   SimpleTimer timer(SimpleTimer::START);
 
-  SHA256HashValue key_hash;
-  if (!SHA256HashValue::ConvertFromHexString(key, &key_hash)) {
-    LOG(DFATAL) << "unexpected key format: key=" << key;
+  std::unique_ptr<LocalOutputCacheEntryReader> cache_entry =
+      OpenEntry(key, trace_id);
+  if (cache_entry == nullptr) {
     return false;
   }
 
-  // Check cache entry first.
-  {
-    AUTO_SHARED_LOCK(lock, &entries_mu_);
-    if (!entries_.contains(key_hash)) {
-      stats_lookup_miss_.Add(1);
+  // Create dummy ExecResp from LocalOutputCacheEntry.
+  resp->set_cache_hit(ExecResp::LOCAL_OUTPUT_CACHE);
+  ExecResult* result = resp->mutable_result();
+  result->set_exit_status(0);
+  for (const auto& file : cache_entry->files()) {
+    ExecResult_Output* output = result->add_output();
+    output->set_filename(std::string(file.filename));
+    output->set_is_executable(file.is_executable);
+    FileBlob* blob = output->mutable_blob();
+    blob->set_blob_type(FileBlob::FILE);  // Always FILE.
+    blob->set_file_size(file.size);
+    if (!file.has_blob) {
+      blob->set_content(std::string(file.content));
+    } else if (!cache_entry->ReadContent(file, blob->mutable_content())) {
+      stats_lookup_failure_.Add(1);
+      LOG(ERROR) << trace_id << " failed to read blob of cache entry:"
+                 << " key=" << key << " filename=" << file.filename;
       return false;
     }
   }
 
-  const std::string cache_file_path = CacheFilePath(key);
+  stats_lookup_success_.Add(1);
+  stats_lookup_success_time_ms_.Add(
+      absl::ToInt64Milliseconds(timer.GetDuration()));
+  return true;
+}
 
-  // Read file.
-  // If GC happened after entries_find(), this file might be lost.
-  std::ifstream ifs(cache_file_path, std::ifstream::binary);
-  if (!ifs.is_open()) {
-    stats_lookup_miss_.Add(1);
-    return false;
-  }
+bool LocalOutputCache::LookupEntry(
+    const std::string& key,
+    ExecResp* resp,
+    std::shared_ptr<const LocalOutputCacheEntryReader>* entry,
+    const std::string& trace_id) {
+  WaitUntilReady();
+  SimpleTimer timer(SimpleTimer::START);
 
-  LocalOutputCacheEntry cache_entry;
-  if (!cache_entry.ParseFromIstream(&ifs)) {
-    LOG(ERROR) << trace_id << " LocalOutputCache: failed to parse:"
-               << " path=" << cache_file_path;
-    stats_lookup_failure_.Add(1);
+  std::unique_ptr<LocalOutputCacheEntryReader> cache_entry =
+      OpenEntry(key, trace_id);
+  if (cache_entry == nullptr) {
     return false;
   }
 
-  UpdateCacheEntry(key_hash);
-
-  // Create dummy ExecResp from LocalOutputCacheEntry.
+  // Create dummy ExecResp without content.
+  // Contents will be written from |entry| directly.
   resp->set_cache_hit(ExecResp::LOCAL_OUTPUT_CACHE);
   ExecResult* result = resp->mutable_result();
   result->set_exit_status(0);
-  for (auto&& file : cache_entry.files()) {
+  for (const auto& file : cache_entry->files()) {
     ExecResult_Output* output = result->add_output();
-    output->set_filename(file.filename());
-    output->set_is_executable(file.is_executable());
+    output->set_filename(std::string(file.filename));
+    output->set_is_executable(file.is_executable);
     FileBlob* blob = output->mutable_blob();
     blob->set_blob_type(FileBlob::FILE);  // Always FILE.
-    blob->set_file_size(file.content().size());
-    blob->set_content(std::move(file.content()));
+    blob->set_file_size(file.size);
   }
+  *entry = std::move(cache_entry);
 
   stats_lookup_success_.Add(1);
   stats_lookup_success_time_ms_.Add(
@@ -637,6 +727,46 @@ bool LocalOutputCache::Lookup(const std::string& key,
   return true;
 }
 
+std::unique_ptr<LocalOutputCacheEntryReader> LocalOutputCache::OpenEntry(
+    const std::string& key,
+    const std::string& trace_id) {
+  SHA256HashValue key_hash;
+  if (!SHA256HashValue::ConvertFromHexString(key, &key_hash)) {
+    LOG(DFATAL) << "unexpected key format: key=" << key;
+    return nullptr;
+  }
+
+  // Check cache entry first.
+  {
+    AUTO_SHARED_LOCK(lock, &entries_mu_);
+    if (!entries_.contains(key_hash)) {
+      stats_lookup_miss_.Add(1);
+      return nullptr;
+    }
+  }
+
+  const std::string cache_file_path = CacheFilePath(key);
+
+  // If GC happened after entries_find(), this file might be lost.
+  // Once the file is opened (and mmapped), its content is kept even if GC
+  // removes the file.
+  if (!FileStat(cache_file_path).IsValid()) {
+    stats_lookup_miss_.Add(1);
+    return nullptr;
+  }
+  std::unique_ptr<LocalOutputCacheEntryReader> cache_entry =
+      LocalOutputCacheEntryReader::Open(cache_file_path);
+  if (cache_entry == nullptr) {
+    LOG(ERROR) << trace_id << " LocalOutputCache: failed to parse:"
+               << " path=" << cache_file_path;
+    stats_lookup_failure_.Add(1);
+    return nullptr;
+  }
+
+  UpdateCacheEntry(key_hash);
+  return cache_entry;
+}
+
 std::string LocalOutputCache::CacheDirWithKeyPrefix(
     absl::string_view key) const {
   return file::JoinPath(cache_dir_, key.substr(0, 2));
@@ -646,6 +776,28 @@ std::string LocalOutputCache::CacheFilePath(absl::string_view key) const {
   return file::JoinPath(cache_dir_, key.substr(0, 2), key);
 }
 
+void LocalOutputCache::RecordCommit(bool success,
+                                    LocalOutputCacheCommitMode method,
+                                    absl::Duration duration) {
+  if (!success) {
+    stats_commit_failure_.Add(1);
+    return;
+  }
+  stats_commit_success_.Add(1);
+  stats_commit_success_time_ms_.Add(absl::ToInt64Milliseconds(duration));
+  switch (method) {
+    case LocalOutputCacheCommitMode::kCopy:
+      stats_commit_copy_.Add(1);
+      break;
+    case LocalOutputCacheCommitMode::kReflink:
+      stats_commit_reflink_.Add(1);
+      break;
+    case LocalOutputCacheCommitMode::kHardlink:
+      stats_commit_hardlink_.Add(1);
+      break;
+  }
+}
+
 void LocalOutputCache::DumpStatsToProto(LocalOutputCacheStats* stats) {
   stats->set_save_success(stats_save_success_.value());
   stats->set_save_success_time_ms(stats_save_success_time_ms_.value());
@@ -656,9 +808,15 @@ void LocalOutputCache::DumpStatsToProto(LocalOutputCacheStats* stats) {
   stats->set_lookup_miss(stats_lookup_miss_.value());
   stats->set_lookup_failure(stats_lookup_failure_.value());
 
+  stats->set_pre_key_lookup_success(stats_pre_key_lookup_success_.value());
+  stats->set_pre_key_lookup_miss(stats_pre_key_lookup_miss_.value());
+
   stats->set_commit_success(stats_commit_success_.value());
   stats->set_commit_success_time_ms(stats_commit_success_time_ms_.value());
   stats->set_commit_failure(stats_commit_failure_.value());
+  stats->set_commit_hardlink(stats_commit_hardlink_.value());
+  stats->set_commit_reflink(stats_commit_reflink_.value());
+  stats->set_commit_copy(stats_commit_copy_.value());
 
   stats->set_gc_count(stats_gc_count_.value());
   stats->set_gc_total_time_ms(stats_gc_total_time_ms_.value());
@@ -676,28 +834,90 @@ std::int64_t LocalOutputCache::TotalCacheAmountInByte() {
 
 // static
 std::string LocalOutputCache::MakeCacheKey(const ExecReq& req) {
-  ExecReq normalized(req);
+  std::string serialized;
+  if (!SerializeForCacheKey(req, &serialized)) {
+    return std::string();
+  }
 
-  // Use the goma server default.
-  const std::vector<std::string> flags{"Xclang", "B", "gcc-toolchain",
-                                       "-sysroot", "resource-dir"};
+  std::string digest;
+  ComputeDataHashKey(serialized, &digest);
+  return digest;
+}
 
-  // TODO: Set debug_prefix_map, too?
-  CompilerFlagTypeSpecific::FromArg(req.command_spec().name())
-      .NewExecReqNormalizer()
-      ->NormalizeForCacheKey(0, true, false, flags,
-                             std::map<std::string, std::string>(), &normalized);
+// static
+std::string LocalOutputCache::MakePreCacheKey(
+    const ExecReq& req,
+    std::vector<std::pair<std::string, FileStat>> inputs) {
+  ExecReq req_without_input(req);
+  req_without_input.clear_input();
 
   std::string serialized;
-  if (!normalized.SerializeToString(&serialized)) {
-    LOG(ERROR) << "failed to make cache key: "
-               << normalized.DebugString();
+  if (!SerializeForCacheKey(req_without_input, &serialized)) {
     return std::string();
   }
 
+  std::sort(inputs.begin(), inputs.end(),
+            [](const std::pair<std::string, FileStat>& lhs,
+               const std::pair<std::string, FileStat>& rhs) {
+              return lhs.first < rhs.first;
+            });
+  for (const auto& input : inputs) {
+    const FileStat& file_stat = input.second;
+    // A file modified in the same mtime resolution cannot be distinguished
+    // by FileStat, so the key must not be cached.
+    if (!file_stat.IsValid() || file_stat.CanBeStale()) {
+      VLOG(1) << "cannot make pre cache key: filename=" << input.first
+              << " file_stat=" << file_stat;
+      return std::string();
+    }
+    absl::StrAppend(&serialized, "\n", input.first,
+                    ":", file_stat.size,
+                    ":", absl::ToUnixNanos(*file_stat.mtime));
+  }
+
   std::string digest;
   ComputeDataHashKey(serialized, &digest);
   return digest;
 }
 
+void LocalOutputCache::AddPreCacheKey(const std::string& pre_key,
+                                      const std::string& key) {
+  DCHECK(!pre_key.empty());
+  DCHECK(!key.empty());
+  AUTOLOCK(lock, &pre_keys_mu_);
+  pre_keys_.emplace_back(pre_key, key);
+  while (pre_keys_.size() > max_cache_items_) {
+    pre_keys_.pop_front();
+  }
+}
+
+bool LocalOutputCache::LookupEntryByPreKey(
+    const std::string& pre_key,
+    std::string* key,
+    ExecResp* resp,
+    std::shared_ptr<const LocalOutputCacheEntryReader>* entry,
+    const std::string& trace_id) {
+  std::string found_key;
+  {
+    AUTOLOCK(lock, &pre_keys_mu_);
+    auto it = pre_keys_.find(pre_key);
+    if (it == pre_keys_.end()) {
+      stats_pre_key_lookup_miss_.Add(1);
+      return false;
+    }
+    pre_keys_.MoveToBack(it);
+    found_key = it->second;
+  }
+
+  // The entry might have been removed by GC. Then the stale mapping is
+  // dropped eventually by newer mappings.
+  if (!LookupEntry(found_key, resp, entry, trace_id)) {
+    stats_pre_key_lookup_miss_.Add(1);
+    return false;
+  }
+  stats_pre_key_lookup_success_.Add(1);
+  *key = std::move(found_key);
+  return true;
+}
+
 } // namespace devtools_goma
@@ -7,15 +7,20 @@
 #define DEVTOOLS_GOMA_CLIENT_LOCAL_OUTPUT_CACHE_H_
 
 #include <cstdint>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "absl/strings/string_view.h"
 #include "absl/time/time.h"
 #include "atomic_stats_counter.h"
 #include "autolock_timer.h"
 #include "compiler_specific.h"
+#include "file_stat.h"
 #include "goma_hash.h"
 #include "linked_unordered_map.h"
+#include "local_output_cache_entry.h"
 #include "worker_thread_manager.h"
 
 MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
@@ -46,7 +51,8 @@ class LocalOutputCache {
                    int max_cache_amount_in_mb,
                    int threshold_cache_amount_in_mb,
                    size_t max_cache_items,
-                   size_t threshold_cache_items);
+                   size_t threshold_cache_items,
+                   LocalOutputCacheCommitMode commit_mode);
   static void Quit();
 
   LocalOutputCache(const LocalOutputCache&) = delete;
@@ -57,6 +63,22 @@ class LocalOutputCache {
   // Creates cache key from |req|.
   static std::string MakeCacheKey(const ExecReq& req);
 
+  // Creates pre cache key from |req| without inputs and |inputs|, which
+  // are pairs of absolute input filename and its FileStat.
+  // Unlike MakeCacheKey(), this doesn't need the content hash of inputs,
+  // so it can be computed before input files are hashed or uploaded.
+  // Returns empty string if any of |inputs| has invalid or possibly stale
+  // FileStat.
+  static std::string MakePreCacheKey(
+      const ExecReq& req,
+      std::vector<std::pair<std::string, FileStat>> inputs);
+
+  // Remembers that cache |key| is for |pre_key|.
+  // The mapping is kept in memory only, and older mappings are dropped
+  // when the number of mappings exceeds max cache items.
+  void AddPreCacheKey(const std::string& pre_key, const std::string& key)
+      LOCKS_EXCLUDED(pre_keys_mu_);
+
   // SaveOutput copies output files to cache.
   // |trace_id| is just used for logging.
   bool SaveOutput(const std::string& key,
@@ -73,6 +95,32 @@ class LocalOutputCache {
               ExecResp* resp,
               const std::string& trace_id);
 
+  // Finds cache with |key| like Lookup(), but does not copy output
+  // contents into |resp|. |resp| will have output filenames and sizes only,
+  // and the contents are available in |entry|, which is mmapped if possible.
+  // Use LocalOutputCacheBlobDownloader to write outputs from |entry|.
+  bool LookupEntry(const std::string& key,
+                   ExecResp* resp,
+                   std::shared_ptr<const LocalOutputCacheEntryReader>* entry,
+                   const std::string& trace_id);
+
+  // Finds cache with |pre_key| like LookupEntry().
+  // On success, |key| will be the cache key for |pre_key|.
+  bool LookupEntryByPreKey(
+      const std::string& pre_key,
+      std::string* key,
+      ExecResp* resp,
+      std::shared_ptr<const LocalOutputCacheEntryReader>* entry,
+      const std::string& trace_id) LOCKS_EXCLUDED(pre_keys_mu_);
+
+  // Records a result of committing an output from cache entry.
+  // |method| is how the output was materialized.
+  void RecordCommit(bool success,
+                    LocalOutputCacheCommitMode method,
+                    absl::Duration duration);
+
+  LocalOutputCacheCommitMode commit_mode() const { return commit_mode_; }
+
   // Dumps stats.
   void DumpStatsToProto(LocalOutputCacheStats* stats);
 
@@ -86,20 +134,26 @@ class LocalOutputCache {
 
  private:
   struct CacheEntry {
-    CacheEntry() : amount_byte(0) {}
-    CacheEntry(absl::Time mtime, std::int64_t amount_byte)
-        : mtime(mtime), amount_byte(amount_byte) {}
+    CacheEntry() : amount_byte(0), num_blobs(0) {}
+    CacheEntry(absl::Time mtime, std::int64_t amount_byte, int num_blobs)
+        : mtime(mtime), amount_byte(amount_byte), num_blobs(num_blobs) {}
     ~CacheEntry() {}
 
     absl::Time mtime;
+    // Including blob files.
     std::int64_t amount_byte;
+    // The number of blob files. Blob files are
+    // LocalOutputCacheEntryReader::BlobPath(CacheFilePath(key), i)
+    // for i in [0, num_blobs).
+    int num_blobs;
   };
 
   LocalOutputCache(std::string cache_dir,
                    std::int64_t max_cache_amount_byte,
                    std::int64_t threashold_cache_amount_byte,
                    size_t max_cache_items,
-                   size_t threshold_cache_items);
+                   size_t threshold_cache_items,
+                   LocalOutputCacheCommitMode commit_mode);
   ~LocalOutputCache();
 
   // load cache entries.
@@ -110,7 +164,8 @@ class LocalOutputCache {
   void WaitUntilReady();
 
   void AddCacheEntry(const SHA256HashValue& key,
-                     std::int64_t cache_amount_in_byte);
+                     std::int64_t cache_amount_in_byte,
+                     int num_blobs);
   // A cache entry is updated, so move it to last.
   void UpdateCacheEntry(const SHA256HashValue& key);
 
@@ -129,6 +184,11 @@ class LocalOutputCache {
   void WakeGCThread() LOCKS_EXCLUDED(entries_mu_);
   void WaitUntilGarbageCollectionThreadDone() LOCKS_EXCLUDED(entries_mu_);
 
+  // Opens cache entry for |key|. Returns nullptr on miss or failure.
+  std::unique_ptr<LocalOutputCacheEntryReader> OpenEntry(
+      const std::string& key,
+      const std::string& trace_id);
+
   // Used only for test.
   void SetReady(bool ready);
 
@@ -145,6 +205,7 @@ class LocalOutputCache {
   const std::int64_t threshold_cache_amount_byte_;
   const size_t max_cache_items_;
   const size_t threshold_cache_items_;
+  const LocalOutputCacheCommitMode commit_mode_;
 
   // Using in initial load of cache entries.
   // After loading all cache entries, |ready_| will become true.
@@ -159,6 +220,11 @@ class LocalOutputCache {
   // total cache amount in bytes.
   std::int64_t entries_total_cache_amount_ GUARDED_BY(entries_mu_);
 
+  // pre cache key to cache key. Older mapping is first.
+  mutable Lock pre_keys_mu_;
+  LinkedUnorderedMap<std::string, std::string> pre_keys_
+      GUARDED_BY(pre_keys_mu_);
+
   mutable Lock gc_mu_;
   ConditionVariable gc_cond_;
   bool gc_should_done_ GUARDED_BY(gc_mu_);
@@ -173,9 +239,15 @@ class LocalOutputCache {
   StatsCounter stats_lookup_miss_;
   StatsCounter stats_lookup_failure_;
 
+  StatsCounter stats_pre_key_lookup_success_;
+  StatsCounter stats_pre_key_lookup_miss_;
+
   StatsCounter stats_commit_success_;
   StatsCounter stats_commit_success_time_ms_;
   StatsCounter stats_commit_failure_;
+  StatsCounter stats_commit_hardlink_;
+  StatsCounter stats_commit_reflink_;
+  StatsCounter stats_commit_copy_;
 
   StatsCounter stats_gc_count_;
   StatsCounter stats_gc_total_time_ms_;
@@ -0,0 +1,687 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "local_output_cache_entry.h"
+
+#include <stdio.h>  // For rename
+
+#include <algorithm>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "file_helper.h"
+#include "file_stat.h"
+#include "glog/logging.h"
+#include "goma_data_util.h"
+#include "scoped_fd.h"
+
+MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
+#include "prototmp/goma_data.pb.h"
+MSVC_POP_WARNING()
+
+namespace devtools_goma {
+
+namespace {
+
+// 'G' (0x47) is not a valid first byte of serialized LocalOutputCacheEntry
+// (wire type 7 is invalid), so the magic never conflicts with legacy entries.
+constexpr absl::string_view kMagic("GOMALOC1", 8);
+constexpr size_t kHeaderSize = 8 + 4 + 4;
+constexpr size_t kIndexFixedSize = 8 + 8 + 4 + 4 + 4;
+constexpr std::uint32_t kFlagExecutable = 1;
+constexpr std::uint32_t kFlagBlob = 2;
+
+void AppendUint32(std::uint32_t v, std::string* out) {
+  for (int i = 0; i < 4; ++i) {
+    out->push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+  }
+}
+
+void AppendUint64(std::uint64_t v, std::string* out) {
+  for (int i = 0; i < 8; ++i) {
+    out->push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+  }
+}
+
+// Consumes little endian integer from |*data|.
+// Returns false if |*data| is too short.
+template <typename T>
+bool ConsumeUint(absl::string_view* data, T* v) {
+  if (data->size() < sizeof(T)) {
+    return false;
+  }
+  T r = 0;
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    r |= static_cast<T>(static_cast<unsigned char>((*data)[i])) << (8 * i);
+  }
+  data->remove_prefix(sizeof(T));
+  *v = r;
+  return true;
+}
+
+bool ConsumeBytes(absl::string_view* data,
+                  size_t size,
+                  absl::string_view* bytes) {
+  if (data->size() < size) {
+    return false;
+  }
+  *bytes = data->substr(0, size);
+  data->remove_prefix(size);
+  return true;
+}
+
+bool WriteAll(const ScopedFd& fd, absl::string_view data) {
+  while (!data.empty()) {
+    ssize_t n = fd.Write(data.data(), data.size());
+    if (n <= 0) {
+      return false;
+    }
+    data.remove_prefix(n);
+  }
+  return true;
+}
+
+// Renames |tmp_path| to |path|. |tmp_path| is removed on failure.
+bool RenameTmpFile(const std::string& tmp_path, const std::string& path) {
+#ifdef _WIN32
+  remove(path.c_str());
+#endif
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    PLOG(ERROR) << "failed to rename " << tmp_path << " to " << path;
+    remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Clones |src| to |dst| by reflink. Returns false if the filesystem
+// does not support it.
+bool CloneFile(const ScopedFd& src, const ScopedFd& dst) {
+#if defined(__linux__) && defined(FICLONE)
+  return ioctl(dst.fd(), FICLONE, src.fd()) == 0;
+#else
+  // TODO: support clonefile on mac.
+  (void)src;
+  (void)dst;
+  return false;
+#endif
+}
+
+#ifndef _WIN32
+// Copies |size| bytes of |src| to |dst|.
+bool CopyFileContent(const ScopedFd& src, const ScopedFd& dst,
+                     std::uint64_t size) {
+  std::string buf(std::min<std::uint64_t>(size, 1 << 20), '\0');
+  std::uint64_t offset = 0;
+  while (offset < size) {
+    ssize_t n = pread(src.fd(), &buf[0],
+                      std::min<std::uint64_t>(buf.size(), size - offset),
+                      offset);
+    if (n <= 0) {
+      return false;
+    }
+    if (!WriteAll(dst, absl::string_view(buf.data(), n))) {
+      return false;
+    }
+    offset += n;
+  }
+  return true;
+}
+#endif
+
+}  // anonymous namespace
+
+bool ParseLocalOutputCacheCommitMode(absl::string_view name,
+                                     LocalOutputCacheCommitMode* mode) {
+  if (name.empty() || name == "copy") {
+    *mode = LocalOutputCacheCommitMode::kCopy;
+    return true;
+  }
+  if (name == "reflink") {
+    *mode = LocalOutputCacheCommitMode::kReflink;
+    return true;
+  }
+  if (name == "hardlink") {
+    *mode = LocalOutputCacheCommitMode::kHardlink;
+    return true;
+  }
+  return false;
+}
+
+void LocalOutputCacheEntryWriter::AddFile(std::string filename,
+                                          bool is_executable,
+                                          std::string content) {
+  AddFileInternal(std::move(filename), is_executable, std::move(content),
+                  false, std::string());
+}
+
+void LocalOutputCacheEntryWriter::AddBlobFile(std::string filename,
+                                              bool is_executable,
+                                              std::string content,
+                                              std::string src_path) {
+  AddFileInternal(std::move(filename), is_executable, std::move(content),
+                  true, std::move(src_path));
+}
+
+void LocalOutputCacheEntryWriter::AddFileInternal(std::string filename,
+                                                  bool is_executable,
+                                                  std::string content,
+                                                  bool is_blob,
+                                                  std::string src_path) {
+  // Compute the same hash key as OutputFileTask does for FileBlob
+  // in ExecResp, without copying the content.
+  FileBlob blob;
+  blob.set_blob_type(FileBlob::FILE);
+  blob.set_file_size(content.size());
+  blob.mutable_content()->swap(content);
+
+  File file;
+  file.filename = std::move(filename);
+  file.is_executable = is_executable;
+  file.hash_key = ComputeFileBlobHashKey(blob);
+  file.content.swap(*blob.mutable_content());
+  file.is_blob = is_blob;
+  file.src_path = std::move(src_path);
+  files_.push_back(std::move(file));
+}
+
+int LocalOutputCacheEntryWriter::num_blobs() const {
+  int n = 0;
+  for (const auto& file : files_) {
+    if (file.is_blob) {
+      ++n;
+    }
+  }
+  return n;
+}
+
+std::string LocalOutputCacheEntryWriter::SerializeHeader() const {
+  size_t index_size = 0;
+  for (const auto& file : files_) {
+    index_size +=
+        kIndexFixedSize + file.filename.size() + file.hash_key.size();
+  }
+
+  std::string header;
+  header.reserve(kHeaderSize + index_size);
+  header.append(kMagic.data(), kMagic.size());
+  AppendUint32(files_.size(), &header);
+  AppendUint32(index_size, &header);
+
+  std::uint64_t offset = kHeaderSize + index_size;
+  for (const auto& file : files_) {
+    const bool has_blob = file.is_blob;
+    std::uint32_t flags = 0;
+    if (file.is_executable) {
+      flags |= kFlagExecutable;
+    }
+    if (has_blob) {
+      flags |= kFlagBlob;
+    }
+    AppendUint64(has_blob ? 0 : offset, &header);
+    AppendUint64(file.content.size(), &header);
+    AppendUint32(flags, &header);
+    AppendUint32(file.filename.size(), &header);
+    AppendUint32(file.hash_key.size(), &header);
+    header.append(file.filename);
+    header.append(file.hash_key);
+    if (!has_blob) {
+      offset += file.content.size();
+    }
+  }
+  DCHECK_EQ(kHeaderSize + index_size, header.size());
+  return header;
+}
+
+bool LocalOutputCacheEntryWriter::WriteToFile(
+    const std::string& path,
+    std::int64_t* written_bytes) const {
+  std::int64_t written = 0;
+
+  // Write blobs to tmp files and rename them, so that an output hard linked
+  // to an old blob is not modified.
+  for (size_t i = 0; i < files_.size(); ++i) {
+    const File& file = files_[i];
+    if (!file.is_blob) {
+      continue;
+    }
+    const std::string blob_path =
+        LocalOutputCacheEntryReader::BlobPath(path, i);
+    const std::string blob_tmp_path = blob_path + ".tmp";
+    {
+      ScopedFd blob_fd(ScopedFd::Create(blob_tmp_path,
+                                        file.is_executable ? 0755 : 0644));
+      if (!blob_fd.valid()) {
+        LOG(ERROR) << "failed to open " << blob_tmp_path;
+        return false;
+      }
+      bool cloned = false;
+      if (!file.src_path.empty()) {
+        ScopedFd src_fd(ScopedFd::OpenForRead(file.src_path));
+        cloned = src_fd.valid() && CloneFile(src_fd, blob_fd);
+      }
+      if (!cloned) {
+        if (!WriteAll(blob_fd, file.content)) {
+          LOG(ERROR) << "failed to write blob " << blob_tmp_path;
+          blob_fd.Close();
+          remove(blob_tmp_path.c_str());
+          return false;
+        }
+      }
+      if (!blob_fd.Close()) {
+        LOG(ERROR) << "failed to close " << blob_tmp_path;
+        remove(blob_tmp_path.c_str());
+        return false;
+      }
+    }
+    if (!RenameTmpFile(blob_tmp_path, blob_path)) {
+      return false;
+    }
+    written += file.content.size();
+  }
+
+  // When compiler_proxy is killed during writing a file, the file will be
+  // invalid but it might look valid (when we're unlucky).
+  // So, we write the entry to a tmp file, and rename it.
+  const std::string tmp_path = path + ".tmp";
+  {
+    ScopedFd fd(ScopedFd::Create(tmp_path, 0644));
+    if (!fd.valid()) {
+      LOG(ERROR) << "failed to open " << tmp_path;
+      return false;
+    }
+    const std::string header = SerializeHeader();
+    bool ok = WriteAll(fd, header);
+    written += header.size();
+    for (const auto& file : files_) {
+      if (!ok) {
+        break;
+      }
+      if (file.is_blob) {
+        continue;
+      }
+      ok = WriteAll(fd, file.content);
+      written += file.content.size();
+    }
+    if (!fd.Close() || !ok) {
+      LOG(ERROR) << "failed to write " << tmp_path;
+      remove(tmp_path.c_str());
+      return false;
+    }
+  }
+  if (!RenameTmpFile(tmp_path, path)) {
+    return false;
+  }
+  *written_bytes = written;
+  return true;
+}
+
+std::string LocalOutputCacheEntryWriter::SerializeToString() const {
+  std::string serialized = SerializeHeader();
+  for (const auto& file : files_) {
+    if (!file.is_blob) {
+      serialized.append(file.content);
+    }
+  }
+  return serialized;
+}
+
+/* static */
+std::string LocalOutputCacheEntryReader::BlobPath(absl::string_view entry_path,
+                                                  int index) {
+  return absl::StrCat(entry_path, ".", index);
+}
+
+/* static */
+std::unique_ptr<LocalOutputCacheEntryReader> LocalOutputCacheEntryReader::Open(
+    const std::string& path) {
+  std::unique_ptr<LocalOutputCacheEntryReader> reader(
+      new LocalOutputCacheEntryReader);
+#ifndef _WIN32
+  ScopedFd fd(ScopedFd::OpenForRead(path));
+  if (!fd.valid()) {
+    return nullptr;
+  }
+  size_t size = 0;
+  if (!fd.GetFileSize(&size)) {
+    PLOG(ERROR) << "failed to get file size " << path;
+    return nullptr;
+  }
+  if (size > 0) {
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.fd(), 0);
+    if (mapped == MAP_FAILED) {
+      PLOG(ERROR) << "mmap failed " << path << " size=" << size;
+      return nullptr;
+    }
+    reader->mapped_ = mapped;
+    reader->mapped_size_ = size;
+    reader->data_ = absl::string_view(static_cast<const char*>(mapped), size);
+  }
+#else
+  // TODO: use CreateFileMapping/MapViewOfFile.
+  if (!ReadFileToString(path, &reader->buffer_)) {
+    return nullptr;
+  }
+  reader->data_ = reader->buffer_;
+#endif
+  if (!reader->Parse()) {
+    LOG(ERROR) << "failed to parse local output cache entry " << path;
+    return nullptr;
+  }
+  if (!reader->OpenBlobs(path)) {
+    return nullptr;
+  }
+  return reader;
+}
+
+/* static */
+std::unique_ptr<LocalOutputCacheEntryReader>
+LocalOutputCacheEntryReader::FromData(absl::string_view data) {
+  std::unique_ptr<LocalOutputCacheEntryReader> reader(
+      new LocalOutputCacheEntryReader);
+  reader->data_ = data;
+  if (!reader->Parse()) {
+    return nullptr;
+  }
+  return reader;
+}
+
+LocalOutputCacheEntryReader::~LocalOutputCacheEntryReader() {
+#ifndef _WIN32
+  if (mapped_ != nullptr) {
+    munmap(mapped_, mapped_size_);
+  }
+#endif
+}
+
+const LocalOutputCacheEntryReader::File* LocalOutputCacheEntryReader::FindFile(
+    absl::string_view filename) const {
+  for (const auto& file : files_) {
+    if (file.filename == filename) {
+      return &file;
+    }
+  }
+  return nullptr;
+}
+
+bool LocalOutputCacheEntryReader::Parse() {
+  if (absl::StartsWith(data_, kMagic)) {
+    is_raw_format_ = true;
+    return ParseRawFormat();
+  }
+  return ParseLegacyFormat();
+}
+
+bool LocalOutputCacheEntryReader::ParseRawFormat() {
+  absl::string_view header = data_;
+  header.remove_prefix(kMagic.size());
+  std::uint32_t num_files = 0;
+  std::uint32_t index_size = 0;
+  if (!ConsumeUint(&header, &num_files) ||
+      !ConsumeUint(&header, &index_size)) {
+    LOG(ERROR) << "too short header";
+    return false;
+  }
+  absl::string_view index;
+  if (!ConsumeBytes(&header, index_size, &index)) {
+    LOG(ERROR) << "too short index: index_size=" << index_size;
+    return false;
+  }
+  const std::uint64_t payload_offset = kHeaderSize + index_size;
+
+  files_.reserve(num_files);
+  for (std::uint32_t i = 0; i < num_files; ++i) {
+    std::uint64_t offset = 0;
+    std::uint64_t size = 0;
+    std::uint32_t flags = 0;
+    std::uint32_t filename_size = 0;
+    std::uint32_t hash_key_size = 0;
+    File file;
+    if (!ConsumeUint(&index, &offset) || !ConsumeUint(&index, &size) ||
+        !ConsumeUint(&index, &flags) || !ConsumeUint(&index, &filename_size) ||
+        !ConsumeUint(&index, &hash_key_size) ||
+        !ConsumeBytes(&index, filename_size, &file.filename) ||
+        !ConsumeBytes(&index, hash_key_size, &file.hash_key)) {
+      LOG(ERROR) << "broken index: i=" << i << " num_files=" << num_files;
+      return false;
+    }
+    file.is_executable = (flags & kFlagExecutable) != 0;
+    file.size = size;
+    if (flags & kFlagBlob) {
+      file.has_blob = true;
+      files_.push_back(file);
+      continue;
+    }
+    if (offset < payload_offset || offset > data_.size() ||
+        size > data_.size() - offset) {
+      LOG(ERROR) << "broken index: out of range:"
+                 << " filename=" << file.filename << " offset=" << offset
+                 << " size=" << size << " data_size=" << data_.size();
+      return false;
+    }
+    file.content = data_.substr(offset, size);
+    files_.push_back(file);
+  }
+  if (!index.empty()) {
+    LOG(ERROR) << "broken index: trailing garbage size=" << index.size();
+    return false;
+  }
+  return true;
+}
+
+bool LocalOutputCacheEntryReader::ParseLegacyFormat() {
+  if (!legacy_entry_.ParseFromArray(data_.data(), data_.size())) {
+    return false;
+  }
+  files_.reserve(legacy_entry_.files_size());
+  for (const auto& legacy_file : legacy_entry_.files()) {
+    File file;
+    file.filename = legacy_file.filename();
+    file.is_executable = legacy_file.is_executable();
+    file.content = legacy_file.content();
+    file.size = file.content.size();
+    files_.push_back(file);
+  }
+  return true;
+}
+
+bool LocalOutputCacheEntryReader::OpenBlobs(const std::string& path) {
+  bool has_blob = false;
+  for (const auto& file : files_) {
+    has_blob |= file.has_blob;
+  }
+  if (!has_blob) {
+    return true;
+  }
+  // Blob files are written before the entry, so a blob newer than
+  // the entry has been modified, e.g. via a hard linked output.
+  // MaterializeBlob updates mtime of the entry when it updates mtime of
+  // a hard linked blob.
+  const FileStat entry_stat(path);
+  if (!entry_stat.IsValid()) {
+    return false;
+  }
+  entry_path_ = path;
+  blob_fds_.resize(files_.size());
+  blob_paths_.resize(files_.size());
+  for (size_t i = 0; i < files_.size(); ++i) {
+    if (!files_[i].has_blob) {
+      continue;
+    }
+    blob_paths_[i] = BlobPath(path, i);
+    blob_fds_[i].reset(ScopedFd::OpenForRead(blob_paths_[i]));
+    if (!blob_fds_[i].valid()) {
+      LOG(ERROR) << "failed to open blob " << blob_paths_[i];
+      return false;
+    }
+    size_t size = 0;
+    if (!blob_fds_[i].GetFileSize(&size) || size != files_[i].size) {
+      LOG(ERROR) << "blob size mismatch " << blob_paths_[i]
+                 << " want=" << files_[i].size << " got=" << size;
+      return false;
+    }
+    const FileStat blob_stat(blob_paths_[i]);
+    if (!blob_stat.IsValid() || !blob_stat.mtime.has_value() ||
+        !entry_stat.mtime.has_value() || *blob_stat.mtime > *entry_stat.mtime) {
+      LOG(ERROR) << "blob is modified after the entry is written "
+                 << blob_paths_[i];
+      return false;
+    }
+  }
+  return true;
+}
+
+bool LocalOutputCacheEntryReader::ReadContent(const File& file,
+                                              std::string* content) const {
+  if (!file.has_blob) {
+    content->assign(file.content.data(), file.content.size());
+    return true;
+  }
+  const size_t index = &file - files_.data();
+  if (index >= blob_fds_.size() || !blob_fds_[index].valid()) {
+    return false;
+  }
+#ifndef _WIN32
+  content->resize(file.size);
+  std::uint64_t offset = 0;
+  while (offset < file.size) {
+    ssize_t n = pread(blob_fds_[index].fd(), &(*content)[offset],
+                      file.size - offset, offset);
+    if (n <= 0) {
+      PLOG(ERROR) << "failed to read " << blob_paths_[index];
+      return false;
+    }
+    offset += n;
+  }
+  return true;
+#else
+  return ReadFileToString(blob_paths_[index], content) &&
+         content->size() == file.size;
+#endif
+}
+
+bool LocalOutputCacheEntryReader::MaterializeBlob(
+    const File& file,
+    const std::string& dst,
+    int mode,
+    LocalOutputCacheCommitMode commit_mode,
+    LocalOutputCacheCommitMode* method) const {
+  const size_t index = &file - files_.data();
+  if (!file.has_blob || index >= blob_fds_.size() ||
+      !blob_fds_[index].valid()) {
+    return false;
+  }
+  const std::string& blob_path = blob_paths_[index];
+
+#ifndef _WIN32
+  if (unlink(dst.c_str()) != 0 && errno != ENOENT) {
+    PLOG(WARNING) << "failed to remove " << dst;
+    return false;
+  }
+  if (commit_mode == LocalOutputCacheCommitMode::kHardlink) {
+    // The output shares the inode with the blob, so it can't have its own
+    // mode. Fall back to reflink or copy if the mode differs.
+    struct stat st;
+    if (fstat(blob_fds_[index].fd(), &st) == 0 &&
+        (st.st_mode & 07777) == (mode & 07777)) {
+      // link fails if blob has been removed by GC. Then fall back to
+      // reflink or copy from the opened blob.
+      if (link(blob_path.c_str(), dst.c_str()) == 0) {
+        // The output must look newer than its inputs, or build tools
+        // (e.g. ninja) would consider it dirty in the next build.
+        if (utimes(dst.c_str(), nullptr) == 0) {
+          // This also updated mtime of the blob. Update mtime of the entry
+          // too, so that OpenBlobs won't consider the blob modified.
+          if (utimes(entry_path_.c_str(), nullptr) != 0) {
+            PLOG(WARNING) << "failed to update mtime of " << entry_path_;
+          }
+          *method = LocalOutputCacheCommitMode::kHardlink;
+          return true;
+        }
+        PLOG(WARNING) << "failed to update mtime of " << dst;
+        unlink(dst.c_str());
+      } else {
+        VLOG(1) << "failed to hardlink " << blob_path << " to " << dst
+                << " errno=" << errno;
+      }
+    }
+  }
+  ScopedFd out(ScopedFd::Create(dst, mode));
+  if (!out.valid()) {
+    return false;
+  }
+  bool ok = false;
+  if (commit_mode != LocalOutputCacheCommitMode::kCopy &&
+      CloneFile(blob_fds_[index], out)) {
+    *method = LocalOutputCacheCommitMode::kReflink;
+    ok = true;
+  } else if (CopyFileContent(blob_fds_[index], out, file.size)) {
+    *method = LocalOutputCacheCommitMode::kCopy;
+    ok = true;
+  }
+  if (!out.Close() || !ok) {
+    unlink(dst.c_str());
+    return false;
+  }
+  return true;
+#else
+  (void)mode;
+  // Hard links are not used on Windows, since outputs can be rewritten in
+  // place (e.g. CompileTask::RewriteCoffTimestamp for .obj), which would
+  // also rewrite the blob. Reflink is not supported either, so copy.
+  DeleteFileA(dst.c_str());
+  if (CopyFileA(blob_path.c_str(), dst.c_str(), FALSE)) {
+    *method = LocalOutputCacheCommitMode::kCopy;
+    return true;
+  }
+  return false;
+#endif
+}
+
+bool UnshareHardLinkedFile(const std::string& path) {
+#ifndef _WIN32
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    PLOG(WARNING) << "failed to stat " << path;
+    return false;
+  }
+  if (st.st_nlink <= 1) {
+    return true;
+  }
+  ScopedFd src(ScopedFd::OpenForRead(path));
+  if (!src.valid()) {
+    return false;
+  }
+  const std::string tmp_path = path + ".unshare";
+  ScopedFd dst(ScopedFd::Create(tmp_path, st.st_mode & 07777));
+  if (!dst.valid()) {
+    return false;
+  }
+  const bool copied = CopyFileContent(src, dst, st.st_size);
+  if (!dst.Close() || !copied) {
+    LOG(WARNING) << "failed to copy " << path << " to " << tmp_path;
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return RenameTmpFile(tmp_path, path);
+#else
+  // MaterializeBlob doesn't make hard links on Windows.
+  (void)path;
+  return true;
+#endif
+}
+
+}  // namespace devtools_goma
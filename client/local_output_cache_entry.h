@@ -0,0 +1,233 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DEVTOOLS_GOMA_CLIENT_LOCAL_OUTPUT_CACHE_ENTRY_H_
+#define DEVTOOLS_GOMA_CLIENT_LOCAL_OUTPUT_CACHE_ENTRY_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "compiler_specific.h"
+#include "scoped_fd.h"
+
+MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
+#include "prototmp/local_output_cache_data.pb.h"
+MSVC_POP_WARNING()
+
+namespace devtools_goma {
+
+// On-disk format of a LocalOutputCache entry.
+//
+// All integers are little endian.
+//
+//   header:
+//     char[8]  magic ("GOMALOC1")
+//     uint32   number of files
+//     uint32   size of index in bytes
+//   index (repeated for each file):
+//     uint64   offset of content from the beginning of the entry
+//              (0 if the content is stored in a blob file)
+//     uint64   size of content
+//     uint32   flags (bit 0: is_executable, bit 1: stored in a blob file)
+//     uint32   size of filename
+//     uint32   size of hash_key
+//     char[]   filename
+//     char[]   hash_key
+//   payload:
+//     raw file contents.
+//
+// Since contents are stored as-is, a reader can mmap an entry and write
+// each content to the output file without copying it into an ExecResp.
+// hash_key is the FileBlob hash key of the content, so that it does not
+// need to be computed again when the output is committed.
+//
+// Content of a file may be stored in a standalone blob file
+// "<entry path>.<file index>" instead of the payload. Such a blob can be
+// materialized as an output by hard link or reflink, without writing
+// the content.
+//
+// Entries written by older compiler_proxy are serialized
+// LocalOutputCacheEntry protos. These are still readable.
+
+// LocalOutputCacheCommitMode specifies how outputs are stored in and
+// committed from LocalOutputCache.
+enum class LocalOutputCacheCommitMode {
+  // Contents are stored in the entry, and copied to outputs.
+  kCopy,
+  // Contents are stored in blob files, and cloned to outputs by reflink
+  // if the filesystem supports it. Otherwise, copied.
+  kReflink,
+  // Contents are stored in blob files, and hard linked to outputs.
+  // Falls back to reflink, then copy, e.g. when the output needs
+  // a different mode from the blob. Outputs are copied on Windows.
+  // Note that outputs share the inode with the cache, so a tool that
+  // modifies an output in place would also modify the cache.
+  // compiler_proxy calls UnshareHardLinkedFile before it rewrites an output.
+  kHardlink,
+};
+
+// Parses |name| ("copy", "reflink" or "hardlink") into |mode|.
+// Empty |name| is treated as "copy". Returns false for unknown name.
+bool ParseLocalOutputCacheCommitMode(absl::string_view name,
+                                     LocalOutputCacheCommitMode* mode);
+
+// If |path| has other hard links, e.g. it was hard linked to a blob by
+// MaterializeBlob, replaces |path| with a copy, so that it can be modified
+// in place without modifying the others.
+// Returns true if |path| is not shared with any other link.
+bool UnshareHardLinkedFile(const std::string& path);
+
+// LocalOutputCacheEntryWriter builds an entry and writes it to a file.
+class LocalOutputCacheEntryWriter {
+ public:
+  LocalOutputCacheEntryWriter() = default;
+
+  LocalOutputCacheEntryWriter(const LocalOutputCacheEntryWriter&) = delete;
+  LocalOutputCacheEntryWriter& operator=(const LocalOutputCacheEntryWriter&) =
+      delete;
+
+  // Adds a file to the entry.
+  void AddFile(std::string filename, bool is_executable, std::string content);
+
+  // Adds a file whose content is stored in a blob file next to the entry.
+  // |src_path| is the file having |content|. It is cloned to the blob file
+  // if possible. If |src_path| is empty, |content| is written.
+  void AddBlobFile(std::string filename,
+                   bool is_executable,
+                   std::string content,
+                   std::string src_path);
+
+  // Writes the entry to |path|, and blob files to BlobPath(|path|, i).
+  // Each file is written to a tmp file and renamed, and blob files are
+  // written before the entry, so a partially written entry is never seen.
+  // On success, returns true and sets the number of written bytes
+  // (including blob files) in |written_bytes|.
+  bool WriteToFile(const std::string& path, std::int64_t* written_bytes) const;
+
+  // Returns the number of blob files.
+  int num_blobs() const;
+
+  // Returns the serialized entry without blob files. Used only for test.
+  std::string SerializeToString() const;
+
+ private:
+  struct File {
+    std::string filename;
+    bool is_executable = false;
+    std::string hash_key;
+    std::string content;
+    // True if the content is stored in a blob file.
+    bool is_blob = false;
+    // File to clone the blob file from. May be empty.
+    std::string src_path;
+  };
+
+  void AddFileInternal(std::string filename,
+                       bool is_executable,
+                       std::string content,
+                       bool is_blob,
+                       std::string src_path);
+  std::string SerializeHeader() const;
+
+  std::vector<File> files_;
+};
+
+// LocalOutputCacheEntryReader provides read only access to an entry.
+// On POSIX, the entry is mmapped, and |content| of each file points to the
+// mapped region. The region is kept alive while the reader is alive.
+class LocalOutputCacheEntryReader {
+ public:
+  struct File {
+    absl::string_view filename;
+    bool is_executable = false;
+    // Empty if the entry does not have hash key (i.e. legacy format).
+    absl::string_view hash_key;
+    // Empty if |has_blob|.
+    absl::string_view content;
+    // True if the content is stored in a blob file.
+    bool has_blob = false;
+    std::uint64_t size = 0;
+  };
+
+  // Returns path of |index|-th blob file of the entry at |entry_path|.
+  static std::string BlobPath(absl::string_view entry_path, int index);
+
+  // Opens an entry at |path|, and its blob files if any.
+  // Returns nullptr if the files could not be read or parsed.
+  static std::unique_ptr<LocalOutputCacheEntryReader> Open(
+      const std::string& path);
+
+  // Parses |data| as an entry. |data| must outlive the reader.
+  static std::unique_ptr<LocalOutputCacheEntryReader> FromData(
+      absl::string_view data);
+
+  ~LocalOutputCacheEntryReader();
+
+  LocalOutputCacheEntryReader(const LocalOutputCacheEntryReader&) = delete;
+  LocalOutputCacheEntryReader& operator=(const LocalOutputCacheEntryReader&) =
+      delete;
+
+  const std::vector<File>& files() const { return files_; }
+
+  // Returns the file named |filename|, or nullptr if not found.
+  const File* FindFile(absl::string_view filename) const;
+
+  // Returns true if the entry is in the raw (non-proto) format.
+  bool is_raw_format() const { return is_raw_format_; }
+
+  // Returns true if any file is stored in a blob file.
+  bool has_blob() const { return !blob_fds_.empty(); }
+
+  // Reads content of |file| into |content|.
+  bool ReadContent(const File& file, std::string* content) const;
+
+  // Materializes |file| at |dst| according to |commit_mode|.
+  // Existing |dst| is removed first, so an output that was hard linked to
+  // the cache before is never overwritten in place.
+  // |dst| is created with |mode|. A hard linked |dst| has the mode of the
+  // blob, so it is hard linked only if the blob has |mode|. Its mtime is
+  // updated to the current time, and so is mtime of the entry file.
+  // Returns false if |file| has no blob or it failed. The method actually
+  // used is set in |method|.
+  bool MaterializeBlob(const File& file,
+                       const std::string& dst,
+                       int mode,
+                       LocalOutputCacheCommitMode commit_mode,
+                       LocalOutputCacheCommitMode* method) const;
+
+ private:
+  LocalOutputCacheEntryReader() = default;
+
+  bool Parse();
+  bool ParseRawFormat();
+  bool ParseLegacyFormat();
+  bool OpenBlobs(const std::string& path);
+
+  absl::string_view data_;
+
+  // Set when |data_| is mmapped.
+  void* mapped_ = nullptr;
+  size_t mapped_size_ = 0;
+  // Set when |data_| is read into memory (e.g. on Windows).
+  std::string buffer_;
+
+  bool is_raw_format_ = false;
+  LocalOutputCacheEntry legacy_entry_;
+  std::vector<File> files_;
+
+  // Blob files are opened in Open(), so that they can be read even if
+  // they are removed by garbage collection.
+  // Indexed by the file index. Invalid for files without blob.
+  std::vector<ScopedFd> blob_fds_;
+  std::vector<std::string> blob_paths_;
+  // Path of the entry file. Set only if the entry has blobs.
+  std::string entry_path_;
+};
+
+}  // namespace devtools_goma
+
+#endif  // DEVTOOLS_GOMA_CLIENT_LOCAL_OUTPUT_CACHE_ENTRY_H_
@@ -0,0 +1,163 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "local_output_cache_entry.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <gtest/gtest.h>
+
+#include "goma_data_util.h"
+#include "path.h"
+#include "unittest_util.h"
+
+MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
+#include "prototmp/goma_data.pb.h"
+MSVC_POP_WARNING()
+
+namespace devtools_goma {
+
+namespace {
+
+std::string FileBlobHashKey(const std::string& content) {
+  FileBlob blob;
+  blob.set_blob_type(FileBlob::FILE);
+  blob.set_file_size(content.size());
+  blob.set_content(content);
+  return ComputeFileBlobHashKey(blob);
+}
+
+}  // anonymous namespace
+
+TEST(LocalOutputCacheEntryTest, RoundTrip) {
+  LocalOutputCacheEntryWriter writer;
+  writer.AddFile("foo.o", false, "foo content");
+  writer.AddFile("bar", true, "bar content");
+  writer.AddFile("empty", false, "");
+
+  const std::string serialized = writer.SerializeToString();
+  std::unique_ptr<LocalOutputCacheEntryReader> reader =
+      LocalOutputCacheEntryReader::FromData(serialized);
+  ASSERT_NE(nullptr, reader);
+  EXPECT_TRUE(reader->is_raw_format());
+  ASSERT_EQ(3U, reader->files().size());
+
+  const auto& files = reader->files();
+  EXPECT_EQ("foo.o", files[0].filename);
+  EXPECT_FALSE(files[0].is_executable);
+  EXPECT_EQ("foo content", files[0].content);
+  EXPECT_EQ(FileBlobHashKey("foo content"), files[0].hash_key);
+
+  EXPECT_EQ("bar", files[1].filename);
+  EXPECT_TRUE(files[1].is_executable);
+  EXPECT_EQ("bar content", files[1].content);
+
+  EXPECT_EQ("empty", files[2].filename);
+  EXPECT_EQ("", files[2].content);
+  EXPECT_EQ(FileBlobHashKey(""), files[2].hash_key);
+
+  EXPECT_EQ(&files[1], reader->FindFile("bar"));
+  EXPECT_EQ(nullptr, reader->FindFile("baz"));
+}
+
+TEST(LocalOutputCacheEntryTest, LegacyFormat) {
+  LocalOutputCacheEntry legacy;
+  LocalOutputCacheFile* file = legacy.add_files();
+  file->set_filename("foo.o");
+  file->set_content("foo content");
+  file->set_is_executable(true);
+  std::string serialized;
+  ASSERT_TRUE(legacy.SerializeToString(&serialized));
+
+  std::unique_ptr<LocalOutputCacheEntryReader> reader =
+      LocalOutputCacheEntryReader::FromData(serialized);
+  ASSERT_NE(nullptr, reader);
+  EXPECT_FALSE(reader->is_raw_format());
+  ASSERT_EQ(1U, reader->files().size());
+  EXPECT_EQ("foo.o", reader->files()[0].filename);
+  EXPECT_TRUE(reader->files()[0].is_executable);
+  EXPECT_EQ("foo content", reader->files()[0].content);
+  EXPECT_EQ("", reader->files()[0].hash_key);
+}
+
+TEST(LocalOutputCacheEntryTest, BrokenEntry) {
+  LocalOutputCacheEntryWriter writer;
+  writer.AddFile("foo.o", false, "foo content");
+  const std::string serialized = writer.SerializeToString();
+
+  // Truncated payload.
+  EXPECT_EQ(nullptr, LocalOutputCacheEntryReader::FromData(
+                         absl::string_view(serialized).substr(
+                             0, serialized.size() - 1)));
+  // Truncated index.
+  EXPECT_EQ(nullptr, LocalOutputCacheEntryReader::FromData(
+                         absl::string_view(serialized).substr(0, 20)));
+  // Truncated header.
+  EXPECT_EQ(nullptr, LocalOutputCacheEntryReader::FromData(
+                         absl::string_view(serialized).substr(0, 10)));
+}
+
+TEST(LocalOutputCacheEntryTest, WriteAndOpen) {
+  TmpdirUtil tmpdir("local_output_cache_entry_unittest");
+  const std::string path = file::JoinPath(tmpdir.tmpdir(), "entry");
+
+  LocalOutputCacheEntryWriter writer;
+  writer.AddFile("foo.o", false, "foo content");
+  writer.AddFile("bar.dwo", false, "bar content");
+  std::int64_t written_bytes = 0;
+  ASSERT_TRUE(writer.WriteToFile(path, &written_bytes));
+  EXPECT_EQ(static_cast<std::int64_t>(writer.SerializeToString().size()),
+            written_bytes);
+
+  std::unique_ptr<LocalOutputCacheEntryReader> reader =
+      LocalOutputCacheEntryReader::Open(path);
+  ASSERT_NE(nullptr, reader);
+  ASSERT_EQ(2U, reader->files().size());
+  EXPECT_EQ("foo content", reader->FindFile("foo.o")->content);
+  EXPECT_EQ("bar content", reader->FindFile("bar.dwo")->content);
+
+  EXPECT_EQ(nullptr, LocalOutputCacheEntryReader::Open(
+                         file::JoinPath(tmpdir.tmpdir(), "missing")));
+}
+
+TEST(LocalOutputCacheEntryTest, WriteAndOpenWithBlob) {
+  TmpdirUtil tmpdir("local_output_cache_entry_unittest");
+  const std::string path = file::JoinPath(tmpdir.tmpdir(), "entry");
+
+  LocalOutputCacheEntryWriter writer;
+  writer.AddFile("foo.o", false, "foo content");
+  writer.AddBlobFile("bar.dwo", true, "bar content", "");
+  EXPECT_EQ(1, writer.num_blobs());
+  std::int64_t written_bytes = 0;
+  ASSERT_TRUE(writer.WriteToFile(path, &written_bytes));
+  EXPECT_EQ(static_cast<std::int64_t>(writer.SerializeToString().size() +
+                                      strlen("bar content")),
+            written_bytes);
+
+  std::unique_ptr<LocalOutputCacheEntryReader> reader =
+      LocalOutputCacheEntryReader::Open(path);
+  ASSERT_NE(nullptr, reader);
+  EXPECT_TRUE(reader->has_blob());
+  const LocalOutputCacheEntryReader::File* foo = reader->FindFile("foo.o");
+  ASSERT_NE(nullptr, foo);
+  EXPECT_FALSE(foo->has_blob);
+  EXPECT_EQ("foo content", foo->content);
+  const LocalOutputCacheEntryReader::File* bar = reader->FindFile("bar.dwo");
+  ASSERT_NE(nullptr, bar);
+  EXPECT_TRUE(bar->has_blob);
+  EXPECT_TRUE(bar->is_executable);
+  EXPECT_EQ(11U, bar->size);
+  EXPECT_EQ(FileBlobHashKey("bar content"), bar->hash_key);
+  std::string content;
+  ASSERT_TRUE(reader->ReadContent(*bar, &content));
+  EXPECT_EQ("bar content", content);
+
+  // Missing blob file makes the entry unreadable.
+  reader.reset();
+  ASSERT_EQ(0, remove(LocalOutputCacheEntryReader::BlobPath(path, 1).c_str()));
+  EXPECT_EQ(nullptr, LocalOutputCacheEntryReader::Open(path));
+}
+
+}  // namespace devtools_goma
@@ -12,10 +12,17 @@
 #include "absl/container/flat_hash_set.h"
 #include "absl/memory/memory.h"
 #include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "compiler_specific.h"
 #include "content.h"
+#include "file_helper.h"
 #include "path.h"
 #include "unittest_util.h"
 
+MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
+#include "prototmp/goma_stats.pb.h"
+MSVC_POP_WARNING()
+
 #ifdef _WIN32
 # include "posix_helper_win.h"
 #endif
@@ -59,7 +66,8 @@ class LocalOutputCacheTest : public ::testing::Test {
                            max_cache_amount,
                            threshold_cache_amount,
                            max_items,
-                           threshold_items);
+                           threshold_items,
+                           commit_mode_);
   }
 
   ExecReq MakeFakeExecReq() {
@@ -99,7 +107,12 @@ class LocalOutputCacheTest : public ::testing::Test {
     LocalOutputCache::instance()->RunGarbageCollection(stat);
   }
 
+  void LoadCacheEntries() {
+    LocalOutputCache::instance()->LoadCacheEntries();
+  }
+
   std::unique_ptr<TmpdirUtil> tmpdir_;
+  LocalOutputCacheCommitMode commit_mode_ = LocalOutputCacheCommitMode::kCopy;
 };
 
 TEST_F(LocalOutputCacheTest, Match) {
@@ -133,6 +146,252 @@ TEST_F(LocalOutputCacheTest, Match) {
             looked_up_resp.result().output(0).filename());
 }
 
+TEST_F(LocalOutputCacheTest, MatchEntry) {
+  InitLocalOutputCache();
+
+  const std::string trace_id = "(test-match-entry)";
+
+  ExecReq req = MakeFakeExecReq();
+  ExecResp resp = MakeFakeExecResp();
+  resp.mutable_result()->mutable_output(0)->set_is_executable(true);
+
+  tmpdir_->CreateTmpFile("build/output.o", "(output)");
+  std::string key = LocalOutputCache::MakeCacheKey(req);
+
+  EXPECT_TRUE(LocalOutputCache::instance()->SaveOutput(
+                  key, &req, &resp, trace_id));
+  tmpdir_->RemoveTmpFile("build/output.o");
+
+  ExecResp looked_up_resp;
+  std::shared_ptr<const LocalOutputCacheEntryReader> entry;
+  EXPECT_TRUE(LocalOutputCache::instance()->LookupEntry(
+      key, &looked_up_resp, &entry, trace_id));
+  ASSERT_NE(nullptr, entry);
+
+  // ExecResp should not have content.
+  ASSERT_EQ(1, looked_up_resp.result().output_size());
+  const ExecResult_Output& output = looked_up_resp.result().output(0);
+  EXPECT_EQ("output.o", output.filename());
+  EXPECT_TRUE(output.is_executable());
+  EXPECT_EQ(FileBlob::FILE, output.blob().blob_type());
+  EXPECT_EQ(8, output.blob().file_size());
+  EXPECT_FALSE(output.blob().has_content());
+
+  // Content should be available in the entry.
+  EXPECT_TRUE(entry->is_raw_format());
+  const LocalOutputCacheEntryReader::File* file = entry->FindFile("output.o");
+  ASSERT_NE(nullptr, file);
+  EXPECT_EQ("(output)", file->content);
+  EXPECT_TRUE(file->is_executable);
+  EXPECT_FALSE(file->hash_key.empty());
+}
+
+TEST_F(LocalOutputCacheTest, PreCacheKey) {
+  const std::string input = tmpdir_->FullPath("build/input.cc");
+  const std::string header = tmpdir_->FullPath("build/input.h");
+  tmpdir_->CreateTmpFile("build/input.cc", "#include \"input.h\"");
+  tmpdir_->CreateTmpFile("build/input.h", "int x;");
+  const absl::Time old_mtime = absl::Now() - absl::Hours(1);
+  ASSERT_TRUE(UpdateMtime(input, old_mtime));
+  ASSERT_TRUE(UpdateMtime(header, old_mtime));
+
+  ExecReq req = MakeFakeExecReqWithArgs({"clang", "-c", "input.cc"});
+  const std::string pre_key = LocalOutputCache::MakePreCacheKey(
+      req, {{input, FileStat(input)}, {header, FileStat(header)}});
+  EXPECT_FALSE(pre_key.empty());
+
+  // Inputs in request and order of |inputs| don't matter.
+  ExecReq req_with_input(req);
+  req_with_input.add_input()->set_filename("input.cc");
+  EXPECT_EQ(pre_key, LocalOutputCache::MakePreCacheKey(
+      req_with_input, {{header, FileStat(header)}, {input, FileStat(input)}}));
+
+  // Different args.
+  EXPECT_NE(pre_key, LocalOutputCache::MakePreCacheKey(
+      MakeFakeExecReqWithArgs({"clang", "-c", "-O2", "input.cc"}),
+      {{input, FileStat(input)}, {header, FileStat(header)}}));
+  // Different inputs.
+  EXPECT_NE(pre_key, LocalOutputCache::MakePreCacheKey(
+      req, {{input, FileStat(input)}}));
+
+  // Modified input.
+  ASSERT_TRUE(UpdateMtime(header, old_mtime + absl::Seconds(10)));
+  EXPECT_NE(pre_key, LocalOutputCache::MakePreCacheKey(
+      req, {{input, FileStat(input)}, {header, FileStat(header)}}));
+
+  // Recently modified input or missing input cannot make a key.
+  ASSERT_TRUE(UpdateMtime(header, absl::Now()));
+  EXPECT_EQ("", LocalOutputCache::MakePreCacheKey(
+      req, {{input, FileStat(input)}, {header, FileStat(header)}}));
+  EXPECT_EQ("", LocalOutputCache::MakePreCacheKey(
+      req, {{input, FileStat(input)},
+            {tmpdir_->FullPath("build/missing.h"), FileStat()}}));
+}
+
+TEST_F(LocalOutputCacheTest, MatchEntryByPreKey) {
+  InitLocalOutputCache();
+
+  const std::string trace_id = "(test-match-entry-by-pre-key)";
+
+  ExecReq req = MakeFakeExecReq();
+  ExecResp resp = MakeFakeExecResp();
+
+  tmpdir_->CreateTmpFile("build/output.o", "(output)");
+  const std::string key = LocalOutputCache::MakeCacheKey(req);
+  const std::string pre_key = "pre-key";
+
+  std::string looked_up_key;
+  ExecResp looked_up_resp;
+  std::shared_ptr<const LocalOutputCacheEntryReader> entry;
+  EXPECT_FALSE(LocalOutputCache::instance()->LookupEntryByPreKey(
+      pre_key, &looked_up_key, &looked_up_resp, &entry, trace_id));
+
+  EXPECT_TRUE(LocalOutputCache::instance()->SaveOutput(
+                  key, &req, &resp, trace_id));
+  tmpdir_->RemoveTmpFile("build/output.o");
+  LocalOutputCache::instance()->AddPreCacheKey(pre_key, key);
+
+  EXPECT_TRUE(LocalOutputCache::instance()->LookupEntryByPreKey(
+      pre_key, &looked_up_key, &looked_up_resp, &entry, trace_id));
+  EXPECT_EQ(key, looked_up_key);
+  ASSERT_NE(nullptr, entry);
+  ASSERT_EQ(1, looked_up_resp.result().output_size());
+  EXPECT_EQ("output.o", looked_up_resp.result().output(0).filename());
+  EXPECT_NE(nullptr, entry->FindFile("output.o"));
+
+  LocalOutputCacheStats stats;
+  LocalOutputCache::instance()->DumpStatsToProto(&stats);
+  EXPECT_EQ(1, stats.pre_key_lookup_success());
+  EXPECT_EQ(1, stats.pre_key_lookup_miss());
+}
+
+TEST_F(LocalOutputCacheTest, MatchEntryWithBlob) {
+  commit_mode_ = LocalOutputCacheCommitMode::kHardlink;
+  InitLocalOutputCache();
+
+  const std::string trace_id = "(test-match-entry-with-blob)";
+
+  ExecReq req = MakeFakeExecReq();
+  ExecResp resp = MakeFakeExecResp();
+
+  tmpdir_->CreateTmpFile("build/output.o", "(output)");
+  std::string key = LocalOutputCache::MakeCacheKey(req);
+
+  EXPECT_TRUE(LocalOutputCache::instance()->SaveOutput(
+                  key, &req, &resp, trace_id));
+  tmpdir_->RemoveTmpFile("build/output.o");
+
+  // Content is stored in a blob file.
+  const std::string blob_path =
+      LocalOutputCacheEntryReader::BlobPath(CacheFilePath(key), 0);
+  EXPECT_EQ(0, access(blob_path.c_str(), F_OK));
+  EXPECT_GT(LocalOutputCache::instance()->TotalCacheAmountInByte(), 8);
+
+  ExecResp looked_up_resp;
+  std::shared_ptr<const LocalOutputCacheEntryReader> entry;
+  EXPECT_TRUE(LocalOutputCache::instance()->LookupEntry(
+      key, &looked_up_resp, &entry, trace_id));
+  ASSERT_NE(nullptr, entry);
+  EXPECT_TRUE(entry->has_blob());
+  ASSERT_EQ(1, looked_up_resp.result().output_size());
+  EXPECT_EQ(8, looked_up_resp.result().output(0).blob().file_size());
+
+  const LocalOutputCacheEntryReader::File* file = entry->FindFile("output.o");
+  ASSERT_NE(nullptr, file);
+  EXPECT_TRUE(file->has_blob);
+  EXPECT_EQ(8U, file->size);
+
+  // Materialize to the build directory.
+  // Existing output should be replaced, not overwritten.
+  tmpdir_->CreateTmpFile("build/output.o", "(old output)");
+  const std::string output_path = tmpdir_->FullPath("build/output.o");
+  const absl::Time old_time = absl::Now() - absl::Hours(1);
+  ASSERT_TRUE(UpdateMtime(blob_path, old_time));
+  ASSERT_TRUE(UpdateMtime(CacheFilePath(key), old_time));
+  LocalOutputCacheCommitMode method = LocalOutputCacheCommitMode::kCopy;
+  EXPECT_TRUE(entry->MaterializeBlob(*file, output_path, 0644,
+                                     LocalOutputCacheCommitMode::kHardlink,
+                                     &method));
+#ifndef _WIN32
+  EXPECT_EQ(LocalOutputCacheCommitMode::kHardlink, method);
+#else
+  EXPECT_EQ(LocalOutputCacheCommitMode::kCopy, method);
+#endif
+  std::string content;
+  ASSERT_TRUE(ReadFileToString(output_path, &content));
+  EXPECT_EQ("(output)", content);
+  ASSERT_TRUE(entry->ReadContent(*file, &content));
+  EXPECT_EQ("(output)", content);
+  // The output should be newer than inputs even if it is hard linked.
+  const FileStat output_stat(output_path);
+  ASSERT_TRUE(output_stat.IsValid());
+  EXPECT_GT(*output_stat.mtime, old_time + absl::Minutes(30));
+
+  // Rewriting the output after unsharing should not modify the blob.
+  EXPECT_TRUE(UnshareHardLinkedFile(output_path));
+  tmpdir_->CreateTmpFile("build/output.o", "(rewritten output)");
+  ASSERT_TRUE(ReadFileToString(blob_path, &content));
+  EXPECT_EQ("(output)", content);
+
+  // The blob is not hard linked if the output needs another mode.
+  EXPECT_TRUE(entry->MaterializeBlob(*file, output_path, 0755,
+                                     LocalOutputCacheCommitMode::kHardlink,
+                                     &method));
+  EXPECT_NE(LocalOutputCacheCommitMode::kHardlink, method);
+  ASSERT_TRUE(ReadFileToString(output_path, &content));
+  EXPECT_EQ("(output)", content);
+
+  // Copy also works.
+  EXPECT_TRUE(entry->MaterializeBlob(*file, output_path, 0644,
+                                     LocalOutputCacheCommitMode::kCopy,
+                                     &method));
+  EXPECT_EQ(LocalOutputCacheCommitMode::kCopy, method);
+  ASSERT_TRUE(ReadFileToString(output_path, &content));
+  EXPECT_EQ("(output)", content);
+}
+
+TEST_F(LocalOutputCacheTest, MatchEntryWithBlobAfterHardlinkCommit) {
+  commit_mode_ = LocalOutputCacheCommitMode::kHardlink;
+  InitLocalOutputCache();
+
+  const std::string trace_id = "(test-match-entry-after-hardlink-commit)";
+
+  ExecReq req = MakeFakeExecReq();
+  ExecResp resp = MakeFakeExecResp();
+
+  tmpdir_->CreateTmpFile("build/output.o", "(output)");
+  std::string key = LocalOutputCache::MakeCacheKey(req);
+
+  EXPECT_TRUE(LocalOutputCache::instance()->SaveOutput(
+                  key, &req, &resp, trace_id));
+  tmpdir_->RemoveTmpFile("build/output.o");
+  const std::string output_path = tmpdir_->FullPath("build/output.o");
+
+  // The entry should still be valid after it is committed, i.e. mtime of
+  // the hard linked blob is updated.
+  for (int i = 0; i < 2; ++i) {
+    SCOPED_TRACE(i);
+    ExecResp looked_up_resp;
+    std::shared_ptr<const LocalOutputCacheEntryReader> entry;
+    ASSERT_TRUE(LocalOutputCache::instance()->LookupEntry(
+        key, &looked_up_resp, &entry, trace_id));
+    ASSERT_NE(nullptr, entry);
+    const LocalOutputCacheEntryReader::File* file =
+        entry->FindFile("output.o");
+    ASSERT_NE(nullptr, file);
+    LocalOutputCacheCommitMode method = LocalOutputCacheCommitMode::kCopy;
+    EXPECT_TRUE(entry->MaterializeBlob(*file, output_path, 0644,
+                                       LocalOutputCacheCommitMode::kHardlink,
+                                       &method));
+#ifndef _WIN32
+    EXPECT_EQ(LocalOutputCacheCommitMode::kHardlink, method);
+#endif
+    std::string content;
+    ASSERT_TRUE(ReadFileToString(output_path, &content));
+    EXPECT_EQ("(output)", content);
+  }
+}
+
 TEST_F(LocalOutputCacheTest, NoMatch) {
   InitLocalOutputCache();
 
@@ -188,6 +447,63 @@ TEST_F(LocalOutputCacheTest, CollectGarbage) {
   }
 }
 
+TEST_F(LocalOutputCacheTest, CollectGarbageWithBlob) {
+  commit_mode_ = LocalOutputCacheCommitMode::kReflink;
+  InitLocalOutputCacheWithParams(0, 0, 100, 100);
+
+  const std::string trace_id = "(garbage)";
+
+  ExecReq req = MakeFakeExecReq();
+  ExecResp resp = MakeFakeExecResp();
+  tmpdir_->CreateTmpFile("build/output.o", "(output)");
+  std::string key = LocalOutputCache::instance()->MakeCacheKey(req);
+  EXPECT_TRUE(LocalOutputCache::instance()->SaveOutput(
+                  key, &req, &resp, trace_id));
+
+  std::string path = CacheFilePath(key);
+  std::string blob_path = LocalOutputCacheEntryReader::BlobPath(path, 0);
+  EXPECT_EQ(0, access(path.c_str(), F_OK));
+  EXPECT_EQ(0, access(blob_path.c_str(), F_OK));
+
+  {
+    LocalOutputCache::GarbageCollectionStat stat;
+    RunGarbageCollection(&stat);
+    EXPECT_NE(0, access(path.c_str(), F_OK));
+    EXPECT_NE(0, access(blob_path.c_str(), F_OK));
+    EXPECT_EQ(1U, stat.num_removed);
+  }
+}
+
+TEST_F(LocalOutputCacheTest, LoadCacheEntriesWithBlob) {
+  commit_mode_ = LocalOutputCacheCommitMode::kReflink;
+  InitLocalOutputCache();
+
+  const std::string trace_id = "(load)";
+
+  ExecReq req = MakeFakeExecReq();
+  ExecResp resp = MakeFakeExecResp();
+  tmpdir_->CreateTmpFile("build/output.o", "(output)");
+  std::string key = LocalOutputCache::instance()->MakeCacheKey(req);
+  EXPECT_TRUE(LocalOutputCache::instance()->SaveOutput(
+                  key, &req, &resp, trace_id));
+  const std::int64_t amount =
+      LocalOutputCache::instance()->TotalCacheAmountInByte();
+  LocalOutputCache::Quit();
+
+  // Blob without entry should be removed.
+  const std::string orphan_key =
+      "000000000000000000000000000000000000000000000000000000000000fa6e";
+  tmpdir_->MkdirForPath("cache/00", true);
+  tmpdir_->CreateTmpFile("cache/00/" + orphan_key + ".0", "(orphan)");
+
+  InitLocalOutputCache();
+  LoadCacheEntries();
+  EXPECT_EQ(1U, LocalOutputCache::instance()->TotalCacheCount());
+  EXPECT_EQ(amount, LocalOutputCache::instance()->TotalCacheAmountInByte());
+  EXPECT_NE(0, access(tmpdir_->FullPath("cache/00/" + orphan_key + ".0").c_str(),
+                      F_OK));
+}
+
 TEST_F(LocalOutputCacheTest, WontCollectGarbage) {
   InitLocalOutputCacheWithParams(1000000, 1000000, 100, 100);
 
@@ -6,6 +6,7 @@
 #include "machine_info.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 
 #include "basictypes.h"
@@ -86,6 +87,11 @@ int64_t GetVirtualMemoryOfCurrentProcess() {
   return pmc.PagefileUsage;
 }
 
+double GetLoadAverage() {
+  // Windows doesn't have load average.
+  return 0;
+}
+
 #elif defined(__linux__)
 
 int GetNumCPUs() {
@@ -166,6 +172,15 @@ int64_t GetVirtualMemoryOfCurrentProcess() {
   return vm_size;
 }
 
+double GetLoadAverage() {
+  double loadavg = 0;
+  if (getloadavg(&loadavg, 1) != 1) {
+    LOG(ERROR) << "getloadavg failed";
+    return 0;
+  }
+  return loadavg;
+}
+
 #elif defined(__MACH__)
 int GetNumCPUs() {
   static const char* kCandidates[] = {
@@ -238,6 +253,15 @@ int64_t GetVirtualMemoryOfCurrentProcess() {
   return taskinfo.pti_virtual_size;
 }
 
+double GetLoadAverage() {
+  double loadavg = 0;
+  if (getloadavg(&loadavg, 1) != 1) {
+    LOG(ERROR) << "getloadavg failed";
+    return 0;
+  }
+  return loadavg;
+}
+
 #else
 #  error "Unknown architecture"
 #endif
@@ -28,6 +28,11 @@ int64_t GetConsumingMemoryOfCurrentProcess();
 // If failed obtaining, 0 will be returned.
 int64_t GetVirtualMemoryOfCurrentProcess();
 
+// Gets the system load average over the last 1 minute.
+// Note that it is not divided by the number of CPUs.
+// If failed obtaining or not supported (e.g. Windows), 0 will be returned.
+double GetLoadAverage();
+
 }  // namespace devtools_goma
 
 #endif  // DEVTOOLS_GOMA_CLIENT_MACHINE_INFO_H_
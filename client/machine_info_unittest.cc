@@ -14,6 +14,7 @@ TEST(MachineInfoTest, Smoke) {
   EXPECT_NE(0, GetSystemTotalMemory());
   EXPECT_NE(0, GetConsumingMemoryOfCurrentProcess());
   EXPECT_NE(0, GetVirtualMemoryOfCurrentProcess());
+  EXPECT_GE(GetLoadAverage(), 0);
 }
 
 }  // namespace devtools_goma
@@ -0,0 +1,92 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DEVTOOLS_GOMA_CLIENT_MPSC_QUEUE_H_
+#define DEVTOOLS_GOMA_CLIENT_MPSC_QUEUE_H_
+
+#include <atomic>
+#include <utility>
+
+namespace devtools_goma {
+
+// MpscQueue is an unbounded lock-free multi-producer single-consumer FIFO
+// queue.
+//
+// Push() can be called from any thread, and takes one atomic exchange.
+// Pop() and empty() must be called from one consumer at a time, e.g. the
+// thread owning the queue, or threads holding the same lock.
+//
+// A value pushed by a producer may not be visible to Pop() until its Push()
+// returns, so Pop() may return false while another Push() is in progress.
+// empty() returns false in such case, so the consumer can check it after
+// telling producers that it is going to wait, and producers can wake it up
+// after Push() if it is waiting (see WorkerThread).
+template <typename T>
+class MpscQueue {
+ public:
+  MpscQueue() : head_(&stub_), tail_(&stub_) {}
+
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue& operator=(const MpscQueue&) = delete;
+
+  ~MpscQueue() {
+    T value;
+    while (Pop(&value)) {
+    }
+    if (tail_ != &stub_) {
+      delete tail_;
+    }
+  }
+
+  void Push(T value) {
+    Node* node = new Node(std::move(value));
+    Node* prev = head_.exchange(node, std::memory_order_seq_cst);
+    // The queue is disconnected between the exchange and this store.
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // Pops the oldest value into |value|.
+  // Returns false if no value is available.  Consumer only.
+  bool Pop(T* value) {
+    Node* tail = tail_;
+    Node* next = tail->next.load(std::memory_order_acquire);
+    if (next == nullptr) {
+      return false;
+    }
+    // |next| becomes the new stub node.
+    *value = std::move(next->value);
+    tail_ = next;
+    if (tail != &stub_) {
+      delete tail;
+    }
+    return true;
+  }
+
+  // Returns true if nothing has been pushed since the last Pop().
+  // Consumer only.
+  bool empty() const {
+    return head_.load(std::memory_order_seq_cst) == tail_;
+  }
+
+ private:
+  struct Node {
+    Node() = default;
+    explicit Node(T v) : value(std::move(v)) {}
+
+    std::atomic<Node*> next{nullptr};
+    T value;
+  };
+
+  // Node that has been popped, or |stub_|.  The next node of it is the
+  // oldest value.
+  Node stub_;
+  // Newest node.  Updated by producers.
+  std::atomic<Node*> head_;
+  // Updated by the consumer.
+  Node* tail_;
+};
+
+}  // namespace devtools_goma
+
+#endif  // DEVTOOLS_GOMA_CLIENT_MPSC_QUEUE_H_
@@ -0,0 +1,105 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mpsc_queue.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "absl/memory/memory.h"
+#include "platform_thread.h"
+
+namespace devtools_goma {
+
+TEST(MpscQueue, Basic) {
+  MpscQueue<std::string> q;
+  std::string value;
+  EXPECT_TRUE(q.empty());
+  EXPECT_FALSE(q.Pop(&value));
+
+  q.Push("a");
+  EXPECT_FALSE(q.empty());
+  q.Push("b");
+  EXPECT_TRUE(q.Pop(&value));
+  EXPECT_EQ("a", value);
+  q.Push("c");
+  EXPECT_TRUE(q.Pop(&value));
+  EXPECT_EQ("b", value);
+  EXPECT_TRUE(q.Pop(&value));
+  EXPECT_EQ("c", value);
+  EXPECT_TRUE(q.empty());
+  EXPECT_FALSE(q.Pop(&value));
+}
+
+TEST(MpscQueue, DestroyNonEmpty) {
+  MpscQueue<std::unique_ptr<int>> q;
+  q.Push(absl::make_unique<int>(1));
+  q.Push(absl::make_unique<int>(2));
+  std::unique_ptr<int> value;
+  EXPECT_TRUE(q.Pop(&value));
+  EXPECT_EQ(1, *value);
+  // Remaining value should be deleted with |q|.
+}
+
+namespace {
+
+class PushThread : public PlatformThread::Delegate {
+ public:
+  PushThread(MpscQueue<int>* q, int id, int loop_num)
+      : q_(q), id_(id), loop_num_(loop_num) {}
+
+  void ThreadMain() override {
+    for (int i = 0; i < loop_num_; ++i) {
+      q_->Push(id_ * loop_num_ + i);
+    }
+  }
+
+ private:
+  MpscQueue<int>* q_;
+  const int id_;
+  const int loop_num_;
+};
+
+}  // anonymous namespace
+
+TEST(MpscQueue, ConcurrentPush) {
+  const int kThreadNum = 8;
+  const int kLoopNum = 10000;
+
+  MpscQueue<int> q;
+  std::vector<std::unique_ptr<PushThread>> pushers;
+  std::vector<PlatformThreadHandle> handles(kThreadNum);
+  for (int i = 0; i < kThreadNum; ++i) {
+    pushers.push_back(absl::make_unique<PushThread>(&q, i, kLoopNum));
+    PlatformThread::Create(pushers.back().get(), &handles[i]);
+  }
+
+  // Values from each thread should be popped in the order pushed.
+  std::vector<int> next(kThreadNum, 0);
+  int num_popped = 0;
+  while (num_popped < kThreadNum * kLoopNum) {
+    int value = 0;
+    if (!q.Pop(&value)) {
+      continue;
+    }
+    ++num_popped;
+    const int id = value / kLoopNum;
+    ASSERT_GE(id, 0);
+    ASSERT_LT(id, kThreadNum);
+    EXPECT_EQ(next[id], value % kLoopNum);
+    next[id] = value % kLoopNum + 1;
+  }
+  for (int i = 0; i < kThreadNum; ++i) {
+    PlatformThread::Join(handles[i]);
+  }
+  EXPECT_TRUE(q.empty());
+  for (int i = 0; i < kThreadNum; ++i) {
+    EXPECT_EQ(kLoopNum, next[i]);
+  }
+}
+
+}  // namespace devtools_goma
@@ -0,0 +1,211 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DEVTOOLS_GOMA_CLIENT_SHARDED_HASH_MAP_H_
+#define DEVTOOLS_GOMA_CLIENT_SHARDED_HASH_MAP_H_
+
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/hash/hash.h"
+#include "absl/memory/memory.h"
+#include "autolock_timer.h"
+#include "glog/logging.h"
+#include "lockhelper.h"
+
+namespace devtools_goma {
+
+namespace internal {
+
+// ShardedContainer splits |Container| into shards by hash of key.
+// Each shard has its own ReadWriteLock, so that operations on
+// different keys rarely contend.
+template <typename Key, typename Container, typename Hash>
+class ShardedContainer {
+ public:
+  // 64 is chosen to have enough shards for 64+ worker threads.
+  static constexpr size_t kDefaultNumShards = 64;
+
+  explicit ShardedContainer(size_t num_shards) {
+    DCHECK_GT(num_shards, 0U);
+    shards_.reserve(num_shards);
+    for (size_t i = 0; i < num_shards; ++i) {
+      shards_.push_back(absl::make_unique<Shard>());
+    }
+  }
+
+  ShardedContainer(const ShardedContainer&) = delete;
+  ShardedContainer& operator=(const ShardedContainer&) = delete;
+
+  bool contains(const Key& key) const {
+    const Shard& shard = GetShard(key);
+    AUTO_SHARED_LOCK(lock, &shard.mu);
+    return shard.container.contains(key);
+  }
+
+  bool erase(const Key& key) {
+    Shard& shard = GetShard(key);
+    AUTO_EXCLUSIVE_LOCK(lock, &shard.mu);
+    return shard.container.erase(key) > 0;
+  }
+
+  // Returns the number of elements. Since shards are locked one by one,
+  // this may not be a consistent snapshot under concurrent updates.
+  size_t size() const {
+    size_t total = 0;
+    for (const auto& shard : shards_) {
+      AUTO_SHARED_LOCK(lock, &shard->mu);
+      total += shard->container.size();
+    }
+    return total;
+  }
+
+  void clear() {
+    for (auto& shard : shards_) {
+      AUTO_EXCLUSIVE_LOCK(lock, &shard->mu);
+      shard->container.clear();
+    }
+  }
+
+  size_t num_shards() const { return shards_.size(); }
+
+ protected:
+  struct Shard {
+    mutable ReadWriteLock mu;
+    Container container GUARDED_BY(mu);
+  };
+
+  // Shard is chosen by the upper bits of hash. The lower bits are used in
+  // flat_hash_map to filter slots, so choosing shards by them would make
+  // all keys in a shard have similar bits and probe more slots.
+  size_t ShardIndex(const Key& key) const {
+    const size_t h = Hash()(key);
+    return (h >> (std::numeric_limits<size_t>::digits - 16)) % shards_.size();
+  }
+
+  Shard& GetShard(const Key& key) { return *shards_[ShardIndex(key)]; }
+  const Shard& GetShard(const Key& key) const {
+    return *shards_[ShardIndex(key)];
+  }
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+template <typename Key, typename Container, typename Hash>
+constexpr size_t ShardedContainer<Key, Container, Hash>::kDefaultNumShards;
+
+}  // namespace internal
+
+// ShardedHashMap is a thread-safe hash map, which is split into shards by
+// hash of key to reduce lock contention.
+// Values are returned by copy, since a reference to a value is not valid
+// after the shard lock is released.
+template <typename Key, typename Value, typename Hash = absl::Hash<Key>>
+class ShardedHashMap
+    : public internal::ShardedContainer<Key,
+                                        absl::flat_hash_map<Key, Value, Hash>,
+                                        Hash> {
+  using Base = internal::
+      ShardedContainer<Key, absl::flat_hash_map<Key, Value, Hash>, Hash>;
+
+ public:
+  explicit ShardedHashMap(size_t num_shards = Base::kDefaultNumShards)
+      : Base(num_shards) {}
+
+  // Returns true and sets |value| if |key| is found.
+  bool Find(const Key& key, Value* value) const {
+    const auto& shard = this->GetShard(key);
+    AUTO_SHARED_LOCK(lock, &shard.mu);
+    auto it = shard.container.find(key);
+    if (it == shard.container.end()) {
+      return false;
+    }
+    *value = it->second;
+    return true;
+  }
+
+  // Returns true and moves the value of |key| to |value| if |key| is found.
+  // |key| is erased from the map.
+  bool Take(const Key& key, Value* value) {
+    auto& shard = this->GetShard(key);
+    AUTO_EXCLUSIVE_LOCK(lock, &shard.mu);
+    auto it = shard.container.find(key);
+    if (it == shard.container.end()) {
+      return false;
+    }
+    *value = std::move(it->second);
+    shard.container.erase(it);
+    return true;
+  }
+
+  // Inserts |value| if |key| is not in the map.
+  // Returns true if inserted.
+  bool Insert(const Key& key, Value value) {
+    auto& shard = this->GetShard(key);
+    AUTO_EXCLUSIVE_LOCK(lock, &shard.mu);
+    return shard.container.emplace(key, std::move(value)).second;
+  }
+
+  // Inserts |value|, or overwrites the existing value of |key|.
+  void InsertOrAssign(const Key& key, Value value) {
+    auto& shard = this->GetShard(key);
+    AUTO_EXCLUSIVE_LOCK(lock, &shard.mu);
+    shard.container[key] = std::move(value);
+  }
+
+  // Calls |f(inserted, &value)| for the value of |key| while the shard is
+  // exclusively locked. If |key| is not in the map, a default constructed
+  // value is inserted and |inserted| is true.
+  // |f| must not access this map.
+  template <typename F>
+  void Update(const Key& key, F&& f) {
+    auto& shard = this->GetShard(key);
+    AUTO_EXCLUSIVE_LOCK(lock, &shard.mu);
+    auto p = shard.container.emplace(key, Value());
+    f(p.second, &p.first->second);
+  }
+
+  // Calls |f(key, value)| for each element.
+  // Each shard is shared locked while |f| is called for its elements,
+  // so |f| must not modify this map.
+  template <typename F>
+  void ForEach(F&& f) const {
+    for (const auto& shard : this->shards_) {
+      AUTO_SHARED_LOCK(lock, &shard->mu);
+      for (const auto& it : shard->container) {
+        f(it.first, it.second);
+      }
+    }
+  }
+};
+
+// ShardedHashSet is a thread-safe hash set, split into shards like
+// ShardedHashMap.
+template <typename Key, typename Hash = absl::Hash<Key>>
+class ShardedHashSet
+    : public internal::
+          ShardedContainer<Key, absl::flat_hash_set<Key, Hash>, Hash> {
+  using Base =
+      internal::ShardedContainer<Key, absl::flat_hash_set<Key, Hash>, Hash>;
+
+ public:
+  explicit ShardedHashSet(size_t num_shards = Base::kDefaultNumShards)
+      : Base(num_shards) {}
+
+  // Inserts |key|. Returns true if |key| was not in the set.
+  bool Insert(const Key& key) {
+    auto& shard = this->GetShard(key);
+    AUTO_EXCLUSIVE_LOCK(lock, &shard.mu);
+    return shard.container.insert(key).second;
+  }
+};
+
+}  // namespace devtools_goma
+
+#endif  // DEVTOOLS_GOMA_CLIENT_SHARDED_HASH_MAP_H_
@@ -0,0 +1,159 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sharded_hash_map.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "absl/strings/str_cat.h"
+#include "platform_thread.h"
+
+namespace devtools_goma {
+
+TEST(ShardedHashMap, Basic) {
+  ShardedHashMap<std::string, int> m;
+  EXPECT_EQ(0U, m.size());
+
+  int value = 0;
+  EXPECT_FALSE(m.Find("a", &value));
+  EXPECT_FALSE(m.contains("a"));
+
+  EXPECT_TRUE(m.Insert("a", 1));
+  EXPECT_FALSE(m.Insert("a", 2));
+  EXPECT_TRUE(m.Find("a", &value));
+  EXPECT_EQ(1, value);
+  EXPECT_TRUE(m.contains("a"));
+
+  m.InsertOrAssign("a", 3);
+  m.InsertOrAssign("b", 4);
+  EXPECT_TRUE(m.Find("a", &value));
+  EXPECT_EQ(3, value);
+  EXPECT_TRUE(m.Find("b", &value));
+  EXPECT_EQ(4, value);
+  EXPECT_EQ(2U, m.size());
+
+  EXPECT_TRUE(m.erase("a"));
+  EXPECT_FALSE(m.erase("a"));
+  EXPECT_FALSE(m.contains("a"));
+  EXPECT_EQ(1U, m.size());
+
+  m.clear();
+  EXPECT_EQ(0U, m.size());
+}
+
+TEST(ShardedHashMap, Take) {
+  ShardedHashMap<std::string, std::string> m;
+  std::string value;
+  EXPECT_FALSE(m.Take("a", &value));
+
+  EXPECT_TRUE(m.Insert("a", "x"));
+  EXPECT_TRUE(m.Take("a", &value));
+  EXPECT_EQ("x", value);
+  EXPECT_FALSE(m.contains("a"));
+  EXPECT_FALSE(m.Take("a", &value));
+  EXPECT_EQ(0U, m.size());
+}
+
+TEST(ShardedHashMap, Update) {
+  ShardedHashMap<std::string, int> m;
+
+  bool inserted = false;
+  m.Update("a", [&inserted](bool is_new, int* value) {
+    inserted = is_new;
+    EXPECT_EQ(0, *value);
+    *value = 10;
+  });
+  EXPECT_TRUE(inserted);
+
+  m.Update("a", [&inserted](bool is_new, int* value) {
+    inserted = is_new;
+    EXPECT_EQ(10, *value);
+    *value += 1;
+  });
+  EXPECT_FALSE(inserted);
+
+  int value = 0;
+  EXPECT_TRUE(m.Find("a", &value));
+  EXPECT_EQ(11, value);
+}
+
+TEST(ShardedHashMap, ForEach) {
+  ShardedHashMap<std::string, int> m(4);
+  EXPECT_EQ(4U, m.num_shards());
+  for (int i = 0; i < 100; ++i) {
+    m.Insert(absl::StrCat("key", i), i);
+  }
+  EXPECT_EQ(100U, m.size());
+
+  std::map<std::string, int> all;
+  m.ForEach([&all](const std::string& key, int value) { all[key] = value; });
+  ASSERT_EQ(100U, all.size());
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(i, all[absl::StrCat("key", i)]);
+  }
+}
+
+TEST(ShardedHashSet, Basic) {
+  ShardedHashSet<std::string> s;
+  EXPECT_FALSE(s.contains("a"));
+  EXPECT_TRUE(s.Insert("a"));
+  EXPECT_FALSE(s.Insert("a"));
+  EXPECT_TRUE(s.contains("a"));
+  EXPECT_EQ(1U, s.size());
+  EXPECT_TRUE(s.erase("a"));
+  EXPECT_EQ(0U, s.size());
+}
+
+namespace {
+
+class IncrementThread : public PlatformThread::Delegate {
+ public:
+  IncrementThread(ShardedHashMap<int, int>* m, int num_keys, int loop_num)
+      : m_(m), num_keys_(num_keys), loop_num_(loop_num) {}
+
+  void ThreadMain() override {
+    for (int i = 0; i < loop_num_; ++i) {
+      m_->Update(i % num_keys_, [](bool, int* value) { ++*value; });
+    }
+  }
+
+ private:
+  ShardedHashMap<int, int>* m_;
+  const int num_keys_;
+  const int loop_num_;
+};
+
+}  // anonymous namespace
+
+TEST(ShardedHashMap, ConcurrentUpdate) {
+  const int kThreadNum = 8;
+  const int kNumKeys = 100;
+  const int kLoopNum = 10000;
+
+  ShardedHashMap<int, int> m;
+  std::vector<std::unique_ptr<IncrementThread>> incrementers;
+  std::vector<PlatformThreadHandle> handles(kThreadNum);
+  for (int i = 0; i < kThreadNum; ++i) {
+    incrementers.push_back(
+        absl::make_unique<IncrementThread>(&m, kNumKeys, kLoopNum));
+    PlatformThread::Create(incrementers.back().get(), &handles[i]);
+  }
+  for (int i = 0; i < kThreadNum; ++i) {
+    PlatformThread::Join(handles[i]);
+  }
+
+  EXPECT_EQ(static_cast<size_t>(kNumKeys), m.size());
+  for (int i = 0; i < kNumKeys; ++i) {
+    int value = 0;
+    EXPECT_TRUE(m.Find(i, &value));
+    EXPECT_EQ(kThreadNum * kLoopNum / kNumKeys, value);
+  }
+}
+
+}  // namespace devtools_goma
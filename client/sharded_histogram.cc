@@ -0,0 +1,344 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sharded_histogram.h"
+
+#include <math.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <utility>
+
+#include "compiler_specific.h"
+#include "glog/logging.h"
+MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
+#include "prototmp/goma_stats.pb.h"
+MSVC_POP_WARNING()
+
+namespace devtools_goma {
+
+namespace {
+
+constexpr int64_t kGraphWidth = 50;
+constexpr int64_t kMaxValue =
+    (int64_t{1} << ShardedHistogram::kMaxValueBits) - 1;
+
+// Returns floor(log2(value)) for value > 0.
+int FloorLog2(int64_t value) {
+  DCHECK_GT(value, 0);
+  int n = 0;
+  for (int shift = 32; shift > 0; shift /= 2) {
+    if (value >> shift) {
+      value >>= shift;
+      n += shift;
+    }
+  }
+  return n;
+}
+
+// Returns the bucket of Histogram with logbase 2 for |value|.
+int Log2BucketIndex(int64_t value) {
+  if (value < 1) {
+    return 0;
+  }
+  return FloorLog2(value) + 1;
+}
+
+int ShardIndex() {
+  // Assign shards to threads in round robin, so that threads in a
+  // WorkerThreadManager pool are spread evenly.
+  static std::atomic<int> next_index;
+  thread_local int index = next_index.fetch_add(
+      1, std::memory_order_relaxed) % ShardedHistogram::kNumShards;
+  return index;
+}
+
+}  // anonymous namespace
+
+struct ShardedHistogram::Shard {
+  Shard() { Clear(); }
+
+  void Add(int bucket, int64_t value) {
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+
+    const double square = static_cast<double>(value) * value;
+    double old_square = sum_of_squares.load(std::memory_order_relaxed);
+    while (!sum_of_squares.compare_exchange_weak(
+        old_square, old_square + square, std::memory_order_relaxed)) {
+    }
+
+    int64_t old_min = min.load(std::memory_order_relaxed);
+    while (value < old_min && !min.compare_exchange_weak(
+        old_min, value, std::memory_order_relaxed)) {
+    }
+    int64_t old_max = max.load(std::memory_order_relaxed);
+    while (value > old_max && !max.compare_exchange_weak(
+        old_max, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  void Clear() {
+    for (auto& bucket : buckets) {
+      bucket.store(0, std::memory_order_relaxed);
+    }
+    sum.store(0, std::memory_order_relaxed);
+    sum_of_squares.store(0, std::memory_order_relaxed);
+    min.store(std::numeric_limits<int64_t>::max(), std::memory_order_relaxed);
+    max.store(-1, std::memory_order_relaxed);
+  }
+
+  // Doesn't have a separate count; it is the sum of |buckets|, so that
+  // snapshot percentiles are consistent with its count.
+  std::atomic<int64_t> buckets[kNumBuckets];
+  std::atomic<int64_t> sum;
+  std::atomic<double> sum_of_squares;
+  std::atomic<int64_t> min;
+  std::atomic<int64_t> max;
+};
+
+ShardedHistogram::Snapshot::Snapshot()
+    : buckets_(kNumBuckets),
+      count_(0),
+      sum_(0),
+      sum_of_squares_(0),
+      min_(std::numeric_limits<int64_t>::max()),
+      max_(0) {
+}
+
+void ShardedHistogram::Snapshot::Merge(const Snapshot& other) {
+  for (int i = 0; i < kNumBuckets; ++i) {
+    buckets_[i] += other.buckets_[i];
+  }
+  if (other.count_ > 0) {
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+  sum_of_squares_ += other.sum_of_squares_;
+}
+
+int64_t ShardedHistogram::Snapshot::standard_deviation() const {
+  if (count_ == 0) {
+    return 0;
+  }
+  double squared_mean = (double)sum_ * sum_ / count_ / count_;
+  double variance = sum_of_squares_ / count_ - squared_mean;
+  if (variance <= 0) {
+    return 0;
+  }
+  return static_cast<int64_t>(sqrt(variance));
+}
+
+int64_t ShardedHistogram::Snapshot::Percentile(double quantile) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  quantile = std::max(0.0, std::min(1.0, quantile));
+  const int64_t rank = std::max<int64_t>(
+      1, static_cast<int64_t>(ceil(quantile * count_)));
+  int64_t seen = 0;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    seen += buckets_[i];
+    if (seen >= rank) {
+      int64_t value = (i + 1 < kNumBuckets) ? BucketLowerBound(i + 1) - 1
+                                            : kMaxValue;
+      return std::max(min_, std::min(max_, value));
+    }
+  }
+  return max_;
+}
+
+std::string ShardedHistogram::Snapshot::DebugString(
+    const std::string& name) const {
+  std::stringstream ss;
+  ss << name << ": "
+     << " Basic stats: count: " << count_
+     << " sum: " << sum_
+     << " min: " << min()
+     << " max: " << max()
+     << " mean: " << mean()
+     << " stddev: " << standard_deviation()
+     << " p50: " << Percentile(0.5)
+     << " p90: " << Percentile(0.9)
+     << " p99: " << Percentile(0.99)
+     << " p999: " << Percentile(0.999)
+     << "\n";
+  if (count_ == 0) {
+    return ss.str();
+  }
+
+  // Show graph in logbase 2 buckets, same as Histogram.
+  const std::vector<int64_t> log2_buckets = Log2Buckets();
+  const int min_bucket = std::min<int>(Log2BucketIndex(min_),
+                                       log2_buckets.size() - 1);
+  const int max_bucket = log2_buckets.size() - 1;
+  const int64_t largest =
+      *std::max_element(log2_buckets.begin(), log2_buckets.end());
+
+  auto log2_bucket_value = [](int n) -> int64_t {
+    return n == 0 ? 0 : int64_t{1} << (n - 1);
+  };
+  const size_t longest_min_label =
+      std::to_string(log2_bucket_value(max_bucket)).size();
+  const size_t longest_max_label =
+      std::to_string(log2_bucket_value(max_bucket + 1)).size();
+  for (int i = min_bucket; i <= max_bucket; ++i) {
+    ss << "["
+       << std::setw(longest_min_label) << std::right << log2_bucket_value(i)
+       << "-"
+       << std::setw(longest_max_label) << std::right
+       << log2_bucket_value(i + 1)
+       << "]: ";
+    if (log2_buckets[i] > 0) {
+      ss << std::left
+         << std::string(kGraphWidth * log2_buckets[i] / largest, '#')
+         << log2_buckets[i];
+    }
+    ss << '\n';
+  }
+  return ss.str();
+}
+
+std::vector<int64_t> ShardedHistogram::Snapshot::Log2Buckets() const {
+  // HDR buckets never cross powers of 2, so they can be folded into
+  // logbase 2 buckets.
+  std::vector<int64_t> log2_buckets(Log2BucketIndex(kMaxValue) + 1);
+  for (int i = 0; i < kNumBuckets; ++i) {
+    log2_buckets[Log2BucketIndex(BucketLowerBound(i))] += buckets_[i];
+  }
+  while (log2_buckets.size() > 1 && log2_buckets.back() == 0) {
+    log2_buckets.pop_back();
+  }
+  return log2_buckets;
+}
+
+void ShardedHistogram::Snapshot::DumpToProto(DistributionProto* dist) const {
+  dist->set_count(count_);
+  dist->set_sum(sum_);
+  dist->set_sum_of_squares(sum_of_squares_);
+  dist->set_min(min());
+  dist->set_max(max());
+
+  // Same buckets as Histogram with logbase 2, for the existing consumers
+  // of bucket_value.
+  dist->set_logbase(2);
+  if (count_ > 0) {
+    for (const auto& value : Log2Buckets()) {
+      dist->add_bucket_value(value);
+    }
+  }
+
+  dist->set_p50(Percentile(0.5));
+  dist->set_p90(Percentile(0.9));
+  dist->set_p99(Percentile(0.99));
+  dist->set_p999(Percentile(0.999));
+}
+
+ShardedHistogram::ShardedHistogram(std::string name)
+    : name_(std::move(name)) {
+  for (auto& shard : shards_) {
+    shard.store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+ShardedHistogram::~ShardedHistogram() {
+  for (auto& shard : shards_) {
+    delete shard.load(std::memory_order_relaxed);
+  }
+}
+
+// static
+int ShardedHistogram::BucketIndex(int64_t value) {
+  if (value < kNumSubBuckets) {
+    return value < 0 ? 0 : static_cast<int>(value);
+  }
+  value = std::min(value, kMaxValue);
+  // value is in [2^e, 2^(e+1)), which is split into kNumSubBuckets.
+  const int e = FloorLog2(value);
+  const int shift = e - kSubBucketBits;
+  return (shift + 1) * kNumSubBuckets +
+      static_cast<int>((value >> shift) - kNumSubBuckets);
+}
+
+// static
+int64_t ShardedHistogram::BucketLowerBound(int bucket) {
+  DCHECK_GE(bucket, 0);
+  DCHECK_LT(bucket, kNumBuckets);
+  if (bucket < kNumSubBuckets) {
+    return bucket;
+  }
+  const int shift = bucket / kNumSubBuckets - 1;
+  const int64_t sub_bucket = bucket % kNumSubBuckets;
+  return (kNumSubBuckets + sub_bucket) << shift;
+}
+
+ShardedHistogram::Shard* ShardedHistogram::GetShard() {
+  std::atomic<Shard*>* slot = &shards_[ShardIndex()];
+  Shard* shard = slot->load(std::memory_order_acquire);
+  if (shard != nullptr) {
+    return shard;
+  }
+  std::unique_ptr<Shard> new_shard(new Shard);
+  if (slot->compare_exchange_strong(shard, new_shard.get(),
+                                    std::memory_order_acq_rel)) {
+    return new_shard.release();
+  }
+  // Other thread allocated the shard.
+  return shard;
+}
+
+void ShardedHistogram::Add(int64_t value) {
+  if (value < 0) {
+    LOG(WARNING) << "value is negative:" << value << " for " << name_;
+    value = 0;
+  }
+  GetShard()->Add(BucketIndex(value), value);
+}
+
+ShardedHistogram::Snapshot ShardedHistogram::GetSnapshot() const {
+  Snapshot snapshot;
+  for (const auto& slot : shards_) {
+    const Shard* shard = slot.load(std::memory_order_acquire);
+    if (shard == nullptr) {
+      continue;
+    }
+    int64_t count = 0;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      int64_t n = shard->buckets[i].load(std::memory_order_relaxed);
+      snapshot.buckets_[i] += n;
+      count += n;
+    }
+    if (count == 0) {
+      continue;
+    }
+    snapshot.count_ += count;
+    snapshot.sum_ += shard->sum.load(std::memory_order_relaxed);
+    snapshot.sum_of_squares_ +=
+        shard->sum_of_squares.load(std::memory_order_relaxed);
+    const int64_t min = shard->min.load(std::memory_order_relaxed);
+    const int64_t max = shard->max.load(std::memory_order_relaxed);
+    // min and max may not be updated yet by concurrent Add().
+    if (min <= max) {
+      snapshot.min_ = std::min(snapshot.min_, min);
+      snapshot.max_ = std::max(snapshot.max_, max);
+    }
+  }
+  return snapshot;
+}
+
+void ShardedHistogram::Reset() {
+  for (auto& slot : shards_) {
+    Shard* shard = slot.load(std::memory_order_acquire);
+    if (shard != nullptr) {
+      shard->Clear();
+    }
+  }
+}
+
+}  // namespace devtools_goma
@@ -0,0 +1,123 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DEVTOOLS_GOMA_CLIENT_SHARDED_HISTOGRAM_H_
+#define DEVTOOLS_GOMA_CLIENT_SHARDED_HISTOGRAM_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "absl/time/time.h"
+
+namespace devtools_goma {
+
+class DistributionProto;
+
+// ShardedHistogram is a thread-safe histogram that reports percentiles.
+//
+// Buckets are HDR (high dynamic range) style: values in [2^e, 2^(e+1)) are
+// split into kNumSubBuckets linear buckets, so a percentile is reported
+// with relative error less than 1/kNumSubBuckets.  Values smaller than
+// kNumSubBuckets have their own buckets.
+//
+// Add() updates a shard chosen by the calling thread with relaxed atomic
+// operations, so concurrent Add() calls rarely contend and never take a
+// lock.  GetSnapshot() merges all shards.
+class ShardedHistogram {
+ public:
+  static constexpr int kSubBucketBits = 4;
+  static constexpr int kNumSubBuckets = 1 << kSubBucketBits;
+  // Values larger than 2^kMaxValueBits are counted in the last bucket.
+  static constexpr int kMaxValueBits = 40;
+  static constexpr int kNumBuckets =
+      (kMaxValueBits - kSubBucketBits + 1) * kNumSubBuckets;
+  static constexpr int kNumShards = 8;
+
+  // Snapshot is a merged copy of a ShardedHistogram.
+  // Snapshots can be merged with each other.  Not thread-safe.
+  class Snapshot {
+   public:
+    Snapshot();
+
+    void Merge(const Snapshot& other);
+
+    int64_t count() const { return count_; }
+    int64_t sum() const { return sum_; }
+    double sum_of_squares() const { return sum_of_squares_; }
+    // min() and max() are 0 if count() is 0.
+    int64_t min() const { return count_ > 0 ? min_ : 0; }
+    int64_t max() const { return count_ > 0 ? max_ : 0; }
+    int64_t mean() const { return count_ > 0 ? sum_ / count_ : 0; }
+    int64_t standard_deviation() const;
+
+    // Returns the value at |quantile| (0.0 to 1.0), i.e. the largest value
+    // in the bucket where |quantile| of values fall in or below.
+    // Returns 0 if count() is 0.
+    int64_t Percentile(double quantile) const;
+
+    // Same format as Histogram::DebugString, with percentiles.
+    std::string DebugString(const std::string& name) const;
+
+    // Dumps buckets as logbase 2 buckets, same as Histogram::DumpToProto,
+    // and percentiles.
+    void DumpToProto(DistributionProto* dist) const;
+
+   private:
+    friend class ShardedHistogram;
+
+    // Returns counts in logbase 2 buckets of Histogram, without trailing
+    // empty buckets.
+    std::vector<int64_t> Log2Buckets() const;
+
+    std::vector<int64_t> buckets_;
+    int64_t count_;
+    int64_t sum_;
+    double sum_of_squares_;
+    int64_t min_;
+    int64_t max_;
+  };
+
+  explicit ShardedHistogram(std::string name);
+  ~ShardedHistogram();
+
+  ShardedHistogram(const ShardedHistogram&) = delete;
+  ShardedHistogram& operator=(const ShardedHistogram&) = delete;
+
+  // Negative value is treated as 0.
+  void Add(int64_t value);
+
+  void AddTimeAsMilliseconds(absl::Duration duration) {
+    Add(absl::ToInt64Milliseconds(duration));
+  }
+
+  Snapshot GetSnapshot() const;
+
+  // Values added concurrently with Reset() may be partially cleared.
+  void Reset();
+
+  const std::string& name() const { return name_; }
+
+  // Returns the bucket index for |value|, and the smallest value in
+  // |bucket|.  Exposed for tests.
+  static int BucketIndex(int64_t value);
+  static int64_t BucketLowerBound(int bucket);
+
+ private:
+  struct Shard;
+
+  // Returns the shard for the calling thread, allocating it if needed.
+  Shard* GetShard();
+
+  const std::string name_;
+  // Allocated on first Add() from a thread mapped to the shard, so an idle
+  // histogram doesn't use memory for buckets.
+  std::atomic<Shard*> shards_[kNumShards];
+};
+
+}  // namespace devtools_goma
+
+#endif  // DEVTOOLS_GOMA_CLIENT_SHARDED_HISTOGRAM_H_
@@ -0,0 +1,175 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sharded_histogram.h"
+
+#include <thread>
+#include <vector>
+
+#include "compiler_specific.h"
+#include "gtest/gtest.h"
+MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
+#include "prototmp/goma_stats.pb.h"
+MSVC_POP_WARNING()
+
+namespace devtools_goma {
+
+TEST(ShardedHistogramTest, BucketIndex) {
+  // Values smaller than kNumSubBuckets have their own buckets.
+  for (int i = 0; i < ShardedHistogram::kNumSubBuckets; ++i) {
+    EXPECT_EQ(i, ShardedHistogram::BucketIndex(i));
+    EXPECT_EQ(i, ShardedHistogram::BucketLowerBound(i));
+  }
+  EXPECT_EQ(0, ShardedHistogram::BucketIndex(-1));
+
+  EXPECT_EQ(16, ShardedHistogram::BucketIndex(16));
+  EXPECT_EQ(31, ShardedHistogram::BucketIndex(31));
+  EXPECT_EQ(32, ShardedHistogram::BucketIndex(32));
+  EXPECT_EQ(32, ShardedHistogram::BucketIndex(33));
+  EXPECT_EQ(33, ShardedHistogram::BucketIndex(34));
+  EXPECT_EQ(48, ShardedHistogram::BucketIndex(64));
+  EXPECT_EQ(48, ShardedHistogram::BucketIndex(67));
+  EXPECT_EQ(49, ShardedHistogram::BucketIndex(68));
+
+  EXPECT_EQ(ShardedHistogram::kNumBuckets - 1,
+            ShardedHistogram::BucketIndex(int64_t{1} << 50));
+
+  // BucketLowerBound is the smallest value of the bucket.
+  for (int i = 0; i < ShardedHistogram::kNumBuckets; ++i) {
+    int64_t lower = ShardedHistogram::BucketLowerBound(i);
+    EXPECT_EQ(i, ShardedHistogram::BucketIndex(lower)) << lower;
+    if (i > 0) {
+      EXPECT_EQ(i - 1, ShardedHistogram::BucketIndex(lower - 1)) << lower;
+    }
+  }
+}
+
+TEST(ShardedHistogramTest, Empty) {
+  ShardedHistogram histogram("test");
+  ShardedHistogram::Snapshot snapshot = histogram.GetSnapshot();
+  EXPECT_EQ(0, snapshot.count());
+  EXPECT_EQ(0, snapshot.min());
+  EXPECT_EQ(0, snapshot.max());
+  EXPECT_EQ(0, snapshot.mean());
+  EXPECT_EQ(0, snapshot.standard_deviation());
+  EXPECT_EQ(0, snapshot.Percentile(0.5));
+  EXPECT_EQ("test:  Basic stats: count: 0 sum: 0 min: 0 max: 0 mean: 0 "
+            "stddev: 0 p50: 0 p90: 0 p99: 0 p999: 0\n",
+            snapshot.DebugString(histogram.name()));
+}
+
+TEST(ShardedHistogramTest, Basic) {
+  ShardedHistogram histogram("test");
+  for (int i = 1; i <= 1000; ++i) {
+    histogram.Add(i);
+  }
+  ShardedHistogram::Snapshot snapshot = histogram.GetSnapshot();
+  EXPECT_EQ(1000, snapshot.count());
+  EXPECT_EQ(500500, snapshot.sum());
+  EXPECT_EQ(1, snapshot.min());
+  EXPECT_EQ(1000, snapshot.max());
+  EXPECT_EQ(500, snapshot.mean());
+  EXPECT_EQ(288, snapshot.standard_deviation());
+
+  // Percentiles are within 1/kNumSubBuckets of exact values.
+  EXPECT_GE(snapshot.Percentile(0.5), 500);
+  EXPECT_LE(snapshot.Percentile(0.5), 500 + 500 / 16);
+  EXPECT_GE(snapshot.Percentile(0.9), 900);
+  EXPECT_LE(snapshot.Percentile(0.9), 900 + 900 / 16);
+  EXPECT_GE(snapshot.Percentile(0.99), 990);
+  EXPECT_LE(snapshot.Percentile(0.99), 1000);
+  EXPECT_EQ(1000, snapshot.Percentile(0.999));
+  EXPECT_EQ(1000, snapshot.Percentile(1.0));
+  EXPECT_EQ(1, snapshot.Percentile(0.0));
+
+  histogram.Reset();
+  EXPECT_EQ(0, histogram.GetSnapshot().count());
+}
+
+TEST(ShardedHistogramTest, TailLatency) {
+  ShardedHistogram histogram("test");
+  for (int i = 0; i < 990; ++i) {
+    histogram.Add(10);
+  }
+  for (int i = 0; i < 10; ++i) {
+    histogram.Add(5000);
+  }
+  ShardedHistogram::Snapshot snapshot = histogram.GetSnapshot();
+  EXPECT_EQ(10, snapshot.Percentile(0.5));
+  EXPECT_EQ(10, snapshot.Percentile(0.99));
+  EXPECT_EQ(5000, snapshot.Percentile(0.999));
+}
+
+TEST(ShardedHistogramTest, Merge) {
+  ShardedHistogram h1("h1");
+  ShardedHistogram h2("h2");
+  h1.Add(1);
+  h1.Add(2);
+  h2.Add(100);
+
+  ShardedHistogram::Snapshot snapshot = h1.GetSnapshot();
+  snapshot.Merge(h2.GetSnapshot());
+  snapshot.Merge(ShardedHistogram::Snapshot());
+  EXPECT_EQ(3, snapshot.count());
+  EXPECT_EQ(103, snapshot.sum());
+  EXPECT_EQ(1, snapshot.min());
+  EXPECT_EQ(100, snapshot.max());
+  EXPECT_EQ(100, snapshot.Percentile(1.0));
+}
+
+TEST(ShardedHistogramTest, DumpToProto) {
+  ShardedHistogram histogram("test");
+  histogram.Add(0);
+  histogram.Add(3);
+  histogram.Add(3);
+  histogram.Add(40);
+
+  DistributionProto dist;
+  histogram.GetSnapshot().DumpToProto(&dist);
+  EXPECT_EQ(4, dist.count());
+  EXPECT_EQ(46, dist.sum());
+  EXPECT_EQ(1618, dist.sum_of_squares());
+  EXPECT_EQ(0, dist.min());
+  EXPECT_EQ(40, dist.max());
+  EXPECT_EQ(2, dist.logbase());
+  // Same buckets as Histogram with logbase 2:
+  // [0,1), [1,2), [2,4), [4,8), [8,16), [16,32), [32,64)
+  ASSERT_EQ(7, dist.bucket_value_size());
+  EXPECT_EQ(1, dist.bucket_value(0));
+  EXPECT_EQ(0, dist.bucket_value(1));
+  EXPECT_EQ(2, dist.bucket_value(2));
+  EXPECT_EQ(0, dist.bucket_value(5));
+  EXPECT_EQ(1, dist.bucket_value(6));
+  EXPECT_EQ(3, dist.p50());
+  EXPECT_EQ(40, dist.p90());
+  EXPECT_EQ(40, dist.p99());
+  EXPECT_EQ(40, dist.p999());
+}
+
+TEST(ShardedHistogramTest, ConcurrentAdd) {
+  static constexpr int kNumThreads = 16;
+  static constexpr int kNumValues = 10000;
+
+  ShardedHistogram histogram("test");
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&histogram]() {
+      for (int j = 1; j <= kNumValues; ++j) {
+        histogram.Add(j);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  ShardedHistogram::Snapshot snapshot = histogram.GetSnapshot();
+  EXPECT_EQ(kNumThreads * kNumValues, snapshot.count());
+  EXPECT_EQ(int64_t{kNumThreads} * kNumValues * (kNumValues + 1) / 2,
+            snapshot.sum());
+  EXPECT_EQ(1, snapshot.min());
+  EXPECT_EQ(kNumValues, snapshot.max());
+}
+
+}  // namespace devtools_goma
@@ -41,8 +41,12 @@ void OutputFileTask::Run(OneshotClosure* closure) {
   VLOG(1) << task_->trace_id() << " output " << info_->filename;
   success_ = blob_downloader_->Download(output_, info_);
   if (success_) {
+    // The downloader may have already set hash_key
+    // (e.g. LocalOutputCacheBlobDownloader).
     // TODO: fix to support cas digest.
-    info_->hash_key = ComputeFileBlobHashKey(output_.blob());
+    if (info_->hash_key.empty()) {
+      info_->hash_key = ComputeFileBlobHashKey(output_.blob());
+    }
   } else {
     LOG(WARNING) << task_->trace_id() << " "
                  << (task_->cache_hit() ? "cached" : "no-cached")
@@ -0,0 +1,185 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "trace_recorder.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include "autolock_timer.h"
+#include "glog/logging.h"
+
+namespace devtools_goma {
+
+namespace {
+
+struct ThreadInfo {
+  // Sequential id of the thread, used as "tid" of trace events.
+  // 0 means not assigned yet.
+  int tid = 0;
+  std::string name;
+  // Generation of TraceRecorder where this thread's name is registered.
+  int registered_generation = 0;
+};
+
+// Incremented in each TraceRecorder::Init().
+std::atomic<int> g_generation;
+
+ThreadInfo* CurrentThreadInfo() {
+  static std::atomic<int> next_tid{1};
+  thread_local ThreadInfo info;
+  if (info.tid == 0) {
+    info.tid = next_tid.fetch_add(1, std::memory_order_relaxed);
+  }
+  return &info;
+}
+
+}  // anonymous namespace
+
+TraceRecorder* TraceRecorder::instance_;
+
+TraceRecorder::TraceRecorder(size_t capacity)
+    : shard_capacity_(std::max<size_t>(1, capacity / kNumShards)),
+      shards_(new Shard[kNumShards]) {
+  for (int i = 0; i < kNumShards; ++i) {
+    AUTOLOCK(lock, &shards_[i].mu);
+    shards_[i].spans.resize(shard_capacity_);
+  }
+}
+
+/* static */
+void TraceRecorder::Init(size_t capacity) {
+  CHECK(instance_ == nullptr);
+  g_generation.fetch_add(1, std::memory_order_relaxed);
+  instance_ = new TraceRecorder(capacity);
+  LOG(INFO) << "tracing enabled capacity=" << instance_->capacity();
+}
+
+/* static */
+void TraceRecorder::Quit() {
+  CHECK(instance_ != nullptr);
+  delete instance_;
+  instance_ = nullptr;
+}
+
+/* static */
+TraceRecorder* TraceRecorder::Instance() {
+  return instance_;
+}
+
+/* static */
+void TraceRecorder::SetCurrentThreadName(absl::string_view name) {
+  ThreadInfo* info = CurrentThreadInfo();
+  info->name = std::string(name);
+  // Register the new name on the next AddSpan.
+  info->registered_generation = 0;
+}
+
+/* static */
+void TraceRecorder::RecordSpan(const char* name,
+                               absl::string_view trace_id,
+                               absl::Duration duration) {
+  TraceRecorder* recorder = Instance();
+  if (recorder == nullptr) {
+    return;
+  }
+  const absl::Time end = absl::Now();
+  recorder->AddSpan(name, trace_id, end - duration, end);
+}
+
+void TraceRecorder::AddSpan(const char* name,
+                            absl::string_view trace_id,
+                            absl::Time start,
+                            absl::Time end) {
+  ThreadInfo* info = CurrentThreadInfo();
+  const int generation = g_generation.load(std::memory_order_relaxed);
+  if (info->registered_generation != generation) {
+    RegisterThread(info->tid, info->name);
+    info->registered_generation = generation;
+  }
+
+  Shard* shard = &shards_[info->tid % kNumShards];
+  AUTOLOCK(lock, &shard->mu);
+  Span* span = &shard->spans[shard->next];
+  span->name = name;
+  // Reuses the buffer of the overwritten span.
+  span->trace_id.assign(trace_id.data(), trace_id.size());
+  span->tid = info->tid;
+  span->start = start;
+  span->end = end;
+  shard->next = (shard->next + 1) % shard->spans.size();
+  shard->size = std::min(shard->size + 1, shard->spans.size());
+}
+
+void TraceRecorder::RegisterThread(int tid, const std::string& name) {
+  AUTOLOCK(lock, &mu_);
+  thread_names_[tid] = name.empty() ? "thread" : name;
+}
+
+void TraceRecorder::DumpToJson(Json::Value* json) const {
+  std::vector<Span> spans;
+  for (int i = 0; i < kNumShards; ++i) {
+    const Shard& shard = shards_[i];
+    AUTOLOCK(lock, &shard.mu);
+    // The oldest span is at |next| if the ring buffer is full.
+    size_t index = (shard.next + shard.spans.size() - shard.size) %
+        shard.spans.size();
+    for (size_t n = 0; n < shard.size; ++n) {
+      spans.push_back(shard.spans[index]);
+      index = (index + 1) % shard.spans.size();
+    }
+  }
+  std::sort(spans.begin(), spans.end(),
+            [](const Span& l, const Span& r) { return l.start < r.start; });
+
+  Json::Value events(Json::arrayValue);
+  {
+    Json::Value process_name;
+    process_name["name"] = "process_name";
+    process_name["ph"] = "M";
+    process_name["pid"] = 1;
+    process_name["args"]["name"] = "compiler_proxy";
+    events.append(std::move(process_name));
+  }
+  {
+    AUTOLOCK(lock, &mu_);
+    for (const auto& iter : thread_names_) {
+      Json::Value thread_name;
+      thread_name["name"] = "thread_name";
+      thread_name["ph"] = "M";
+      thread_name["pid"] = 1;
+      thread_name["tid"] = iter.first;
+      thread_name["args"]["name"] = iter.second;
+      events.append(std::move(thread_name));
+    }
+  }
+  for (const auto& span : spans) {
+    Json::Value event;
+    event["name"] = span.name;
+    event["cat"] = "goma";
+    // Complete event, which has both start time and duration.
+    event["ph"] = "X";
+    event["pid"] = 1;
+    event["tid"] = span.tid;
+    event["ts"] = Json::Int64(absl::ToUnixMicros(span.start));
+    event["dur"] = Json::Int64(
+        absl::ToInt64Microseconds(span.end - span.start));
+    event["args"]["trace_id"] = span.trace_id;
+    events.append(std::move(event));
+  }
+
+  *json = Json::Value(Json::objectValue);
+  (*json)["traceEvents"] = std::move(events);
+  (*json)["displayTimeUnit"] = "ms";
+}
+
+void TraceRecorder::Clear() {
+  for (int i = 0; i < kNumShards; ++i) {
+    AUTOLOCK(lock, &shards_[i].mu);
+    shards_[i].next = 0;
+    shards_[i].size = 0;
+  }
+}
+
+}  // namespace devtools_goma
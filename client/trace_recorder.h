@@ -0,0 +1,101 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef DEVTOOLS_GOMA_CLIENT_TRACE_RECORDER_H_
+#define DEVTOOLS_GOMA_CLIENT_TRACE_RECORDER_H_
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "json/json.h"
+#include "lockhelper.h"
+
+namespace devtools_goma {
+
+// TraceRecorder records spans of each phase of tasks (e.g. include
+// processing, file upload, RPC), and exports them in Chrome trace event
+// format, which can be viewed with chrome://tracing or Perfetto UI.
+//
+// Spans are kept in ring buffers sharded by thread, so recording a span
+// takes an uncontended lock and no allocation for short trace_id, and the
+// oldest spans are overwritten when the buffers are full.
+//
+// Tracing is enabled only after Init().  Like Counterz, Init() and Quit()
+// must be called while no other threads use TraceRecorder.
+class TraceRecorder {
+ public:
+  static constexpr int kNumShards = 16;
+
+  // Enables tracing, keeping at most about |capacity| spans.
+  static void Init(size_t capacity);
+  static void Quit();
+  // Returns nullptr if tracing is not enabled.
+  static TraceRecorder* Instance();
+
+  // Sets the name of the calling thread shown in the trace.
+  // It can be called before Init().
+  static void SetCurrentThreadName(absl::string_view name);
+
+  // Records span |name| of |trace_id|, which ended now and took
+  // |duration|, if tracing is enabled.
+  static void RecordSpan(const char* name,
+                         absl::string_view trace_id,
+                         absl::Duration duration);
+
+  // Records span |name| of |trace_id| from |start| to |end| on the calling
+  // thread.  |name| must be a string literal; it is not copied.
+  void AddSpan(const char* name,
+               absl::string_view trace_id,
+               absl::Time start,
+               absl::Time end);
+
+  // Dumps recorded spans as Chrome trace event format JSON object.
+  void DumpToJson(Json::Value* json) const;
+
+  // Clears recorded spans.
+  void Clear();
+
+  size_t capacity() const { return kNumShards * shard_capacity_; }
+
+ private:
+  struct Span {
+    const char* name = nullptr;
+    std::string trace_id;
+    int tid = 0;
+    absl::Time start;
+    absl::Time end;
+  };
+
+  // Ring buffer of spans.
+  struct Shard {
+    mutable Lock mu;
+    std::vector<Span> spans GUARDED_BY(mu);
+    // Index of |spans| where the next span is written.
+    size_t next GUARDED_BY(mu) = 0;
+    size_t size GUARDED_BY(mu) = 0;
+  };
+
+  explicit TraceRecorder(size_t capacity);
+  TraceRecorder(const TraceRecorder&) = delete;
+  TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+  void RegisterThread(int tid, const std::string& name) LOCKS_EXCLUDED(mu_);
+
+  const size_t shard_capacity_;
+  std::unique_ptr<Shard[]> shards_;
+
+  mutable Lock mu_;
+  // tid to thread name.
+  std::map<int, std::string> thread_names_ GUARDED_BY(mu_);
+
+  static TraceRecorder* instance_;
+};
+
+}  // namespace devtools_goma
+
+#endif  // DEVTOOLS_GOMA_CLIENT_TRACE_RECORDER_H_
@@ -0,0 +1,132 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "trace_recorder.h"
+
+#include <thread>
+#include <vector>
+
+#include "absl/time/clock.h"
+#include "gtest/gtest.h"
+
+namespace devtools_goma {
+
+class TraceRecorderTest : public ::testing::Test {
+ protected:
+  void TearDown() override {
+    if (TraceRecorder::Instance() != nullptr) {
+      TraceRecorder::Quit();
+    }
+  }
+
+  // Returns trace events other than metadata events.
+  static std::vector<Json::Value> GetSpanEvents(const Json::Value& json) {
+    std::vector<Json::Value> events;
+    for (const auto& event : json["traceEvents"]) {
+      if (event["ph"].asString() == "X") {
+        events.push_back(event);
+      }
+    }
+    return events;
+  }
+};
+
+TEST_F(TraceRecorderTest, Disabled) {
+  EXPECT_EQ(nullptr, TraceRecorder::Instance());
+  // Should be no-op.
+  TraceRecorder::RecordSpan("Span", "Task:1", absl::Milliseconds(1));
+}
+
+TEST_F(TraceRecorderTest, AddSpan) {
+  TraceRecorder::Init(1024);
+  TraceRecorder* recorder = TraceRecorder::Instance();
+  ASSERT_NE(nullptr, recorder);
+
+  TraceRecorder::SetCurrentThreadName("test_thread");
+  const absl::Time start = absl::FromUnixMicros(1000000);
+  recorder->AddSpan("RPC", "Task:2", start + absl::Microseconds(10),
+                    start + absl::Microseconds(30));
+  recorder->AddSpan("IncludeProcessor", "Task:1", start,
+                    start + absl::Microseconds(5));
+
+  Json::Value json;
+  recorder->DumpToJson(&json);
+  EXPECT_EQ("ms", json["displayTimeUnit"].asString());
+
+  std::vector<Json::Value> events = GetSpanEvents(json);
+  ASSERT_EQ(2U, events.size());
+  // Sorted by start time.
+  EXPECT_EQ("IncludeProcessor", events[0]["name"].asString());
+  EXPECT_EQ("Task:1", events[0]["args"]["trace_id"].asString());
+  EXPECT_EQ(1000000, events[0]["ts"].asInt64());
+  EXPECT_EQ(5, events[0]["dur"].asInt64());
+  EXPECT_EQ("RPC", events[1]["name"].asString());
+  EXPECT_EQ("Task:2", events[1]["args"]["trace_id"].asString());
+  EXPECT_EQ(1000010, events[1]["ts"].asInt64());
+  EXPECT_EQ(20, events[1]["dur"].asInt64());
+  EXPECT_EQ(events[0]["tid"].asInt(), events[1]["tid"].asInt());
+
+  bool found_thread_name = false;
+  for (const auto& event : json["traceEvents"]) {
+    if (event["name"].asString() == "thread_name" &&
+        event["tid"].asInt() == events[0]["tid"].asInt()) {
+      EXPECT_EQ("test_thread", event["args"]["name"].asString());
+      found_thread_name = true;
+    }
+  }
+  EXPECT_TRUE(found_thread_name);
+
+  recorder->Clear();
+  recorder->DumpToJson(&json);
+  EXPECT_TRUE(GetSpanEvents(json).empty());
+}
+
+TEST_F(TraceRecorderTest, RingBuffer) {
+  // One span per shard.
+  TraceRecorder::Init(TraceRecorder::kNumShards);
+  TraceRecorder* recorder = TraceRecorder::Instance();
+  ASSERT_EQ(static_cast<size_t>(TraceRecorder::kNumShards),
+            recorder->capacity());
+
+  const absl::Time start = absl::FromUnixMicros(1000000);
+  for (int i = 0; i < 10; ++i) {
+    recorder->AddSpan("Span", "Task:" + std::to_string(i),
+                      start + absl::Microseconds(i),
+                      start + absl::Microseconds(i + 1));
+  }
+
+  Json::Value json;
+  recorder->DumpToJson(&json);
+  std::vector<Json::Value> events = GetSpanEvents(json);
+  // Only the newest span is kept in the shard of this thread.
+  ASSERT_EQ(1U, events.size());
+  EXPECT_EQ("Task:9", events[0]["args"]["trace_id"].asString());
+}
+
+TEST_F(TraceRecorderTest, ConcurrentRecordSpan) {
+  static constexpr int kNumThreads = 8;
+  static constexpr int kNumSpans = 100;
+  TraceRecorder::Init(kNumThreads * kNumSpans * TraceRecorder::kNumShards);
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([i]() {
+      TraceRecorder::SetCurrentThreadName("worker" + std::to_string(i));
+      for (int j = 0; j < kNumSpans; ++j) {
+        TraceRecorder::RecordSpan("Span", "Task:" + std::to_string(j),
+                                  absl::Microseconds(1));
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  Json::Value json;
+  TraceRecorder::Instance()->DumpToJson(&json);
+  EXPECT_EQ(static_cast<size_t>(kNumThreads * kNumSpans),
+            GetSpanEvents(json).size());
+}
+
+}  // namespace devtools_goma
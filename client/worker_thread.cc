@@ -18,6 +18,7 @@
 #include "glog/logging.h"
 #include "ioutil.h"
 #include "socket_descriptor.h"
+#include "trace_recorder.h"
 #include "worker_thread_manager.h"
 
 #ifdef _WIN32
@@ -204,8 +205,15 @@ WorkerThread::WorkerThread(int pool, std::string name)
       tick_(0),
       shutting_down_(false),
       quit_(false),
+      stealing_workers_(nullptr),
+      num_stealable_closures_(nullptr),
+      num_stealable_pendings_(0),
+      stole_last_(false),
+      num_stolen_(0),
       auto_lock_stat_next_closure_(nullptr),
       auto_lock_stat_poll_events_(nullptr),
+      num_immediate_closures_(0),
+      polling_(false),
       idle_loops_throttler_(name_, &mu_) {
   VLOG(2) << "WorkerThread " << name_;
   int pipe_fd[2];
@@ -293,6 +301,7 @@ void WorkerThread::ThreadMain() {
   TlsSetValue(key_worker_, this);
 #endif
   PlatformThread::SetName(handle_, name_);
+  TraceRecorder::SetCurrentThreadName(name_);
   {
     const ThreadId id = GetCurrentThreadId();
     VLOG(1) << "Start thread:" << id << " " << name_;
@@ -305,6 +314,7 @@ void WorkerThread::ThreadMain() {
     for (int priority = PRIORITY_MIN; priority < NUM_PRIORITIES; ++priority) {
       CHECK(pendings_[priority].empty());
     }
+    CHECK(immediate_closures_.empty());
     CHECK(descriptors_.empty());
     CHECK(periodic_closures_.empty());
     CHECK(quit_);
@@ -316,15 +326,39 @@ bool WorkerThread::Dispatch() {
   now_cached_.set(absl::nullopt);
   // These variables are defined so that we don't have to use them under |mu_|.
   ClosureData closure_data_copy;
+  bool steal = false;
+  bool wakeup_idle_worker = false;
   {
     AUTOLOCK_WITH_STAT(lock, &mu_, auto_lock_stat_next_closure_);
     if (!NextClosure()) {
       VLOG(2) << "Dispatch end " << name_;
       return false;
     }
-    if (!current_closure_data_)
+    if (current_closure_data_) {
+      closure_data_copy = current_closure_data_.value();
+      // Remaining closures would wait until the closure finishes.
+      wakeup_idle_worker = work_stealing_enabled() && !quit_ &&
+                           num_stealable_pendings_ > 0;
+    } else if (work_stealing_enabled() && !quit_ &&
+               num_stealable_closures_->load() > 0) {
+      steal = true;
+    } else {
       return true;
-    closure_data_copy = current_closure_data_.value();
+    }
+  }
+  if (steal) {
+    // Other worker's mu_ is taken in StealClosure, so it must be called
+    // without our mu_.
+    const bool stolen = StealClosureFromOthers(&closure_data_copy);
+    AUTOLOCK(lock, &mu_);
+    stole_last_ = stolen;
+    if (!stolen) {
+      return true;
+    }
+    ++num_stolen_;
+    current_closure_data_ = closure_data_copy;
+  } else if (wakeup_idle_worker) {
+    WakeupIdleWorker();
   }
   VLOG(2) << "Loop closure=" << closure_data_copy.closure_ << " " << name_;
   const Timestamp start = timer_.GetDuration();
@@ -425,12 +459,46 @@ void WorkerThread::UnregisterPeriodicClosure(
 
 void WorkerThread::RunClosure(const char* const location, Closure* closure,
                               Priority priority) {
+  RunClosureInternal(location, closure, priority, false);
+}
+
+void WorkerThread::RunStealableClosure(const char* const location,
+                                       Closure* closure,
+                                       Priority priority) {
+  DCHECK_LT(priority, PRIORITY_HIGH);
+  RunClosureInternal(location, closure, priority, work_stealing_enabled());
+  // The closure would wait until the current closure finishes.
+  if (work_stealing_enabled() && IsBusy()) {
+    WakeupIdleWorker();
+  }
+}
+
+void WorkerThread::RunClosureInternal(const char* const location,
+                                      Closure* closure,
+                                      Priority priority,
+                                      bool stealable) {
   VLOG(2) << "RunClosure " << name_;
   DCHECK_GE(priority, PRIORITY_MIN);
   DCHECK_LT(priority, NUM_PRIORITIES);
+  if (priority == PRIORITY_IMMEDIATE) {
+    DCHECK(!stealable);
+    // Immediate closures are often queued from other threads, so they
+    // are queued without |mu_|.  queuelen and tick are set when the worker
+    // moves it to pendings_.
+    ++num_immediate_closures_;
+    immediate_closures_.Push(
+        ClosureData(location, closure, 0, 0, timer_.GetDuration()));
+    // Pairs with |polling_| and immediate_closures_.empty() in NextClosure,
+    // so either the worker finds the closure before waiting for descriptors,
+    // or we see it waiting.
+    if (!THREAD_ID_IS_SELF(id()) && polling_.load()) {
+      poller_->Signal();
+    }
+    return;
+  }
   {
     AUTOLOCK(lock, &mu_);
-    AddClosure(location, priority, closure);
+    AddClosure(location, priority, closure, stealable);
     // If this is the same thread, or this worker is running some closure
     // (or in other words, this worker is not in select wait),
     // next Dispatch could pick a closure from pendings_, so we don't need
@@ -465,6 +533,7 @@ size_t WorkerThread::load() const {
     int w = 1 << priority;
     n += pendings_[priority].size() * w;
   }
+  n += num_immediate_closures_.load() * (1 << PRIORITY_IMMEDIATE);
   return n;
 }
 
@@ -474,6 +543,7 @@ size_t WorkerThread::pendings() const {
   for (int priority = PRIORITY_MIN; priority < NUM_PRIORITIES; ++priority) {
     n += pendings_[priority].size();
   }
+  n += num_immediate_closures_.load();
   return n;
 }
 
@@ -482,6 +552,15 @@ bool WorkerThread::IsIdle() const {
   return !current_closure_data_ && descriptors_.size() == 0;
 }
 
+bool WorkerThread::IsBusy() const {
+  AUTOLOCK(lock, &mu_);
+  return current_closure_data_.has_value();
+}
+
+void WorkerThread::Wakeup() {
+  poller_->Signal();
+}
+
 std::string WorkerThread::DebugString() const {
   AUTOLOCK(lock, &mu_);
   std::ostringstream s;
@@ -501,8 +580,11 @@ std::string WorkerThread::DebugString() const {
       << " w=" << max_wait_time_[priority]
       << "] ";
   }
+  s << ": queued_immediate=" << num_immediate_closures_.load();
   s << ": delayed=" << delayed_pendings_.size();
   s << ": periodic=" << periodic_closures_.size();
+  if (work_stealing_enabled())
+    s << ": stolen=" << num_stolen_;
   const auto current_pool = pool();
   if (current_pool != 0)
     s << ": pool=" << current_pool;
@@ -536,6 +618,15 @@ bool WorkerThread::NextClosure() {
   // delayed closure.
   poll_interval_ = kDefaultPollInterval;
 
+  // Don't wait for descriptors while closures are being stolen from other
+  // workers.  Otherwise, the worker will be woken up by busy workers.
+  const bool can_steal = work_stealing_enabled() && !quit_ && stole_last_ &&
+                         num_stealable_closures_->load() > 0;
+  if (can_steal) {
+    poll_interval_ = absl::ZeroDuration();
+  }
+
+  DrainImmediateClosures();
   int priority = PRIORITY_IMMEDIATE;
   for (priority = PRIORITY_IMMEDIATE; priority >= PRIORITY_MIN; --priority) {
     if (!pendings_[priority].empty()) {
@@ -562,9 +653,17 @@ bool WorkerThread::NextClosure() {
   VLOG(2) << "poll_interval=" << poll_interval_;
   CHECK_GE(poll_interval_, absl::ZeroDuration());
 
+  if (poll_interval_ > absl::ZeroDuration()) {
+    // RunClosure will wake up the poller for new immediate closures.
+    polling_.store(true);
+    if (!immediate_closures_.empty()) {
+      poll_interval_ = absl::ZeroDuration();
+    }
+  }
   const Timestamp poll_start_time = timer_.GetDuration();
   poller_->PollEvents(descriptors_, poll_interval_, priority, &io_pendings,
                       &mu_, &auto_lock_stat_poll_events_);
+  polling_.store(false);
   // Updated cached time value.
   now_cached_.set(timer_.GetDuration());
   // on Windows, poll time would be 0.51481 or so when no event happened.
@@ -597,7 +696,7 @@ bool WorkerThread::NextClosure() {
                         << " time:" << delayed_closure->time();
     delayed_pendings_.pop();
     AddClosure(delayed_closure->location(), PRIORITY_IMMEDIATE,
-               NewCallback(delayed_closure, &DelayedClosureImpl::Run));
+               NewCallback(delayed_closure, &DelayedClosureImpl::Run), false);
   }
 
   // Check periodic closures.
@@ -608,7 +707,7 @@ bool WorkerThread::NextClosure() {
       LOG_EVERY_SEC(INFO) << "periodic_closure location:"
                           << periodic_closure->location();
       AddClosure(periodic_closure->location(),
-                 PRIORITY_IMMEDIATE, closure);
+                 PRIORITY_IMMEDIATE, closure, false);
     }
   }
 
@@ -619,12 +718,13 @@ bool WorkerThread::NextClosure() {
     while (!pendings.empty()) {
       LOG_EVERY_SEC(INFO) << "io closure: " << pendings.front();
       // TODO: use original location
-      AddClosure(FROM_HERE, io_priority, pendings.front());
+      AddClosure(FROM_HERE, io_priority, pendings.front(), false);
       pendings.pop_front();
     }
   }
 
   // Check pendings again.
+  DrainImmediateClosures();
   for (priority = PRIORITY_IMMEDIATE; priority >= PRIORITY_MIN; --priority) {
     if (!pendings_[priority].empty()) {
       auto priority_typed = static_cast<Priority>(priority);
@@ -655,20 +755,28 @@ bool WorkerThread::NextClosure() {
               << " descriptors=" << descriptors_.empty();
   }
   VLOG(4) << "NextClosure: no closure to run, name_=" << name_;
-  throttler_raii.MarkLoopIdle();
+  // Dispatch will try to steal a closure, which is not an idle loop.
+  if (!can_steal) {
+    throttler_raii.MarkLoopIdle();
+  }
   return true;
 }
 
 void WorkerThread::AddClosure(const char* const location, Priority priority,
-                              Closure* closure) {
+                              Closure* closure, bool stealable) {
   VLOG(2) << "AddClosure " << name_;
   // mu_ held.
   ClosureData closure_data(location, closure, pendings_[priority].size(), tick_,
                            timer_.GetDuration());
+  closure_data.stealable_ = stealable;
   if (closure_data.queuelen_ > max_queuelen_[priority]) {
     max_queuelen_[priority] = closure_data.queuelen_;
   }
   pendings_[priority].push_back(closure_data);
+  if (stealable) {
+    ++num_stealable_pendings_;
+    ++*num_stealable_closures_;
+  }
 }
 
 WorkerThread::ClosureData WorkerThread::GetClosure(Priority priority) {
@@ -676,6 +784,10 @@ WorkerThread::ClosureData WorkerThread::GetClosure(Priority priority) {
   CHECK(!pendings_[priority].empty());
   ClosureData closure_data = pendings_[priority].front();
   pendings_[priority].pop_front();
+  if (closure_data.stealable_) {
+    --num_stealable_pendings_;
+    --*num_stealable_closures_;
+  }
   absl::Duration wait_time = timer_.GetDuration() - closure_data.timestamp_;
   if (wait_time > max_wait_time_[priority]) {
     max_wait_time_[priority] = wait_time;
@@ -689,6 +801,72 @@ WorkerThread::ClosureData WorkerThread::GetClosure(Priority priority) {
   return closure_data;
 }
 
+void WorkerThread::DrainImmediateClosures() {
+  // mu_ held.
+  std::deque<ClosureData>& pendings = pendings_[PRIORITY_IMMEDIATE];
+  ClosureData closure_data;
+  while (immediate_closures_.Pop(&closure_data)) {
+    --num_immediate_closures_;
+    closure_data.queuelen_ = pendings.size();
+    closure_data.tick_ = tick_;
+    if (closure_data.queuelen_ > max_queuelen_[PRIORITY_IMMEDIATE]) {
+      max_queuelen_[PRIORITY_IMMEDIATE] = closure_data.queuelen_;
+    }
+    pendings.push_back(closure_data);
+  }
+}
+
+bool WorkerThread::StealClosure(ClosureData* closure_data) {
+  AUTOLOCK(lock, &mu_);
+  // Closures queued in idle worker will run soon.
+  if (!current_closure_data_ || num_stealable_pendings_ == 0) {
+    return false;
+  }
+  for (int priority = PRIORITY_MIN; priority < PRIORITY_HIGH; ++priority) {
+    std::deque<ClosureData>& pendings = pendings_[priority];
+    // Steals the oldest one, which has waited the longest.
+    for (auto it = pendings.begin(); it != pendings.end(); ++it) {
+      if (!it->stealable_) {
+        continue;
+      }
+      *closure_data = *it;
+      pendings.erase(it);
+      --num_stealable_pendings_;
+      --*num_stealable_closures_;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool WorkerThread::StealClosureFromOthers(ClosureData* closure_data) {
+  auto found =
+      std::find(stealing_workers_->begin(), stealing_workers_->end(), this);
+  CHECK(found != stealing_workers_->end());
+  // Starts from the next worker to spread victims.
+  const size_t start = found - stealing_workers_->begin();
+  const size_t num_workers = stealing_workers_->size();
+  for (size_t i = 1; i < num_workers; ++i) {
+    WorkerThread* worker = (*stealing_workers_)[(start + i) % num_workers];
+    if (worker->StealClosure(closure_data)) {
+      VLOG(2) << name_ << " stole closure " << closure_data->location_
+              << " from " << worker->id();
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkerThread::WakeupIdleWorker() {
+  for (auto* worker : *stealing_workers_) {
+    if (worker == this || worker->IsBusy() || worker->pendings() > 0) {
+      continue;
+    }
+    worker->Wakeup();
+    return;
+  }
+}
+
 void WorkerThread::InitializeWorkerKey() {
 #ifndef _WIN32
   pthread_key_create(&key_worker_, nullptr);
@@ -723,6 +901,16 @@ void WorkerThread::UnregisterTimeoutEvent(SocketDescriptor* d) {
   poller_->UnregisterTimeoutEvent(d);
 }
 
+void WorkerThread::EnableWorkStealing(
+    const std::vector<WorkerThread*>* workers,
+    std::atomic<int>* num_stealable_closures) {
+  CHECK_EQ(handle_, kNullThreadHandle) << "must be called before Start";
+  CHECK(workers != nullptr);
+  CHECK(num_stealable_closures != nullptr);
+  stealing_workers_ = workers;
+  num_stealable_closures_ = num_stealable_closures;
+}
+
 void WorkerThread::Start() {
   VLOG(2) << "Start " << name_;
   CHECK(PlatformThread::Create(this, &handle_));
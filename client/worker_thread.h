@@ -6,6 +6,7 @@
 #ifndef DEVTOOLS_GOMA_CLIENT_WORKER_THREAD_H_
 #define DEVTOOLS_GOMA_CLIENT_WORKER_THREAD_H_
 
+#include <atomic>
 #include <deque>
 #include <map>
 #include <queue>
@@ -20,6 +21,7 @@
 #include "callback.h"
 #include "descriptor_event_type.h"
 #include "lockhelper.h"
+#include "mpsc_queue.h"
 #include "notification.h"
 #include "platform_thread.h"
 #include "scoped_fd.h"
@@ -144,6 +146,14 @@ class WorkerThread : public PlatformThread::Delegate {
   int pool() const { return pool_.get(); }
   ThreadId id() const { return id_.get(); }
   Timestamp NowCached();
+
+  // Enables work stealing.  When the worker has nothing to run, it steals
+  // closures queued by RunStealableClosure on busy workers in |workers|.
+  // |num_stealable_closures| counts stealable closures queued in |workers|.
+  // Both are shared by |workers|, and must outlive the workers.
+  // Must be called before Start().
+  void EnableWorkStealing(const std::vector<WorkerThread*>* workers,
+                          std::atomic<int>* num_stealable_closures);
   void Start();
 
   // Runs delayed closures as soon as possible.
@@ -184,6 +194,13 @@ class WorkerThread : public PlatformThread::Delegate {
   void RunClosure(const char* const location,
                   Closure* closure,
                   Priority priority) LOCKS_EXCLUDED(mu_);
+  // Same as RunClosure, but |closure| may be run on other worker in the same
+  // pool if work stealing is enabled.  |closure| must not depend on
+  // the worker thread, e.g. descriptors registered in it.
+  // |priority| must be lower than PRIORITY_HIGH.
+  void RunStealableClosure(const char* const location,
+                           Closure* closure,
+                           Priority priority) LOCKS_EXCLUDED(mu_);
   CancelableClosure* RunDelayedClosure(const char* const location,
                                        absl::Duration delay,
                                        Closure* closure) LOCKS_EXCLUDED(mu_);
@@ -192,6 +209,10 @@ class WorkerThread : public PlatformThread::Delegate {
   size_t pendings() const LOCKS_EXCLUDED(mu_);
 
   bool IsIdle() const LOCKS_EXCLUDED(mu_);
+  // Returns true if the worker is running a closure.
+  bool IsBusy() const LOCKS_EXCLUDED(mu_);
+  // Wakes up the worker waiting for descriptors.
+  void Wakeup();
   std::string DebugString() const LOCKS_EXCLUDED(mu_);
 
   static std::string Priority_Name(Priority priority);
@@ -212,6 +233,8 @@ class WorkerThread : public PlatformThread::Delegate {
     int queuelen_;
     int tick_;
     Timestamp timestamp_;
+    // True if it can be run on other worker.
+    bool stealable_ = false;
   };
 
   class CompareDelayedClosureImpl {
@@ -257,12 +280,34 @@ class WorkerThread : public PlatformThread::Delegate {
   // Assert mu_ held.
   void AddClosure(const char* const location,
                   Priority priority,
-                  Closure* closure) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+                  Closure* closure,
+                  bool stealable) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void RunClosureInternal(const char* const location,
+                          Closure* closure,
+                          Priority priority,
+                          bool stealable) LOCKS_EXCLUDED(mu_);
 
   // Gets closure in priority.
   // Assert mu_ held.
   ClosureData GetClosure(Priority priority) EXCLUSIVE_LOCKS_REQUIRED(mu_);
 
+  // Moves closures in |immediate_closures_| to
+  // pendings_[PRIORITY_IMMEDIATE].  Called only in the worker thread.
+  void DrainImmediateClosures() EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // Takes the oldest stealable closure in the lowest priority queue, if
+  // this worker is busy.  Called by other worker.
+  // Returns false if no closure to be stolen.
+  bool StealClosure(ClosureData* closure_data) LOCKS_EXCLUDED(mu_);
+
+  // Steals a closure from other workers.
+  bool StealClosureFromOthers(ClosureData* closure_data) LOCKS_EXCLUDED(mu_);
+
+  // Wakes up an idle worker to steal a closure from this worker.
+  void WakeupIdleWorker() LOCKS_EXCLUDED(mu_);
+
+  bool work_stealing_enabled() const { return stealing_workers_ != nullptr; }
+
   static void InitializeWorkerKey();
 
   const std::string name_;
@@ -279,11 +324,29 @@ class WorkerThread : public PlatformThread::Delegate {
   bool shutting_down_ GUARDED_BY(mu_);
   bool quit_ GUARDED_BY(mu_);
 
+  // Set before Start() if work stealing is enabled.
+  const std::vector<WorkerThread*>* stealing_workers_;
+  std::atomic<int>* num_stealable_closures_;
+  // Number of stealable closures in |pendings_|.
+  int num_stealable_pendings_ GUARDED_BY(mu_);
+  // True if the last attempt to steal a closure succeeded, so other
+  // closures would be stolen soon.
+  bool stole_last_ GUARDED_BY(mu_);
+  // Number of closures stolen from other workers.
+  int num_stolen_ GUARDED_BY(mu_);
+
   // These auto_lock_stat_* are owned by g_auto_lock_stats.
   AutoLockStat* auto_lock_stat_next_closure_;
   AutoLockStat* auto_lock_stat_poll_events_;
 
   std::deque<ClosureData> pendings_[NUM_PRIORITIES] GUARDED_BY(mu_);
+  // Closures of PRIORITY_IMMEDIATE queued by RunClosure without |mu_|.
+  // It is consumed by the worker thread with |mu_| held.
+  MpscQueue<ClosureData> immediate_closures_;
+  std::atomic<int> num_immediate_closures_;
+  // True while the worker may wait for descriptors, so RunClosure needs
+  // to wake it up.
+  std::atomic<bool> polling_;
   int max_queuelen_[NUM_PRIORITIES] GUARDED_BY(mu_);
   absl::Duration max_wait_time_[NUM_PRIORITIES] GUARDED_BY(mu_);
 
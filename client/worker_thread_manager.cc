@@ -12,6 +12,7 @@
 #include <queue>
 #include <sstream>
 
+#include "absl/memory/memory.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "autolock_timer.h"
@@ -49,6 +50,7 @@ static void DontCallForkInWorkerThreadManager() {
 WorkerThreadManager::WorkerThreadManager()
     : next_worker_index_(0),
       next_pool_(kFreePool + 1),
+      work_stealing_(false),
       alarm_worker_(nullptr),
       next_periodic_closure_id_(1) {
   WorkerThread::Initialize();
@@ -69,6 +71,12 @@ WorkerThreadManager::~WorkerThreadManager() {
   g_enable_fork = true;
 }
 
+void WorkerThreadManager::EnableWorkStealing() {
+  AUTO_EXCLUSIVE_LOCK(lock, &mu_);
+  CHECK(workers_.empty()) << "must be called before Start";
+  work_stealing_ = true;
+}
+
 void WorkerThreadManager::Start(int num_threads) {
   AUTO_EXCLUSIVE_LOCK(lock, &mu_);
   CHECK(workers_.empty());
@@ -76,23 +84,38 @@ void WorkerThreadManager::Start(int num_threads) {
   alarm_worker_ = new WorkerThread(kAlarmPool, "alarm_worker");
   alarm_worker_->Start();
   next_worker_index_ = 0;
-  for (int i = 0; i < num_threads; ++i) {
-    WorkerThread* worker = new WorkerThread(kFreePool, "worker");
-    worker->Start();
-    workers_.push_back(worker);
-  }
+  StartWorkers(kFreePool, num_threads, "worker");
 }
 
 int WorkerThreadManager::StartPool(int num_threads, const std::string& name) {
   AUTO_EXCLUSIVE_LOCK(lock, &mu_);
   CHECK(GetCurrentWorker() == nullptr);
   int pool = next_pool_++;
+  StartWorkers(pool, num_threads, name);
+  return pool;
+}
+
+void WorkerThreadManager::StartWorkers(int pool,
+                                       int num_threads,
+                                       const std::string& name) {
+  std::vector<WorkerThread*> workers;
   for (int i = 0; i < num_threads; ++i) {
-    WorkerThread* worker = new WorkerThread(pool, name);
+    workers.push_back(new WorkerThread(pool, name));
+  }
+  if (work_stealing_ && num_threads > 1) {
+    // All workers in the pool need to be known before they start.
+    stealing_pools_.push_back(absl::make_unique<StealingPool>());
+    StealingPool* stealing_pool = stealing_pools_.back().get();
+    stealing_pool->workers = workers;
+    for (auto* worker : workers) {
+      worker->EnableWorkStealing(&stealing_pool->workers,
+                                 &stealing_pool->num_stealable_closures);
+    }
+  }
+  for (auto* worker : workers) {
     worker->Start();
     workers_.push_back(worker);
   }
-  return pool;
 }
 
 void WorkerThreadManager::NewThread(OneshotClosure* callback,
@@ -138,16 +161,18 @@ void WorkerThreadManager::Finish() {
     delete alarm_worker_;
     alarm_worker_ = nullptr;
   }
-  for (std::vector<WorkerThread*>::iterator iter = workers_.begin();
-       iter != workers_.end();
-       ++iter) {
-    WorkerThread* worker = *iter;
+  // Workers are deleted after all workers are joined, since a worker may
+  // access other workers to steal closures until it finishes.
+  for (auto* worker : workers_) {
     if (worker) {
       worker->Join();
-      delete worker;
-      *iter = nullptr;
     }
   }
+  for (auto& worker : workers_) {
+    delete worker;
+    worker = nullptr;
+  }
+  stealing_pools_.clear();
 }
 
 WorkerThread::ThreadId WorkerThreadManager::GetCurrentThreadId() {
@@ -271,7 +296,11 @@ void WorkerThreadManager::RunClosureInPool(
     CHECK(candidate_worker);
     next_worker_index_ = (i + 1) % workers_.size();
   }
-  return candidate_worker->RunClosure(location, closure, priority);
+  if (priority < WorkerThread::PRIORITY_HIGH) {
+    candidate_worker->RunStealableClosure(location, closure, priority);
+    return;
+  }
+  candidate_worker->RunClosure(location, closure, priority);
 }
 
 void WorkerThreadManager::RunClosureInThread(
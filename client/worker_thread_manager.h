@@ -6,6 +6,7 @@
 #ifndef DEVTOOLS_GOMA_CLIENT_WORKER_THREAD_MANAGER_H_
 #define DEVTOOLS_GOMA_CLIENT_WORKER_THREAD_MANAGER_H_
 
+#include <atomic>
 #include <memory>
 #include <string>
 #include <vector>
@@ -43,6 +44,15 @@ class WorkerThreadManager {
   WorkerThreadManager();
   ~WorkerThreadManager();
 
+  // Enables work stealing in kFreePool and pools created by StartPool().
+  // Idle worker steals closures queued by RunClosure() or RunClosureInPool()
+  // in lower priority than PRIORITY_HIGH from busy workers in the same pool,
+  // so closures don't wait for a long closure while other workers are idle.
+  // Closures run by RunClosureInThread() and descriptor callbacks are never
+  // stolen.
+  // Must be called before Start().
+  void EnableWorkStealing() LOCKS_EXCLUDED(mu_);
+
   // Starts worker threads.
   void Start(int num_threads) LOCKS_EXCLUDED(mu_);
 
@@ -128,6 +138,17 @@ class WorkerThreadManager {
   friend class WorkerThreadManagerTest;
   struct Periodic;
 
+  // Workers in a pool that steal closures from each other.
+  // It is not modified after the workers start.
+  struct StealingPool {
+    std::vector<WorkerThread*> workers;
+    std::atomic<int> num_stealable_closures{0};
+  };
+
+  // Creates and starts |num_threads| workers in |pool|.
+  void StartWorkers(int pool, int num_threads, const std::string& name)
+      EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
   static void RegisterPeriodicClosureOnAlarmer(
       WorkerThread* alarmer, PeriodicClosureId id, const char* location,
       absl::Duration period, std::unique_ptr<PermanentClosure> closure);
@@ -143,6 +164,8 @@ class WorkerThreadManager {
   std::vector<WorkerThread*> workers_ GUARDED_BY(mu_);
   size_t next_worker_index_ GUARDED_BY(mu_);
   int next_pool_ GUARDED_BY(mu_);
+  bool work_stealing_ GUARDED_BY(mu_);
+  std::vector<std::unique_ptr<StealingPool>> stealing_pools_ GUARDED_BY(mu_);
 
   WorkerThread* alarm_worker_;
 
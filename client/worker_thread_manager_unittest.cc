@@ -19,9 +19,11 @@
 #include <gtest/gtest.h>
 
 #include "absl/memory/memory.h"
+#include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "callback.h"
 #include "compiler_specific.h"
+#include "descriptor_poller.h"
 #include "lockhelper.h"
 #include "mock_socket_factory.h"
 #include "platform_thread.h"
@@ -405,6 +407,132 @@ class WorkerThreadManagerTest : public ::testing::Test {
     }
   }
 
+  OneshotClosure* NewBlockAndRunClosure(
+      WorkerThread::ThreadId* blocked_threadid) {
+    return NewCallback(this, &WorkerThreadManagerTest::BlockAndRunClosure,
+                       blocked_threadid);
+  }
+
+  // Runs on a worker, and queues a closure on the same worker, which can run
+  // only if other worker steals it.
+  void BlockAndRunClosure(WorkerThread::ThreadId* blocked_threadid) {
+    {
+      AutoLock lock(&mu_);
+      *blocked_threadid = wm_->GetCurrentThreadId();
+    }
+    wm_->RunClosure(FROM_HERE, NewTestRun(), WorkerThread::PRIORITY_LOW);
+    SimpleTimer timer;
+    while (test_threadid() == 0 && timer.GetDuration() < absl::Seconds(10)) {
+      absl::SleepFor(absl::Milliseconds(1));
+    }
+  }
+
+  void RunDescriptorReadableTest() {
+    wm_->Start(1);
+    int socks[2];
+    ASSERT_EQ(0, OpenSocketPairForTest(socks));
+    TestReadContext tc(socks[0], absl::ZeroDuration());
+    ScopedSocket s(socks[1]);
+    wm_->RunClosure(FROM_HERE, NewTestDescriptorRead(&tc),
+                    WorkerThread::PRIORITY_LOW);
+    WaitTestRead(&tc, 0);
+    {
+      AutoLock lock(&mu_);
+      EXPECT_EQ(0, tc.num_read_);
+      EXPECT_TRUE(tc.socket_descriptor_ != nullptr);
+    }
+    char buf[1] = { 42 };
+    EXPECT_EQ(1, s.Write(buf, 1));
+    WaitTestRead(&tc, 1);
+    {
+      AutoLock lock(&mu_);
+      EXPECT_EQ(1, tc.num_read_);
+      EXPECT_TRUE(tc.socket_descriptor_ != nullptr);
+    }
+    s.Close();
+    WaitTestReadFinish(&tc);
+    {
+      AutoLock lock(&mu_);
+      EXPECT_EQ(2, tc.num_read_);
+      EXPECT_TRUE(tc.socket_descriptor_ == nullptr);
+    }
+    wm_->Finish();
+  }
+
+  void RunDescriptorWritableTest() {
+    wm_->Start(1);
+    int socks[2];
+    ASSERT_EQ(0, OpenSocketPairForTest(socks));
+    const int kTotalWrite = 8192;
+    TestWriteContext tc(socks[1], kTotalWrite);
+    ScopedSocket s0(socks[0]);
+    ScopedSocket s1(socks[1]);
+    wm_->RunClosure(FROM_HERE, NewTestDescriptorWrite(&tc),
+                    WorkerThread::PRIORITY_LOW);
+    WaitTestWrite(&tc, 1);
+    {
+      AutoLock lock(&mu_);
+      EXPECT_GE(tc.num_write_, 1);
+      EXPECT_TRUE(tc.socket_descriptor_ != nullptr);
+    }
+    char buf[1] = { 42 };
+    int total_read = 0;
+    for (;;) {
+      int n = s0.Read(buf, 1);
+      if (n == 0) {
+        break;
+      }
+      if (n < 0) {
+        PLOG(ERROR) << "read " << n;
+        break;
+      }
+      EXPECT_EQ(1, n);
+      total_read += n;
+    }
+    WaitTestWriteFinish(&tc);
+    {
+      AutoLock lock(&mu_);
+      EXPECT_TRUE(tc.socket_descriptor_ == nullptr);
+      EXPECT_EQ(kTotalWrite, tc.num_write_);
+      EXPECT_EQ(kTotalWrite, total_read);
+    }
+    s1.Close();
+    wm_->Finish();
+  }
+
+  void RunDescriptorTimeoutTest() {
+    wm_->Start(1);
+    int socks[2];
+    ASSERT_EQ(0, OpenSocketPairForTest(socks));
+    TestReadContext tc(socks[0], absl::Milliseconds(500));
+    ScopedSocket s(socks[1]);
+    wm_->RunClosure(FROM_HERE, NewTestDescriptorRead(&tc),
+                    WorkerThread::PRIORITY_LOW);
+    WaitTestRead(&tc, 0);
+    {
+      AutoLock lock(&mu_);
+      EXPECT_EQ(0, tc.num_read_);
+      EXPECT_TRUE(tc.socket_descriptor_ != nullptr);
+    }
+    char buf[1] = { 42 };
+    EXPECT_EQ(1, s.Write(buf, 1));
+    WaitTestRead(&tc, 1);
+    {
+      AutoLock lock(&mu_);
+      EXPECT_EQ(1, tc.num_read_);
+      EXPECT_FALSE(tc.timeout_called_);
+      EXPECT_TRUE(tc.socket_descriptor_ != nullptr);
+    }
+    WaitTestReadFinish(&tc);
+    {
+      AutoLock lock(&mu_);
+      EXPECT_EQ(1, tc.num_read_);
+      EXPECT_TRUE(tc.timeout_called_);
+      EXPECT_TRUE(tc.socket_descriptor_ == nullptr);
+    }
+    wm_->Finish();
+  }
+
   WorkerThread::ThreadId test_threadid() const {
     AutoLock lock(&mu_);
     return test_threadid_;
@@ -514,6 +642,22 @@ TEST_F(WorkerThreadManagerTest, RunClosureInPool) {
   wm_->Finish();
 }
 
+TEST_F(WorkerThreadManagerTest, WorkStealing) {
+  wm_->EnableWorkStealing();
+  wm_->Start(2);
+  WorkerThread::ThreadId blocked_threadid = 0;
+  wm_->RunClosure(FROM_HERE, NewBlockAndRunClosure(&blocked_threadid),
+                  WorkerThread::PRIORITY_LOW);
+  WaitTestRun();
+  EXPECT_NE(test_threadid(), static_cast<WorkerThread::ThreadId>(0));
+  {
+    AutoLock lock(&mu_);
+    EXPECT_NE(blocked_threadid, static_cast<WorkerThread::ThreadId>(0));
+  }
+  EXPECT_NE(test_threadid(), blocked_threadid);
+  wm_->Finish();
+}
+
 TEST_F(WorkerThreadManagerTest, PeriodicClosure) {
   wm_->Start(1);
   SimpleTimer timer;
@@ -526,109 +670,40 @@ TEST_F(WorkerThreadManagerTest, PeriodicClosure) {
 }
 
 TEST_F(WorkerThreadManagerTest, DescriptorReadable) {
-  wm_->Start(1);
-  int socks[2];
-  ASSERT_EQ(0, OpenSocketPairForTest(socks));
-  TestReadContext tc(socks[0], absl::ZeroDuration());
-  ScopedSocket s(socks[1]);
-  wm_->RunClosure(FROM_HERE, NewTestDescriptorRead(&tc),
-                  WorkerThread::PRIORITY_LOW);
-  WaitTestRead(&tc, 0);
-  {
-    AutoLock lock(&mu_);
-    EXPECT_EQ(0, tc.num_read_);
-    EXPECT_TRUE(tc.socket_descriptor_ != nullptr);
-  }
-  char buf[1] = { 42 };
-  EXPECT_EQ(1, s.Write(buf, 1));
-  WaitTestRead(&tc, 1);
-  {
-    AutoLock lock(&mu_);
-    EXPECT_EQ(1, tc.num_read_);
-    EXPECT_TRUE(tc.socket_descriptor_ != nullptr);
-  }
-  s.Close();
-  WaitTestReadFinish(&tc);
-  {
-    AutoLock lock(&mu_);
-    EXPECT_EQ(2, tc.num_read_);
-    EXPECT_TRUE(tc.socket_descriptor_ == nullptr);
-  }
-  wm_->Finish();
+  RunDescriptorReadableTest();
 }
 
 TEST_F(WorkerThreadManagerTest, DescriptorWritable) {
-  wm_->Start(1);
-  int socks[2];
-  ASSERT_EQ(0, OpenSocketPairForTest(socks));
-  const int kTotalWrite = 8192;
-  TestWriteContext tc(socks[1], kTotalWrite);
-  ScopedSocket s0(socks[0]);
-  ScopedSocket s1(socks[1]);
-  wm_->RunClosure(FROM_HERE, NewTestDescriptorWrite(&tc),
-                  WorkerThread::PRIORITY_LOW);
-  WaitTestWrite(&tc, 1);
-  {
-    AutoLock lock(&mu_);
-    EXPECT_GE(tc.num_write_, 1);
-    EXPECT_TRUE(tc.socket_descriptor_ != nullptr);
-  }
-  char buf[1] = { 42 };
-  int total_read = 0;
-  for (;;) {
-    int n = s0.Read(buf, 1);
-    if (n == 0) {
-      break;
-    }
-    if (n < 0) {
-      PLOG(ERROR) << "read " << n;
-      break;
-    }
-    EXPECT_EQ(1, n);
-    total_read += n;
-  }
-  WaitTestWriteFinish(&tc);
-  {
-    AutoLock lock(&mu_);
-    EXPECT_TRUE(tc.socket_descriptor_ == nullptr);
-    EXPECT_EQ(kTotalWrite, tc.num_write_);
-    EXPECT_EQ(kTotalWrite, total_read);
-  }
-  s1.Close();
-  wm_->Finish();
+  RunDescriptorWritableTest();
 }
 
 TEST_F(WorkerThreadManagerTest, DescriptorTimeout) {
-  wm_->Start(1);
-  int socks[2];
-  ASSERT_EQ(0, OpenSocketPairForTest(socks));
-  TestReadContext tc(socks[0], absl::Milliseconds(500));
-  ScopedSocket s(socks[1]);
-  wm_->RunClosure(FROM_HERE, NewTestDescriptorRead(&tc),
-                  WorkerThread::PRIORITY_LOW);
-  WaitTestRead(&tc, 0);
-  {
-    AutoLock lock(&mu_);
-    EXPECT_EQ(0, tc.num_read_);
-    EXPECT_TRUE(tc.socket_descriptor_ != nullptr);
-  }
-  char buf[1] = { 42 };
-  EXPECT_EQ(1, s.Write(buf, 1));
-  WaitTestRead(&tc, 1);
-  {
-    AutoLock lock(&mu_);
-    EXPECT_EQ(1, tc.num_read_);
-    EXPECT_FALSE(tc.timeout_called_);
-    EXPECT_TRUE(tc.socket_descriptor_ != nullptr);
+  RunDescriptorTimeoutTest();
+}
+
+class WorkerThreadManagerIoUringTest : public WorkerThreadManagerTest {
+ protected:
+  void SetUp() override {
+    DescriptorPoller::EnableIoUring(true);
+    WorkerThreadManagerTest::SetUp();
   }
-  WaitTestReadFinish(&tc);
-  {
-    AutoLock lock(&mu_);
-    EXPECT_EQ(1, tc.num_read_);
-    EXPECT_TRUE(tc.timeout_called_);
-    EXPECT_TRUE(tc.socket_descriptor_ == nullptr);
+  void TearDown() override {
+    WorkerThreadManagerTest::TearDown();
+    DescriptorPoller::EnableIoUring(false);
   }
-  wm_->Finish();
+};
+
+// These run with epoll if the kernel doesn't support io_uring.
+TEST_F(WorkerThreadManagerIoUringTest, DescriptorReadable) {
+  RunDescriptorReadableTest();
+}
+
+TEST_F(WorkerThreadManagerIoUringTest, DescriptorWritable) {
+  RunDescriptorWritableTest();
+}
+
+TEST_F(WorkerThreadManagerIoUringTest, DescriptorTimeout) {
+  RunDescriptorTimeoutTest();
 }
 
 }  // namespace devtools_goma
@@ -5,11 +5,15 @@
 
 #include "zero_copy_stream_impl.h"
 
+#include <algorithm>
 #include <cstring>
 
 #include "absl/memory/memory.h"
 #include "absl/strings/escaping.h"
 #include "glog/logging.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/wire_format.h"
+#include "google/protobuf/wire_format_lite.h"
 #include "zlib.h"
 
 namespace {
@@ -19,6 +23,11 @@ constexpr int kDefaultBufferSize = 65536;
 
 constexpr absl::string_view kChunkHeader("0000\r\n");
 constexpr absl::string_view kChunkEnd("\r\n");
+constexpr absl::string_view kLastChunk("0\r\n\r\n");
+
+// String fields larger than this are returned from MessageInputStream
+// without copy.
+constexpr size_t kMinDirectStringSize = 4096;
 
 // FixChunk sets chunk-size and CRLF separator.
 void FixChunk(void* buffer, int chunk_size) {
@@ -36,6 +45,35 @@ void FixChunk(void* buffer, int chunk_size) {
   VLOG(2) << absl::CEscape(header);
 }
 
+// Returns available size for compressed data in a chunk of |buffer_size|.
+// Space for the last chunk is also reserved.
+int ChunkDataSize(int buffer_size) {
+  int size = buffer_size - kChunkHeader.size() - kChunkEnd.size() -
+             kLastChunk.size();
+  CHECK_GT(size, 0);
+  return std::min(size, 0xffff);
+}
+
+// FinishChunk frames |chunk_size| bytes of compressed data at
+// |buffer| + kChunkHeader.size() as a chunk, and appends the last chunk
+// if |last| is true.
+// Returns the size of data in |buffer|.
+int FinishChunk(void* buffer, int chunk_size, bool last) {
+  char* p = static_cast<char*>(buffer);
+  int size = 0;
+  // Empty chunk must not be sent, since it means the end of the body.
+  if (chunk_size > 0) {
+    FixChunk(buffer, chunk_size);
+    size = kChunkHeader.size() + chunk_size + kChunkEnd.size();
+  }
+  if (last) {
+    memcpy(p + size, kLastChunk.data(), kLastChunk.size());
+    size += kLastChunk.size();
+  }
+  VLOG(2) << absl::CEscape(absl::string_view(p, size));
+  return size;
+}
+
 }  // anonymous namespace
 
 namespace devtools_goma {
@@ -129,66 +167,271 @@ int GzipRequestInputStream::CopyingStream::Read(void* buffer, int size) {
     LOG(ERROR) << "Read zerror=" << zerror_ << " " << zError(zerror_);
     return -1;  // error
   }
-  const void* raw_buffer = nullptr;
-  int raw_size = 0;
-  while (raw_size == 0) {
-    if (!raw_data_->Next(&raw_buffer, &raw_size)) {
+  Bytef* start = static_cast<Bytef*>(buffer) + kChunkHeader.size();
+  zcontext_.next_out = start;
+  zcontext_.avail_out = ChunkDataSize(size);
+  // Fills the chunk as much as possible, since deflate may not output
+  // anything for small input.
+  while (zcontext_.avail_out > 0) {
+    if (zcontext_.avail_in == 0 && !input_done_) {
+      const void* raw_buffer = nullptr;
+      int raw_size = 0;
+      if (raw_data_->Next(&raw_buffer, &raw_size)) {
+        // |raw_buffer| is valid until next call of raw_data_->Next(),
+        // so remaining input is kept for next Read.
+        zcontext_.next_in =
+            static_cast<Bytef*>(const_cast<void*>(raw_buffer));
+        zcontext_.avail_in = raw_size;
+        continue;
+      }
       // EOF or error
       // TODO: check bytecount of raw_data to see error or EOF?
-      constexpr absl::string_view kLast("0\r\n\r\n");
-
-      Bytef empty_input[1];
-      zcontext_.next_in = empty_input;
-      zcontext_.avail_in = 0;
-      zcontext_.next_out = static_cast<Bytef*>(buffer) + kChunkHeader.size();
-      Bytef* start = zcontext_.next_out;
-      zcontext_.avail_out =
-          size - kChunkHeader.size() - kChunkEnd.size() - kLast.size();
-      CHECK_GT(zcontext_.avail_out, 0);
-      zerror_ = deflate(&zcontext_, Z_FINISH);
-      if (zerror_ != Z_STREAM_END) {
-        LOG(ERROR) << "deflate finish error " << zerror_ << " "
-                   << zError(zerror_);
-        return -1;
-      }
-      int chunk_size = zcontext_.next_out - start;
-      FixChunk(buffer, chunk_size);
-      zcontext_.next_out += kChunkEnd.size();
-      zcontext_.avail_out -= kChunkEnd.size();
-
-      CHECK_GT(zcontext_.avail_out, kLast.size());
-      memcpy(zcontext_.next_out, kLast.data(), kLast.size());
-      return zcontext_.next_out + kLast.size() - static_cast<Bytef*>(buffer);
+      input_done_ = true;
     }
-    LOG_IF(INFO, raw_size == 0) << "Next returns size=0, retry";
-  }
-  int chunk_size = 0;
-  zcontext_.next_in = static_cast<const Bytef*>(raw_buffer);
-  zcontext_.avail_in = raw_size;
-  zcontext_.next_out = static_cast<Bytef*>(buffer) + kChunkHeader.size();
-  zcontext_.avail_out = size - kChunkHeader.size() - kChunkEnd.size();
-  do {
-    Bytef* start = zcontext_.next_out;
-    zerror_ = deflate(&zcontext_, Z_NO_FLUSH);
-    if (zerror_ != Z_OK) {
+    zerror_ = deflate(&zcontext_, input_done_ ? Z_FINISH : Z_NO_FLUSH);
+    if (zerror_ == Z_STREAM_END) {
+      break;
+    }
+    if (zerror_ != Z_OK && zerror_ != Z_BUF_ERROR) {
       LOG(ERROR) << "deflate error " << zerror_ << " " << zError(zerror_)
-                 << " in=" << zcontext_.next_in << " " << zcontext_.avail_in
-                 << " out=" << zcontext_.next_out << " " << zcontext_.avail_out;
+                 << " in=" << zcontext_.avail_in
+                 << " out=" << zcontext_.avail_out;
       return -1;
     }
-    VLOG(1) << "deflate size=" << (zcontext_.next_out - start);
-    chunk_size += zcontext_.next_out - start;
-  } while (zcontext_.avail_in > 0 && zcontext_.avail_out > 0);
-  if (zcontext_.avail_in > 0) {
-    VLOG(1) << "deflate backup=" << zcontext_.avail_in;
-    raw_data_->BackUp(zcontext_.avail_in);
+    // Z_BUF_ERROR just means no progress was possible.
+    zerror_ = Z_OK;
   }
+  int chunk_size = zcontext_.next_out - start;
   VLOG(1) << "deflate chunk_size=" << chunk_size;
-  FixChunk(buffer, chunk_size);
-  int ret = kChunkHeader.size() + chunk_size + kChunkEnd.size();
-  VLOG(2) << absl::CEscape(
-      absl::string_view(static_cast<const char*>(buffer), ret));
-  return ret;
+  return FinishChunk(buffer, chunk_size, zerror_ == Z_STREAM_END);
+}
+
+MessageInputStream::MessageInputStream(
+    const google::protobuf::Message* message)
+    : size_(message->ByteSizeLong()) {
+  // ByteSizeLong() above also caches sizes of submessages, which are
+  // used to write length of submessages.
+  PushFrame(message, 0);
+}
+
+void MessageInputStream::PushFrame(const google::protobuf::Message* message,
+                                   int group_number) {
+  stack_.push_back(Frame{message, {}, 0, 0, group_number});
+  // Fields are sorted by field number, same as generated serializer.
+  message->GetReflection()->ListFields(*message, &stack_.back().fields);
+}
+
+bool MessageInputStream::Next(const void** data, int* size) {
+  if (pending_.empty() && !Fill()) {
+    last_ = absl::string_view();
+    return false;
+  }
+  last_ = pending_;
+  pending_ = absl::string_view();
+  *data = last_.data();
+  *size = last_.size();
+  byte_count_ += last_.size();
+  return true;
+}
+
+void MessageInputStream::BackUp(int count) {
+  CHECK_GE(count, 0);
+  CHECK_LE(static_cast<size_t>(count), last_.size());
+  CHECK(pending_.empty());
+  pending_ = last_.substr(last_.size() - count);
+  last_ = absl::string_view();
+  byte_count_ -= count;
+}
+
+bool MessageInputStream::Skip(int count) {
+  const void* data;
+  int size;
+  while (count > 0) {
+    if (!Next(&data, &size)) {
+      return false;
+    }
+    if (size > count) {
+      BackUp(size - count);
+      return true;
+    }
+    count -= size;
+  }
+  return true;
+}
+
+bool MessageInputStream::Fill() {
+  if (!direct_.empty()) {
+    pending_ = direct_;
+    direct_ = absl::string_view();
+    return true;
+  }
+  buffer_.clear();
+  {
+    google::protobuf::io::StringOutputStream string_stream(&buffer_);
+    google::protobuf::io::CodedOutputStream output(&string_stream);
+    while (!stack_.empty() && direct_.empty() &&
+           output.ByteCount() < kDefaultBufferSize) {
+      SerializeNext(&output);
+    }
+  }
+  pending_ = buffer_;
+  if (pending_.empty()) {
+    pending_ = direct_;
+    direct_ = absl::string_view();
+  }
+  return !pending_.empty();
+}
+
+void MessageInputStream::SerializeNext(
+    google::protobuf::io::CodedOutputStream* output) {
+  using google::protobuf::FieldDescriptor;
+  using google::protobuf::internal::WireFormat;
+  using google::protobuf::internal::WireFormatLite;
+
+  Frame* frame = &stack_.back();
+  const google::protobuf::Message& message = *frame->message;
+  const google::protobuf::Reflection* reflection = message.GetReflection();
+  if (frame->field_index == frame->fields.size()) {
+    WireFormat::SerializeUnknownFields(reflection->GetUnknownFields(message),
+                                       output);
+    if (frame->group_number > 0) {
+      output->WriteTag(WireFormatLite::MakeTag(
+          frame->group_number, WireFormatLite::WIRETYPE_END_GROUP));
+    }
+    stack_.pop_back();
+    return;
+  }
+  const FieldDescriptor* field = frame->fields[frame->field_index];
+  const bool is_message =
+      (field->type() == FieldDescriptor::TYPE_MESSAGE && !field->is_map()) ||
+      field->type() == FieldDescriptor::TYPE_GROUP;
+  const bool is_string = field->type() == FieldDescriptor::TYPE_STRING ||
+                         field->type() == FieldDescriptor::TYPE_BYTES;
+  if (!is_message && !is_string) {
+    // Scalar fields (including packed ones) and maps are small enough to
+    // serialize at once.
+    WireFormat::SerializeFieldWithCachedSizes(field, message, output);
+    ++frame->field_index;
+    return;
+  }
+
+  const int index = frame->element_index;
+  if (field->is_repeated() &&
+      index + 1 < reflection->FieldSize(message, field)) {
+    ++frame->element_index;
+  } else {
+    ++frame->field_index;
+    frame->element_index = 0;
+  }
+
+  if (is_message) {
+    const google::protobuf::Message& submessage =
+        field->is_repeated()
+            ? reflection->GetRepeatedMessage(message, field, index)
+            : reflection->GetMessage(message, field);
+    // Note: |frame| is invalidated by PushFrame.
+    if (field->type() == FieldDescriptor::TYPE_GROUP) {
+      output->WriteTag(WireFormatLite::MakeTag(
+          field->number(), WireFormatLite::WIRETYPE_START_GROUP));
+      PushFrame(&submessage, field->number());
+      return;
+    }
+    output->WriteTag(WireFormatLite::MakeTag(
+        field->number(), WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+    output->WriteVarint32(submessage.GetCachedSize());
+    PushFrame(&submessage, 0);
+    return;
+  }
+
+  output->WriteTag(WireFormatLite::MakeTag(
+      field->number(), WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+
+  std::string scratch;
+  const std::string& value =
+      field->is_repeated()
+          ? reflection->GetRepeatedStringReference(message, field, index,
+                                                   &scratch)
+          : reflection->GetStringReference(message, field, &scratch);
+  output->WriteVarint32(value.size());
+  if (value.size() >= kMinDirectStringSize && &value != &scratch) {
+    direct_ = value;
+    return;
+  }
+  output->WriteString(value);
+}
+
+#ifdef ENABLE_ZSTD
+ZstdRequestInputStream::ZstdRequestInputStream(
+    std::unique_ptr<ZeroCopyInputStream> raw_data,
+    Options options)
+    : copy_input_(std::move(raw_data), options),
+      impl_(&copy_input_, kDefaultBufferSize) {}
+
+ZstdRequestInputStream::CopyingStream::CopyingStream(
+    std::unique_ptr<ZeroCopyInputStream> raw_data,
+    Options options)
+    : raw_data_(std::move(raw_data)), cctx_(ZSTD_createCCtx()) {
+  CHECK(cctx_ != nullptr);
+  size_t r = ZSTD_CCtx_setParameter(cctx_, ZSTD_c_compressionLevel,
+                                    options.compression_level);
+  const ZstdDictionary* dict = options.dictionary;
+  if (!ZSTD_isError(r) && dict != nullptr) {
+    if (dict->compression_level() == options.compression_level) {
+      r = ZSTD_CCtx_refCDict(cctx_, dict->cdict());
+    } else {
+      r = ZSTD_CCtx_loadDictionary(cctx_, dict->content().data(),
+                                   dict->content().size());
+    }
+  }
+  if (ZSTD_isError(r)) {
+    error_message_ = ZSTD_getErrorName(r);
+    LOG(ERROR) << "failed to set up zstd: " << error_message_;
+  }
+}
+
+ZstdRequestInputStream::CopyingStream::~CopyingStream() {
+  ZSTD_freeCCtx(cctx_);
+}
+
+int ZstdRequestInputStream::CopyingStream::Read(void* buffer, int size) {
+  DCHECK_EQ(size, kDefaultBufferSize);
+  if (finished_) {
+    return 0;  // EOF
+  }
+  if (error_message_ != nullptr) {
+    LOG(ERROR) << "Read zstd error=" << error_message_;
+    return -1;  // error
+  }
+  ZSTD_outBuffer output{static_cast<char*>(buffer) + kChunkHeader.size(),
+                        static_cast<size_t>(ChunkDataSize(size)), 0};
+  while (output.pos < output.size) {
+    if (input_.pos == input_.size && !input_done_) {
+      const void* raw_buffer = nullptr;
+      int raw_size = 0;
+      if (raw_data_->Next(&raw_buffer, &raw_size)) {
+        // |raw_buffer| is valid until next call of raw_data_->Next(),
+        // so remaining input is kept for next Read.
+        input_ = ZSTD_inBuffer{raw_buffer, static_cast<size_t>(raw_size), 0};
+        continue;
+      }
+      input_done_ = true;
+    }
+    size_t r = ZSTD_compressStream2(cctx_, &output, &input_,
+                                    input_done_ ? ZSTD_e_end
+                                                : ZSTD_e_continue);
+    if (ZSTD_isError(r)) {
+      error_message_ = ZSTD_getErrorName(r);
+      LOG(ERROR) << "zstd compress error " << error_message_;
+      return -1;
+    }
+    if (input_done_ && r == 0) {
+      finished_ = true;
+      break;
+    }
+  }
+  VLOG(1) << "zstd chunk_size=" << output.pos;
+  return FinishChunk(buffer, output.pos, finished_);
 }
+#endif  // ENABLE_ZSTD
 
 }  // namespace devtools_goma
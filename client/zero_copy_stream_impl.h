@@ -16,7 +16,10 @@ MSVC_PUSH_DISABLE_WARNING_FOR_PROTO()
 #include "google/protobuf/io/zero_copy_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
 #include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "google/protobuf/message.h"
 MSVC_POP_WARNING()
+#include "absl/strings/string_view.h"
+#include "compress_util.h"
 #include "scoped_fd.h"
 #include "zlib.h"
 
@@ -131,6 +134,62 @@ class GzipInputStream : public google::protobuf::io::ZeroCopyInputStream {
   std::unique_ptr<google::protobuf::io::ZeroCopyInputStream> input_;
 };
 
+// MessageInputStream serializes |message| incrementally, so the whole
+// serialized message is not held in memory.
+// Submessages and groups are serialized field by field, and large string
+// fields are returned without copy.
+// Output is the same as message->SerializeToString().
+// |message| is not owned, and must not be modified while the stream is used.
+class MessageInputStream : public google::protobuf::io::ZeroCopyInputStream {
+ public:
+  explicit MessageInputStream(const google::protobuf::Message* message);
+  ~MessageInputStream() override = default;
+
+  MessageInputStream(MessageInputStream&&) = delete;
+  MessageInputStream(const MessageInputStream&) = delete;
+  MessageInputStream& operator=(const MessageInputStream&) = delete;
+  MessageInputStream& operator=(MessageInputStream&&) = delete;
+
+  // Returns the serialized size of the message.
+  size_t size() const { return size_; }
+
+  bool Next(const void** data, int* size) override;
+  void BackUp(int count) override;
+  bool Skip(int count) override;
+  google::protobuf::int64 ByteCount() const override { return byte_count_; }
+
+ private:
+  struct Frame {
+    const google::protobuf::Message* message;
+    std::vector<const google::protobuf::FieldDescriptor*> fields;
+    size_t field_index;
+    int element_index;
+    // Field number of the group if |message| is a group, or 0.
+    int group_number;
+  };
+
+  void PushFrame(const google::protobuf::Message* message, int group_number);
+
+  // Sets next piece of serialized data in |pending_|.
+  // Returns false if all data has been returned.
+  bool Fill();
+
+  // Serializes next field (or next element of repeated field) of the message
+  // at the top of |stack_|.
+  void SerializeNext(google::protobuf::io::CodedOutputStream* output);
+
+  const size_t size_;
+  std::vector<Frame> stack_;
+  std::string buffer_;
+  // Large string field to be returned after |buffer_|.
+  absl::string_view direct_;
+  // Data not returned yet.
+  absl::string_view pending_;
+  // Data returned by the last Next.
+  absl::string_view last_;
+  google::protobuf::int64 byte_count_ = 0;
+};
+
 // GzipRequestInputStream compresses the input data in chunked encoding.
 // Can be used for HTTP request body.
 class GzipRequestInputStream
@@ -173,11 +232,68 @@ class GzipRequestInputStream
     std::unique_ptr<google::protobuf::io::ZeroCopyInputStream> raw_data_;
     z_stream zcontext_;
     int zerror_ = Z_OK;
+    bool input_done_ = false;
+  };
+
+  CopyingStream copy_input_;
+  google::protobuf::io::CopyingInputStreamAdaptor impl_;
+};
+
+#ifdef ENABLE_ZSTD
+// ZstdRequestInputStream compresses the input data with zstd in chunked
+// encoding.
+// Can be used for HTTP request body.
+class ZstdRequestInputStream
+    : public google::protobuf::io::ZeroCopyInputStream {
+ public:
+  struct Options {
+    int compression_level = 3;
+    // Not owned. Can be nullptr.
+    const ZstdDictionary* dictionary = nullptr;
+  };
+
+  ZstdRequestInputStream(
+      std::unique_ptr<google::protobuf::io::ZeroCopyInputStream> raw_data,
+      Options options);
+  ~ZstdRequestInputStream() override = default;
+
+  ZstdRequestInputStream(ZstdRequestInputStream&&) = delete;
+  ZstdRequestInputStream(const ZstdRequestInputStream&) = delete;
+  ZstdRequestInputStream& operator=(const ZstdRequestInputStream&) = delete;
+  ZstdRequestInputStream& operator=(ZstdRequestInputStream&&) = delete;
+
+  bool Next(const void** data, int* size) override {
+    return impl_.Next(data, size);
+  }
+  void BackUp(int count) override { impl_.BackUp(count); }
+  bool Skip(int size) override { return impl_.Skip(size); }
+  google::protobuf::int64 ByteCount() const override {
+    return impl_.ByteCount();
+  }
+
+ private:
+  class CopyingStream : public google::protobuf::io::CopyingInputStream {
+   public:
+    CopyingStream(
+        std::unique_ptr<google::protobuf::io::ZeroCopyInputStream> raw_data,
+        Options options);
+    ~CopyingStream() override;
+
+    int Read(void* buffer, int size) override;
+
+   private:
+    std::unique_ptr<google::protobuf::io::ZeroCopyInputStream> raw_data_;
+    ZSTD_CCtx* cctx_;
+    ZSTD_inBuffer input_{nullptr, 0, 0};
+    const char* error_message_ = nullptr;
+    bool input_done_ = false;
+    bool finished_ = false;
   };
 
   CopyingStream copy_input_;
   google::protobuf::io::CopyingInputStreamAdaptor impl_;
 };
+#endif  // ENABLE_ZSTD
 
 }  // namespace devtools_goma
 
@@ -9,10 +9,12 @@
 #include "absl/memory/memory.h"
 #include "absl/strings/escaping.h"
 #include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
 #include "glog/logging.h"
 #include "gtest/gtest.h"
 #include "http_util.h"
+#include "prototmp/goma_data.pb.h"
 
 namespace {
 
@@ -27,6 +29,48 @@ std::string ReadAllFromZeroCopyInputStream(
   return data;
 }
 
+// Returns concatenated data of chunks in |body|.
+std::string DecodeChunkedBody(absl::string_view body) {
+  devtools_goma::HttpChunkParser parser;
+  std::vector<absl::string_view> pieces;
+  EXPECT_TRUE(parser.Parse(body, &pieces))
+      << parser.error_message() << " body=" << absl::CEscape(body);
+  EXPECT_TRUE(parser.done());
+  std::string data;
+  for (auto piece : pieces) {
+    data.append(piece.data(), piece.size());
+  }
+  return data;
+}
+
+// Returns ExecReq that has inputs with small and large contents.
+devtools_goma::ExecReq CreateExecReq() {
+  devtools_goma::ExecReq req;
+  req.mutable_command_spec()->set_name("clang++");
+  req.mutable_command_spec()->set_version("4.2.1");
+  req.add_arg("clang++");
+  req.add_arg("-c");
+  req.add_arg("foo.cc");
+  req.set_cwd("/home/goma/src");
+  std::string content;
+  for (int i = 0; i < 3; ++i) {
+    devtools_goma::ExecReq_Input* input = req.add_input();
+    input->set_filename(absl::StrCat("input", i, ".cc"));
+    input->set_hash_key(std::string(64, 'a' + i));
+    content.append(100000 * i, 'x');
+    for (int j = 0; j < 1000 * i; ++j) {
+      absl::StrAppend(&content, "int v", j, " = ", j * j % 7919, ";\n");
+    }
+    devtools_goma::FileBlob* blob = input->mutable_content();
+    blob->set_blob_type(devtools_goma::FileBlob::FILE);
+    blob->set_file_size(content.size());
+    blob->set_content(content);
+  }
+  req.mutable_requester_info()->set_compiler_proxy_id("compiler_proxy_id");
+  req.mutable_requester_info()->set_retry(1);
+  return req;
+}
+
 }  // anonymous namespace
 
 namespace devtools_goma {
@@ -42,7 +86,7 @@ TEST(ZeroCopyStreamImplTest, GzipRequestInputStream) {
   EXPECT_TRUE(absl::EndsWith(compressed_req_body, "0\r\n\r\n"))
       << absl::CEscape(compressed_req_body);
 
-  HttpChunkParser parser;
+  devtools_goma::HttpChunkParser parser;
   std::vector<absl::string_view> pieces;
   EXPECT_TRUE(parser.Parse(compressed_req_body, &pieces))
       << parser.error_message()
@@ -64,4 +108,100 @@ TEST(ZeroCopyStreamImplTest, GzipRequestInputStream) {
   EXPECT_EQ(kInputData, decompressed_data);
 }
 
+TEST(ZeroCopyStreamImplTest, GzipRequestInputStreamLargeInput) {
+  const std::string serialized = CreateExecReq().SerializeAsString();
+  ASSERT_GT(serialized.size(), 65536U);
+
+  GzipRequestInputStream::Options options;
+  GzipRequestInputStream request(
+      absl::make_unique<StringInputStream>(serialized), options);
+  std::string compressed = DecodeChunkedBody(
+      ReadAllFromZeroCopyInputStream(&request));
+
+  GzipInputStream gzip_input(
+      absl::make_unique<StringInputStream>(std::move(compressed)));
+  EXPECT_EQ(serialized, ReadAllFromZeroCopyInputStream(&gzip_input));
+}
+
+TEST(ZeroCopyStreamImplTest, MessageInputStream) {
+  const ExecReq req = CreateExecReq();
+  const std::string serialized = req.SerializeAsString();
+
+  MessageInputStream input(&req);
+  EXPECT_EQ(serialized.size(), input.size());
+  EXPECT_EQ(serialized, ReadAllFromZeroCopyInputStream(&input));
+  EXPECT_EQ(static_cast<google::protobuf::int64>(serialized.size()),
+            input.ByteCount());
+}
+
+TEST(ZeroCopyStreamImplTest, MessageInputStreamEmpty) {
+  const ExecReq req;
+  MessageInputStream input(&req);
+  EXPECT_EQ(0U, input.size());
+  EXPECT_EQ("", ReadAllFromZeroCopyInputStream(&input));
+}
+
+TEST(ZeroCopyStreamImplTest, MessageInputStreamUnknownFields) {
+  ExecReq req = CreateExecReq();
+  // Parse ExecReq as FileBlob, so most fields become unknown fields.
+  FileBlob blob;
+  ASSERT_TRUE(blob.ParsePartialFromString(req.SerializeAsString()));
+  ASSERT_GT(blob.GetReflection()->GetUnknownFields(blob).field_count(), 0);
+  const std::string serialized = blob.SerializePartialAsString();
+
+  MessageInputStream input(&blob);
+  EXPECT_EQ(serialized, ReadAllFromZeroCopyInputStream(&input));
+}
+
+TEST(ZeroCopyStreamImplTest, MessageInputStreamBackUpAndSkip) {
+  const ExecReq req = CreateExecReq();
+  const std::string serialized = req.SerializeAsString();
+
+  MessageInputStream input(&req);
+  std::string data;
+  const void* buffer;
+  int size;
+  while (input.Next(&buffer, &size)) {
+    // Reads half of each piece.
+    int n = (size + 1) / 2;
+    data.append(static_cast<const char*>(buffer), n);
+    input.BackUp(size - n);
+    EXPECT_EQ(static_cast<google::protobuf::int64>(data.size()),
+              input.ByteCount());
+  }
+  EXPECT_EQ(serialized, data);
+
+  MessageInputStream skip_input(&req);
+  ASSERT_TRUE(skip_input.Skip(100000));
+  EXPECT_EQ(serialized.substr(100000),
+            ReadAllFromZeroCopyInputStream(&skip_input));
+  EXPECT_FALSE(skip_input.Skip(1));
+
+  // Parser also uses BackUp.
+  MessageInputStream parse_input(&req);
+  ExecReq parsed;
+  ASSERT_TRUE(parsed.ParseFromZeroCopyStream(&parse_input));
+  EXPECT_EQ(serialized, parsed.SerializeAsString());
+}
+
+#ifdef ENABLE_ZSTD
+TEST(ZeroCopyStreamImplTest, ZstdRequestInputStream) {
+  const ExecReq req = CreateExecReq();
+  const std::string serialized = req.SerializeAsString();
+
+  ZstdRequestInputStream::Options options;
+  options.compression_level = 1;
+  ZstdRequestInputStream request(absl::make_unique<MessageInputStream>(&req),
+                                 options);
+  std::string compressed_req_body = ReadAllFromZeroCopyInputStream(&request);
+  EXPECT_TRUE(absl::EndsWith(compressed_req_body, "0\r\n\r\n"));
+  std::string compressed = DecodeChunkedBody(compressed_req_body);
+
+  ZstdInputStream zstd_input(
+      absl::make_unique<StringInputStream>(std::move(compressed)));
+  EXPECT_EQ(serialized, ReadAllFromZeroCopyInputStream(&zstd_input));
+  EXPECT_EQ(nullptr, zstd_input.ErrorMessage());
+}
+#endif  // ENABLE_ZSTD
+
 }  // namespace devtools_goma
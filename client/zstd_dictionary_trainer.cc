@@ -0,0 +1,58 @@
+// Copyright 2019 The Goma Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+//  This tool is used to train zstd dictionary for HttpRPC from ExecReqs
+//  dumped by compiler_proxy (exec_req.data).
+//  The dictionary should be deployed to both the server and
+//  GOMA_HTTP_RPC_ZSTD_DICTIONARY_FILE.
+//
+
+#include <stdlib.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "compress_util.h"
+#include "file_helper.h"
+#include "glog/logging.h"
+#include "prototmp/goma_data.pb.h"
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: \n"
+              << argv[0] << " <output dictionary> <exec_req.data>..."
+              << std::endl;
+    exit(1);
+  }
+
+  std::vector<std::string> samples;
+  for (int i = 2; i < argc; ++i) {
+    std::string data;
+    LOG_IF(FATAL, !devtools_goma::ReadFileToString(argv[i], &data))
+        << "failed to read " << argv[i];
+    devtools_goma::ExecReq req;
+    LOG_IF(FATAL, !req.ParseFromString(data)) << "failed to parse " << argv[i];
+    // Dumped request has contents of input files, but compiler_proxy usually
+    // sends only hash keys of them.
+    for (auto& input : *req.mutable_input()) {
+      input.clear_content();
+    }
+    samples.push_back(req.SerializeAsString());
+  }
+
+#ifdef ENABLE_ZSTD
+  const size_t kMaxDictionarySize = 112 * 1024;
+  std::string dictionary;
+  LOG_IF(FATAL, !devtools_goma::ZstdDictionary::Train(
+                    samples, kMaxDictionarySize, &dictionary))
+      << "failed to train dictionary from " << samples.size() << " samples";
+  LOG_IF(FATAL, !devtools_goma::WriteStringToFile(dictionary, argv[1]))
+      << "failed to write " << argv[1];
+  std::cout << "wrote " << argv[1] << " size=" << dictionary.size()
+            << " samples=" << samples.size() << std::endl;
+#else
+  LOG(FATAL) << "zstd is not supported.  need ENABLE_ZSTD";
+#endif
+}
@@ -12,6 +12,9 @@
 #include "absl/strings/string_view.h"
 #include "glog/logging.h"
 #include "google/protobuf/io/gzip_stream.h"
+#ifdef ENABLE_ZSTD
+#include "zdict.h"
+#endif  // ENABLE_ZSTD
 
 using google::protobuf::io::GzipInputStream;
 
@@ -35,6 +38,8 @@ const char* GetEncodingName(EncodingType type) {
       return "gzip";
     case EncodingType::LZMA2:
       return "lzma2";
+    case EncodingType::ZSTD:
+      return "zstd";
   }
 }
 
@@ -48,6 +53,9 @@ EncodingType ParseEncodingName(absl::string_view s) {
   if (absl::StartsWith(s, "lzma2")) {
     return EncodingType::LZMA2;
   }
+  if (absl::StartsWith(s, "zstd")) {
+    return EncodingType::ZSTD;
+  }
   return EncodingType::NO_ENCODING;
 }
 
@@ -75,6 +83,7 @@ EncodingType PickEncoding(const std::vector<EncodingType>& accepts,
 EncodingType GetEncodingFromHeader(absl::string_view header) {
   std::vector<EncodingType> prefs = {
     EncodingType::LZMA2,
+    EncodingType::ZSTD,
     EncodingType::GZIP,
     EncodingType::DEFLATE,
   };
@@ -320,6 +329,270 @@ bool LZMAOutputStream::Close() {
 
 #endif
 
+#ifdef ENABLE_ZSTD
+std::unique_ptr<ZstdDictionary> ZstdDictionary::Create(
+    std::string content, int compression_level) {
+  const uint32_t id = ZDICT_getDictID(content.data(), content.size());
+  if (id == 0) {
+    LOG(WARNING) << "not a zstd dictionary. size=" << content.size();
+    return nullptr;
+  }
+  ZSTD_CDict* cdict =
+      ZSTD_createCDict(content.data(), content.size(), compression_level);
+  ZSTD_DDict* ddict = ZSTD_createDDict(content.data(), content.size());
+  if (cdict == nullptr || ddict == nullptr) {
+    LOG(WARNING) << "failed to create zstd dictionary. id=" << id;
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeDDict(ddict);
+    return nullptr;
+  }
+  return std::unique_ptr<ZstdDictionary>(new ZstdDictionary(
+      std::move(content), id, compression_level, cdict, ddict));
+}
+
+bool ZstdDictionary::Train(const std::vector<std::string>& samples,
+                           size_t max_dictionary_size,
+                           std::string* dictionary) {
+  std::string samples_buffer;
+  std::vector<size_t> sample_sizes;
+  sample_sizes.reserve(samples.size());
+  for (const auto& sample : samples) {
+    samples_buffer += sample;
+    sample_sizes.push_back(sample.size());
+  }
+  dictionary->resize(max_dictionary_size);
+  size_t size = ZDICT_trainFromBuffer(
+      &(*dictionary)[0], dictionary->size(), samples_buffer.data(),
+      sample_sizes.data(), sample_sizes.size());
+  if (ZDICT_isError(size)) {
+    LOG(WARNING) << "failed to train zstd dictionary:"
+                 << ZDICT_getErrorName(size)
+                 << " num_samples=" << samples.size();
+    dictionary->clear();
+    return false;
+  }
+  dictionary->resize(size);
+  return true;
+}
+
+ZstdDictionary::ZstdDictionary(std::string content,
+                               uint32_t id,
+                               int compression_level,
+                               ZSTD_CDict* cdict,
+                               ZSTD_DDict* ddict)
+    : content_(std::move(content)),
+      id_(id),
+      compression_level_(compression_level),
+      cdict_(cdict),
+      ddict_(ddict) {}
+
+ZstdDictionary::~ZstdDictionary() {
+  ZSTD_freeCDict(cdict_);
+  ZSTD_freeDDict(ddict_);
+}
+
+ZstdInputStream::ZstdInputStream(
+    std::unique_ptr<ZeroCopyInputStream> sub_stream,
+    const ZstdDictionary* dictionary)
+    : sub_stream_(std::move(sub_stream)),
+      dctx_(ZSTD_createDCtx()),
+      input_{nullptr, 0, 0},
+      output_buffer_size_(ZSTD_DStreamOutSize()) {
+  CHECK(dctx_ != nullptr);
+  output_buffer_ = absl::make_unique<char[]>(output_buffer_size_);
+  if (dictionary != nullptr) {
+    size_t r = ZSTD_DCtx_refDDict(dctx_, dictionary->ddict());
+    if (ZSTD_isError(r)) {
+      error_message_ = ZSTD_getErrorName(r);
+    }
+  }
+}
+
+ZstdInputStream::~ZstdInputStream() {
+  ZSTD_freeDCtx(dctx_);
+}
+
+bool ZstdInputStream::Next(const void** data, int* size) {
+  if (backup_size_ > 0) {
+    *data = output_buffer_.get() + output_size_ - backup_size_;
+    *size = backup_size_;
+    backup_size_ = 0;
+    return true;
+  }
+  while (error_message_ == nullptr) {
+    if (input_.pos == input_.size && !output_full_ && !sub_stream_end_) {
+      const void* in;
+      int in_size;
+      if (sub_stream_->Next(&in, &in_size)) {
+        input_ = ZSTD_inBuffer{in, static_cast<size_t>(in_size), 0};
+      } else {
+        input_ = ZSTD_inBuffer{nullptr, 0, 0};
+        sub_stream_end_ = true;
+      }
+    }
+    if (input_.pos == input_.size && !output_full_ && sub_stream_end_) {
+      if (last_result_ != 0) {
+        error_message_ = "truncated zstd frame";
+      }
+      return false;
+    }
+    ZSTD_outBuffer output{output_buffer_.get(), output_buffer_size_, 0};
+    size_t r = ZSTD_decompressStream(dctx_, &output, &input_);
+    if (ZSTD_isError(r)) {
+      error_message_ = ZSTD_getErrorName(r);
+      LOG(WARNING) << "zstd decompression error:" << error_message_;
+      return false;
+    }
+    last_result_ = r;
+    output_full_ = output.pos == output.size;
+    if (output.pos > 0) {
+      output_size_ = output.pos;
+      byte_count_ += output.pos;
+      *data = output_buffer_.get();
+      *size = output.pos;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ZstdInputStream::BackUp(int count) {
+  CHECK_GE(count, 0);
+  CHECK_LE(backup_size_ + count, output_size_);
+  backup_size_ += count;
+}
+
+bool ZstdInputStream::Skip(int count) {
+  const void* data;
+  int size;
+  bool ok = false;
+  while ((ok = Next(&data, &size)) && (size < count)) {
+    count -= size;
+  }
+  if (ok && (size > count)) {
+    BackUp(size - count);
+  }
+  return ok;
+}
+
+int64_t ZstdInputStream::ByteCount() const {
+  return byte_count_ - backup_size_;
+}
+
+ZstdOutputStream::Options::Options()
+    : compression_level(ZSTD_CLEVEL_DEFAULT),
+      dictionary(nullptr),
+      buffer_size(ZSTD_CStreamInSize()) {
+}
+
+ZstdOutputStream::ZstdOutputStream(
+    std::unique_ptr<ZeroCopyOutputStream> sub_stream)
+    : ZstdOutputStream(std::move(sub_stream), Options()) {
+}
+
+ZstdOutputStream::ZstdOutputStream(
+    std::unique_ptr<ZeroCopyOutputStream> sub_stream, const Options& options)
+    : sub_stream_(std::move(sub_stream)),
+      cctx_(ZSTD_createCCtx()),
+      input_buffer_size_(options.buffer_size) {
+  CHECK(cctx_ != nullptr);
+  CHECK_GT(input_buffer_size_, 0);
+  input_buffer_ = absl::make_unique<char[]>(input_buffer_size_);
+  size_t r = ZSTD_CCtx_setParameter(cctx_, ZSTD_c_compressionLevel,
+                                    options.compression_level);
+  const ZstdDictionary* dict = options.dictionary;
+  if (!ZSTD_isError(r) && dict != nullptr) {
+    if (dict->compression_level() == options.compression_level) {
+      r = ZSTD_CCtx_refCDict(cctx_, dict->cdict());
+    } else {
+      // CDict is bound to its compression level, so the dictionary needs
+      // to be digested again for this stream.
+      r = ZSTD_CCtx_loadDictionary(cctx_, dict->content().data(),
+                                   dict->content().size());
+    }
+  }
+  if (ZSTD_isError(r)) {
+    error_message_ = ZSTD_getErrorName(r);
+  }
+}
+
+ZstdOutputStream::~ZstdOutputStream() {
+  ZSTD_freeCCtx(cctx_);
+}
+
+bool ZstdOutputStream::Compress(ZSTD_EndDirective directive) {
+  ZSTD_inBuffer input{input_buffer_.get(), input_size_, 0};
+  for (;;) {
+    if (sub_data_ == nullptr) {
+      if (!sub_stream_->Next(&sub_data_, &sub_data_size_)) {
+        sub_data_ = nullptr;
+        error_message_ = "failed to write to sub stream";
+        return false;
+      }
+      sub_data_used_ = 0;
+    }
+    ZSTD_outBuffer output{sub_data_, static_cast<size_t>(sub_data_size_),
+                          static_cast<size_t>(sub_data_used_)};
+    size_t r = ZSTD_compressStream2(cctx_, &output, &input, directive);
+    if (ZSTD_isError(r)) {
+      error_message_ = ZSTD_getErrorName(r);
+      LOG(WARNING) << "zstd compression error:" << error_message_;
+      return false;
+    }
+    sub_data_used_ = output.pos;
+    if (output.pos == output.size) {
+      // We don't own the buffer any more.
+      sub_data_ = nullptr;
+    }
+    if (directive == ZSTD_e_continue ? input.pos == input.size : r == 0) {
+      break;
+    }
+  }
+  input_size_ = 0;
+  return true;
+}
+
+bool ZstdOutputStream::Next(void** data, int* size) {
+  if (error_message_ != nullptr) {
+    return false;
+  }
+  if (input_size_ > 0 && !Compress(ZSTD_e_continue)) {
+    return false;
+  }
+  byte_count_ += input_buffer_size_;
+  input_size_ = input_buffer_size_;
+  *data = input_buffer_.get();
+  *size = input_buffer_size_;
+  return true;
+}
+
+void ZstdOutputStream::BackUp(int count) {
+  CHECK_GE(count, 0);
+  CHECK_LE(static_cast<size_t>(count), input_size_);
+  input_size_ -= count;
+  byte_count_ -= count;
+}
+
+int64_t ZstdOutputStream::ByteCount() const {
+  return byte_count_;
+}
+
+bool ZstdOutputStream::Close() {
+  if (error_message_ != nullptr) {
+    return false;
+  }
+  if (!Compress(ZSTD_e_end)) {
+    return false;
+  }
+  if (sub_data_ != nullptr) {
+    // Notify lower layer of data.
+    sub_stream_->BackUp(sub_data_size_ - sub_data_used_);
+    sub_data_ = nullptr;
+  }
+  return true;
+}
+#endif  // ENABLE_ZSTD
+
 InflateInputStream::InflateInputStream(
     std::unique_ptr<ZeroCopyInputStream> sub_stream)
     : zlib_content_(std::move(sub_stream)) {
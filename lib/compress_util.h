@@ -7,6 +7,7 @@
 #include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "absl/base/macros.h"
 #include "absl/strings/string_view.h"
@@ -19,6 +20,9 @@
 # endif  // _WIN32
 #include "lzma.h"
 #endif  // ENABLE_LZMA
+#ifdef ENABLE_ZSTD
+#include "zstd.h"
+#endif  // ENABLE_ZSTD
 
 namespace devtools_goma {
 
@@ -27,11 +31,14 @@ using google::protobuf::io::ConcatenatingInputStream;
 using google::protobuf::io::ZeroCopyInputStream;
 using google::protobuf::io::ZeroCopyOutputStream;
 
+class ZstdDictionary;
+
 enum class EncodingType {
   NO_ENCODING,
   DEFLATE,
   GZIP,
   LZMA2,
+  ZSTD,
 };
 
 const char* GetEncodingName(EncodingType type);
@@ -175,6 +182,154 @@ class LZMAOutputStream : public ZeroCopyOutputStream {
 
 #endif
 
+#ifdef ENABLE_ZSTD
+// ZstdDictionary is a zstd dictionary shared between client and server.
+// Since a zstd frame has the dictionary ID, the peer can find which
+// dictionary is needed to decompress it.
+// It is thread-safe once created.
+class ZstdDictionary {
+ public:
+  // Returns nullptr if |content| is not a zstd dictionary.
+  // The dictionary is digested for |compression_level| in advance.
+  static std::unique_ptr<ZstdDictionary> Create(std::string content,
+                                                int compression_level);
+
+  // Trains a dictionary from |samples|, e.g. serialized ExecReqs.
+  // Returns true and sets |dictionary| on success.
+  static bool Train(const std::vector<std::string>& samples,
+                    size_t max_dictionary_size,
+                    std::string* dictionary);
+
+  ~ZstdDictionary();
+
+  ZstdDictionary(ZstdDictionary&&) = delete;
+  ZstdDictionary(const ZstdDictionary&) = delete;
+  ZstdDictionary& operator=(const ZstdDictionary&) = delete;
+  ZstdDictionary& operator=(ZstdDictionary&&) = delete;
+
+  uint32_t id() const { return id_; }
+  const std::string& content() const { return content_; }
+  int compression_level() const { return compression_level_; }
+  const ZSTD_CDict* cdict() const { return cdict_; }
+  const ZSTD_DDict* ddict() const { return ddict_; }
+
+ private:
+  ZstdDictionary(std::string content,
+                 uint32_t id,
+                 int compression_level,
+                 ZSTD_CDict* cdict,
+                 ZSTD_DDict* ddict);
+
+  const std::string content_;
+  const uint32_t id_;
+  const int compression_level_;
+  ZSTD_CDict* const cdict_;
+  ZSTD_DDict* const ddict_;
+};
+
+// ZstdInputStream is a ZeroCopyInputStream that decompresses zstd frames
+// read from an underlying ZeroCopyInputStream.
+class ZstdInputStream : public ZeroCopyInputStream {
+ public:
+  // |dictionary| can be nullptr. It doesn't take ownership of |dictionary|.
+  ZstdInputStream(std::unique_ptr<ZeroCopyInputStream> sub_stream,
+                  const ZstdDictionary* dictionary);
+  explicit ZstdInputStream(std::unique_ptr<ZeroCopyInputStream> sub_stream)
+      : ZstdInputStream(std::move(sub_stream), nullptr) {}
+  ~ZstdInputStream() override;
+
+  ZstdInputStream(ZstdInputStream&&) = delete;
+  ZstdInputStream(const ZstdInputStream&) = delete;
+  ZstdInputStream& operator=(const ZstdInputStream&) = delete;
+  ZstdInputStream& operator=(ZstdInputStream&&) = delete;
+
+  // Returns the last zstd error, or nullptr if no error.
+  const char* ErrorMessage() const { return error_message_; }
+
+  // implements ZeroCopyInputStream ---
+  bool Next(const void** data, int* size) override;
+  void BackUp(int count) override;
+  bool Skip(int count) override;
+  int64_t ByteCount() const override;
+
+ private:
+  std::unique_ptr<ZeroCopyInputStream> sub_stream_;
+  ZSTD_DCtx* dctx_;
+  ZSTD_inBuffer input_;
+  bool sub_stream_end_ = false;
+  // True if the last decompression filled |output_buffer_|, i.e.
+  // zstd may have more data to flush without reading input.
+  bool output_full_ = false;
+  // Hint from the last ZSTD_decompressStream. 0 means a frame is completed.
+  size_t last_result_ = 0;
+  const char* error_message_ = nullptr;
+
+  std::unique_ptr<char[]> output_buffer_;
+  size_t output_buffer_size_;
+  // Size of data in |output_buffer_| returned by the last Next.
+  size_t output_size_ = 0;
+  // Bytes pushed back by BackUp.
+  size_t backup_size_ = 0;
+  int64_t byte_count_ = 0;
+};
+
+// ZstdOutputStream is a ZeroCopyOutputStream that compresses data to
+// an underlying ZeroCopyOutputStream.
+class ZstdOutputStream : public ZeroCopyOutputStream {
+ public:
+  struct Options {
+    Options();
+
+    int compression_level;
+    // Not owned. Can be nullptr.
+    const ZstdDictionary* dictionary;
+    size_t buffer_size;
+  };
+  explicit ZstdOutputStream(std::unique_ptr<ZeroCopyOutputStream> sub_stream);
+  ZstdOutputStream(std::unique_ptr<ZeroCopyOutputStream> sub_stream,
+                   const Options& options);
+  ~ZstdOutputStream() override;
+
+  ZstdOutputStream(ZstdOutputStream&&) = delete;
+  ZstdOutputStream(const ZstdOutputStream&) = delete;
+  ZstdOutputStream& operator=(const ZstdOutputStream&) = delete;
+  ZstdOutputStream& operator=(ZstdOutputStream&&) = delete;
+
+  // Writes out all data and ends the zstd frame.
+  // It is the caller's responsibility to close the underlying stream if
+  // necessary.
+  // Returns true if no error.
+  bool Close();
+
+  // Returns the last zstd error, or nullptr if no error.
+  const char* ErrorMessage() const { return error_message_; }
+
+  // implements ZeroCopyOutputStream ---
+  bool Next(void** data, int* size) override;
+  void BackUp(int count) override;
+  int64_t ByteCount() const override;
+
+ private:
+  // Compresses data in |input_buffer_|.
+  bool Compress(ZSTD_EndDirective directive);
+
+  std::unique_ptr<ZeroCopyOutputStream> sub_stream_;
+  ZSTD_CCtx* cctx_;
+  const char* error_message_ = nullptr;
+
+  // Result from calling Next() on sub_stream_, and its used size.
+  void* sub_data_ = nullptr;
+  int sub_data_size_ = 0;
+  int sub_data_used_ = 0;
+
+  std::unique_ptr<char[]> input_buffer_;
+  size_t input_buffer_size_;
+  // Size of data written in |input_buffer_|.
+  size_t input_size_ = 0;
+  int64_t byte_count_ = 0;
+};
+#endif  // ENABLE_ZSTD
+
 // InflateInputStream assumes sub_stream as deflate compressed stream.
 // It automatically inserts zlib header to make sub_stream handled by
 // GzipInputStream.
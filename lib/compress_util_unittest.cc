@@ -5,7 +5,11 @@
 
 #include "lib/compress_util.h"
 
+#include <string.h>
+
+#include <algorithm>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "absl/memory/memory.h"
@@ -21,12 +25,20 @@ using google::protobuf::io::ConcatenatingInputStream;
 using google::protobuf::io::StringOutputStream;
 #endif  // ENABLE_LZMA
 
+#ifdef ENABLE_ZSTD
+#include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "prototmp/goma_data.pb.h"
+using google::protobuf::io::ArrayInputStream;
+using google::protobuf::io::StringOutputStream;
+#endif  // ENABLE_ZSTD
+
 namespace devtools_goma {
 
 TEST(CompressUtilTest, ParseEncodingName) {
   EXPECT_EQ(EncodingType::DEFLATE, ParseEncodingName("deflate"));
   EXPECT_EQ(EncodingType::GZIP, ParseEncodingName("gzip"));
   EXPECT_EQ(EncodingType::LZMA2, ParseEncodingName("lzma2"));
+  EXPECT_EQ(EncodingType::ZSTD, ParseEncodingName("zstd"));
 
   // TODO: better weight handling?
   EXPECT_EQ(EncodingType::DEFLATE, ParseEncodingName("deflate;q=1.0"));
@@ -53,6 +65,8 @@ TEST(CompressUtilTest, ParseAcceptEncoding) {
   EXPECT_EQ(want, ParseAcceptEncoding("deflate;q=1,gzip"));
   want = {EncodingType::GZIP, EncodingType::DEFLATE};
   EXPECT_EQ(want, ParseAcceptEncoding("gzip, deflate"));
+  want = {EncodingType::ZSTD, EncodingType::GZIP};
+  EXPECT_EQ(want, ParseAcceptEncoding("zstd, gzip"));
 }
 
 TEST(COmpressUtilTest, PickEncoding) {
@@ -271,4 +285,169 @@ TEST_F(LZMATest, LZMAStreamEndToEnd) {
 
 #endif
 
+#ifdef ENABLE_ZSTD
+class ZstdTest : public testing::Test {
+ protected:
+  static ExecReq MakeExecReq(int i) {
+    ExecReq req;
+    req.mutable_command_spec()->set_name("clang++");
+    req.mutable_command_spec()->set_version("4.2.1[clang version 9.0.0]");
+    req.mutable_command_spec()->set_target("x86_64-unknown-linux-gnu");
+    req.add_arg("clang++");
+    req.add_arg("-c");
+    req.add_arg("../../base/file" + std::to_string(i) + ".cc");
+    req.add_arg("-o");
+    req.add_arg("obj/base/file" + std::to_string(i) + ".o");
+    for (int j = 0; j < 20; ++j) {
+      req.add_arg("-DFEATURE_" + std::to_string(j) + "=1");
+      ExecReq_Input* input = req.add_input();
+      input->set_filename("../../base/header" + std::to_string(j) + ".h");
+      input->set_hash_key(std::string(64, 'a' + (i + j) % 26));
+    }
+    req.set_cwd("/b/build/out/Release");
+    return req;
+  }
+
+  static std::string Compress(const ExecReq& req,
+                              const ZstdOutputStream::Options& options) {
+    std::string compressed;
+    ZstdOutputStream zstream(absl::make_unique<StringOutputStream>(&compressed),
+                             options);
+    EXPECT_TRUE(req.SerializeToZeroCopyStream(&zstream));
+    EXPECT_TRUE(zstream.Close()) << zstream.ErrorMessage();
+    EXPECT_EQ(req.ByteSizeLong(), zstream.ByteCount());
+    return compressed;
+  }
+};
+
+TEST_F(ZstdTest, EndToEnd) {
+  const ExecReq req = MakeExecReq(0);
+  const std::string compressed = Compress(req, ZstdOutputStream::Options());
+  EXPECT_LT(compressed.size(), req.ByteSizeLong());
+
+  ZstdInputStream zinput(
+      absl::make_unique<ArrayInputStream>(compressed.data(),
+                                          compressed.size()));
+  ExecReq decompressed;
+  EXPECT_TRUE(decompressed.ParseFromZeroCopyStream(&zinput));
+  EXPECT_EQ(req.SerializeAsString(), decompressed.SerializeAsString());
+  EXPECT_EQ(nullptr, zinput.ErrorMessage());
+  EXPECT_EQ(req.ByteSizeLong(), zinput.ByteCount());
+}
+
+TEST_F(ZstdTest, SmallBuffers) {
+  const ExecReq req = MakeExecReq(1);
+  ZstdOutputStream::Options options;
+  options.compression_level = 1;
+  options.buffer_size = 7;
+  const std::string compressed = Compress(req, options);
+
+  // Feed 3 bytes at once.
+  ZstdInputStream zinput(absl::make_unique<ArrayInputStream>(
+      compressed.data(), compressed.size(), 3));
+  ExecReq decompressed;
+  EXPECT_TRUE(decompressed.ParseFromZeroCopyStream(&zinput));
+  EXPECT_EQ(req.SerializeAsString(), decompressed.SerializeAsString());
+}
+
+TEST_F(ZstdTest, BackUpAndSkip) {
+  // Larger than the output buffer of ZstdInputStream.
+  const std::string data(300000, 'x');
+  std::string compressed;
+  {
+    ZstdOutputStream zstream(
+        absl::make_unique<StringOutputStream>(&compressed));
+    void* buf;
+    int size;
+    size_t written = 0;
+    while (written < data.size()) {
+      ASSERT_TRUE(zstream.Next(&buf, &size));
+      int n = std::min<size_t>(size, data.size() - written);
+      memcpy(buf, data.data() + written, n);
+      zstream.BackUp(size - n);
+      written += n;
+    }
+    ASSERT_TRUE(zstream.Close());
+  }
+
+  ZstdInputStream zinput(absl::make_unique<ArrayInputStream>(
+      compressed.data(), compressed.size()));
+  const void* buf;
+  int size;
+  ASSERT_TRUE(zinput.Next(&buf, &size));
+  ASSERT_GT(size, 10);
+  zinput.BackUp(10);
+  EXPECT_EQ(size - 10, zinput.ByteCount());
+  ASSERT_TRUE(zinput.Skip(20));
+  EXPECT_EQ(size + 10, zinput.ByteCount());
+  int64_t total = zinput.ByteCount();
+  while (zinput.Next(&buf, &size)) {
+    total += size;
+  }
+  EXPECT_EQ(static_cast<int64_t>(data.size()), total);
+  EXPECT_EQ(nullptr, zinput.ErrorMessage());
+}
+
+TEST_F(ZstdTest, Truncated) {
+  const std::string compressed =
+      Compress(MakeExecReq(2), ZstdOutputStream::Options());
+  ZstdInputStream zinput(absl::make_unique<ArrayInputStream>(
+      compressed.data(), compressed.size() - 1));
+  const void* buf;
+  int size;
+  while (zinput.Next(&buf, &size)) {
+  }
+  EXPECT_NE(nullptr, zinput.ErrorMessage());
+}
+
+TEST_F(ZstdTest, Dictionary) {
+  std::vector<std::string> samples;
+  for (int i = 0; i < 1000; ++i) {
+    samples.push_back(MakeExecReq(i).SerializeAsString());
+  }
+  std::string dict_content;
+  ASSERT_TRUE(ZstdDictionary::Train(samples, 16 * 1024, &dict_content));
+  std::unique_ptr<ZstdDictionary> dict =
+      ZstdDictionary::Create(dict_content, ZSTD_CLEVEL_DEFAULT);
+  ASSERT_NE(nullptr, dict);
+  EXPECT_NE(0u, dict->id());
+
+  const ExecReq req = MakeExecReq(1234);
+  const std::string without_dict =
+      Compress(req, ZstdOutputStream::Options());
+  ZstdOutputStream::Options options;
+  options.dictionary = dict.get();
+  const std::string with_dict = Compress(req, options);
+  EXPECT_LT(with_dict.size(), without_dict.size());
+
+  ZstdInputStream zinput(
+      absl::make_unique<ArrayInputStream>(with_dict.data(), with_dict.size()),
+      dict.get());
+  ExecReq decompressed;
+  EXPECT_TRUE(decompressed.ParseFromZeroCopyStream(&zinput));
+  EXPECT_EQ(req.SerializeAsString(), decompressed.SerializeAsString());
+
+  // Can't decompress without the dictionary.
+  // Dictionary digested for another compression level.
+  options.compression_level = 9;
+  const std::string with_dict_level9 = Compress(req, options);
+  ZstdInputStream zinput_level9(
+      absl::make_unique<ArrayInputStream>(with_dict_level9.data(),
+                                          with_dict_level9.size()),
+      dict.get());
+  decompressed.Clear();
+  EXPECT_TRUE(decompressed.ParseFromZeroCopyStream(&zinput_level9));
+  EXPECT_EQ(req.SerializeAsString(), decompressed.SerializeAsString());
+
+  ZstdInputStream zinput_no_dict(absl::make_unique<ArrayInputStream>(
+      with_dict.data(), with_dict.size()));
+  EXPECT_FALSE(decompressed.ParseFromZeroCopyStream(&zinput_no_dict));
+  EXPECT_NE(nullptr, zinput_no_dict.ErrorMessage());
+}
+
+TEST_F(ZstdTest, InvalidDictionary) {
+  EXPECT_EQ(nullptr, ZstdDictionary::Create("not a dictionary", 3));
+}
+#endif  // ENABLE_ZSTD
+
 }  // namespace devtools_goma
@@ -105,7 +105,7 @@ class FileOutputImpl : public FileDataOutput {
   FileOutputImpl& operator=(const FileOutputImpl&) = delete;
 
   bool IsValid() const override { return fd_.valid(); }
-  bool WriteAt(off_t offset, const std::string& content) override {
+  bool WriteAt(off_t offset, absl::string_view content) override {
     off_t pos = fd_.Seek(offset, devtools_goma::ScopedFd::SeekAbsolute);
     if (pos < 0 || pos != offset) {
       PLOG(ERROR) << "seek failed? " << filename_ << " pos=" << pos
@@ -151,7 +151,7 @@ class StringOutputImpl : public FileDataOutput {
   StringOutputImpl& operator=(const StringOutputImpl&) = delete;
 
   bool IsValid() const override { return buf_ != nullptr; }
-  bool WriteAt(off_t offset, const std::string& content) override {
+  bool WriteAt(off_t offset, absl::string_view content) override {
     if (buf_->size() < offset + content.size()) {
       buf_->resize(offset + content.size());
     }
@@ -10,6 +10,8 @@
 #include <memory>
 #include <string>
 
+#include "absl/strings/string_view.h"
+
 namespace devtools_goma {
 
 // TODO: provide Input too.
@@ -25,7 +27,7 @@ class FileDataOutput {
   // IsValid returns true if this output is valid to use.
   virtual bool IsValid() const = 0;
   // WriteAt writes content at offset in output.
-  virtual bool WriteAt(off_t offset, const std::string& content) = 0;
+  virtual bool WriteAt(off_t offset, absl::string_view content) = 0;
   // Close closes the output.
   virtual bool Close() = 0;
   // ToString returns string representation of this output. e.g. filename.
@@ -239,6 +239,11 @@ bool FileServiceClient::FinishStoreFileTask(
     if (task->resp().hash_key(i).empty()) {
       VLOG(1) << "No response at " << i;
       num_failed++;
+      continue;
+    }
+    if (known_chunk_checker_ != nullptr && i < task->req().blob_size()) {
+      known_chunk_checker_->OnChunkStored(task->resp().hash_key(i),
+                                          task->req().blob(i).file_size());
     }
   }
   if (num_failed > 0) {
@@ -276,6 +281,10 @@ bool FileServiceClient::CreateFileChunks(
       std::string hash_key = ComputeFileBlobHashKey(*chunk);
       LOG(INFO) << "chunk hash_key:" << hash_key;
       blob->add_hash_key(hash_key);
+      if (IsKnownChunk(hash_key, chunk_size)) {
+        task->mutable_req()->mutable_blob()->RemoveLast();
+        continue;
+      }
       if (task->req().blob_size() >= kNumChunksInStreamRequest) {
         if (!FinishStoreFileTask(std::move(in_flight_task)))
           return false;
@@ -318,7 +327,7 @@ bool FileServiceClient::CreateFileChunks(
     std::string hash_key = ComputeFileBlobHashKey(*chunk);
     VLOG(1) << "chunk hash_key:" << hash_key;
     blob->add_hash_key(hash_key);
-    if (store) {
+    if (store && !IsKnownChunk(hash_key, chunk_size)) {
       if (!StoreFile(&req, &resp)) {
         LOG(WARNING) << "StoreFile failed";
         return false;
@@ -328,11 +337,26 @@ bool FileServiceClient::CreateFileChunks(
                      << "!=" << hash_key;
         return false;
       }
+      if (known_chunk_checker_ != nullptr) {
+        known_chunk_checker_->OnChunkStored(hash_key, chunk_size);
+      }
     }
   }
   return true;
 }
 
+bool FileServiceClient::IsKnownChunk(const std::string& hash_key,
+                                     int64_t chunk_size) {
+  if (known_chunk_checker_ == nullptr) {
+    return false;
+  }
+  if (!known_chunk_checker_->IsKnownChunk(hash_key, chunk_size)) {
+    return false;
+  }
+  VLOG(1) << "skip storing known chunk hash_key:" << hash_key;
+  return true;
+}
+
 bool FileServiceClient::ReadFileContent(FileReader* fr,
                                         off_t offset, off_t chunk_size,
                                         FileBlob* blob) {
@@ -54,6 +54,19 @@ class FileServiceClient {
     Resp resp_;
   };
 
+  // KnownChunkChecker lets CreateFileBlob skip storing chunks of a large
+  // file that are already stored in file service.
+  class KnownChunkChecker {
+   public:
+    virtual ~KnownChunkChecker() {}
+    // Returns true if the chunk of |hash_key| doesn't need to be stored.
+    virtual bool IsKnownChunk(const std::string& hash_key,
+                              int64_t chunk_size) = 0;
+    // Called when the chunk of |hash_key| has been stored.
+    virtual void OnChunkStored(const std::string& hash_key,
+                               int64_t chunk_size) = 0;
+  };
+
   FileServiceClient()
       : reader_factory_(FileReaderFactory::GetInstance()) {}
   virtual ~FileServiceClient() {}
@@ -107,12 +120,21 @@ class FileServiceClient {
   virtual bool StoreFile(const StoreFileReq* req, StoreFileResp* resp) = 0;
   virtual bool LookupFile(const LookupFileReq* req, LookupFileResp* resp) = 0;
 
+  // Sets |checker| used when storing chunks of large files.
+  // It doesn't take ownership of |checker|.
+  void set_known_chunk_checker(KnownChunkChecker* checker) {
+    known_chunk_checker_ = checker;
+  }
+
  protected:
   FileReaderFactory* reader_factory_;
   std::unique_ptr<RequesterInfo> requester_info_;
   std::string trace_id_;
 
  private:
+  // Returns true if the chunk doesn't need to be stored.
+  bool IsKnownChunk(const std::string& hash_key, int64_t chunk_size);
+
   bool FinishStoreFileTask(
       std::unique_ptr<AsyncTask<StoreFileReq, StoreFileResp>> task);
 
@@ -130,6 +152,8 @@ class FileServiceClient {
       std::unique_ptr<AsyncTask<LookupFileReq, LookupFileResp>> task,
       FileDataOutput* output);
   bool OutputFileChunks(const FileBlob& blob, FileDataOutput* output);
+
+  KnownChunkChecker* known_chunk_checker_ = nullptr;
 };
 
 }  // namespace devtools_goma